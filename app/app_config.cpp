@@ -0,0 +1,359 @@
+#include "app_config.h"
+#include "../session/client_table.h"
+
+static const char* profile_names[] = {"baseline", "main", "high"};
+static const video_profile profiles[] = {
+    VIDEO_PROFILE_BASELINE,
+    VIDEO_PROFILE_MAIN,
+    VIDEO_PROFILE_HIGH
+};
+
+static int parse_int(const char* value, int min, int max, int* out)
+{
+    char* end;
+    long n = strtol(value, &end, 10);
+
+    if(end == value || *end || n < min || n > max)
+        return 0;
+
+    *out = (int)n;
+    return 1;
+}
+
+static int parse_u64(const char* value, uint64_t* out)
+{
+    char* end;
+    unsigned long long n = strtoull(value, &end, 10);
+
+    if(end == value || *end || *value == '-')
+        return 0;
+
+    *out = n;
+    return 1;
+}
+
+static int parse_u32(const char* value, uint32_t* out)
+{
+    uint64_t n;
+
+    if(!parse_u64(value, &n) || n > UINT32_MAX)
+        return 0;
+
+    *out = (uint32_t)n;
+    return 1;
+}
+
+static int parse_profile(const char* value, video_profile* out)
+{
+    int i;
+
+    for(i = 0; i < 3; i++)
+        if(!strcmp(value, profile_names[i]))
+        {
+            *out = profiles[i];
+            return 1;
+        }
+
+    return 0;
+}
+
+static const char* profile_name(video_profile profile)
+{
+    int i;
+
+    for(i = 0; i < 3; i++)
+        if(profiles[i] == profile)
+            return profile_names[i];
+
+    return "unknown";
+}
+
+//Calls parse_pair() for every key=value of args. Returns 0 as soon as one
+//of them fails
+static int parse_pairs(
+        const char* args,
+        int (*parse_pair)(const char* key, const char* value, void* out),
+        void* out){
+    char buf[COMMAND_BUFSIZE];
+    char* save;
+    char* pair;
+
+    strncpy(buf, args, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for(pair = strtok_r(buf, " \r\n", &save); pair
+        ; pair = strtok_r(0, " \r\n", &save))
+    {
+        char* value = strchr(pair, '=');
+
+        if(value)
+            *value++ = '\0';
+        if(!value || !parse_pair(pair, value, out))
+        {
+            DEBUG_ERR("bad argument %s\n", pair);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int parse_config_pair(const char* pair, const char* value, void* out)
+{
+    video_config_t* config = (video_config_t*)out;
+
+    if(!strcmp(pair, "width"))
+        return parse_int(value, CONFIG_MIN_WIDTH, CONFIG_MAX_WIDTH, &config->width)
+            && !(config->width % 32);
+    if(!strcmp(pair, "height"))
+        return parse_int(value, CONFIG_MIN_HEIGHT, CONFIG_MAX_HEIGHT, &config->height)
+            && !(config->height % 16);
+    if(!strcmp(pair, "framerate"))
+        return parse_int(value, 1, CONFIG_MAX_FRAMERATE, &config->framerate);
+    if(!strcmp(pair, "bitrate"))
+        return parse_int(value, CONFIG_MIN_BITRATE, CONFIG_MAX_BITRATE
+                         , &config->bitrate);
+    if(!strcmp(pair, "idr"))
+        return parse_int(value, 1, CONFIG_MAX_IDR_PERIOD, &config->idr_period);
+    if(!strcmp(pair, "qp_i"))
+        return parse_int(value, 0, CONFIG_MAX_QP, &config->qp_i);
+    if(!strcmp(pair, "qp_p"))
+        return parse_int(value, 0, CONFIG_MAX_QP, &config->qp_p);
+    if(!strcmp(pair, "profile"))
+        return parse_profile(value, &config->profile);
+    if(!strcmp(pair, "refresh"))
+        return parse_int(value, 0, CONFIG_MAX_IDR_PERIOD
+                         , &config->refresh_period);
+
+    return 0;
+}
+
+static int parse_report_pair(const char* pair, const char* value, void* out)
+{
+    receiver_report_t* report = (receiver_report_t*)out;
+
+    if(!strcmp(pair, "lost"))
+        return parse_u32(value, &report->lost);
+    if(!strcmp(pair, "received"))
+        return parse_u32(value, &report->received);
+    if(!strcmp(pair, "jitter"))
+        return parse_u32(value, &report->jitter_us);
+    if(!strcmp(pair, "bytes"))
+        return parse_u64(value, &report->bytes);
+
+    return 0;
+}
+
+static int parse_fec_pair(const char* pair, const char* value, void* out)
+{
+    fec_config_t* config = (fec_config_t*)out;
+    int mode;
+
+    if(!strcmp(pair, "mode"))
+    {
+        for(mode = FEC_MODE_OFF; mode <= FEC_MODE_RS; mode++)
+            if(!strcmp(value, fec_mode_name((fec_mode)mode)))
+            {
+                config->mode = (fec_mode)mode;
+                return 1;
+            }
+        return 0;
+    }
+    if(!strcmp(pair, "k"))
+        return parse_int(value, 1, FEC_RS_MAX_BLOCK, &config->block_packets);
+    if(!strcmp(pair, "m"))
+        return parse_int(value, 1, FEC_RS_MAX_REPAIR, &config->repair_packets);
+    if(!strcmp(pair, "frames"))
+        return parse_int(value, 1, CONFIG_MAX_FEC_FRAMES, &config->block_frames);
+
+    return 0;
+}
+
+static int parse_pacing_pair(const char* pair, const char* value, void* out)
+{
+    pacing_config_t* config = (pacing_config_t*)out;
+    int mode;
+
+    if(!strcmp(pair, "mode"))
+    {
+        for(mode = PACING_OFF; mode <= PACING_TXTIME; mode++)
+            if(!strcmp(value, pacing_mode_name((pacing_mode)mode)))
+            {
+                config->mode = (pacing_mode)mode;
+                return 1;
+            }
+        return 0;
+    }
+    if(!strcmp(pair, "spread"))
+        return parse_int(value, 1, 100, &config->spread_percent);
+
+    return 0;
+}
+
+static int parse_record_pair(const char* pair, const char* value, void* out)
+{
+    record_config_t* config = (record_config_t*)out;
+
+    if(!strcmp(pair, "pre"))
+        return parse_int(value, 0, CONFIG_MAX_RECORD_SECONDS
+                         , &config->pre_seconds);
+    if(!strcmp(pair, "post"))
+        return parse_int(value, 0, CONFIG_MAX_RECORD_SECONDS
+                         , &config->post_seconds);
+
+    return 0;
+}
+
+int parse_video_config(const char* args, video_config_t* config)
+{
+    video_config_t parsed = *config;
+
+    if(!parse_pairs(args, parse_config_pair, &parsed))
+        return 0;
+
+    *config = parsed;
+    return 1;
+}
+
+int parse_receiver_report(const char* args, receiver_report_t* report)
+{
+    memset(report, 0, sizeof(*report));
+
+    return parse_pairs(args, parse_report_pair, report);
+}
+
+int parse_fec_config(const char* args, fec_config_t* config)
+{
+    fec_config_t parsed = *config;
+
+    if(!parse_pairs(args, parse_fec_pair, &parsed))
+        return 0;
+
+    //The XOR mask covers 48 packets
+    if(parsed.mode == FEC_MODE_XOR && parsed.block_packets > FEC_XOR_MAX_BLOCK)
+    {
+        DEBUG_ERR("bad argument k=%d\n", parsed.block_packets);
+        return 0;
+    }
+
+    *config = parsed;
+    return 1;
+}
+
+int parse_pacing_config(const char* args, pacing_config_t* config)
+{
+    pacing_config_t parsed = *config;
+
+    if(!parse_pairs(args, parse_pacing_pair, &parsed))
+        return 0;
+
+    *config = parsed;
+    return 1;
+}
+
+int parse_record_config(const char* args, record_config_t* config)
+{
+    record_config_t parsed = *config;
+
+    if(!parse_pairs(args, parse_record_pair, &parsed))
+        return 0;
+
+    *config = parsed;
+    return 1;
+}
+
+int parse_layer(const char* args, int* layer)
+{
+    char name[8];
+
+    if(sscanf(args, "%7s", name) != 1)
+        return 0;
+
+    if(!strcmp(name, "main"))
+        *layer = LAYER_MAIN;
+    else if(!strcmp(name, "low"))
+        *layer = LAYER_LOW;
+    else if(!strcmp(name, "auto"))
+        *layer = LAYER_AUTO;
+    else
+        return 0;
+
+    return 1;
+}
+
+const char* layer_name(int layer)
+{
+    return layer == LAYER_LOW ? "low" : layer == LAYER_AUTO ? "auto" : "main";
+}
+
+int parse_nack(const char* args, uint16_t* seqs, int max)
+{
+    char buf[COMMAND_BUFSIZE];
+    char* save;
+    char* range;
+    int count = 0;
+
+    strncpy(buf, args, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for(range = strtok_r(buf, " \r\n", &save); range && count < max
+        ; range = strtok_r(0, " \r\n", &save))
+    {
+        char* last = strchr(range, '-');
+        int first_seq, last_seq;
+
+        if(last)
+            *last++ = '\0';
+        if(!parse_int(range, 0, UINT16_MAX, &first_seq)
+           || !parse_int(last ? last : range, 0, UINT16_MAX, &last_seq))
+        {
+            DEBUG_ERR("bad argument %s\n", range);
+            return 0;
+        }
+
+        //The range may wrap around
+        uint16_t seq = first_seq;
+        do
+            seqs[count++] = seq;
+        while(seq++ != (uint16_t)last_seq && count < max);
+    }
+
+    return count;
+}
+
+void format_video_config(video_config_t* config, char* buf, int size)
+{
+    snprintf(buf, size
+             , "width=%d height=%d framerate=%d bitrate=%d idr=%d qp_i=%d "
+               "qp_p=%d profile=%s refresh=%d"
+             , config->width
+             , config->height
+             , config->framerate
+             , config->bitrate
+             , config->idr_period
+             , config->qp_i
+             , config->qp_p
+             , profile_name(config->profile)
+             , config->refresh_period);
+}
+
+void format_fec_config(fec_config_t* config, char* buf, int size)
+{
+    snprintf(buf, size, "mode=%s k=%d m=%d frames=%d"
+             , fec_mode_name(config->mode)
+             , config->block_packets
+             , config->mode == FEC_MODE_XOR ? 1 : config->repair_packets
+             , config->block_frames);
+}
+
+void format_pacing_config(pacing_config_t* config, char* buf, int size)
+{
+    snprintf(buf, size, "mode=%s spread=%d", pacing_mode_name(config->mode)
+             , config->spread_percent);
+}
+
+void format_record_config(record_config_t* config, char* buf, int size)
+{
+    snprintf(buf, size, "pre=%d post=%d", config->pre_seconds
+             , config->post_seconds);
+}
@@ -0,0 +1,59 @@
+#ifndef APP_CONFIG_H
+#define APP_CONFIG_H
+
+#include "../source/frame_source.h"
+#include "../udp_setup/udp_setup.h"
+#include "../session/rate_control.h"
+#include "../rtp/rtp_fec.h"
+#include "../session/pacer.h"
+#include "../record/recorder.h"
+
+//Accepted ranges of SET_CONFIG. The camera needs the width aligned to 32
+//and the height to 16
+#define CONFIG_MIN_WIDTH 64
+#define CONFIG_MAX_WIDTH 1920
+#define CONFIG_MIN_HEIGHT 64
+#define CONFIG_MAX_HEIGHT 1080
+#define CONFIG_MAX_FRAMERATE 90
+#define CONFIG_MIN_BITRATE 10000
+#define CONFIG_MAX_BITRATE 25000000
+#define CONFIG_MAX_IDR_PERIOD 3000
+#define CONFIG_MAX_QP 51
+#define CONFIG_REPLY_SIZE 192
+#define CONFIG_MAX_FEC_FRAMES 30
+#define NACK_MAX_PACKETS 64 //sequence numbers taken from one NACK
+#define CONFIG_MAX_RECORD_SECONDS 3600
+
+//Updates config from "key=value" pairs separated by spaces, keys are
+//width, height, framerate, bitrate, idr, qp_i, qp_p, profile (baseline,
+//main, high) and refresh. Returns 0 and leaves config untouched on any bad
+//pair
+int parse_video_config(const char* args, video_config_t* config);
+void format_video_config(video_config_t* config, char* buf, int size);
+//RECEIVER_REPORT arguments, the counters since the previous report: lost,
+//received (packets), jitter (us) and bytes. Missing keys are 0
+int parse_receiver_report(const char* args, receiver_report_t* report);
+//SET_FEC arguments: mode (off, xor, rs), k, m and frames, see fec_config_t.
+//Returns 0 and leaves config untouched on any bad pair or if k or m is out
+//of range for the mode
+int parse_fec_config(const char* args, fec_config_t* config);
+void format_fec_config(fec_config_t* config, char* buf, int size);
+//SET_PACING arguments: mode (off, user, rate, txtime) and spread (percent
+//of the frame interval). Returns 0 and leaves config untouched on any bad
+//pair
+int parse_pacing_config(const char* args, pacing_config_t* config);
+void format_pacing_config(pacing_config_t* config, char* buf, int size);
+//SET_RECORD arguments: pre and post (seconds), see record_config_t. Returns
+//0 and leaves config untouched on any bad pair
+int parse_record_config(const char* args, record_config_t* config);
+void format_record_config(record_config_t* config, char* buf, int size);
+//SET_LAYER argument: main, low or auto (LAYER_AUTO). Returns 0 on anything
+//else
+int parse_layer(const char* args, int* layer);
+const char* layer_name(int layer);
+//NACK arguments, sequence numbers and first-last ranges separated by spaces
+//("812 815-818"). Fills seqs with at most max of them and returns how many,
+//0 on a bad argument
+int parse_nack(const char* args, uint16_t* seqs, int max);
+
+#endif
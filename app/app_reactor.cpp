@@ -0,0 +1,112 @@
+#include "app_reactor.h"
+#include "../common_util/common_util.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+typedef struct {
+    int fd; //-1 for a free slot
+    reactor_handler handler;
+    void* arg;
+} reactor_entry_t;
+
+//Only used by the main thread
+static int epoll_fd = -1;
+static reactor_entry_t entries[REACTOR_MAX_HANDLERS];
+static int running;
+
+void reactor_init()
+{
+    int i;
+
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        DEBUG_ERR("epoll_create1 error\n");
+        exit(1);
+    }
+
+    for(i = 0; i < REACTOR_MAX_HANDLERS; i++)
+        entries[i].fd = -1;
+}
+
+void reactor_close()
+{
+    close(epoll_fd);
+    epoll_fd = -1;
+}
+
+int reactor_add(int fd, reactor_handler handler, void* arg)
+{
+    struct epoll_event event;
+    int i;
+
+    for(i = 0; i < REACTOR_MAX_HANDLERS && entries[i].fd >= 0; i++);
+    if(i == REACTOR_MAX_HANDLERS)
+    {
+        DEBUG_ERR("reactor full\n");
+        return 0;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &entries[i];
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        DEBUG_ERR("epoll_ctl add error\n");
+        return 0;
+    }
+
+    entries[i].fd = fd;
+    entries[i].handler = handler;
+    entries[i].arg = arg;
+
+    return 1;
+}
+
+void reactor_remove(int fd)
+{
+    int i;
+
+    for(i = 0; i < REACTOR_MAX_HANDLERS; i++)
+        if(entries[i].fd == fd)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
+            entries[i].fd = -1;
+        }
+}
+
+void reactor_run()
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    running = 1;
+    while(running)
+    {
+        int count = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        int i;
+
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            DEBUG_ERR("epoll_wait error\n");
+            exit(1);
+        }
+
+        for(i = 0; i < count && running; i++)
+        {
+            reactor_entry_t* entry = (reactor_entry_t*)events[i].data.ptr;
+
+            //Removed by an earlier handler of this batch
+            if(entry->fd < 0)
+                continue;
+            entry->handler(entry->fd, entry->arg);
+        }
+    }
+}
+
+void reactor_stop()
+{
+    running = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef APP_REACTOR_H
+#define APP_REACTOR_H
+
+//The main thread waits for everything it handles in one epoll set: the
+//command socket, the session timers, the source frame notifications, the
+//zerocopy completions, the metrics endpoint and the shutdown request
+#define REACTOR_MAX_HANDLERS 64
+#define REACTOR_MAX_EVENTS 16
+
+typedef void (*reactor_handler)(int fd, void* arg);
+
+void reactor_init();
+void reactor_close();
+//Calls handler whenever fd is readable or has an error pending. Returns 0
+//if there is no room
+int reactor_add(int fd, reactor_handler handler, void* arg);
+void reactor_remove(int fd);
+//Dispatches until reactor_stop(), which a handler calls
+void reactor_run();
+void reactor_stop();
+
+#endif
@@ -0,0 +1,370 @@
+#include "app_stats.h"
+#include "app_config.h"
+#include "../session/client_table.h"
+#include "../common_util/stats.h"
+#include "app_reactor.h"
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define STATS_HTTP_REQUEST_BYTES 1024
+
+typedef struct {
+    stat_counter counter;
+    const char* key; //STATS reply
+    const char* metric; //Prometheus, without the _total suffix
+    const char* help;
+} counter_info_t;
+
+typedef struct {
+    stat_gauge gauge;
+    const char* key;
+    const char* metric;
+    const char* help;
+    double scale; //Prometheus wants seconds
+} gauge_info_t;
+
+static const counter_info_t counter_info[] = {
+    {STAT_FRAMES_ENCODED, "frames", "rpi_stream_frames_encoded"
+     , "Frames taken from the source"},
+    {STAT_BYTES_ENCODED, "encoded_bytes", "rpi_stream_encoded_bytes"
+     , "H.264 bytes taken from the source"},
+    {STAT_PACKETS_SENT, "packets", "rpi_stream_packets_sent"
+     , "RTP packets sent, all clients"},
+    {STAT_BYTES_SENT, "bytes", "rpi_stream_bytes_sent"
+     , "RTP bytes sent, all clients"},
+    {STAT_SEND_SYSCALLS, "syscalls", "rpi_stream_send_syscalls"
+     , "Send system calls"},
+    {STAT_COMMAND_SYSCALLS, "command_syscalls"
+     , "rpi_stream_command_syscalls", "System calls reading commands"},
+    {STAT_SEND_ERRORS, "errors", "rpi_stream_send_errors"
+     , "Failed sends other than a full socket buffer"},
+    {STAT_SEND_EAGAIN, "eagain", "rpi_stream_send_eagain"
+     , "Sends that found the socket buffer full"},
+    {STAT_FRAMES_DROPPED, "dropped", "rpi_stream_frames_dropped"
+     , "Frames not sent to a client, all clients"},
+    {STAT_SOURCE_STALLS, "stalls", "rpi_stream_source_stalls"
+     , "Times the source stopped delivering frames while capturing"},
+    {STAT_FEC_PACKETS, "fec_packets", "rpi_stream_fec_packets"
+     , "FEC repair packets made"},
+    {STAT_NACKED_PACKETS, "nacked", "rpi_stream_nacked_packets"
+     , "Packets clients asked for again"},
+    {STAT_RETRANSMITS, "retransmits", "rpi_stream_retransmits"
+     , "Packets sent again after a NACK"},
+    {STAT_RETRANSMIT_MISSES, "rtx_misses", "rpi_stream_retransmit_misses"
+     , "NACKed packets no longer in the send history"},
+    {STAT_RETRANSMIT_LIMITED, "rtx_limited", "rpi_stream_retransmit_limited"
+     , "NACKed packets not sent again to stay under the retransmit rate"},
+    {STAT_ZEROCOPY_SENDS, "zerocopy", "rpi_stream_zerocopy_sends"
+     , "Messages sent without copying the payload"},
+    {STAT_ZEROCOPY_COPIED, "zc_copied", "rpi_stream_zerocopy_copied"
+     , "Zerocopy messages the kernel had to copy after all"},
+    {STAT_KEYFRAME_REQUESTS, "keyframe_requests"
+     , "rpi_stream_keyframe_requests"
+     , "Keyframes asked for by clients, the rate control or a recording"},
+    {STAT_KEYFRAMES_FORCED, "keyframes_forced", "rpi_stream_keyframes_forced"
+     , "IDRs the source was asked for, after coalescing the requests"},
+    {STAT_RECORD_FRAMES, "record_frames", "rpi_stream_record_frames"
+     , "Frames written to local recordings"},
+    {STAT_RECORD_BYTES, "record_bytes", "rpi_stream_record_bytes"
+     , "Bytes written to local recordings"},
+    {STAT_RECORD_DROPPED, "record_dropped", "rpi_stream_record_dropped_frames"
+     , "Frames missing from recordings because the disk fell behind"},
+    {STAT_RECORD_ERRORS, "record_errors", "rpi_stream_record_errors"
+     , "Failed writes or syncs of a recording"},
+};
+
+static const gauge_info_t gauge_info[] = {
+    {STAT_FPS, "fps", "rpi_stream_fps"
+     , "Frames per second from the source", 1},
+    {STAT_BITRATE, "bitrate", "rpi_stream_bitrate_bps"
+     , "Encoded bits per second from the source", 1},
+    {STAT_TARGET_BITRATE, "target", "rpi_stream_target_bitrate_bps"
+     , "Bitrate the source was asked for", 1},
+    {STAT_INIT_US, "init_us", "rpi_stream_source_init_seconds"
+     , "Duration of the last source init", 1e-6},
+    {STAT_DEINIT_US, "deinit_us", "rpi_stream_source_deinit_seconds"
+     , "Duration of the last source deinit", 1e-6},
+    {STAT_CONFIG_US, "config_us", "rpi_stream_config_seconds"
+     , "Duration of the last SET_CONFIG", 1e-6},
+    {STAT_MOTION_SCORE, "motion", "rpi_stream_motion_score"
+     , "Mean luma difference of the last two frames, hundredths", 1},
+    {STAT_MOTION_IDLE, "motion_idle", "rpi_stream_motion_idle"
+     , "1 while the scene is still and the encoder runs at the idle rate", 1},
+    {STAT_RECORD_SYNC_US, "record_sync_us", "rpi_stream_record_sync_seconds"
+     , "Duration of the last sync of a recording to the disk", 1e-6},
+};
+
+static frame_source_t* http_source;
+static int http_socket = -1;
+static char http_page[STATS_PAGE_SIZE];
+
+//snprintf() at *used, which stops moving once the buffer is full
+static void append(char* buf, int size, int* used, const char* fmt, ...)
+{
+    va_list args;
+
+    if(*used >= size - 1)
+        return;
+
+    va_start(args, fmt);
+    int len = vsnprintf(buf + *used, size - *used, fmt, args);
+    va_end(args);
+
+    if(len > 0)
+        *used += len < size - *used ? len : size - 1 - *used;
+}
+
+static const char* client_name(client_stats_t* client, char* name, int size)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &client->command_addr.sin_addr, ip, sizeof(ip));
+    snprintf(name, size, "%s:%d", ip, ntohs(client->command_addr.sin_port));
+
+    return name;
+}
+
+int format_stats(frame_source_t* source, char* buf, int size)
+{
+    //Local, the STATS command and the endpoint thread may both be here
+    client_stats_t client_stats[MAX_CLIENTS + 1];
+    int used = 0;
+    unsigned int i;
+    char name[32];
+
+    buf[0] = '\0';
+    for(i = 0; i < sizeof(counter_info)/sizeof(counter_info[0]); i++)
+        append(buf, size, &used, "%s=%llu ", counter_info[i].key
+               , (unsigned long long)stats_counter(counter_info[i].counter));
+    for(i = 0; i < sizeof(gauge_info)/sizeof(gauge_info[0]); i++)
+        append(buf, size, &used, "%s=%lld ", gauge_info[i].key
+               , (long long)stats_gauge(gauge_info[i].gauge));
+
+    append(buf, size, &used, "pending=%d held=%d"
+           , source->pending_buffers(), stream_frames_in_use());
+
+    //Counted here rather than with client_count(), so it matches the list
+    int count = client_get_stats(client_stats, MAX_CLIENTS + 1);
+    append(buf, size, &used, " clients=%d", count);
+    for(i = 0; i < (unsigned int)count; i++)
+    {
+        client_stats_t* client = &client_stats[i];
+        append(buf, size, &used, "; %s%s layer=%s%s queue=%u sent=%llu"
+               " dropped=%llu rtx=%llu rate=%d"
+               , client_name(client, name, sizeof(name))
+               , client->multicast ? " (multicast)" : ""
+               , layer_name(client->layer)
+               , client->auto_layer ? "(auto)" : ""
+               , client->queue_depth
+               , (unsigned long long)client->sent_frames
+               , (unsigned long long)client->dropped_frames
+               , (unsigned long long)client->retransmits
+               , client->bitrate);
+    }
+
+    return used;
+}
+
+int format_stats_prometheus(frame_source_t* source, char* buf, int size)
+{
+    client_stats_t client_stats[MAX_CLIENTS + 1];
+    int used = 0;
+    unsigned int i;
+    int stage;
+    char name[32];
+
+    buf[0] = '\0';
+    for(i = 0; i < sizeof(counter_info)/sizeof(counter_info[0]); i++)
+    {
+        const counter_info_t* info = &counter_info[i];
+        append(buf, size, &used, "# HELP %s_total %s\n# TYPE %s_total counter\n"
+               "%s_total %llu\n", info->metric, info->help, info->metric
+               , info->metric
+               , (unsigned long long)stats_counter(info->counter));
+    }
+
+    for(i = 0; i < sizeof(gauge_info)/sizeof(gauge_info[0]); i++)
+    {
+        const gauge_info_t* info = &gauge_info[i];
+        append(buf, size, &used, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n"
+               , info->metric, info->help, info->metric, info->metric
+               , stats_gauge(info->gauge)*info->scale);
+    }
+
+    append(buf, size, &used, "# HELP rpi_stream_encoder_pending_buffers"
+           " Encoder output buffers filled and not yet streamed\n"
+           "# TYPE rpi_stream_encoder_pending_buffers gauge\n"
+           "rpi_stream_encoder_pending_buffers %d\n"
+           , source->pending_buffers());
+    append(buf, size, &used, "# HELP rpi_stream_source_buffers_held"
+           " Source buffers waiting for clients to send them\n"
+           "# TYPE rpi_stream_source_buffers_held gauge\n"
+           "rpi_stream_source_buffers_held %d\n", stream_frames_in_use());
+
+    append(buf, size, &used, "# HELP rpi_stream_latency_seconds"
+           " Per frame latency of each pipeline stage\n"
+           "# TYPE rpi_stream_latency_seconds summary\n");
+    for(stage = 0; stage < TRACE_STAGES; stage++)
+    {
+        latency_hist_t* hist = frame_trace_stage((trace_stage)stage);
+        const char* stage_name = frame_trace_stage_name((trace_stage)stage);
+
+        append(buf, size, &used
+               , "rpi_stream_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %g\n"
+               "rpi_stream_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %g\n"
+               "rpi_stream_latency_seconds{stage=\"%s\",quantile=\"1\"} %g\n"
+               "rpi_stream_latency_seconds_sum{stage=\"%s\"} %g\n"
+               "rpi_stream_latency_seconds_count{stage=\"%s\"} %llu\n"
+               , stage_name, latency_hist_percentile(hist, 50)*1e-6
+               , stage_name, latency_hist_percentile(hist, 99)*1e-6
+               , stage_name, latency_hist_max(hist)*1e-6
+               , stage_name, latency_hist_sum(hist)*1e-6
+               , stage_name, (unsigned long long)latency_hist_count(hist));
+    }
+
+    int count = client_get_stats(client_stats, MAX_CLIENTS + 1);
+    append(buf, size, &used, "# HELP rpi_stream_clients Active clients\n"
+           "# TYPE rpi_stream_clients gauge\nrpi_stream_clients %d\n"
+           , client_count());
+
+    append(buf, size, &used, "# HELP rpi_stream_client_queue_depth"
+           " Frames queued for the client\n"
+           "# TYPE rpi_stream_client_queue_depth gauge\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_queue_depth{client=\"%s\"} %u\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , client_stats[i].queue_depth);
+
+    append(buf, size, &used, "# HELP rpi_stream_client_sent_frames_total"
+           " Frames sent to the client\n"
+           "# TYPE rpi_stream_client_sent_frames_total counter\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_sent_frames_total{client=\"%s\"} %llu\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , (unsigned long long)client_stats[i].sent_frames);
+
+    append(buf, size, &used, "# HELP rpi_stream_client_dropped_frames_total"
+           " Frames dropped for the client\n"
+           "# TYPE rpi_stream_client_dropped_frames_total counter\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_dropped_frames_total{client=\"%s\"} %llu\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , (unsigned long long)client_stats[i].dropped_frames);
+
+    append(buf, size, &used, "# HELP rpi_stream_client_retransmits_total"
+           " Packets sent again to the client after a NACK\n"
+           "# TYPE rpi_stream_client_retransmits_total counter\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_retransmits_total{client=\"%s\"} %llu\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , (unsigned long long)client_stats[i].retransmits);
+
+    append(buf, size, &used, "# HELP rpi_stream_client_layer"
+           " Simulcast layer the client gets, 0 main, 1 low\n"
+           "# TYPE rpi_stream_client_layer gauge\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_layer{client=\"%s\"} %d\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , client_stats[i].layer);
+
+    append(buf, size, &used, "# HELP rpi_stream_client_bitrate_bps"
+           " Bandwidth estimate from the receiver reports\n"
+           "# TYPE rpi_stream_client_bitrate_bps gauge\n");
+    for(i = 0; i < (unsigned int)count; i++)
+        append(buf, size, &used
+               , "rpi_stream_client_bitrate_bps{client=\"%s\"} %d\n"
+               , client_name(&client_stats[i], name, sizeof(name))
+               , client_stats[i].bitrate);
+
+    return used;
+}
+
+//Whatever the request is, the answer is the metrics page
+static void on_http_request(int connection, void* arg)
+{
+    char request[STATS_HTTP_REQUEST_BYTES];
+    char header[128];
+
+    int received = recv(connection, request, sizeof(request), MSG_DONTWAIT);
+
+    if(received > 0)
+    {
+        int len = format_stats_prometheus(http_source, http_page
+                                          , sizeof(http_page));
+        int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", len);
+
+        //A local reader takes the page in one go, if not it is cut short
+        if(send(connection, header, header_len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0
+           || send(connection, http_page, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+            DEBUG_ERR("stats http send error\n");
+    }
+    else if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    reactor_remove(connection);
+    close(connection);
+}
+
+static void on_http_connection(int fd, void* arg)
+{
+    int connection = accept4(fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(connection < 0)
+        return;
+
+    if(!reactor_add(connection, on_http_request, 0))
+        close(connection);
+}
+
+void stats_http_start(frame_source_t* source)
+{
+    struct sockaddr_in addr;
+    int reuse = 1;
+
+    if(!STATS_HTTP_PORT)
+        return;
+
+    http_source = source;
+    http_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    setsockopt(http_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_aton(STATS_HTTP_ADDR, &addr.sin_addr);
+    addr.sin_port = htons(STATS_HTTP_PORT);
+
+    //The stream works without it, so only complain
+    if(bind(http_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0
+       || listen(http_socket, 4) < 0
+       || !reactor_add(http_socket, on_http_connection, 0))
+    {
+        DEBUG_ERR("stats http socket bind error\n");
+        close(http_socket);
+        http_socket = -1;
+        return;
+    }
+
+    DEBUG_MSG("metrics on http://%s:%d/metrics\n", STATS_HTTP_ADDR
+              , STATS_HTTP_PORT);
+}
+
+void stats_http_stop()
+{
+    if(http_socket < 0)
+        return;
+
+    reactor_remove(http_socket);
+    close(http_socket);
+    http_socket = -1;
+}
@@ -0,0 +1,21 @@
+#ifndef APP_STATS_H
+#define APP_STATS_H
+
+#include "../source/frame_source.h"
+
+//Reply of the STATS command, fits one datagram
+#define STATS_REPLY_SIZE 1400
+//Local Prometheus endpoint, plain HTTP on STATS_HTTP_ADDR. 0 turns it off
+#define STATS_HTTP_PORT 50080
+#define STATS_HTTP_ADDR "127.0.0.1"
+#define STATS_PAGE_SIZE 16384
+
+//"key=value" counters and gauges, then "; <ip>:<port> queue=.." per client
+int format_stats(frame_source_t* source, char* buf, int size);
+//Prometheus text exposition format 0.0.4
+int format_stats_prometheus(frame_source_t* source, char* buf, int size);
+//Serves format_stats_prometheus() from the reactor
+void stats_http_start(frame_source_t* source);
+void stats_http_stop();
+
+#endif
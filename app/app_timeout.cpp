@@ -1,20 +1,7 @@
 #include "app_timeout.h"
+#include "../common_util/common_util.h"
 
-static struct timespec spec;
-static long end;
-
-void set_timeout()
-{
-    clock_gettime (CLOCK_MONOTONIC, &spec);
-
-    long now;
-    now = spec.tv_sec*1000 + spec.tv_nsec/1.0e6;
-    end = now + TIMEOUT_MS;
-}
-
-int is_timeout()
+void set_timeout(uint64_t* deadline_us)
 {
-    clock_gettime (CLOCK_MONOTONIC, &spec);
-    
-    return (spec.tv_sec*1000 + spec.tv_nsec/1.0e6 >= end);
+    *deadline_us = get_time_us() + (uint64_t)TIMEOUT_MS*1000;
 }
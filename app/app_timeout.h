@@ -2,10 +2,12 @@
 #define APP_TIMEOUT_H
 
 #include <time.h>
+#include <stdint.h>
 
 #define TIMEOUT_MS 2000 //2 second timeout
 
-void set_timeout();
-int is_timeout();
+//Session deadline on the get_time_us() clock, the client table arms a
+//timerfd with it
+void set_timeout(uint64_t* deadline_us);
 
 #endif
@@ -1,75 +1,827 @@
 #include "../udp_setup/udp_setup.h"
-#include "../openmax/h264.h"
+#include "../source/frame_source.h"
+#include "../source/frame_assembler.h"
 #include "../common_util/common_util.h"
+#include "../session/client_table.h"
+#include "../session/packet_history.h"
+#include "../session/keyframe_request.h"
+#include "../record/recorder.h"
+#include "../fec/gf256.h"
 #include "app_timeout.h"
+#include "app_config.h"
+#include "app_stats.h"
+#include "app_reactor.h"
 
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
-static void* stream_thread(void* arg)
-{           
-    OMX_BUFFERHEADERTYPE* frame_buffer;
+#define IDLE_WAIT_MS 100 //how often an idle stream thread checks for quit
+//No frame from a capturing source for this long is reported as a stall
+#define SOURCE_STALL_MS 2000
+//How long the shutdown waits for the kernel to finish zerocopy sends
+#define SHUTDOWN_DRAIN_MS 1000
 
-    omx_h264_init();
-    
-    while(!is_quit())
+//Each layer is a stream of its own, with its SSRC and sequence numbers
+static rtp_session_t rtp_sessions[STREAM_LAYERS];
+static rtp_fec_t rtp_fecs[STREAM_LAYERS];
+static frame_source_t* source;
+//Chains the source buffers into frames for deliver_frame(). Fed and reset
+//by the stream thread
+static frame_assembler_t assembler;
+//Latest config asked with SET_CONFIG, applied by the stream thread that owns
+//the source
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static video_config_t requested_config;
+static int config_pending;
+static struct sockaddr_in config_requester;
+//Latest SET_FEC, taken by deliver_frame()
+static fec_config_t requested_fec;
+static int fec_pending;
+//Latest SET_PACING, with the mode the kernel allowed
+static pacing_config_t requested_pacing;
+//Latest SET_RECORD
+static record_config_t requested_record;
+//IDRs asked for with KEYFRAME_REQUEST, by a receiver report with heavy loss,
+//a layer switch that found no GOP cached or a frame cut short. Coalesced
+//into as few as possible and sent to the source by the stream thread
+static pthread_mutex_t keyframe_lock = PTHREAD_MUTEX_INITIALIZER;
+static keyframe_request_t keyframe_requests;
+//Source watchdog of the reactor. The source signals frame_notify_fd for
+//every frame, stall_timer_fd fires if that stops while capturing
+static int frame_notify_fd;
+static int stall_timer_fd;
+static int capturing_now;
+static int stalled;
+//The source queues the buffers from a thread of its own and signals
+//buffer_ready_fd, which the stream thread waits on along with control_fd
+//rather than blocking in fill_buffer()
+static int ready_fd_delivery;
+static int buffer_ready_fd;
+static int control_fd;
+//Capture session, reset by the stream thread before the capture starts and
+//read after it stopped. Only the thread delivering the frames updates it
+static uint64_t session_start_us;
+static uint64_t session_frames;
+static int first_frame;
+//Measures fps and bitrate of the main layer over STATS_RATE_WINDOW_US
+static uint64_t window_start_us;
+static uint64_t window_frames, window_bytes;
+
+static void arm_stall_timer()
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = SOURCE_STALL_MS/1000;
+    spec.it_value.tv_nsec = (SOURCE_STALL_MS%1000)*1000000L;
+    timerfd_settime(stall_timer_fd, 0, &spec, 0);
+}
+
+static void request_keyframe()
+{
+    pthread_mutex_lock(&keyframe_lock);
+    keyframe_request_add(&keyframe_requests);
+    pthread_mutex_unlock(&keyframe_lock);
+    stats_add(STAT_KEYFRAME_REQUESTS, 1);
+}
+
+static void release_source_frame(source_frame_t* source_frame)
+{
+    int i;
+
+    for(i = 0; i < source_frame->buffer_count; i++)
+        source->release_buffer(source_frame->buffers[i]);
+}
+
+//Applies a pending SET_CONFIG and tells the requester how long it took
+static void apply_requested_config()
+{
+    video_config_t config;
+    struct sockaddr_in requester;
+    char reply[CONFIG_REPLY_SIZE];
+    static const char* how[] = {"stored", "live", "restart", "failed"};
+
+    pthread_mutex_lock(&config_lock);
+    if(!config_pending)
     {
-        frame_buffer = fill_frame_buffer();
+        pthread_mutex_unlock(&config_lock);
+        return;
+    }
+    config = requested_config;
+    requester = config_requester;
+    config_pending = 0;
+    pthread_mutex_unlock(&config_lock);
+
+    uint64_t start_us = get_time_us();
 
-        udp_send_stream(frame_buffer->pBuffer
-                        , frame_buffer->nFilledLen);
+    //A restart frees the source buffers, every frame has to be back first.
+    //The capture stops meanwhile so the source can't fill another one
+    int restart = source->config_needs_restart(&config);
+    int capturing = __atomic_load_n(&capturing_now, __ATOMIC_ACQUIRE);
 
-        if (is_timeout())
-            break;
+    if(restart)
+    {
+        if(capturing)
+            source->stop_capture();
+        frame_assembler_reset(&assembler);
+        while(stream_frames_in_use())
+        {
+            client_wake_sender();
+            usleep(1000);
+        }
     }
 
-    omx_h264_deinit();
+    int result = source->set_config(&config);
+    //A failed restart may have dropped the low layer
+    if(restart)
+        client_set_layer_count(source->layer_count());
+    if(restart && capturing)
+        source->start_capture();
+    uint64_t apply_us = get_time_us() - start_us;
+    stats_set(STAT_CONFIG_US, apply_us);
 
-    DEBUG_MSG("stream thread ended\n");
-    pthread_exit((void *) 0); // user-requested-stop
+    DEBUG_MSG("config %s in %llu us\n", how[result]
+              , (unsigned long long)apply_us);
+    snprintf(reply, sizeof(reply), "CONFIG %s %llu us", how[result]
+             , (unsigned long long)apply_us);
+    udp_reply_to(&requester, reply);
 }
 
-int main(int argc, char** argv)
+//Follows the bandwidth estimate of the slowest client
+static void apply_rate_control()
 {
-    udp_server_setup();
-    pthread_t stream_tid;
-    int stream_thread_status;
+    video_config_t config;
+    int bitrate = client_target_bitrate();
+
+    source->set_bitrate(bitrate);
+    source->get_config(&config);
+    if(config.framerate)
+        client_set_frame_interval(1000000/config.framerate);
+    stats_set(STAT_TARGET_BITRATE, bitrate && bitrate < config.bitrate
+              ? bitrate : config.bitrate);
+
+    pthread_mutex_lock(&keyframe_lock);
+    uint32_t requests = keyframe_requests.requests;
+    int due = keyframe_request_due(&keyframe_requests, get_time_us());
+    pthread_mutex_unlock(&keyframe_lock);
 
-    while(1)
+    if(due)
     {
-        if(udp_receive_command())
+        DEBUG_MSG("requesting an IDR for %u keyframe requests\n", requests);
+        stats_add(STAT_KEYFRAMES_FORCED, 1);
+        source->request_idr();
+    }
+}
+
+//Packetizes one source frame and queues it to every client. Called by the
+//stream thread
+static void deliver_frame(source_frame_t* source_frame)
+{
+    stream_frame_t* frame;
+    int layer = source_frame->layer;
+    int i;
+
+    //There is a frame per source buffer at most, this only fails if the
+    //source has more buffers than STREAM_FRAME_POOL
+    if(!(frame = stream_frame_get(release_source_frame)))
+    {
+        DEBUG_ERR("no free stream frame\n");
+        release_source_frame(source_frame);
+        return;
+    }
+
+    //The receivers can't decode the rest of the GOP after a cut frame
+    if(!source_frame->complete)
+        request_keyframe();
+    //Whatever asked for one, this serves it
+    else if(source_frame->keyframe && layer == LAYER_MAIN)
+    {
+        pthread_mutex_lock(&keyframe_lock);
+        keyframe_request_delivered(&keyframe_requests, get_time_us());
+        pthread_mutex_unlock(&keyframe_lock);
+    }
+
+    frame->source = *source_frame;
+    recorder_add(&frame->source);
+    frame->trace.capture_us = source_frame->capture_us;
+    frame->trace.ready_us = source_frame->ready_us;
+    frame->trace.filled_us = get_time_us();
+    frame->layer = layer;
+    rtp_packetize_h264_segments(&rtp_sessions[layer]
+                                , &frame->rtp
+                                , frame->source.segments
+                                , frame->source.buffer_count
+                                , rtp_timestamp_from_us(
+                                    source_frame->timestamp_us)
+                                , source_frame->complete);
+    if(RTP_CAPTURE_TIME_EXT)
+        rtp_add_capture_time(&frame->rtp, get_unix_time_us()
+                             - (frame->trace.filled_us
+                                - source_frame->capture_us));
+    if(__atomic_load_n(&fec_pending, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&config_lock);
+        for(i = 0; i < STREAM_LAYERS; i++)
+            rtp_fec_set_config(&rtp_fecs[i], &requested_fec);
+        fec_pending = 0;
+        pthread_mutex_unlock(&config_lock);
+    }
+    rtp_fec_protect(&rtp_fecs[layer], &frame->rtp, &frame->fec);
+    frame->trace.queued_us = get_time_us();
+
+    stats_add(STAT_FRAMES_ENCODED, 1);
+    stats_add(STAT_BYTES_ENCODED, frame->source.len);
+    stats_add(STAT_FEC_PACKETS, frame->rtp.repair_count);
+    if(layer == LAYER_MAIN)
+    {
+        window_frames++;
+        window_bytes += frame->source.len;
+    }
+    if(frame->trace.queued_us - window_start_us >= STATS_RATE_WINDOW_US)
+    {
+        uint64_t window_us = frame->trace.queued_us - window_start_us;
+        stats_set(STAT_FPS, window_frames*1000000/window_us);
+        stats_set(STAT_BITRATE, window_bytes*8*1000000/window_us);
+        window_start_us = frame->trace.queued_us;
+        window_frames = window_bytes = 0;
+    }
+
+    //The buffer goes back to the source once every client sent it, the
+    //packet history keeps copies
+    client_fanout(frame);
+    packet_history_add(frame, get_time_us());
+    stream_frame_unref(frame);
+    session_frames++;
+
+    if(first_frame)
+    {
+        DEBUG_MSG("first frame queued %llu us after capture start\n"
+                  , (unsigned long long)(get_time_us() - session_start_us));
+        first_frame = 0;
+    }
+}
+
+//Takes every buffer of the source, frames go to deliver_frame() once
+//complete
+static void deliver_buffer(source_buffer_t* buffer)
+{
+    frame_assembler_add(&assembler, buffer);
+}
+
+//Waits until every frame is back, the source can't go down before. The
+//reactor may be gone already, so the zerocopy completions are read here
+static void drain_frames()
+{
+    int i;
+
+    for(i = 0; stream_frames_in_use() && i < SHUTDOWN_DRAIN_MS; i++)
+    {
+        udp_stream_events();
+        usleep(1000);
+    }
+
+    if(stream_frames_in_use())
+        DEBUG_ERR("%d frames still held by the kernel\n", stream_frames_in_use());
+}
+
+//Sleeps until the source filled a buffer, on_command() has news for the
+//stream thread or timeout_ms passed, then takes every buffer filled
+static void wait_buffers(int timeout_ms)
+{
+    struct pollfd pfd[2];
+    source_buffer_t* buffer;
+
+    pfd[0].fd = buffer_ready_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = control_fd;
+    pfd[1].events = POLLIN;
+    if(poll(pfd, 2, timeout_ms) <= 0)
+        return;
+
+    //Drained before the ring is read, a buffer queued meanwhile signals again
+    if(pfd[0].revents)
+        event_fd_drain(buffer_ready_fd);
+    if(pfd[1].revents)
+        event_fd_drain(control_fd);
+    while((buffer = source->take_buffer()))
+        deliver_buffer(buffer);
+}
+
+//Owns the frame source. Captures while at least one client is subscribed and
+//fans every frame out to all of them
+static void* stream_thread(void* arg)
+{
+    int pipeline_ready = PERSISTENT_PIPELINE;
+    int capturing = 0;
+    uint64_t start_packets = 0, start_syscalls = 0;
+
+    while(!is_quit())
+    {
+        apply_requested_config();
+        apply_rate_control();
+
+        //The recorder may want the frames without any client
+        if(!client_count() && !recorder_wants_frames(get_time_us()))
         {
-            if(udp_check_command("VIDEO_REQUEST"))
+            if(capturing)
             {
-                DEBUG_MSG("set timeout %d ms\n", TIMEOUT_MS);
-                set_timeout();
-
-                DEBUG_MSG("create thread for stream\n");
-                
-                if(pthread_create(&stream_tid
-                                  , NULL
-                                  , stream_thread
-                                  , NULL) != 0)
-                    DEBUG_ERR("Error while creating stream_stread\n");
+                source->stop_capture();
+                frame_assembler_reset(&assembler);
+                packet_history_clear();
+                capturing = 0;
+                __atomic_store_n(&capturing_now, 0, __ATOMIC_RELEASE);
+                stats_set(STAT_FPS, 0);
+                stats_set(STAT_BITRATE, 0);
+
+                uint64_t packets, syscalls;
+                udp_get_send_stats(&packets, &syscalls);
+                packets -= start_packets;
+                syscalls -= start_syscalls;
+                if(session_frames)
+                    DEBUG_MSG("encoded %llu frames, sent %llu packets/s, "
+                              "%.2f syscalls per frame (%s)\n"
+                              , (unsigned long long)session_frames
+                              , (unsigned long long)(packets*1000000
+                                  /(get_time_us() - session_start_us + 1))
+                              , (double)syscalls/session_frames
+                              , udp_send_mode_name());
+                frame_trace_log();
             }
-            else if(udp_check_command("SET_TIMEOUT"))
+
+            //The source buffers have to be back before it goes down
+            if(pipeline_ready && !PERSISTENT_PIPELINE && !stream_frames_in_use())
             {
-                DEBUG_MSG("set timeout %d ms\n", TIMEOUT_MS);
-                set_timeout();
+                uint64_t deinit_start_us = get_time_us();
+                source->deinit();
+                stats_set(STAT_DEINIT_US, get_time_us() - deinit_start_us);
+                pipeline_ready = 0;
             }
-            else if(udp_check_command("QUIT_SERVER"))
-            {
-                DEBUG_MSG("quit_request received\n");
-                set_quit();
-                DEBUG_MSG("wait until stream thread join\n");
-                pthread_join(stream_tid, (void **)&stream_thread_status);
 
-                break;
-            }
+            client_wait_subscribers(IDLE_WAIT_MS);
+            continue;
+        }
+
+        if(!pipeline_ready)
+        {
+            uint64_t init_start_us = get_time_us();
+            source->init();
+            stats_set(STAT_INIT_US, get_time_us() - init_start_us);
+            //Fewer layers if the simulcast setup failed
+            client_set_layer_count(source->layer_count());
+            pipeline_ready = 1;
+        }
+
+        if(!capturing)
+        {
+            session_start_us = get_time_us();
+            udp_get_send_stats(&start_packets, &start_syscalls);
+            session_frames = 0;
+            first_frame = 1;
+            frame_trace_reset();
+            window_start_us = session_start_us;
+            window_frames = window_bytes = 0;
+
+            source->start_capture();
+            capturing = 1;
+            __atomic_store_n(&capturing_now, 1, __ATOMIC_RELEASE);
+            arm_stall_timer();
         }
+
+        if(ready_fd_delivery)
+            wait_buffers(IDLE_WAIT_MS);
+        else
+            deliver_buffer(source->fill_buffer());
+    }
+
+    if(capturing)
+        source->stop_capture();
+    frame_assembler_reset(&assembler);
+    packet_history_clear();
+
+    if(pipeline_ready && !PERSISTENT_PIPELINE)
+    {
+        drain_frames();
+        source->deinit();
+    }
+
+    DEBUG_MSG("stream thread ended\n");
+    pthread_exit((void *) 0); // user-requested-stop
+}
+
+//Sends the queued frames to every client, so a slow client never blocks
+//the source
+static void* sender_thread(void* arg)
+{
+    uint64_t burst_deadline_us = 0;
+
+    //The waits between paced packets are short
+    prctl(PR_SET_TIMERSLACK, PACING_TIMER_SLACK_NS);
+
+    while(!is_quit())
+    {
+        client_wait_queued(burst_deadline_us);
+        burst_deadline_us = client_send_queued();
+    }
+
+    //Give the remaining frames back to the source
+    client_send_queued();
+
+    DEBUG_MSG("sender thread ended\n");
+    pthread_exit((void *) 0);
+}
+
+static void on_command(int fd, void* arg)
+{
+    uint64_t deadline_us;
+
+    if(!udp_receive_command())
+        return;
+
+    if(udp_check_command("VIDEO_REQUEST"))
+    {
+        DEBUG_MSG("set timeout %d ms\n", TIMEOUT_MS);
+        set_timeout(&deadline_us);
+        client_subscribe(udp_command_addr(), deadline_us, 0);
+    }
+    else if(udp_check_command("VIDEO_JOIN_MCAST"))
+    {
+        DEBUG_MSG("set timeout %d ms\n", TIMEOUT_MS);
+        set_timeout(&deadline_us);
+        if(client_subscribe(udp_command_addr(), deadline_us, 1))
+            udp_reply_command("MCAST " MCAST_GROUP);
+    }
+    else if(udp_check_command("SET_TIMEOUT"))
+    {
+        DEBUG_MSG("set timeout %d ms\n", TIMEOUT_MS);
+        set_timeout(&deadline_us);
+        client_keepalive(udp_command_addr(), deadline_us);
+    }
+    else if(udp_check_command("SET_CONFIG"))
+    {
+        int valid;
+
+        pthread_mutex_lock(&config_lock);
+        if((valid = parse_video_config(udp_command_args("SET_CONFIG")
+                                       , &requested_config)))
+        {
+            config_pending = 1;
+            config_requester = *udp_command_addr();
+        }
+        pthread_mutex_unlock(&config_lock);
+
+        if(!valid)
+            udp_reply_command("CONFIG error");
+    }
+    else if(udp_check_command("SET_FEC"))
+    {
+        char reply[CONFIG_REPLY_SIZE];
+        int len = snprintf(reply, sizeof(reply), "FEC ");
+        int valid;
+
+        //No arguments just reports the config
+        pthread_mutex_lock(&config_lock);
+        if((valid = parse_fec_config(udp_command_args("SET_FEC")
+                                     , &requested_fec)))
+            __atomic_store_n(&fec_pending, 1, __ATOMIC_RELEASE);
+        format_fec_config(&requested_fec, reply + len, sizeof(reply) - len);
+        pthread_mutex_unlock(&config_lock);
+
+        udp_reply_command(valid ? reply : "FEC error");
+    }
+    else if(udp_check_command("SET_PACING"))
+    {
+        char reply[CONFIG_REPLY_SIZE];
+        int len = snprintf(reply, sizeof(reply), "PACING ");
+        int valid;
+
+        //No arguments just reports the config
+        pthread_mutex_lock(&config_lock);
+        if((valid = parse_pacing_config(udp_command_args("SET_PACING")
+                                        , &requested_pacing)))
+            requested_pacing.mode = client_set_pacing(&requested_pacing);
+        format_pacing_config(&requested_pacing, reply + len, sizeof(reply) - len);
+        pthread_mutex_unlock(&config_lock);
+
+        udp_reply_command(valid ? reply : "PACING error");
+    }
+    else if(udp_check_command("SET_RECORD"))
+    {
+        char reply[CONFIG_REPLY_SIZE];
+        int len = snprintf(reply, sizeof(reply), "RECORD ");
+        int valid;
+
+        //No arguments just reports the config
+        pthread_mutex_lock(&config_lock);
+        if((valid = parse_record_config(udp_command_args("SET_RECORD")
+                                        , &requested_record)))
+            recorder_set_config(&requested_record);
+        format_record_config(&requested_record, reply + len, sizeof(reply) - len);
+        pthread_mutex_unlock(&config_lock);
+
+        //A pre window keeps the capture going
+        client_wake_subscribers();
+        udp_reply_command(valid ? reply : "RECORD error");
+    }
+    else if(udp_check_command("RECORD_START"))
+    {
+        //The recording can't start before a keyframe
+        if(recorder_start(get_time_us()))
+            request_keyframe();
+        client_wake_subscribers();
+        udp_reply_command("RECORD on");
+    }
+    else if(udp_check_command("RECORD_TRIGGER"))
+    {
+        if(recorder_trigger(get_time_us()))
+            request_keyframe();
+        client_wake_subscribers();
+        udp_reply_command("RECORD on");
+    }
+    else if(udp_check_command("RECORD_STOP"))
+    {
+        recorder_stop(get_time_us());
+        udp_reply_command("RECORD off");
+    }
+    else if(udp_check_command("GET_CONFIG"))
+    {
+        char reply[CONFIG_REPLY_SIZE];
+
+        pthread_mutex_lock(&config_lock);
+        format_video_config(&requested_config, reply, sizeof(reply));
+        pthread_mutex_unlock(&config_lock);
+
+        udp_reply_command(reply);
+    }
+    else if(udp_check_command("RECEIVER_REPORT"))
+    {
+        receiver_report_t report;
+
+        if(parse_receiver_report(udp_command_args("RECEIVER_REPORT")
+                                 , &report)
+           && (client_report(udp_command_addr(), &report, get_time_us())
+               & RATE_REQUEST_IDR))
+            request_keyframe();
+    }
+    else if(udp_check_command("SET_LAYER"))
+    {
+        char reply[CONFIG_REPLY_SIZE];
+        int layer;
+        int request_idr;
+
+        if(!parse_layer(udp_command_args("SET_LAYER"), &layer)
+           || (layer = client_set_layer(udp_command_addr(), layer
+                                        , &request_idr)) < 0)
+            udp_reply_command("LAYER error");
+        else
+        {
+            if(request_idr)
+                request_keyframe();
+            snprintf(reply, sizeof(reply), "LAYER %s", layer_name(layer));
+            udp_reply_command(reply);
+        }
+    }
+    else if(udp_check_command("KEYFRAME_REQUEST"))
+    {
+        //No reply, the IDR is the answer
+        if(client_is_subscribed(udp_command_addr()))
+            request_keyframe();
+    }
+    else if(udp_check_command("NACK"))
+    {
+        uint16_t seqs[NACK_MAX_PACKETS];
+        int count = parse_nack(udp_command_args("NACK"), seqs, NACK_MAX_PACKETS);
+
+        //No reply, the retransmits are the answer
+        if(count)
+            client_nack(udp_command_addr(), seqs, count, get_time_us());
+    }
+    else if(udp_check_command("GET_LATENCY"))
+    {
+        char reply[LATENCY_REPLY_SIZE];
+        int len = snprintf(reply, sizeof(reply), "LATENCY ");
+
+        frame_trace_format(reply + len, sizeof(reply) - len);
+        udp_reply_command(reply);
+    }
+    else if(udp_check_command("STATS"))
+    {
+        char reply[STATS_REPLY_SIZE];
+        int len = snprintf(reply, sizeof(reply), "STATS ");
+
+        format_stats(source, reply + len, sizeof(reply) - len);
+        udp_reply_command(reply);
+    }
+    else if(udp_check_command("SET_LOG_LEVEL"))
+    {
+        int level = log_level_from_name(udp_command_args("SET_LOG_LEVEL"));
+
+        if(level < 0)
+            udp_reply_command("LOG_LEVEL error");
+        else
+            log_set_level(level);
+    }
+    else if(udp_check_command("VIDEO_STOP"))
+    {
+        client_unsubscribe(udp_command_addr());
+    }
+    else if(udp_check_command("QUIT_SERVER"))
+    {
+        DEBUG_MSG("quit_request received\n");
+        set_quit();
+    }
+
+    //Config, rate and subscription changes are picked up between frames
+    event_fd_signal(control_fd);
+}
+
+static void on_session_timer(int fd, void* arg)
+{
+    client_session_timer((int)(intptr_t)arg);
+    event_fd_signal(control_fd);
+}
+
+static void on_stream_events(int fd, void* arg)
+{
+    udp_stream_events();
+}
+
+static void on_frame_ready(int fd, void* arg)
+{
+    event_fd_drain(fd);
+
+    if(stalled)
+    {
+        DEBUG_MSG("source delivers frames again\n");
+        stalled = 0;
+    }
+    arm_stall_timer();
+}
+
+static void on_stall_timer(int fd, void* arg)
+{
+    uint64_t expirations;
+
+    if(read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    //Rearmed by the next frame
+    if(__atomic_load_n(&capturing_now, __ATOMIC_ACQUIRE) && !stalled)
+    {
+        DEBUG_ERR("no frame from the source for %d ms\n", SOURCE_STALL_MS);
+        stats_add(STAT_SOURCE_STALLS, 1);
+        stalled = 1;
+    }
+}
+
+static void on_signal(int fd, void* arg)
+{
+    struct signalfd_siginfo info;
+
+    if(read(fd, &info, sizeof(info)) != sizeof(info))
+        return;
+
+    DEBUG_MSG("signal %d received\n", (int)info.ssi_signo);
+    set_quit();
+}
+
+static void on_quit(int fd, void* arg)
+{
+    reactor_stop();
+}
+
+//Usage: rpi_stream_server [camera [record=<path>]
+//                          | file <path.h264> [fast] [trace=<path>]
+//                          | synthetic [fast] [simulcast] [p=<bytes>]
+//                            [idr=<bytes>] [scene=<seconds>]]
+int main(int argc, char** argv)
+{
+    sigset_t quit_signals;
+    pthread_t stream_tid;
+    pthread_t sender_tid;
+    int thread_status;
+    int signal_fd;
+    int i;
+
+    //Taken through signalfd, blocked before any thread inherits the mask
+    sigemptyset(&quit_signals);
+    sigaddset(&quit_signals, SIGINT);
+    sigaddset(&quit_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quit_signals, 0);
+    quit_init();
+
+    log_init();
+    if(!(source = frame_source_select(argc - 1, argv + 1)))
+        exit(1);
+
+    udp_server_setup();
+    client_table_init();
+    keyframe_request_init(&keyframe_requests);
+    client_set_layer_count(source->layer_count());
+    source->get_config(&requested_config);
+    fec_config_default(&requested_fec);
+    for(i = 0; i < STREAM_LAYERS; i++)
+    {
+        rtp_session_init(&rtp_sessions[i]
+                         , (uint32_t)(get_time_us() ^ getpid()) + i);
+        rtp_fec_init(&rtp_fecs[i], &rtp_sessions[i], &requested_fec);
+    }
+    if(source->layer_count() > 1)
+        DEBUG_MSG("simulcast, %d layers\n", source->layer_count());
+    DEBUG_MSG("fec %s, GF(256) kernel %s\n", fec_mode_name(requested_fec.mode)
+              , gf256_kernel_name());
+    record_config_default(&requested_record);
+    recorder_init();
+    pacing_config_default(&requested_pacing);
+    requested_pacing.mode = client_set_pacing(&requested_pacing);
+    DEBUG_MSG("pacing %s over %d%% of the frame interval\n"
+              , pacing_mode_name(requested_pacing.mode)
+              , requested_pacing.spread_percent);
+
+    frame_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stall_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    signal_fd = signalfd(-1, &quit_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    buffer_ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(frame_notify_fd < 0 || stall_timer_fd < 0 || signal_fd < 0
+       || control_fd < 0 || buffer_ready_fd < 0)
+    {
+        DEBUG_ERR("Error while creating the event descriptors\n");
+        exit(1);
+    }
+    source->set_frame_notify(frame_notify_fd);
+    frame_assembler_init(&assembler, deliver_frame, source->release_buffer);
+    ready_fd_delivery = SOURCE_READY_FD
+                        && source->set_buffer_ready(buffer_ready_fd);
+    DEBUG_MSG("%s frame delivery\n", ready_fd_delivery ? "eventfd" : "pull");
+
+    reactor_init();
+    reactor_add(udp_command_fd(), on_command, 0);
+    reactor_add(quit_event_fd(), on_quit, 0);
+    reactor_add(signal_fd, on_signal, 0);
+    reactor_add(frame_notify_fd, on_frame_ready, 0);
+    reactor_add(stall_timer_fd, on_stall_timer, 0);
+    if(udp_zerocopy_enabled())
+        reactor_add(udp_stream_fd(), on_stream_events, 0);
+    for(i = 0; i < MAX_CLIENTS; i++)
+        reactor_add(client_timer_fd(i), on_session_timer, (void*)(intptr_t)i);
+
+    if (PERSISTENT_PIPELINE)
+    {
+        uint64_t init_start_us = get_time_us();
+        source->init();
+        stats_set(STAT_INIT_US, get_time_us() - init_start_us);
+        client_set_layer_count(source->layer_count());
+        DEBUG_MSG("pipeline init took %llu us\n"
+                  , (unsigned long long)(get_time_us() - init_start_us));
+    }
+
+    if(pthread_create(&stream_tid, NULL, stream_thread, NULL) != 0
+       || pthread_create(&sender_tid, NULL, sender_thread, NULL) != 0)
+    {
+        DEBUG_ERR("Error while creating stream threads\n");
+        exit(1);
+    }
+    stats_http_start(source);
+
+    reactor_run();
+
+    client_remove_all();
+    DEBUG_MSG("wait until stream threads join\n");
+    client_wake_subscribers();
+    event_fd_signal(control_fd);
+    client_wake_sender();
+    pthread_join(sender_tid, (void **)&thread_status);
+    pthread_join(stream_tid, (void **)&thread_status);
+    stats_http_stop();
+    //Writes what is left of a recording
+    recorder_shutdown();
+
+    if (PERSISTENT_PIPELINE)
+    {
+        drain_frames();
+        uint64_t deinit_start_us = get_time_us();
+        source->deinit();
+        stats_set(STAT_DEINIT_US, get_time_us() - deinit_start_us);
+        DEBUG_MSG("pipeline deinit took %llu us\n"
+                  , (unsigned long long)(get_time_us() - deinit_start_us));
     }
 
     DEBUG_MSG("close and shutdown server\n");
+    reactor_close();
+    source->set_frame_notify(-1);
+    source->set_buffer_ready(-1);
+    close(frame_notify_fd);
+    close(buffer_ready_fd);
+    close(stall_timer_fd);
+    close(signal_fd);
+    close(control_fd);
     udp_server_close();
+    log_shutdown();
 
     return 0;
 }
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../common_util/latency_hist.h"
+#include "../common_util/stats.h"
+#include "../udp_setup/udp_setup.h"
+
+//System calls, CPU time and latency of reading the commands with
+//recvfrom() and with the multishot recvmsg of io_uring. A client thread
+//sends bursts of commands to the command port, the main thread reads them
+//like the reactor does: one udp_receive_command() each time
+//udp_command_fd() polls readable. The system calls counted are the polls
+//and STAT_COMMAND_SYSCALLS, the CPU time is the main thread's. Bursts
+//longer than UDP_URING_COMMAND_BUFFERS end the multishot request, which is
+//armed again. The client waits for a burst to be read before it sends the
+//next one, a reader starved of the CPU would overflow the socket buffer
+//otherwise. Returns 1 if a command is lost
+//
+//command_bench [commands=2000] [interval_us=1000]
+#define COMMAND_BENCH_TIMEOUT_MS 2000
+
+static const char* mode_names[] = {"recvfrom", "io_uring"};
+static int bursts[] = {1, 8, 32};
+#define BURST_SIZES (int)(sizeof(bursts)/sizeof(bursts[0]))
+
+static int commands = 2000;
+static int interval_us = 1000;
+
+static int client_socket;
+static struct sockaddr_in server_addr;
+static int burst;
+static int received;
+static int reading;
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "commands=", 9))
+            commands = atoi(argv[i] + 9);
+        else if(!strncmp(argv[i], "interval_us=", 12))
+            interval_us = atoi(argv[i] + 12);
+        else
+        {
+            fprintf(stderr, "usage: %s [commands=N] [interval_us=N]\n"
+                    , argv[0]);
+            exit(1);
+        }
+    }
+
+    if(commands <= 0 || interval_us <= 0)
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+//The client, a burst every interval_us once the last one is read. Each
+//command carries its send time
+static void* client_main(void* arg)
+{
+    uint64_t due_us = get_time_us();
+    char cmd[64];
+    int sent = 0;
+
+    while(sent < commands && __atomic_load_n(&reading, __ATOMIC_ACQUIRE))
+    {
+        struct timespec due;
+        int i;
+
+        due.tv_sec = due_us/1000000;
+        due.tv_nsec = (due_us%1000000)*1000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR);
+        if(__atomic_load_n(&received, __ATOMIC_ACQUIRE) < sent)
+        {
+            due_us += interval_us;
+            continue;
+        }
+        for(i = 0; i < burst && sent < commands; i++, sent++)
+        {
+            int len = snprintf(cmd, sizeof(cmd), "SET_TIMEOUT %llu"
+                               , (unsigned long long)get_time_us());
+            sendto(client_socket, cmd, len, 0, (struct sockaddr*)&server_addr
+                   , sizeof(server_addr));
+        }
+        due_us += interval_us;
+    }
+
+    return 0;
+}
+
+static void run(int mode, int* failures)
+{
+    uint64_t start_syscalls = stats_counter(STAT_COMMAND_SYSCALLS);
+    uint64_t polls = 0;
+    uint64_t cpu_ns = 0;
+    latency_hist_t latency;
+    pthread_t client;
+    struct pollfd pfd;
+
+    if(udp_set_command_uring(mode) != mode)
+    {
+        printf("%-9s %5d  not supported by the kernel\n", mode_names[mode]
+               , burst);
+        return;
+    }
+
+    latency_hist_reset(&latency);
+    received = 0;
+    reading = 1;
+    pfd.fd = udp_command_fd();
+    pfd.events = POLLIN;
+    pthread_create(&client, 0, client_main, 0);
+    while(received < commands)
+    {
+        polls++;
+        int ready = poll(&pfd, 1, COMMAND_BENCH_TIMEOUT_MS);
+        if(ready <= 0)
+            break;
+
+        uint64_t start_ns = thread_cpu_ns();
+        int got = udp_receive_command();
+        cpu_ns += thread_cpu_ns() - start_ns;
+        if(got && udp_check_command("SET_TIMEOUT"))
+        {
+            latency_hist_record(&latency, get_time_us()
+                                - strtoull(udp_command_args("SET_TIMEOUT")
+                                           , 0, 10));
+            __atomic_store_n(&received, received + 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(&reading, 0, __ATOMIC_RELEASE);
+    pthread_join(client, 0);
+
+    uint64_t syscalls = stats_counter(STAT_COMMAND_SYSCALLS) - start_syscalls;
+    printf("%-9s %5d %9.2f %9.2f %10.2f %7llu %7llu %7llu %6d/%d\n"
+           , mode_names[mode], burst, (double)syscalls/commands
+           , (double)(syscalls + polls)/commands, cpu_ns/1000.0/commands
+           , (unsigned long long)latency_hist_percentile(&latency, 50)
+           , (unsigned long long)latency_hist_percentile(&latency, 99)
+           , (unsigned long long)latency_hist_max(&latency), received
+           , commands);
+    if(received != commands)
+    {
+        printf("FAIL %s lost %d commands in bursts of %d\n", mode_names[mode]
+               , commands - received, burst);
+        (*failures)++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int failures = 0;
+    int size = 1024*1024;
+    int b, mode;
+
+    parse_args(argc, argv);
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+
+    client_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = htons(SERVER_COMMAND_PORT);
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    printf("%d commands, a burst every %d us\n", commands, interval_us);
+    printf("%-9s %5s %9s %9s %10s %23s\n", "", "", "reads", "+polls"
+           , "", "latency (us)");
+    printf("%-9s %5s %9s %9s %10s %7s %7s %7s %13s\n", "mode", "burst"
+           , "calls/cmd", "calls/cmd", "cpu us/cmd", "p50", "p99", "max"
+           , "received");
+    for(b = 0; b < BURST_SIZES; b++)
+    {
+        burst = bursts[b];
+        for(mode = 0; mode < 2; mode++)
+            run(mode, &failures);
+    }
+
+    close(client_socket);
+    udp_server_close();
+
+    return failures ? 1 : 0;
+}
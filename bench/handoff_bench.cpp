@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../common_util/latency_hist.h"
+#include "../common_util/spsc_ring.h"
+#include "../rtp/rtp_h264.h"
+
+//Callback to send latency of the ways the encoder callback can hand a frame
+//to the stream thread, and how long each holds the callback thread:
+//  sink     the callback packetizes and sends the frame itself
+//  flags    ring push, then the event flags the stream thread waits on, as
+//           vcos_event_flags_set()/get() do it on Linux (mutex and condition)
+//  eventfd  ring push, then an eventfd the stream thread polls along with a
+//           control eventfd, what the camera source does with SOURCE_READY_FD
+//The stream side is the same in all three: it takes table_lock, which a
+//reactor thread holds for contention_us every millisecond like the NACK
+//retransmits do, packetizes the frame and sends it to a loopback receiver.
+//No camera here, so the callback is a thread of this program running at
+//fps; on the Pi the ILCS thread also calls back the other components.
+//
+//handoff_bench [frames=300] [fps=60] [frame_bytes=20000] [contention_us=200]
+#define BENCH_RING_SIZE 16
+#define BENCH_REACTOR_PERIOD_US 1000
+
+enum {
+    MODE_SINK,
+    MODE_FLAGS,
+    MODE_EVENTFD,
+    MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = {"sink", "flags", "eventfd"};
+
+static int frames = 300;
+static int fps = 60;
+static int frame_bytes = 20000;
+static int contention_us = 200;
+
+static uint8_t* frame_data;
+static uint64_t frame_ready_us[BENCH_RING_SIZE];
+static spsc_ring_t ring;
+static void* ring_slots[BENCH_RING_SIZE];
+static int mode;
+static int running;
+//Event flags of the flags mode
+static pthread_mutex_t flags_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flags_cond = PTHREAD_COND_INITIALIZER;
+static int flags_set;
+//The eventfd mode waits on both, like the stream thread
+static int ready_fd;
+static int control_fd;
+//What the stream thread shares with the reactor
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int send_socket;
+static int receive_socket;
+static struct sockaddr_in receive_addr;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+static struct mmsghdr msgs[RTP_MAX_PACKETS];
+
+static latency_hist_t hold_hist;
+static latency_hist_t send_hist;
+static int delivered;
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "frames=", 7))
+            frames = atoi(argv[i] + 7);
+        else if(!strncmp(argv[i], "fps=", 4))
+            fps = atoi(argv[i] + 4);
+        else if(!strncmp(argv[i], "frame_bytes=", 12))
+            frame_bytes = atoi(argv[i] + 12);
+        else if(!strncmp(argv[i], "contention_us=", 14))
+            contention_us = atoi(argv[i] + 14);
+        else
+        {
+            fprintf(stderr, "usage: %s [frames=N] [fps=N] [frame_bytes=N]"
+                    " [contention_us=N]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(frames <= 0 || fps <= 0 || frame_bytes < 16
+       || frame_bytes > RTP_MAX_PAYLOAD*(RTP_MAX_PACKETS - 1) || contention_us < 0)
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+//One IDR slice, no byte pattern that looks like a start code
+static void make_frame()
+{
+    int i;
+
+    frame_data = (uint8_t*)malloc(frame_bytes);
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 0;
+    frame_data[3] = 1;
+    frame_data[4] = 0x65;
+    for(i = 5; i < frame_bytes; i++)
+        frame_data[i] = 1 + rand()%255;
+}
+
+static void setup_sockets()
+{
+    socklen_t len = sizeof(receive_addr);
+    int size = 4*1024*1024;
+
+    send_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    receive_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&receive_addr, 0, sizeof(receive_addr));
+    receive_addr.sin_family = AF_INET;
+    receive_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(send_socket < 0 || receive_socket < 0
+       || bind(receive_socket, (struct sockaddr*)&receive_addr
+               , sizeof(receive_addr)) < 0
+       || getsockname(receive_socket, (struct sockaddr*)&receive_addr
+                      , &len) < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(send_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+//The part of deliver_frame() and the sender that every mode runs
+static void deliver(int slot)
+{
+    int count;
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+    count = rtp_packetize_h264(&session, &rtp_frame, frame_data, frame_bytes
+                               , 0, 1);
+    for(i = 0; i < count; i++)
+    {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &receive_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(receive_addr);
+        msgs[i].msg_hdr.msg_iov = rtp_frame.packets[i].iov;
+        msgs[i].msg_hdr.msg_iovlen = rtp_frame.packets[i].iov_count;
+    }
+    if(sendmmsg(send_socket, msgs, count, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+        perror("sendmmsg");
+    pthread_mutex_unlock(&table_lock);
+
+    latency_hist_record(&send_hist, get_time_us() - frame_ready_us[slot]);
+    __atomic_add_fetch(&delivered, 1, __ATOMIC_RELEASE);
+}
+
+static void* reactor_main(void* arg)
+{
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        uint64_t until_us;
+
+        pthread_mutex_lock(&table_lock);
+        until_us = get_time_us() + contention_us;
+        while(get_time_us() < until_us);
+        pthread_mutex_unlock(&table_lock);
+        usleep(BENCH_REACTOR_PERIOD_US);
+    }
+
+    return 0;
+}
+
+static void* receiver_main(void* arg)
+{
+    char buf[2048];
+    struct pollfd pfd;
+
+    pfd.fd = receive_socket;
+    pfd.events = POLLIN;
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        if(poll(&pfd, 1, 10) > 0)
+            while(recv(receive_socket, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+
+    return 0;
+}
+
+static void take_frames()
+{
+    void* item;
+
+    while((item = spsc_ring_pop(&ring)))
+        deliver((int)(intptr_t)item - 1);
+}
+
+//The stream thread of the flags and eventfd modes
+static void* stream_main(void* arg)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = ready_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = control_fd;
+    pfd[1].events = POLLIN;
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        if(mode == MODE_FLAGS)
+        {
+            pthread_mutex_lock(&flags_lock);
+            while(!flags_set && __atomic_load_n(&running, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&flags_cond, &flags_lock);
+            flags_set = 0;
+            pthread_mutex_unlock(&flags_lock);
+        }
+        else if(poll(pfd, 2, 100) > 0)
+        {
+            if(pfd[0].revents)
+                event_fd_drain(ready_fd);
+            if(pfd[1].revents)
+                event_fd_drain(control_fd);
+        }
+        take_frames();
+    }
+    take_frames();
+
+    return 0;
+}
+
+//The encoder callback
+static void frame_done(int slot)
+{
+    uint64_t start_us = get_time_us();
+
+    frame_ready_us[slot] = start_us;
+    if(mode == MODE_SINK)
+        deliver(slot);
+    else
+    {
+        spsc_ring_push(&ring, (void*)(intptr_t)(slot + 1));
+        if(mode == MODE_FLAGS)
+        {
+            pthread_mutex_lock(&flags_lock);
+            flags_set = 1;
+            pthread_cond_broadcast(&flags_cond);
+            pthread_mutex_unlock(&flags_lock);
+        }
+        else
+            event_fd_signal(ready_fd);
+    }
+    latency_hist_record(&hold_hist, get_time_us() - start_us);
+}
+
+static void run_mode()
+{
+    pthread_t reactor, receiver, stream;
+    uint64_t interval_us = 1000000/fps;
+    uint64_t due_us;
+    int i;
+
+    latency_hist_reset(&hold_hist);
+    latency_hist_reset(&send_hist);
+    spsc_ring_init(&ring, ring_slots, BENCH_RING_SIZE);
+    delivered = 0;
+    flags_set = 0;
+    running = 1;
+    pthread_create(&reactor, 0, reactor_main, 0);
+    pthread_create(&receiver, 0, receiver_main, 0);
+    if(mode != MODE_SINK)
+        pthread_create(&stream, 0, stream_main, 0);
+
+    due_us = get_time_us() + interval_us;
+    for(i = 0; i < frames; i++)
+    {
+        struct timespec due;
+
+        due.tv_sec = due_us/1000000;
+        due.tv_nsec = (due_us%1000000)*1000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR);
+        //A frame in the ring is never overwritten, the stream thread keeps up
+        //at any sane fps
+        frame_done(i%BENCH_RING_SIZE);
+        due_us += interval_us;
+    }
+    while(__atomic_load_n(&delivered, __ATOMIC_ACQUIRE) < frames)
+        usleep(1000);
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    if(mode == MODE_FLAGS)
+    {
+        pthread_mutex_lock(&flags_lock);
+        pthread_cond_broadcast(&flags_cond);
+        pthread_mutex_unlock(&flags_lock);
+    }
+    if(mode != MODE_SINK)
+    {
+        event_fd_signal(control_fd);
+        pthread_join(stream, 0);
+    }
+    pthread_join(reactor, 0);
+    pthread_join(receiver, 0);
+
+    printf("%-8s %8llu %8llu %8llu %10llu %8llu %8llu\n"
+           , mode_names[mode]
+           , (unsigned long long)latency_hist_percentile(&hold_hist, 50)
+           , (unsigned long long)latency_hist_percentile(&hold_hist, 99)
+           , (unsigned long long)latency_hist_max(&hold_hist)
+           , (unsigned long long)latency_hist_percentile(&send_hist, 50)
+           , (unsigned long long)latency_hist_percentile(&send_hist, 99)
+           , (unsigned long long)latency_hist_max(&send_hist));
+}
+
+int main(int argc, char** argv)
+{
+    parse_args(argc, argv);
+    make_frame();
+    setup_sockets();
+    rtp_session_init(&session, 0x1234);
+    ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    printf("%d frames of %d bytes at %d fps, table_lock held %d us every %d us\n"
+           , frames, frame_bytes, fps, contention_us, BENCH_REACTOR_PERIOD_US);
+    printf("%-8s %26s %28s\n", "", "callback held (us)", "callback to sent (us)");
+    printf("%-8s %8s %8s %8s %10s %8s %8s\n", "mode", "p50", "p99", "max"
+           , "p50", "p99", "max");
+    for(mode = 0; mode < MODE_COUNT; mode++)
+        run_mode();
+
+    close(ready_fd);
+    close(control_fd);
+    close(send_socket);
+    close(receive_socket);
+    free(frame_data);
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common_util/common_util.h"
+#include "../common_util/latency_hist.h"
+
+//How long the encoder callback is held by its per frame message, the way
+//DEBUG_MSG used to print it and the way it does now:
+//  stdio     fprintf() to a line buffered stdout, the old DEBUG_MSG on a
+//            terminal
+//  async     log_write() at LOG_INFO, the record goes to the drainer
+//  filtered  log_write() at LOG_DEBUG under the default level, what the
+//            DEBUG_TRACE of fill_buffer_done() costs
+//  none      no message, the cost of the clock reads
+//stdout is a pipe of one page read by a thread that stops for stall_ms
+//every stall_every_ms, like a slow terminal or a busy journald: once the
+//pipe is full, stdio blocks the callback. Latencies are in nanoseconds, the
+//table goes to the original stdout
+//
+//log_bench [calls=3000] [rate=1000] [stall_ms=100] [stall_every_ms=500]
+enum {
+    MODE_STDIO,
+    MODE_ASYNC,
+    MODE_FILTERED,
+    MODE_NONE,
+    MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = {"stdio", "async", "filtered"
+                                             , "none"};
+static const char* component_name = "OMX.broadcom.video_encode";
+
+static int calls = 3000;
+static int rate = 1000;
+static int stall_ms = 100;
+static int stall_every_ms = 500;
+
+static int pipe_fds[2];
+static FILE* results;
+static int reading;
+static latency_hist_t hist;
+static int slow_calls; //over 1 ms
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "calls=", 6))
+            calls = atoi(argv[i] + 6);
+        else if(!strncmp(argv[i], "rate=", 5))
+            rate = atoi(argv[i] + 5);
+        else if(!strncmp(argv[i], "stall_ms=", 9))
+            stall_ms = atoi(argv[i] + 9);
+        else if(!strncmp(argv[i], "stall_every_ms=", 15))
+            stall_every_ms = atoi(argv[i] + 15);
+        else
+        {
+            fprintf(stderr, "usage: %s [calls=N] [rate=N] [stall_ms=N]"
+                    " [stall_every_ms=N]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(calls <= 0 || rate <= 0 || rate > 1000000 || stall_ms < 0
+       || stall_every_ms <= stall_ms)
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+//Points stdout at the pipe, the results keep the original one
+static void setup_pipe()
+{
+    if(pipe(pipe_fds) < 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, 4096);
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    setvbuf(stdout, 0, _IOLBF, 0);
+}
+
+static void* reader_main(void* arg)
+{
+    char buf[4096];
+    uint64_t next_stall_ns = now_ns() + stall_every_ms*1000000ull;
+
+    while(__atomic_load_n(&reading, __ATOMIC_ACQUIRE))
+    {
+        if(now_ns() >= next_stall_ns)
+        {
+            usleep(stall_ms*1000);
+            next_stall_ns += stall_every_ms*1000000ull;
+        }
+        if(read(pipe_fds[0], buf, sizeof(buf)) < 0 && errno != EINTR)
+            break;
+    }
+
+    return 0;
+}
+
+//The encoder callback, the message is the one of fill_buffer_done()
+static void frame_done(int mode, int frame)
+{
+    uint64_t start_ns = now_ns();
+
+    if(mode == MODE_STDIO)
+        fprintf(stdout, "event: %s, fill_buffer_done %d\n", component_name
+                , frame);
+    else if(mode == MODE_ASYNC)
+        log_write(LOG_INFO, "event: %s, fill_buffer_done %d\n", component_name
+                  , frame);
+    else if(mode == MODE_FILTERED)
+        log_write(LOG_DEBUG, "event: %s, fill_buffer_done %d\n"
+                  , component_name, frame);
+
+    uint64_t took_ns = now_ns() - start_ns;
+    latency_hist_record(&hist, took_ns);
+    slow_calls += took_ns > 1000000;
+}
+
+static void run_mode(int mode)
+{
+    uint64_t interval_ns = 1000000000ull/rate;
+    uint64_t due_ns = now_ns() + interval_ns;
+    int i;
+
+    latency_hist_reset(&hist);
+    slow_calls = 0;
+    for(i = 0; i < calls; i++)
+    {
+        struct timespec due;
+
+        due.tv_sec = due_ns/1000000000ull;
+        due.tv_nsec = due_ns%1000000000ull;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR);
+        frame_done(mode, i);
+        due_ns += interval_ns;
+    }
+
+    fprintf(results, "%-9s %8llu %8llu %8llu %10llu %6d\n", mode_names[mode]
+            , (unsigned long long)latency_hist_percentile(&hist, 50)
+            , (unsigned long long)latency_hist_percentile(&hist, 99)
+            , (unsigned long long)latency_hist_percentile(&hist, 99.9)
+            , (unsigned long long)latency_hist_max(&hist), slow_calls);
+    fflush(results);
+}
+
+int main(int argc, char** argv)
+{
+    pthread_t reader;
+    int mode;
+
+    parse_args(argc, argv);
+    setup_pipe();
+    reading = 1;
+    pthread_create(&reader, 0, reader_main, 0);
+    log_init();
+
+    fprintf(results, "%d calls at %d/s, stdout is a pipe stopped for %d ms"
+            " every %d ms\n", calls, rate, stall_ms, stall_every_ms);
+    fprintf(results, "%-9s %8s %8s %8s %10s %6s\n", "mode", "p50 ns"
+            , "p99 ns", "p99.9 ns", "max ns", ">1 ms");
+    for(mode = 0; mode < MODE_COUNT; mode++)
+        run_mode(mode);
+
+    log_shutdown();
+    __atomic_store_n(&reading, 0, __ATOMIC_RELEASE);
+    fclose(stdout);
+    close(pipe_fds[1]);
+    pthread_join(reader, 0);
+    fclose(results);
+
+    return 0;
+}
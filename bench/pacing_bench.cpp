@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../common_util/latency_hist.h"
+#include "../rtp/rtp_h264.h"
+#include "../session/pacer.h"
+#include "../udp_setup/udp_setup.h"
+
+//Inter-packet gaps and bursts of the frames the server sends, without
+//pacing and with each pacing mode, as a loopback receiver sees them (kernel
+//receive timestamps). Every frame is an IDR of frame_bytes, the case of
+//VIDEO_IDR_PERIOD 1. The sending side is send_paced() of the client table:
+//the user mode wakes up when the pacer is due and sends what it allows.
+//The rate and txtime modes need the fq qdisc, which the loopback device
+//doesn't have, so there they only show the cost of asking. A burst is a run
+//of packets less than PACING_BENCH_BURST_GAP_US apart. Returns 1 if a
+//packet is lost, or if the user mode sends a burst bigger than its bucket
+//allows or doesn't spread the frame
+//
+//pacing_bench [frames=60] [fps=30] [frame_bytes=60000] [spread=50]
+#define PACING_BENCH_BURST_GAP_US 50
+#define PACING_BENCH_MODES 4
+
+static int frames = 60;
+static int fps = 30;
+static int frame_bytes = 60000;
+static int spread_percent = PACING_SPREAD_PERCENT;
+
+typedef struct {
+    uint32_t timestamp;
+    uint64_t time_ns;
+} arrival_t;
+
+static uint8_t* frame_data;
+static int receive_socket;
+static struct sockaddr_in receive_addr;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+static arrival_t* arrivals;
+static int arrival_count;
+static int max_arrivals;
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "frames=", 7))
+            frames = atoi(argv[i] + 7);
+        else if(!strncmp(argv[i], "fps=", 4))
+            fps = atoi(argv[i] + 4);
+        else if(!strncmp(argv[i], "frame_bytes=", 12))
+            frame_bytes = atoi(argv[i] + 12);
+        else if(!strncmp(argv[i], "spread=", 7))
+            spread_percent = atoi(argv[i] + 7);
+        else
+        {
+            fprintf(stderr, "usage: %s [frames=N] [fps=N] [frame_bytes=N]"
+                    " [spread=1-100]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(frames <= 0 || fps <= 0 || frame_bytes < 16
+       || frame_bytes > RTP_MAX_PAYLOAD*(RTP_MAX_PACKETS - 1)
+       || spread_percent < 1 || spread_percent > 100)
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+//One IDR slice, no byte pattern that looks like a start code
+static void make_frame()
+{
+    int i;
+
+    frame_data = (uint8_t*)malloc(frame_bytes);
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 0;
+    frame_data[3] = 1;
+    frame_data[4] = 0x65;
+    for(i = 5; i < frame_bytes; i++)
+        frame_data[i] = 1 + rand()%255;
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void setup_receiver()
+{
+    socklen_t len = sizeof(receive_addr);
+    int size = 4*1024*1024;
+    int one = 1;
+
+    receive_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&receive_addr, 0, sizeof(receive_addr));
+    receive_addr.sin_family = AF_INET;
+    receive_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(receive_socket < 0
+       || bind(receive_socket, (struct sockaddr*)&receive_addr
+               , sizeof(receive_addr)) < 0
+       || getsockname(receive_socket, (struct sockaddr*)&receive_addr
+                      , &len) < 0
+       || setsockopt(receive_socket, SOL_SOCKET, SO_TIMESTAMPNS, &one
+                     , sizeof(one)) < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+//Takes the arrival time of every packet waiting
+static void drain_receiver()
+{
+    uint8_t buf[2048];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    for(;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(receive_socket, &msg, MSG_DONTWAIT) < RTP_HEADER_SIZE)
+            return;
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            if(cmsg->cmsg_level == SOL_SOCKET
+               && cmsg->cmsg_type == SCM_TIMESTAMPNS
+               && arrival_count < max_arrivals)
+            {
+                struct timespec ts;
+                arrival_t* arrival = &arrivals[arrival_count++];
+
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                arrival->time_ns = (uint64_t)ts.tv_sec*1000000000ull
+                    + ts.tv_nsec;
+                arrival->timestamp = (uint32_t)buf[4] << 24 | buf[5] << 16
+                    | buf[6] << 8 | buf[7];
+            }
+    }
+}
+
+static void sleep_until(uint64_t due_us)
+{
+    struct timespec due;
+
+    due.tv_sec = due_us/1000000;
+    due.tv_nsec = (due_us%1000000)*1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR);
+}
+
+//send_paced() for one frame, to the end
+static void send_frame(int mode, uint64_t spread_us)
+{
+    int count = rtp_frame.packet_count;
+    uint64_t now_us = get_time_us();
+    uint32_t bytes = 0;
+    pacer_t pacer;
+    int first = 0;
+    int i;
+
+    for(i = 0; i < count; i++)
+        bytes += rtp_frame.packets[i].size;
+    pacer_start_frame(&pacer, bytes, spread_us, now_us);
+
+    if(mode == PACING_TXTIME)
+        udp_send_timed(rtp_frame.packets, count, &receive_addr, now_us
+                       , spread_us);
+    else if(mode != PACING_USER)
+    {
+        if(mode == PACING_RATE)
+            udp_set_pacing_rate(pacer.rate);
+        udp_send_packets(rtp_frame.packets, count, &receive_addr, 0);
+    }
+    else
+        while(first < count)
+        {
+            int last = first;
+
+            while(last < count && pacer_ready(&pacer, now_us))
+                pacer_consume(&pacer, rtp_frame.packets[last++].size);
+            if(last > first)
+                udp_send_packets(&rtp_frame.packets[first], last - first
+                                 , &receive_addr, 0);
+            first = last;
+            if(first < count)
+            {
+                sleep_until(pacer_due_us(&pacer, get_time_us()));
+                now_us = get_time_us();
+            }
+        }
+}
+
+//Gaps of the packets of each frame, in arrival order
+static int report(int mode, int* max_burst, double* mean_span_us)
+{
+    latency_hist_t gaps;
+    int buckets[4] = {0, 0, 0, 0};
+    int bursts = 0, burst_packets = 0;
+    int burst = 1;
+    uint64_t span_ns = 0;
+    uint64_t frame_start_ns = arrivals[0].time_ns;
+    int spans = 0;
+    int i;
+
+    latency_hist_reset(&gaps);
+    *max_burst = 0;
+    for(i = 1; i <= arrival_count; i++)
+    {
+        int same_frame = i < arrival_count
+            && arrivals[i].timestamp == arrivals[i - 1].timestamp;
+        uint64_t gap_ns = same_frame
+            ? arrivals[i].time_ns - arrivals[i - 1].time_ns : 0;
+
+        if(same_frame)
+        {
+            latency_hist_record(&gaps, gap_ns);
+            buckets[gap_ns < 10000 ? 0 : gap_ns < 100000 ? 1
+                    : gap_ns < 1000000 ? 2 : 3]++;
+        }
+        if(same_frame && gap_ns < PACING_BENCH_BURST_GAP_US*1000)
+        {
+            burst++;
+            continue;
+        }
+
+        bursts++;
+        burst_packets += burst;
+        if(burst > *max_burst)
+            *max_burst = burst;
+        burst = 1;
+        if(!same_frame)
+        {
+            span_ns += arrivals[i - 1].time_ns - frame_start_ns;
+            spans++;
+            if(i < arrival_count)
+                frame_start_ns = arrivals[i].time_ns;
+        }
+    }
+    *mean_span_us = spans ? span_ns/1000.0/spans : 0;
+
+    printf("%-7s %7.1f %7.1f %8.1f %6.1f %5d %8.0f   %5d %5d %5d %5d\n"
+           , pacing_mode_name((pacing_mode)mode)
+           , latency_hist_percentile(&gaps, 50)/1000.0
+           , latency_hist_percentile(&gaps, 99)/1000.0
+           , latency_hist_max(&gaps)/1000.0
+           , bursts ? (double)burst_packets/bursts : 0, *max_burst
+           , *mean_span_us, buckets[0], buckets[1], buckets[2], buckets[3]);
+
+    return spans;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t interval_us, spread_us;
+    int failures = 0;
+    int mode;
+
+    parse_args(argc, argv);
+    make_frame();
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+    setup_receiver();
+    rtp_session_init(&session, 0x5041);
+    //Like the sender thread
+    prctl(PR_SET_TIMERSLACK, PACING_TIMER_SLACK_NS);
+
+    interval_us = 1000000/fps;
+    spread_us = interval_us*spread_percent/100;
+    max_arrivals = frames*RTP_MAX_PACKETS;
+    arrivals = (arrival_t*)malloc(max_arrivals*sizeof(*arrivals));
+
+    printf("%d IDR frames of %d bytes at %d fps, spread over %llu us\n"
+           , frames, frame_bytes, fps, (unsigned long long)spread_us);
+    printf("%-7s %23s %20s %8s   %23s\n", "", "gap (us)", "burst (packets)"
+           , "frame", "gaps by size (us)");
+    printf("%-7s %7s %7s %8s %6s %5s %8s   %5s %5s %5s %5s\n", "mode", "p50"
+           , "p99", "max", "mean", "max", "span us", "<10", "<100", "<1000"
+           , "more");
+    for(mode = 0; mode < PACING_BENCH_MODES; mode++)
+    {
+        uint64_t start_us;
+        int max_burst;
+        double span_us;
+        int i;
+
+        if(mode == PACING_TXTIME && !udp_enable_txtime())
+        {
+            printf("%-7s SO_TXTIME not supported\n"
+                   , pacing_mode_name((pacing_mode)mode));
+            continue;
+        }
+
+        arrival_count = 0;
+        start_us = get_time_us();
+        for(i = 0; i < frames; i++)
+        {
+            sleep_until(start_us + i*interval_us);
+            drain_receiver();
+            rtp_packetize_h264(&session, &rtp_frame, frame_data, frame_bytes
+                               , i*(RTP_CLOCK_RATE/fps), 1);
+            send_frame(mode, spread_us);
+        }
+        sleep_until(start_us + frames*interval_us);
+        drain_receiver();
+        udp_set_pacing_rate(0);
+
+        if(arrival_count != frames*rtp_frame.packet_count)
+        {
+            printf("FAIL %s: %d of %d packets arrived\n"
+                   , pacing_mode_name((pacing_mode)mode), arrival_count
+                   , frames*rtp_frame.packet_count);
+            failures++;
+            continue;
+        }
+        report(mode, &max_burst, &span_us);
+
+        //The bucket holds PACING_BURST_BYTES, the packet that takes it
+        //below zero goes too
+        if(mode == PACING_USER
+           && rtp_frame.packet_count > PACING_BURST_BYTES/RTP_MAX_PAYLOAD + 2
+           && (max_burst > PACING_BURST_BYTES/RTP_MAX_PAYLOAD + 2
+               || span_us < spread_us/2))
+        {
+            printf("FAIL user pacing: bursts of %d packets, frames over %.0f"
+                   " us\n", max_burst, span_us);
+            failures++;
+        }
+    }
+
+    udp_server_close();
+    close(receive_socket);
+    free(arrivals);
+    free(frame_data);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../app/app_config.h"
+#include "../session/rate_control.h"
+
+//Replays a trace of receiver reports through rate_control_update() and
+//prints the estimate and the IDR requests after each one, to tune the
+//RATE_* constants off the Pi. A trace has a line per report: the time in
+//microseconds, then the command as the client sent it
+//  502338 RECEIVER_REPORT lost=56 received=40 jitter=14717 bytes=54624
+//Lines starting with # are skipped. The estimate doesn't feed back into the
+//trace, so after a change it shows the first reaction of the controller
+//rather than where the stream would have settled
+//
+//rate_sim <trace> [start=<bitrate>]
+#define RATE_SIM_LINE_SIZE 512
+
+int main(int argc, char** argv)
+{
+    char line[RATE_SIM_LINE_SIZE];
+    rate_control_t rc;
+    receiver_report_t report;
+    int start_bitrate = RATE_START_BITRATE;
+    int reports = 0, idrs = 0, bad = 0;
+    int min_bitrate = 0, max_bitrate = 0;
+    uint64_t previous_us = 0;
+    FILE* trace;
+
+    if(argc < 2 || argc > 3
+       || (argc == 3 && (strncmp(argv[2], "start=", 6)
+                         || (start_bitrate = atoi(argv[2] + 6)) <= 0)))
+    {
+        fprintf(stderr, "usage: %s <trace> [start=<bitrate>]\n", argv[0]);
+        return 1;
+    }
+    if(!(trace = fopen(argv[1], "r")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    rate_control_init(&rc, start_bitrate);
+    printf("%10s %6s %9s %9s %10s %s\n", "time_ms", "loss%", "rx_kbps"
+           , "jitter_ms", "estimate", "decision");
+    while(fgets(line, sizeof(line), trace))
+    {
+        unsigned long long time_us;
+        char* args;
+        int n;
+
+        if(line[0] == '#' || line[0] == '\n')
+            continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(sscanf(line, "%llu RECEIVER_REPORT%n", &time_us, &n) < 1
+           || !strstr(line, "RECEIVER_REPORT"))
+        {
+            bad++;
+            continue;
+        }
+        args = line + n;
+        while(*args == ' ')
+            args++;
+        if(!parse_receiver_report(args, &report))
+        {
+            bad++;
+            continue;
+        }
+
+        uint32_t packets = report.lost + report.received;
+        uint64_t interval_us = time_us - previous_us;
+        int flags = rate_control_update(&rc, &report, time_us);
+        previous_us = time_us;
+
+        printf("%10.1f %6.1f %9.1f %9.1f %10d %s\n"
+               , time_us/1000.0
+               , packets ? 100.0*report.lost/packets : 0.0
+               , interval_us ? report.bytes*8.0*1000/interval_us : 0.0
+               , report.jitter_us/1000.0
+               , rc.bitrate
+               , flags & RATE_REQUEST_IDR ? "IDR" : "");
+
+        if(!reports || rc.bitrate < min_bitrate)
+            min_bitrate = rc.bitrate;
+        if(!reports || rc.bitrate > max_bitrate)
+            max_bitrate = rc.bitrate;
+        idrs += !!(flags & RATE_REQUEST_IDR);
+        reports++;
+    }
+    fclose(trace);
+
+    printf("%d reports, %d IDR requests, estimate %d to %d bps, final %d bps\n"
+           , reports, idrs, min_bitrate, max_bitrate, rc.bitrate);
+    if(bad)
+        fprintf(stderr, "%d lines not understood\n", bad);
+
+    return reports && !bad ? 0 : 1;
+}
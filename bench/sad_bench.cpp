@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common_util/common_util.h"
+#include "../source/motion.h"
+
+//Block SAD kernels of the motion gate on consecutive luma planes of an I420
+//file, each against the scalar one, then the motion_update() score of every
+//frame. A plane bigger than MOTION_WIDTH x MOTION_HEIGHT is timed as it is
+//and box averaged down for the scores, like the resizer hands it over.
+//samples/scene_128x96.yuv is a textured scene with sensor-like noise and a
+//box moving over it for the first 16 of its 32 frames. Returns 1 if a
+//kernel disagrees with the scalar one
+//
+//sad_bench <i420 file> <width> <height> [rounds=200]
+#define SAD_BENCH_MAX_FRAMES 300
+
+static const char* kernel_names[] = {"scalar", "sse2", "avx2", "neon"};
+#define KERNEL_NAMES (int)(sizeof(kernel_names)/sizeof(kernel_names[0]))
+
+static uint8_t* frames;
+static int frame_count;
+static int width;
+static int height;
+static size_t frame_size;
+
+static void load(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+
+    if(!f)
+    {
+        perror(path);
+        exit(1);
+    }
+    frame_size = (size_t)width*height*3/2;
+    frames = (uint8_t*)malloc(frame_size*SAD_BENCH_MAX_FRAMES);
+    while(frame_count < SAD_BENCH_MAX_FRAMES
+          && fread(frames + frame_count*frame_size, 1, frame_size, f)
+          == frame_size)
+        frame_count++;
+    fclose(f);
+
+    if(frame_count < 2)
+    {
+        fprintf(stderr, "%s: less than two %dx%d frames\n", path, width
+                , height);
+        exit(1);
+    }
+}
+
+//Box average of the luma of frame down to MOTION_WIDTH x MOTION_HEIGHT
+static void shrink(const uint8_t* luma, uint8_t* out)
+{
+    int box_w = width/MOTION_WIDTH;
+    int box_h = height/MOTION_HEIGHT;
+    int x, y, i, j;
+
+    for(y = 0; y < MOTION_HEIGHT; y++)
+        for(x = 0; x < MOTION_WIDTH; x++)
+        {
+            int sum = 0;
+
+            for(i = 0; i < box_h; i++)
+                for(j = 0; j < box_w; j++)
+                    sum += luma[(y*box_h + i)*width + x*box_w + j];
+            out[y*MOTION_WIDTH + x] = sum/(box_w*box_h);
+        }
+}
+
+int main(int argc, char** argv)
+{
+    int blocks;
+    int rounds = 200;
+    uint32_t* sums;
+    uint32_t* expected;
+    uint8_t small[MOTION_WIDTH*MOTION_HEIGHT];
+    motion_detector_t motion;
+    int failures = 0;
+    int k, f, r;
+
+    if(argc < 4 || argc > 5
+       || (argc == 5 && (strncmp(argv[4], "rounds=", 7)
+                         || (rounds = atoi(argv[4] + 7)) <= 0)))
+    {
+        fprintf(stderr, "usage: %s <i420 file> <width> <height> [rounds=N]\n"
+                , argv[0]);
+        return 1;
+    }
+    width = atoi(argv[2]);
+    height = atoi(argv[3]);
+    if(width < MOTION_WIDTH || height < MOTION_HEIGHT || width%MOTION_BLOCK
+       || height%MOTION_BLOCK)
+    {
+        fprintf(stderr, "the size must be multiples of %d, at least %dx%d\n"
+                , MOTION_BLOCK, MOTION_WIDTH, MOTION_HEIGHT);
+        return 1;
+    }
+    load(argv[1]);
+
+    blocks = (width/MOTION_BLOCK)*(height/MOTION_BLOCK);
+    sums = (uint32_t*)malloc(blocks*sizeof(*sums));
+    expected = (uint32_t*)malloc(blocks*(frame_count - 1)*sizeof(*expected));
+
+    motion_init(&motion);
+    printf("%d frames of %dx%d, %d rounds, motion_init() picks %s\n"
+           , frame_count, width, height, rounds, motion_kernel_name());
+    printf("%-7s %10s %8s %8s\n", "kernel", "us/pair", "GB/s", "x scalar");
+
+    double scalar_us = 0;
+    for(k = 0; k < KERNEL_NAMES; k++)
+    {
+        if(!motion_use_kernel(kernel_names[k]))
+            continue;
+
+        //The sums of every pair, checked against the scalar ones
+        for(f = 1; f < frame_count; f++)
+        {
+            uint32_t* pair = expected + (f - 1)*blocks;
+
+            motion_block_sad(frames + f*frame_size, width
+                             , frames + (f - 1)*frame_size, width, width, height
+                             , k ? sums : pair);
+            if(k && memcmp(sums, pair, blocks*sizeof(*sums)))
+            {
+                printf("FAIL %s differs from scalar on frame %d\n"
+                       , kernel_names[k], f);
+                failures++;
+                break;
+            }
+        }
+
+        uint64_t start_us = get_time_us();
+        for(r = 0; r < rounds; r++)
+            for(f = 1; f < frame_count; f++)
+                motion_block_sad(frames + f*frame_size, width
+                                 , frames + (f - 1)*frame_size, width, width
+                                 , height, sums);
+        double pair_us = (double)(get_time_us() - start_us)
+            /((double)rounds*(frame_count - 1));
+        if(!k)
+            scalar_us = pair_us;
+
+        printf("%-7s %10.2f %8.2f %8.1f\n", kernel_names[k], pair_us
+               , 2.0*width*height/pair_us/1000, scalar_us/pair_us);
+    }
+
+    motion_init(&motion);
+    printf("scores at %dx%d (threshold %d):", MOTION_WIDTH, MOTION_HEIGHT
+           , MOTION_THRESHOLD);
+    for(f = 0; f < frame_count; f++)
+    {
+        shrink(frames + f*frame_size, small);
+        motion_update(&motion, small, MOTION_WIDTH, f*100000ull);
+        printf(" %d", motion.score);
+    }
+    printf("\n");
+
+    free(frames);
+    free(sums);
+    free(expected);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../rtp/rtp_h264.h"
+#include "../udp_setup/udp_setup.h"
+
+//Packets/s and system calls per frame of each send mode of
+//udp_send_stream(), from the server stream socket to a loopback receiver.
+//The receiver is drained after every frame, out of the timed part, and
+//every packet has to arrive. Only the send is timed: wall time gives the
+//packets/s, thread CPU time the cost per frame. The loopback device
+//segments the GSO super packets in software, a NIC with UDP segmentation
+//offload saves that too. Returns 1 if a packet is lost or a batched mode
+//makes as many system calls as sendmsg
+//
+//send_bench [frames=300] [frame_bytes=20000]
+static const char* mode_names[] = {"sendmsg", "sendmmsg", "gso"};
+
+static int frames = 300;
+static int frame_bytes = 20000;
+
+static uint8_t* frame_data;
+static int receive_socket;
+static struct sockaddr_in receive_addr;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "frames=", 7))
+            frames = atoi(argv[i] + 7);
+        else if(!strncmp(argv[i], "frame_bytes=", 12))
+            frame_bytes = atoi(argv[i] + 12);
+        else
+        {
+            fprintf(stderr, "usage: %s [frames=N] [frame_bytes=N]\n"
+                    , argv[0]);
+            exit(1);
+        }
+    }
+
+    if(frames <= 0 || frame_bytes < 16
+       || frame_bytes > RTP_MAX_PAYLOAD*(RTP_MAX_PACKETS - 1))
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+//One IDR slice, no byte pattern that looks like a start code
+static void make_frame()
+{
+    int i;
+
+    frame_data = (uint8_t*)malloc(frame_bytes);
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 0;
+    frame_data[3] = 1;
+    frame_data[4] = 0x65;
+    for(i = 5; i < frame_bytes; i++)
+        frame_data[i] = 1 + rand()%255;
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void setup_receiver()
+{
+    socklen_t len = sizeof(receive_addr);
+    int size = 4*1024*1024;
+
+    receive_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&receive_addr, 0, sizeof(receive_addr));
+    receive_addr.sin_family = AF_INET;
+    receive_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(receive_socket < 0
+       || bind(receive_socket, (struct sockaddr*)&receive_addr
+               , sizeof(receive_addr)) < 0
+       || getsockname(receive_socket, (struct sockaddr*)&receive_addr
+                      , &len) < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int drain_receiver()
+{
+    char buf[2048];
+    int count = 0;
+
+    while(recv(receive_socket, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        count++;
+
+    return count;
+}
+
+//Sends every frame in mode, returns the system calls per frame or -1 if
+//the kernel lacks the mode
+static double run_mode(int mode, int* failures)
+{
+    uint64_t start_packets, start_syscalls, packets, syscalls;
+    uint64_t wall_us = 0;
+    uint64_t cpu_ns = 0;
+    int received = 0;
+    int full = 0;
+    int i;
+
+    if(udp_set_send_mode(mode) != mode)
+    {
+        printf("%-9s not supported by the kernel\n", mode_names[mode]);
+        return -1;
+    }
+
+    drain_receiver();
+    udp_get_send_stats(&start_packets, &start_syscalls);
+    for(i = 0; i < frames; i++)
+    {
+        rtp_packetize_h264(&session, &rtp_frame, frame_data, frame_bytes
+                           , i*3000, 1);
+
+        uint64_t start_us = get_time_us();
+        uint64_t start_ns = thread_cpu_ns();
+        full += udp_send_stream(&rtp_frame, &receive_addr);
+        cpu_ns += thread_cpu_ns() - start_ns;
+        wall_us += get_time_us() - start_us;
+
+        received += drain_receiver();
+    }
+    udp_get_send_stats(&packets, &syscalls);
+    packets -= start_packets;
+    syscalls -= start_syscalls;
+
+    printf("%-9s %8.1f %9.2f %10.0f %10.2f %8.1f %9d/%llu\n"
+           , mode_names[mode]
+           , (double)packets/frames
+           , (double)syscalls/frames
+           , wall_us ? packets*1e6/wall_us : 0
+           , cpu_ns/1000.0/frames
+           , cpu_ns/1000.0/(frames*(double)frame_bytes/(1 << 20))
+           , received, (unsigned long long)packets);
+
+    if(full || (uint64_t)received != packets
+       || packets != (uint64_t)frames*rtp_frame.packet_count)
+    {
+        printf("FAIL %s lost packets, socket buffer full %d times\n"
+               , mode_names[mode], full);
+        (*failures)++;
+    }
+
+    return (double)syscalls/frames;
+}
+
+int main(int argc, char** argv)
+{
+    double syscalls[3];
+    int failures = 0;
+    int mode;
+
+    parse_args(argc, argv);
+    make_frame();
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+    setup_receiver();
+    rtp_session_init(&session, 0x5345);
+
+    printf("%d frames of %d bytes to a loopback receiver\n", frames
+           , frame_bytes);
+    printf("%-9s %8s %9s %10s %10s %8s %13s\n", "mode", "pkts/fr"
+           , "calls/fr", "pkts/s", "cpu us/fr", "us/MB", "received");
+    for(mode = UDP_SEND_MODE_SENDTO; mode <= UDP_SEND_MODE_GSO; mode++)
+        syscalls[mode] = run_mode(mode, &failures);
+
+    for(mode = UDP_SEND_MODE_SENDMMSG; mode <= UDP_SEND_MODE_GSO; mode++)
+        if(syscalls[mode] >= 0
+           && syscalls[mode] >= syscalls[UDP_SEND_MODE_SENDTO])
+        {
+            printf("FAIL %s makes %.2f system calls per frame\n"
+                   , mode_names[mode], syscalls[mode]);
+            failures++;
+        }
+
+    udp_server_close();
+    close(receive_socket);
+    free(frame_data);
+
+    return failures ? 1 : 0;
+}
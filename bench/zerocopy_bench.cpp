@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../common_util/stats.h"
+#include "../rtp/rtp_h264.h"
+#include "../udp_setup/udp_setup.h"
+
+//CPU time per MB of udp_send_packets() with the pages copied and sent with
+//MSG_ZEROCOPY, for small frames and for 1080p sized ones:
+//  copy      udp_set_zerocopy(0)
+//  zerocopy  zerocopy forced on before every frame, even after the kernel
+//            reported copying the pages
+//  auto      what the server does: on, until the first completion that
+//            reports a copy (UDP_ZEROCOPY_STOP_ON_COPY)
+//The sender thread time covers the send and reading the completions with
+//udp_stream_events(). The loopback receiver is drained out of the timed
+//part. The loopback device always copies zerocopy pages on delivery, so
+//the bench shows what zerocopy costs where it can't help. A NIC with
+//scatter-gather is where it pays, run it against one with dest=<address>
+//(nothing is checked at the other end then). Returns 1 if a packet is lost,
+//or a frame handed to zerocopy is still held a second after the last send
+//
+//zerocopy_bench [frames=200] [dest=<ipv4 address>]
+#define ZEROCOPY_BENCH_SMALL 8000
+#define ZEROCOPY_BENCH_LARGE 150000
+
+enum {
+    MODE_COPY,
+    MODE_ZEROCOPY,
+    MODE_AUTO,
+    MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = {"copy", "zerocopy", "auto"};
+
+static int frames = 200;
+static const char* dest_name;
+
+static uint8_t frame_data[ZEROCOPY_BENCH_LARGE];
+static int receive_socket = -1;
+static struct sockaddr_in dest_addr;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+static int held;
+static int released;
+
+static void parse_args(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "frames=", 7))
+            frames = atoi(argv[i] + 7);
+        else if(!strncmp(argv[i], "dest=", 5))
+            dest_name = argv[i] + 5;
+        else
+        {
+            fprintf(stderr, "usage: %s [frames=N] [dest=<ipv4 address>]\n"
+                    , argv[0]);
+            exit(1);
+        }
+    }
+
+    if(frames <= 0)
+    {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//A loopback receiver, or the address given
+static void setup_dest()
+{
+    socklen_t len = sizeof(dest_addr);
+    int size = 4*1024*1024;
+
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    if(dest_name)
+    {
+        if(!inet_aton(dest_name, &dest_addr.sin_addr))
+        {
+            fprintf(stderr, "bad address %s\n", dest_name);
+            exit(1);
+        }
+        dest_addr.sin_port = htons(CLIENT_STREAM_PORT);
+        return;
+    }
+
+    receive_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    dest_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(receive_socket < 0
+       || bind(receive_socket, (struct sockaddr*)&dest_addr
+               , sizeof(dest_addr)) < 0
+       || getsockname(receive_socket, (struct sockaddr*)&dest_addr
+                      , &len) < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(receive_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+static int drain_receiver()
+{
+    char buf[2048];
+    int count = 0;
+
+    if(receive_socket < 0)
+        return 0;
+    while(recv(receive_socket, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        count++;
+
+    return count;
+}
+
+//The owner is the frame, stream_frame_ref()/unref() in the server
+static void hold(void* owner)
+{
+    held++;
+}
+
+static void release(void* owner)
+{
+    released++;
+}
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void run(int mode, int frame_bytes, int* failures)
+{
+    uint64_t start_sends = stats_counter(STAT_ZEROCOPY_SENDS);
+    uint64_t start_copied = stats_counter(STAT_ZEROCOPY_COPIED);
+    uint64_t cpu_ns = 0;
+    uint64_t deadline_us;
+    int received = 0;
+    int full = 0;
+    int i;
+
+    held = released = 0;
+    if(!udp_set_zerocopy(mode != MODE_COPY) && mode != MODE_COPY)
+    {
+        printf("%-9s %7d  not supported by the kernel\n", mode_names[mode]
+               , frame_bytes);
+        return;
+    }
+
+    drain_receiver();
+    for(i = 0; i < frames; i++)
+    {
+        if(mode == MODE_ZEROCOPY)
+            udp_set_zerocopy(1);
+        rtp_packetize_h264(&session, &rtp_frame, frame_data, frame_bytes
+                           , i*3000, 1);
+
+        uint64_t start_ns = thread_cpu_ns();
+        full += udp_send_packets(rtp_frame.packets, rtp_frame.packet_count
+                                 , &dest_addr, &rtp_frame);
+        udp_stream_events();
+        cpu_ns += thread_cpu_ns() - start_ns;
+
+        received += drain_receiver();
+    }
+
+    //The last completions may come after the last send
+    deadline_us = get_time_us() + 1000000;
+    while(released < held && get_time_us() < deadline_us)
+    {
+        usleep(1000);
+        udp_stream_events();
+    }
+    received += drain_receiver();
+
+    printf("%-9s %7d %10.1f %8.1f %9llu %8llu %6d/%d\n", mode_names[mode]
+           , frame_bytes, cpu_ns/1000.0/frames
+           , cpu_ns/1000.0/(frames*(double)frame_bytes/(1 << 20))
+           , (unsigned long long)(stats_counter(STAT_ZEROCOPY_SENDS)
+                                  - start_sends)
+           , (unsigned long long)(stats_counter(STAT_ZEROCOPY_COPIED)
+                                  - start_copied)
+           , released, held);
+
+    if(released != held)
+    {
+        printf("FAIL %s: %d frames still held\n", mode_names[mode]
+               , held - released);
+        (*failures)++;
+    }
+    if(receive_socket >= 0
+       && (full || received != frames*rtp_frame.packet_count))
+    {
+        printf("FAIL %s: %d of %d packets arrived\n", mode_names[mode]
+               , received, frames*rtp_frame.packet_count);
+        (*failures)++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int sizes[2] = {ZEROCOPY_BENCH_SMALL, ZEROCOPY_BENCH_LARGE};
+    int failures = 0;
+    int mode, size;
+    int i;
+
+    parse_args(argc, argv);
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+    udp_set_zerocopy_owner(hold, release);
+    setup_dest();
+    rtp_session_init(&session, 0x5a43);
+
+    //One IDR slice, no byte pattern that looks like a start code
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 0;
+    frame_data[3] = 1;
+    frame_data[4] = 0x65;
+    for(i = 5; i < ZEROCOPY_BENCH_LARGE; i++)
+        frame_data[i] = 1 + rand()%255;
+
+    printf("%d frames to %s:%d, %s send mode, zerocopy from %d bytes\n"
+           , frames, inet_ntoa(dest_addr.sin_addr), ntohs(dest_addr.sin_port)
+           , udp_send_mode_name(), UDP_ZEROCOPY_MIN_BYTES);
+    printf("%-9s %7s %10s %8s %9s %8s %13s\n", "mode", "bytes", "cpu us/fr"
+           , "us/MB", "zc sends", "copied", "released");
+    for(size = 0; size < 2; size++)
+        for(mode = 0; mode < MODE_COUNT; mode++)
+            run(mode, sizes[size], &failures);
+
+    udp_server_close();
+    if(receive_socket >= 0)
+        close(receive_socket);
+
+    return failures ? 1 : 0;
+}
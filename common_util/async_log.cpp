@@ -0,0 +1,399 @@
+#include "async_log.h"
+#include "common_util.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+int log_level = LOG_DEFAULT_LEVEL;
+
+static log_ring_t rings[LOG_MAX_THREADS];
+static int ring_count;
+static __thread log_ring_t* thread_ring;
+//Records of threads beyond LOG_MAX_THREADS
+static uint64_t unregistered_dropped;
+
+//The drainer thread and the exit handler both consume, one at a time
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drainer_tid;
+static int drainer_running;
+
+typedef enum {
+    ARG_NONE = 0,
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+} arg_type;
+
+//One printf conversion, without its length modifier
+typedef struct {
+    const char* start; //the '%'
+    int spec_len; //flags, width and precision after the '%'
+    int length; //'h' (also hh), 'l', 'L' for ll/j/z/t, 0 for none
+    char conversion;
+    arg_type type;
+} conversion_t;
+
+//Finds the next conversion of fmt that takes an argument
+static int next_conversion(const char** fmt, conversion_t* conv)
+{
+    const char* p = *fmt;
+
+    while((p = strchr(p, '%')))
+    {
+        conv->start = p++;
+        if(*p == '%')
+        {
+            p++;
+            continue;
+        }
+
+        while(*p && strchr("-+ #0123456789.", *p))
+            p++;
+        conv->spec_len = p - conv->start - 1;
+
+        conv->length = 0;
+        while(*p && strchr("hlLqjzt", *p))
+        {
+            if(*p == 'h')
+                conv->length = 'h';
+            else if(*p == 'l' && !conv->length)
+                conv->length = 'l';
+            else
+                conv->length = 'L';
+            p++;
+        }
+
+        conv->conversion = *p;
+        if(*p)
+            p++;
+        *fmt = p;
+
+        switch(conv->conversion)
+        {
+            case 'd': case 'i':
+                conv->type = ARG_SIGNED;
+                return 1;
+            case 'u': case 'o': case 'x': case 'X': case 'c':
+                conv->type = ARG_UNSIGNED;
+                return 1;
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+                conv->type = ARG_DOUBLE;
+                return 1;
+            case 's':
+                conv->type = ARG_STRING;
+                return 1;
+            case 'p':
+                conv->type = ARG_POINTER;
+                return 1;
+            default:
+                //Unsupported, printed as is
+                conv->type = ARG_NONE;
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static log_ring_t* get_thread_ring()
+{
+    if(!thread_ring)
+    {
+        int i = __atomic_fetch_add(&ring_count, 1, __ATOMIC_ACQ_REL);
+        if(i >= LOG_MAX_THREADS)
+            return 0;
+        thread_ring = &rings[i];
+    }
+
+    return thread_ring;
+}
+
+void log_write(int level, const char* fmt, ...)
+{
+    if(level > log_level)
+        return;
+
+    log_ring_t* ring = get_thread_ring();
+    if(!ring)
+    {
+        __atomic_add_fetch(&unregistered_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_record_t* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    const char* p = fmt;
+    conversion_t conv;
+    int string_used = 0;
+    va_list args;
+
+    record->fmt = fmt;
+    record->time_us = get_time_us();
+    record->level = level;
+    record->arg_count = 0;
+
+    va_start(args, fmt);
+    while(record->arg_count < LOG_MAX_ARGS && next_conversion(&p, &conv))
+    {
+        uint64_t* arg = &record->args[record->arg_count++];
+
+        switch(conv.type)
+        {
+            case ARG_SIGNED:
+                if(conv.length == 'L')
+                    *arg = (uint64_t)va_arg(args, long long);
+                else if(conv.length == 'l')
+                    *arg = (uint64_t)(long long)va_arg(args, long);
+                else
+                    *arg = (uint64_t)(long long)va_arg(args, int);
+                break;
+            case ARG_UNSIGNED:
+                if(conv.length == 'L')
+                    *arg = va_arg(args, unsigned long long);
+                else if(conv.length == 'l')
+                    *arg = va_arg(args, unsigned long);
+                else
+                    *arg = va_arg(args, unsigned int);
+                break;
+            case ARG_DOUBLE:
+            {
+                double value = va_arg(args, double);
+                memcpy(arg, &value, sizeof(value));
+                break;
+            }
+            case ARG_STRING:
+            {
+                //Copied, the caller's buffer may be gone when it is printed
+                const char* value = va_arg(args, const char*);
+                if(!value)
+                    value = "(null)";
+                int len = strlen(value);
+                if(len > LOG_STRING_BYTES - 1 - string_used)
+                    len = LOG_STRING_BYTES - 1 - string_used;
+                memcpy(&record->strings[string_used], value, len);
+                record->strings[string_used + len] = '\0';
+                *arg = string_used;
+                string_used += len + (string_used + len < LOG_STRING_BYTES - 1);
+                break;
+            }
+            case ARG_POINTER:
+                *arg = (uint64_t)(uintptr_t)va_arg(args, void*);
+                break;
+            default:
+                record->arg_count--;
+                break;
+        }
+    }
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Formats a record the way printf would have
+static void format_record(log_record_t* record, char* line, int size)
+{
+    const char* p = record->fmt;
+    const char* copied = p;
+    conversion_t conv;
+    int arg = 0;
+    int used = 0;
+
+    while(next_conversion(&p, &conv) && used < size)
+    {
+        char spec[32];
+        int len;
+
+        //Literal text in front, with %% turned into %
+        while(copied < conv.start && used < size - 1)
+        {
+            line[used++] = *copied;
+            if(*copied == '%' && copied[1] == '%')
+                copied++;
+            copied++;
+        }
+        copied = p;
+
+        if(conv.type == ARG_NONE || arg >= record->arg_count
+           || conv.spec_len > (int)sizeof(spec) - 5)
+            continue;
+
+        spec[0] = '%';
+        memcpy(&spec[1], conv.start + 1, conv.spec_len);
+        len = conv.spec_len + 1;
+        if((conv.type == ARG_SIGNED || conv.type == ARG_UNSIGNED)
+           && conv.conversion != 'c')
+        {
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+        }
+        spec[len++] = conv.conversion;
+        spec[len] = '\0';
+
+        uint64_t value = record->args[arg++];
+        switch(conv.type)
+        {
+            case ARG_SIGNED:
+                len = snprintf(line + used, size - used, spec, (long long)value);
+                break;
+            case ARG_UNSIGNED:
+                if(conv.conversion == 'c')
+                    len = snprintf(line + used, size - used, spec, (int)value);
+                else
+                    len = snprintf(line + used, size - used, spec
+                                   , (unsigned long long)value);
+                break;
+            case ARG_DOUBLE:
+            {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                len = snprintf(line + used, size - used, spec, d);
+                break;
+            }
+            case ARG_STRING:
+                len = snprintf(line + used, size - used, spec
+                               , &record->strings[value]);
+                break;
+            default:
+                len = snprintf(line + used, size - used, spec
+                               , (void*)(uintptr_t)value);
+                break;
+        }
+        if(len > 0)
+            used += len;
+    }
+
+    while(*copied && used < size - 1)
+    {
+        line[used++] = *copied;
+        if(*copied == '%' && copied[1] == '%')
+            copied++;
+        copied++;
+    }
+
+    if(used > size - 1)
+        used = size - 1;
+    line[used] = '\0';
+}
+
+//Prints every pending record, oldest first across the threads
+static void drain()
+{
+    char line[LOG_LINE_BYTES];
+    int count;
+    int i;
+
+    pthread_mutex_lock(&drain_lock);
+
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    if(count > LOG_MAX_THREADS)
+        count = LOG_MAX_THREADS;
+
+    while(1)
+    {
+        log_ring_t* oldest = 0;
+        log_record_t* record = 0;
+
+        for(i = 0; i < count; i++)
+        {
+            log_ring_t* ring = &rings[i];
+            uint32_t tail = ring->tail;
+            if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                continue;
+
+            log_record_t* candidate = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            if(!record || candidate->time_us < record->time_us)
+            {
+                oldest = ring;
+                record = candidate;
+            }
+        }
+
+        if(!record)
+            break;
+
+        format_record(record, line, sizeof(line));
+        fputs(line, record->level == LOG_ERROR ? stderr : stdout);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        uint64_t dropped = __atomic_exchange_n(&rings[i].dropped, 0
+                                               , __ATOMIC_RELAXED);
+        if(dropped)
+            fprintf(stderr, "log: %llu messages dropped\n"
+                    , (unsigned long long)dropped);
+    }
+    uint64_t dropped = __atomic_exchange_n(&unregistered_dropped, 0
+                                           , __ATOMIC_RELAXED);
+    if(dropped)
+        fprintf(stderr, "log: %llu messages dropped, more than %d threads\n"
+                , (unsigned long long)dropped, LOG_MAX_THREADS);
+
+    fflush(stdout);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void* drainer_thread(void* arg)
+{
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = LOG_DRAIN_INTERVAL_MS*1000000L;
+
+    while(__atomic_load_n(&drainer_running, __ATOMIC_ACQUIRE))
+    {
+        drain();
+        nanosleep(&interval, 0);
+    }
+
+    return 0;
+}
+
+void log_init()
+{
+    //The error paths exit(1), print what they logged before that
+    atexit(drain);
+
+    __atomic_store_n(&drainer_running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&drainer_tid, 0, drainer_thread, 0) != 0)
+    {
+        fprintf(stderr, "Error while creating the log thread\n");
+        exit(1);
+    }
+}
+
+void log_shutdown()
+{
+    __atomic_store_n(&drainer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(drainer_tid, 0);
+    drain();
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level_from_name(const char* name)
+{
+    static const char* names[] = {"error", "info", "debug"};
+    int i;
+
+    for(i = 0; i <= LOG_DEBUG; i++)
+        if(!strncmp(name, names[i], strlen(names[i])))
+            return i;
+
+    return -1;
+}
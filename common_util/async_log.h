@@ -0,0 +1,53 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+//Logging without stdio on the calling thread. Every thread writes fixed size
+//records (format pointer, raw arguments, copied strings) into its own lock
+//free ring, a drainer thread formats and prints them. A full ring drops the
+//record instead of blocking
+
+#define LOG_MAX_THREADS 16
+#define LOG_RING_SIZE 256 //records per thread, power of two
+#define LOG_MAX_ARGS 8
+#define LOG_STRING_BYTES 96 //room for the %s arguments of one record
+#define LOG_LINE_BYTES 512
+#define LOG_DRAIN_INTERVAL_MS 10
+
+//Levels, a message is kept if its level is <= the runtime level
+#define LOG_ERROR 0 //stderr
+#define LOG_INFO 1
+#define LOG_DEBUG 2 //per frame messages, off by default
+#define LOG_DEFAULT_LEVEL LOG_INFO
+
+typedef struct {
+    const char* fmt;
+    uint64_t time_us;
+    uint8_t level;
+    uint8_t arg_count;
+    uint64_t args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_BYTES];
+} log_record_t;
+
+typedef struct {
+    log_record_t records[LOG_RING_SIZE];
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint64_t dropped;
+} log_ring_t;
+
+extern int log_level;
+
+//Starts the drainer. Records written before are kept until it runs
+void log_init();
+//Prints what is left and stops the drainer
+void log_shutdown();
+void log_set_level(int level);
+//"error", "info" or "debug", -1 if unknown
+int log_level_from_name(const char* name);
+void log_write(int level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
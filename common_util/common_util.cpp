@@ -1,13 +1,63 @@
 #include "common_util.h"
 
-int quit_flag;
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static int quit_flag;
+static int quit_fd = -1;
+
+void quit_init()
+{
+    quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
 
 void set_quit()
 {
-    quit_flag = 1;
+    __atomic_store_n(&quit_flag, 1, __ATOMIC_RELEASE);
+    event_fd_signal(quit_fd);
 }
 
 int is_quit()
 {
-    return quit_flag;
+    return __atomic_load_n(&quit_flag, __ATOMIC_ACQUIRE);
+}
+
+int quit_event_fd()
+{
+    return quit_fd;
+}
+
+void event_fd_signal(int fd)
+{
+    uint64_t one = 1;
+
+    //Only fails if the counter is about to overflow, it is signaled anyway
+    if(fd >= 0 && write(fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+uint64_t event_fd_drain(int fd)
+{
+    uint64_t count;
+
+    if(read(fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+
+    return count;
+}
+
+uint64_t get_time_us()
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (uint64_t)spec.tv_sec*1000000 + spec.tv_nsec/1000;
+}
+
+uint64_t get_unix_time_us()
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+
+    return (uint64_t)spec.tv_sec*1000000 + spec.tv_nsec/1000;
 }
@@ -1,17 +1,41 @@
 #ifndef COMMON_UTIL_H
 #define COMMON_UTIL_H
 
+#include <stdint.h>
+#include <time.h>
+
+#include "async_log.h"
+
+//Comment out to compile every message out
 #define USE_DEBUG_MSG
 
 #ifdef USE_DEBUG_MSG
-#define DEBUG_ERR(...) fprintf(stderr, __VA_ARGS__)
-#define DEBUG_MSG(...) fprintf(stdout, __VA_ARGS__)
+#define DEBUG_ERR(...) log_write(LOG_ERROR, __VA_ARGS__)
+#define DEBUG_MSG(...) log_write(LOG_INFO, __VA_ARGS__)
+//Per frame messages, only kept with the log level at debug
+#define DEBUG_TRACE(...) log_write(LOG_DEBUG, __VA_ARGS__)
 #else
 #define DEBUG_ERR(...)
 #define DEBUG_MSG(...)
+#define DEBUG_TRACE(...)
 #endif
 
+//Shutdown request, seen by every thread. quit_init() has to run before any
+//other thread is started
+void quit_init();
 void set_quit();
 int is_quit();
+//eventfd that becomes readable with set_quit(), for epoll
+int quit_event_fd();
+
+//Adds 1 to an eventfd, never blocks
+void event_fd_signal(int fd);
+//Reads and resets an eventfd, returns its count (0 if it wasn't signaled)
+uint64_t event_fd_drain(int fd);
+
+//Monotonic clock in microseconds, used for latency measurements
+uint64_t get_time_us();
+//Wall clock in microseconds since the Unix epoch
+uint64_t get_unix_time_us();
 
 #endif
@@ -0,0 +1,94 @@
+#include "latency_hist.h"
+
+#include <string.h>
+
+static int bucket_index(uint64_t value)
+{
+    if(value < LATENCY_HIST_SUB_BUCKETS)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    if(msb >= LATENCY_HIST_MAX_BITS)
+        return LATENCY_HIST_BUCKETS - 1;
+
+    //The bits under the leading one pick the bucket inside its power of two
+    int shift = msb - LATENCY_HIST_SUB_BITS;
+    return (msb - LATENCY_HIST_SUB_BITS + 1)*LATENCY_HIST_SUB_BUCKETS
+        + ((value >> shift) & (LATENCY_HIST_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_highest(int index)
+{
+    if(index < LATENCY_HIST_SUB_BUCKETS)
+        return index;
+
+    int shift = index/LATENCY_HIST_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(LATENCY_HIST_SUB_BUCKETS
+                                 + index%LATENCY_HIST_SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void latency_hist_reset(latency_hist_t* hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void latency_hist_record(latency_hist_t* hist, uint64_t value_us)
+{
+    __atomic_add_fetch(&hist->counts[bucket_index(value_us)], 1
+                       , __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_us, value_us, __ATOMIC_RELAXED);
+
+    uint64_t max_us = __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+    while(value_us > max_us
+          && !__atomic_compare_exchange_n(&hist->max_us, &max_us, value_us, 1
+                                          , __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t latency_hist_percentile(latency_hist_t* hist, double percentile)
+{
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    int i;
+
+    //Summed here rather than read from total, which may be ahead of the
+    //buckets while another thread records
+    for(i = 0; i < LATENCY_HIST_BUCKETS; i++)
+        total += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+    if(!total)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile/100*total + 0.5);
+    if(rank < 1)
+        rank = 1;
+
+    for(i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        seen += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+        if(seen >= rank)
+            break;
+    }
+    if(i == LATENCY_HIST_BUCKETS)
+        i--;
+
+    //The bucket bound may be past the largest value really seen
+    uint64_t value = bucket_highest(i);
+    uint64_t max_us = latency_hist_max(hist);
+    return value < max_us ? value : max_us;
+}
+
+uint64_t latency_hist_max(latency_hist_t* hist)
+{
+    return __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED);
+}
+
+uint64_t latency_hist_count(latency_hist_t* hist)
+{
+    return __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+}
+
+uint64_t latency_hist_sum(latency_hist_t* hist)
+{
+    return __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+
+//Fixed size log-linear histogram of microsecond latencies, like HdrHistogram
+//with LATENCY_HIST_SUB_BITS significant bits: every power of two range is
+//split into 2^LATENCY_HIST_SUB_BITS buckets, so a recorded value is off by
+//at most 1/16 (6%). Recording is a few relaxed atomic adds, any thread may
+//record while another one reads
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_SUB_BUCKETS (1 << LATENCY_HIST_SUB_BITS)
+//Values from 2^LATENCY_HIST_MAX_BITS us (134 s) on land in the last bucket
+#define LATENCY_HIST_MAX_BITS 27
+#define LATENCY_HIST_BUCKETS \
+    ((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1)*LATENCY_HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[LATENCY_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum_us;
+    uint64_t max_us;
+} latency_hist_t;
+
+void latency_hist_reset(latency_hist_t* hist);
+void latency_hist_record(latency_hist_t* hist, uint64_t value_us);
+//Highest value of the bucket holding the given percentile (0-100), 0 if
+//nothing was recorded
+uint64_t latency_hist_percentile(latency_hist_t* hist, double percentile);
+uint64_t latency_hist_max(latency_hist_t* hist);
+uint64_t latency_hist_count(latency_hist_t* hist);
+uint64_t latency_hist_sum(latency_hist_t* hist);
+
+#endif
@@ -0,0 +1,44 @@
+#include "spsc_ring.h"
+
+void spsc_ring_init(spsc_ring_t* ring, void** slots, uint32_t size)
+{
+    ring->slots = slots;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+int spsc_ring_push(spsc_ring_t* ring, void* item)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask)
+        return 0;
+
+    ring->slots[head & ring->mask] = item;
+    //Publish the slot before the new head becomes visible to the consumer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void* spsc_ring_pop(spsc_ring_t* ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return 0;
+
+    void* item = ring->slots[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+uint32_t spsc_ring_count(spsc_ring_t* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
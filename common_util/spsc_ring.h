@@ -0,0 +1,25 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+
+//Lock-free single producer / single consumer ring of pointers. The producer
+//only writes head and the consumer only writes tail, so one thread may push
+//(e.g. an OpenMAX callback) while another one pops without any lock
+typedef struct {
+    void** slots;
+    uint32_t mask;
+    //Kept on separate cache lines so producer and consumer don't false share
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} spsc_ring_t;
+
+//size must be a power of two, slots must hold size entries
+void spsc_ring_init(spsc_ring_t* ring, void** slots, uint32_t size);
+//Returns 0 if the ring is full
+int spsc_ring_push(spsc_ring_t* ring, void* item);
+//Returns NULL if the ring is empty
+void* spsc_ring_pop(spsc_ring_t* ring);
+uint32_t spsc_ring_count(spsc_ring_t* ring);
+
+#endif
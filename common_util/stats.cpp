@@ -0,0 +1,54 @@
+#include "stats.h"
+
+static stats_block_t blocks[STATS_MAX_THREADS];
+static int block_count;
+static __thread stats_block_t* thread_block;
+//Threads beyond STATS_MAX_THREADS share this one with atomic adds
+static stats_block_t shared_block;
+static int64_t gauges[STAT_GAUGES];
+
+void stats_add(stat_counter counter, uint64_t value)
+{
+    if(!thread_block)
+    {
+        int i = __atomic_fetch_add(&block_count, 1, __ATOMIC_RELAXED);
+        if(i >= STATS_MAX_THREADS)
+        {
+            __atomic_add_fetch(&shared_block.counters[counter], value
+                               , __ATOMIC_RELAXED);
+            return;
+        }
+        thread_block = &blocks[i];
+    }
+
+    //Only this thread writes the block, readers just must not see a torn
+    //value
+    uint64_t* slot = &thread_block->counters[counter];
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value
+                     , __ATOMIC_RELAXED);
+}
+
+uint64_t stats_counter(stat_counter counter)
+{
+    uint64_t sum = __atomic_load_n(&shared_block.counters[counter]
+                                   , __ATOMIC_RELAXED);
+    int count = __atomic_load_n(&block_count, __ATOMIC_RELAXED);
+    int i;
+
+    if(count > STATS_MAX_THREADS)
+        count = STATS_MAX_THREADS;
+    for(i = 0; i < count; i++)
+        sum += __atomic_load_n(&blocks[i].counters[counter], __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+void stats_set(stat_gauge gauge, int64_t value)
+{
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+int64_t stats_gauge(stat_gauge gauge)
+{
+    return __atomic_load_n(&gauges[gauge], __ATOMIC_RELAXED);
+}
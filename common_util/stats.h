@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+//Server counters without locks or shared cache lines. Every thread adds to
+//its own block, a reader sums the blocks. Gauges hold the last value set
+#define STATS_MAX_THREADS 16
+
+typedef enum {
+    STAT_FRAMES_ENCODED = 0,
+    STAT_BYTES_ENCODED,
+    STAT_PACKETS_SENT,
+    STAT_BYTES_SENT,
+    STAT_SEND_SYSCALLS,
+    STAT_COMMAND_SYSCALLS, //recvfrom(), or io_uring_enter() and eventfd reads
+    STAT_SEND_ERRORS,
+    STAT_SEND_EAGAIN, //socket buffer full, rest of the frame dropped
+    STAT_FRAMES_DROPPED, //client queue full or socket buffer full
+    STAT_SOURCE_STALLS, //no frame for SOURCE_STALL_MS while capturing
+    STAT_FEC_PACKETS, //repair packets made, sent once per client
+    STAT_NACKED_PACKETS, //packets asked for again with NACK
+    STAT_RETRANSMITS, //packets sent again
+    STAT_RETRANSMIT_MISSES, //NACKed packets no longer in the history
+    STAT_RETRANSMIT_LIMITED, //NACKed packets over the retransmit rate
+    STAT_ZEROCOPY_SENDS, //messages sent with MSG_ZEROCOPY
+    STAT_ZEROCOPY_COPIED, //of them, copied by the kernel after all
+    STAT_KEYFRAME_REQUESTS, //by clients, the rate control and recordings
+    STAT_KEYFRAMES_FORCED, //IDRs the source was asked for
+    STAT_RECORD_FRAMES, //frames written to recordings
+    STAT_RECORD_BYTES,
+    STAT_RECORD_DROPPED, //frames lost to the ring while the disk stalled
+    STAT_RECORD_ERRORS, //failed writes and syncs, each ends a recording
+    STAT_COUNTERS,
+} stat_counter;
+
+typedef enum {
+    STAT_FPS = 0, //measured over the last STATS_RATE_WINDOW_US
+    STAT_BITRATE, //encoded bits/s, same window
+    STAT_TARGET_BITRATE, //what the source was asked for
+    STAT_INIT_US, //last source init
+    STAT_DEINIT_US, //last source deinit
+    STAT_CONFIG_US, //last SET_CONFIG
+    STAT_MOTION_SCORE, //of the last frame pair, see source/motion.h
+    STAT_MOTION_IDLE, //1 while a still scene holds the encoder back
+    STAT_RECORD_SYNC_US, //last fdatasync() of a recording
+    STAT_GAUGES,
+} stat_gauge;
+
+#define STATS_RATE_WINDOW_US 1000000
+
+typedef struct {
+    uint64_t counters[STAT_COUNTERS];
+} __attribute__((aligned(64))) stats_block_t;
+
+void stats_add(stat_counter counter, uint64_t value);
+//Sum over every thread
+uint64_t stats_counter(stat_counter counter);
+void stats_set(stat_gauge gauge, int64_t value);
+int64_t stats_gauge(stat_gauge gauge);
+
+#endif
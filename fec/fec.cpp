@@ -0,0 +1,25 @@
+#include "fec.h"
+#include "gf256.h"
+
+uint8_t fec_rs_coefficient(int repair, int media)
+{
+    //The repair packets take x = 0 .. FEC_RS_MAX_REPAIR - 1 and the media
+    //packets the y above, so x + y (XOR) is never 0
+    return gf256_inv(repair ^ (FEC_RS_MAX_REPAIR + media));
+}
+
+void fec_bitstring_header(
+        const uint8_t* rtp_header,
+        uint16_t protected_len,
+        uint8_t* out){
+    //P, X and CC, the version isn't protected
+    out[0] = rtp_header[0] & 0x3f;
+    //M and PT
+    out[1] = rtp_header[1];
+    out[2] = rtp_header[4];
+    out[3] = rtp_header[5];
+    out[4] = rtp_header[6];
+    out[5] = rtp_header[7];
+    out[6] = protected_len >> 8;
+    out[7] = protected_len & 0xff;
+}
@@ -0,0 +1,63 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+//Repair packets of the video stream. They are an RTP stream of their own
+//(RFC 5109): payload type, sequence numbers and SSRC, FEC_REPAIR_SSRC() of
+//the media SSRC, sent to the same port. Receivers tell the two streams
+//apart by SSRC. Each repair packet protects a block of consecutive media
+//packets:
+//
+//  XOR  RFC 5109 FEC header and one level 0 ULP header, with a 16 bit mask
+//       or a 48 bit one (L set). The payload is the XOR of the protected
+//       packets and recovers one loss per block
+//  RS   E set in the first byte, then the SN base, k, m, the index of this
+//       repair packet and the protection length. The payload is a systematic
+//       Cauchy Reed-Solomon code word over GF(256) that, with the other
+//       repair packets of the block, recovers up to m losses
+//
+//Both codes work on the RFC 5109 bit string of each media packet: the P, X,
+//CC, M and PT fields, the timestamp and the length of what follows the fixed
+//header (FEC_BITSTRING_HEADER bytes), then everything after the fixed
+//header, zero padded to the protection length
+#define FEC_PAYLOAD_TYPE 127
+//SSRC of the repair stream of a media stream, and the other way around.
+//There is no SDP to pair them, both ends derive it. Never another layer's
+//SSRC, those differ in the low bits
+#define FEC_REPAIR_SSRC(ssrc) ((uint32_t)(ssrc) ^ 0x80000000u)
+#define FEC_RTP_HEADER_SIZE 12
+#define FEC_MAX_PACKET 1500
+#define FEC_MAX_PROTECTED (FEC_MAX_PACKET - FEC_RTP_HEADER_SIZE)
+#define FEC_BITSTRING_HEADER 8
+#define FEC_BITSTRING_SIZE (FEC_BITSTRING_HEADER + FEC_MAX_PROTECTED)
+
+#define FEC_HEADER_SIZE 10
+#define FEC_XOR_LEVEL_SIZE 4 //protection length, 16 bit mask
+#define FEC_XOR_LEVEL_LONG_SIZE 8 //protection length, 48 bit mask
+#define FEC_FLAG_E 0x80
+#define FEC_FLAG_L 0x40
+
+//Media packets per block
+#define FEC_XOR_MAX_BLOCK 48
+#define FEC_RS_MAX_BLOCK 128
+//Repair packets per block of the RS code
+#define FEC_RS_MAX_REPAIR 16
+
+typedef enum {
+    FEC_MODE_OFF = 0,
+    FEC_MODE_XOR,
+    FEC_MODE_RS,
+} fec_mode;
+
+//Weight of media packet media of a block in its repair packet repair,
+//1/(x + y) of a Cauchy matrix, so every square submatrix can be inverted
+uint8_t fec_rs_coefficient(int repair, int media);
+//Bit string header of an RTP packet from its fixed header and the length of
+//what follows it
+void fec_bitstring_header(
+    const uint8_t* rtp_header,
+    uint16_t protected_len,
+    uint8_t* out);
+
+#endif
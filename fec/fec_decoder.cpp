@@ -0,0 +1,424 @@
+#include "fec_decoder.h"
+#include "gf256.h"
+
+#include <string.h>
+
+//a is older than b, with wrap around
+#define SEQUENCE_BEFORE(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)) < 0)
+
+static uint16_t read16(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t read32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void fec_decoder_init(fec_decoder_t* decoder, fec_deliver deliver, void* arg)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    gf256_init();
+    decoder->deliver = deliver;
+    decoder->arg = arg;
+}
+
+static fec_media_slot_t* find_media(fec_decoder_t* decoder, uint16_t sequence)
+{
+    fec_media_slot_t* slot =
+        &decoder->media[sequence & (FEC_DECODER_WINDOW - 1)];
+
+    return (slot->valid && slot->sequence == sequence) ? slot : 0;
+}
+
+//Offsets from the SN base of the packets a repair packet protects
+static int block_members(fec_repair_slot_t* repair, int* offsets)
+{
+    int count = 0;
+    int i;
+
+    if(repair->mode == FEC_MODE_XOR)
+    {
+        for(i = 0; i < FEC_XOR_MAX_BLOCK; i++)
+            if(repair->mask & (1ULL << (FEC_XOR_MAX_BLOCK - 1 - i)))
+                offsets[count++] = i;
+    }
+    else
+        for(i = 0; i < repair->k; i++)
+            offsets[count++] = i;
+
+    return count;
+}
+
+static int same_block(fec_repair_slot_t* a, fec_repair_slot_t* b)
+{
+    if(a->mode != b->mode || a->base != b->base || a->ssrc != b->ssrc
+       || a->protected_len != b->protected_len)
+        return 0;
+
+    return a->mode == FEC_MODE_XOR ? a->mask == b->mask : a->k == b->k;
+}
+
+static uint8_t coefficient(fec_repair_slot_t* repair, int offset)
+{
+    return repair->mode == FEC_MODE_XOR
+        ? 1 : fec_rs_coefficient(repair->index, offset);
+}
+
+static void drop_block(fec_decoder_t* decoder, fec_repair_slot_t* block)
+{
+    fec_repair_slot_t copy = *block;
+    int i;
+
+    for(i = 0; i < FEC_DECODER_REPAIRS; i++)
+        if(decoder->repairs[i].valid && same_block(&decoder->repairs[i], &copy))
+            decoder->repairs[i].valid = 0;
+}
+
+//Inverts the n x n matrix a into inv with Gauss-Jordan elimination. Returns
+//0 if it is singular
+static int invert(uint8_t a[][FEC_RS_MAX_REPAIR],
+        uint8_t inv[][FEC_RS_MAX_REPAIR], int n)
+{
+    int row, col, i;
+
+    for(row = 0; row < n; row++)
+        for(col = 0; col < n; col++)
+            inv[row][col] = (row == col);
+
+    for(col = 0; col < n; col++)
+    {
+        for(row = col; row < n && !a[row][col]; row++);
+        if(row == n)
+            return 0;
+
+        if(row != col)
+            for(i = 0; i < n; i++)
+            {
+                uint8_t t = a[row][i];
+                a[row][i] = a[col][i];
+                a[col][i] = t;
+                t = inv[row][i];
+                inv[row][i] = inv[col][i];
+                inv[col][i] = t;
+            }
+
+        uint8_t scale = gf256_inv(a[col][col]);
+        for(i = 0; i < n; i++)
+        {
+            a[col][i] = gf256_mul(a[col][i], scale);
+            inv[col][i] = gf256_mul(inv[col][i], scale);
+        }
+
+        for(row = 0; row < n; row++)
+        {
+            uint8_t f = a[row][col];
+
+            if(row == col || !f)
+                continue;
+            for(i = 0; i < n; i++)
+            {
+                a[row][i] ^= gf256_mul(f, a[col][i]);
+                inv[row][i] ^= gf256_mul(f, inv[col][i]);
+            }
+        }
+    }
+
+    return 1;
+}
+
+//Rebuilds the RTP packet of a recovered bit string and hands it out
+static void deliver_recovered(
+        fec_decoder_t* decoder,
+        fec_repair_slot_t* block,
+        uint16_t sequence){
+    uint8_t* bits = decoder->recovered
+        + FEC_RTP_HEADER_SIZE - FEC_BITSTRING_HEADER;
+    uint8_t* p = decoder->recovered;
+    uint16_t len = read16(bits + 6);
+    uint8_t flags = bits[0];
+    uint8_t marker_type = bits[1];
+    uint8_t timestamp[4];
+
+    if(len > block->protected_len || (flags & 0xc0))
+    {
+        decoder->stats.bad_packets++;
+        return;
+    }
+    memcpy(timestamp, bits + 2, 4);
+
+    p[0] = 0x80 | flags;
+    p[1] = marker_type;
+    p[2] = sequence >> 8;
+    p[3] = sequence & 0xff;
+    memcpy(p + 4, timestamp, 4);
+    p[8] = decoder->ssrc >> 24;
+    p[9] = decoder->ssrc >> 16;
+    p[10] = decoder->ssrc >> 8;
+    p[11] = decoder->ssrc;
+
+    fec_media_slot_t* slot = &decoder->media[sequence & (FEC_DECODER_WINDOW - 1)];
+    slot->valid = 1;
+    slot->sequence = sequence;
+    slot->len = FEC_RTP_HEADER_SIZE + len;
+    memcpy(slot->data, p, slot->len);
+
+    decoder->stats.recovered_packets++;
+    decoder->deliver(decoder->arg, slot->data, slot->len);
+}
+
+//Recovers the missing packets of the block of repair once there are as many
+//repair packets as losses
+static void try_block(fec_decoder_t* decoder, fec_repair_slot_t* repair)
+{
+    int offsets[FEC_RS_MAX_BLOCK];
+    int missing[FEC_RS_MAX_REPAIR];
+    fec_repair_slot_t* rows[FEC_RS_MAX_REPAIR];
+    uint8_t a[FEC_RS_MAX_REPAIR][FEC_RS_MAX_REPAIR];
+    uint8_t inv[FEC_RS_MAX_REPAIR][FEC_RS_MAX_REPAIR];
+    int count = block_members(repair, offsets);
+    int row_count = 0, missing_count = 0;
+    int len = FEC_BITSTRING_HEADER + repair->protected_len;
+    int i, r, c;
+
+    for(i = 0; i < FEC_DECODER_REPAIRS && row_count < FEC_RS_MAX_REPAIR; i++)
+        if(decoder->repairs[i].valid && same_block(&decoder->repairs[i], repair))
+            rows[row_count++] = &decoder->repairs[i];
+
+    for(i = 0; i < count; i++)
+        if(!find_media(decoder, repair->base + offsets[i]))
+        {
+            if(missing_count == row_count)
+                return;
+            missing[missing_count++] = i;
+        }
+
+    if(!missing_count)
+    {
+        drop_block(decoder, repair);
+        return;
+    }
+
+    //Take the received packets out of the repair data, what is left is a
+    //combination of the missing ones only
+    for(r = 0; r < missing_count; r++)
+    {
+        uint8_t* work = decoder->work[r];
+        int m = 0;
+
+        memcpy(work, rows[r]->bitstring, len);
+        for(i = 0; i < count; i++)
+        {
+            if(m < missing_count && missing[m] == i)
+            {
+                m++;
+                continue;
+            }
+
+            fec_media_slot_t* media = find_media(decoder, repair->base + offsets[i]);
+            int protected_len = media->len - FEC_RTP_HEADER_SIZE;
+            uint8_t header[FEC_BITSTRING_HEADER];
+            uint8_t weight = coefficient(rows[r], offsets[i]);
+
+            if(protected_len < 0 || protected_len > repair->protected_len)
+            {
+                decoder->stats.bad_packets++;
+                drop_block(decoder, repair);
+                return;
+            }
+            fec_bitstring_header(media->data, protected_len, header);
+            gf256_mul_add_region(work, header, weight, FEC_BITSTRING_HEADER);
+            gf256_mul_add_region(work + FEC_BITSTRING_HEADER
+                                 , media->data + FEC_RTP_HEADER_SIZE
+                                 , weight, protected_len);
+        }
+
+        for(c = 0; c < missing_count; c++)
+            a[r][c] = coefficient(rows[r], offsets[missing[c]]);
+    }
+
+    if(!invert(a, inv, missing_count))
+        return;
+
+    fec_repair_slot_t block = *repair;
+    for(c = 0; c < missing_count; c++)
+    {
+        uint8_t* bits = decoder->recovered
+            + FEC_RTP_HEADER_SIZE - FEC_BITSTRING_HEADER;
+
+        memset(bits, 0, len);
+        for(r = 0; r < missing_count; r++)
+            gf256_mul_add_region(bits, decoder->work[r], inv[c][r], len);
+        deliver_recovered(decoder, &block, block.base + offsets[missing[c]]);
+    }
+
+    drop_block(decoder, &block);
+}
+
+static int parse_repair(
+        const uint8_t* packet,
+        int len,
+        fec_repair_slot_t* repair){
+    const uint8_t* h = packet + FEC_RTP_HEADER_SIZE;
+    const uint8_t* payload;
+    int level_size;
+
+    if(len < FEC_RTP_HEADER_SIZE + FEC_HEADER_SIZE)
+        return 0;
+
+    repair->ssrc = read32(packet + 8);
+    repair->base = read16(h + 2);
+
+    if(h[0] & FEC_FLAG_E)
+    {
+        repair->mode = FEC_MODE_RS;
+        repair->k = h[4];
+        repair->index = h[6];
+        repair->protected_len = read16(h + 8);
+        payload = h + FEC_HEADER_SIZE;
+
+        if(repair->k < 1 || repair->k > FEC_RS_MAX_BLOCK
+           || repair->index >= h[5] || repair->index >= FEC_RS_MAX_REPAIR
+           || repair->protected_len > FEC_MAX_PROTECTED
+           || len != FEC_RTP_HEADER_SIZE + FEC_HEADER_SIZE
+                     + FEC_BITSTRING_HEADER + repair->protected_len)
+            return 0;
+
+        memcpy(repair->bitstring, payload
+               , FEC_BITSTRING_HEADER + repair->protected_len);
+        return 1;
+    }
+
+    repair->mode = FEC_MODE_XOR;
+    level_size = (h[0] & FEC_FLAG_L) ? FEC_XOR_LEVEL_LONG_SIZE : FEC_XOR_LEVEL_SIZE;
+    if(len < FEC_RTP_HEADER_SIZE + FEC_HEADER_SIZE + level_size)
+        return 0;
+
+    const uint8_t* level = h + FEC_HEADER_SIZE;
+    int i;
+
+    repair->protected_len = read16(level);
+    repair->mask = 0;
+    for(i = 0; i < level_size - 2; i++)
+        repair->mask |= (uint64_t)level[2 + i] << (40 - 8*i);
+    payload = level + level_size;
+
+    if(!repair->mask || repair->protected_len > FEC_MAX_PROTECTED
+       || len != FEC_RTP_HEADER_SIZE + FEC_HEADER_SIZE + level_size
+                 + repair->protected_len)
+        return 0;
+
+    //The recovery fields of the FEC header are the bit string header
+    repair->bitstring[0] = h[0] & 0x3f;
+    repair->bitstring[1] = h[1];
+    memcpy(repair->bitstring + 2, h + 4, 6);
+    memcpy(repair->bitstring + FEC_BITSTRING_HEADER, payload
+           , repair->protected_len);
+
+    return 1;
+}
+
+//Blocks that far behind the newest media packet may already have lost
+//their packets from the window
+static int too_old(fec_decoder_t* decoder, uint16_t base)
+{
+    return decoder->started && SEQUENCE_BEFORE(base + FEC_DECODER_WINDOW/2
+                                               , decoder->highest);
+}
+
+static void push_repair(fec_decoder_t* decoder, const uint8_t* packet, int len)
+{
+    fec_repair_slot_t* repair = &decoder->repairs[decoder->next_repair];
+
+    repair->valid = 0;
+    if(!parse_repair(packet, len, repair))
+    {
+        decoder->stats.bad_packets++;
+        return;
+    }
+    decoder->stats.repair_packets++;
+    if(too_old(decoder, repair->base))
+        return;
+
+    repair->valid = 1;
+    decoder->next_repair = (decoder->next_repair + 1) % FEC_DECODER_REPAIRS;
+    try_block(decoder, repair);
+}
+
+static void push_media(fec_decoder_t* decoder, const uint8_t* packet, int len)
+{
+    uint16_t sequence = read16(packet + 2);
+    fec_media_slot_t* slot = &decoder->media[sequence & (FEC_DECODER_WINDOW - 1)];
+    int i;
+
+    decoder->stats.media_packets++;
+    if(!decoder->started || SEQUENCE_BEFORE(decoder->highest, sequence))
+    {
+        decoder->highest = sequence;
+        decoder->started = 1;
+    }
+
+    slot->valid = 1;
+    slot->sequence = sequence;
+    slot->len = len;
+    memcpy(slot->data, packet, len);
+    decoder->deliver(decoder->arg, packet, len);
+
+    //Blocks this packet belongs to may be short of one loss less now
+    for(i = 0; i < FEC_DECODER_REPAIRS; i++)
+    {
+        fec_repair_slot_t* repair = &decoder->repairs[i];
+        uint16_t offset = sequence - repair->base;
+
+        if(!repair->valid)
+            continue;
+        if(too_old(decoder, repair->base))
+            repair->valid = 0;
+        else if(offset < (repair->mode == FEC_MODE_XOR
+                          ? FEC_XOR_MAX_BLOCK : repair->k))
+            try_block(decoder, repair);
+    }
+}
+
+//Forgets the packets and blocks of the previous stream
+static void start_stream(fec_decoder_t* decoder, uint32_t ssrc)
+{
+    memset(decoder->media, 0, sizeof(decoder->media));
+    memset(decoder->repairs, 0, sizeof(decoder->repairs));
+    decoder->next_repair = 0;
+    decoder->highest = 0;
+    decoder->started = 0;
+    decoder->ssrc = ssrc;
+    decoder->have_ssrc = 1;
+    decoder->stats.streams++;
+}
+
+void fec_decoder_push(fec_decoder_t* decoder, const uint8_t* packet, int len)
+{
+    uint32_t ssrc;
+    int repair;
+
+    if(len < FEC_RTP_HEADER_SIZE || len > FEC_MAX_PACKET
+       || (packet[0] & 0xc0) != 0x80)
+    {
+        decoder->stats.bad_packets++;
+        return;
+    }
+
+    //The payload type only tells which stream a new SSRC belongs to
+    ssrc = read32(packet + 8);
+    repair = (packet[1] & 0x7f) == FEC_PAYLOAD_TYPE;
+    if(!decoder->have_ssrc)
+        start_stream(decoder, repair ? FEC_REPAIR_SSRC(ssrc) : ssrc);
+    else if(!repair && ssrc != decoder->ssrc
+            && ssrc != FEC_REPAIR_SSRC(decoder->ssrc))
+        start_stream(decoder, ssrc);
+
+    if(ssrc == decoder->ssrc)
+        push_media(decoder, packet, len);
+    else if(ssrc == FEC_REPAIR_SSRC(decoder->ssrc))
+        push_repair(decoder, packet, len);
+    else
+        decoder->stats.bad_packets++;
+}
@@ -0,0 +1,75 @@
+#ifndef FEC_DECODER_H
+#define FEC_DECODER_H
+
+#include <stdint.h>
+
+#include "fec.h"
+
+//Receiver side of fec.h, for clients of the stream. Every datagram of the
+//stream port goes through fec_decoder_push(). Media packets come back out of
+//deliver() right away, recovered ones as soon as their block has enough
+//repair data, so they may be late and out of order like any reordered packet.
+//The first packet gives the media SSRC, a repair packet through
+//FEC_REPAIR_SSRC(), and the packets are told apart by SSRC from then on. A
+//media packet of another SSRC starts the decoder over, after a layer switch
+//or a server restart
+#define FEC_DECODER_WINDOW 1024 //media packets kept, power of two
+#define FEC_DECODER_REPAIRS 128 //repair packets kept
+
+typedef void (*fec_deliver)(void* arg, const uint8_t* packet, int len);
+
+typedef struct {
+    uint64_t media_packets;
+    uint64_t repair_packets;
+    uint64_t recovered_packets;
+    //Not RTP, malformed repair packets or repair packets of another stream
+    uint64_t bad_packets;
+    uint64_t streams; //media SSRCs followed
+} fec_decoder_stats_t;
+
+typedef struct {
+    int valid;
+    uint16_t sequence;
+    uint16_t len;
+    uint8_t data[FEC_MAX_PACKET];
+} fec_media_slot_t;
+
+typedef struct {
+    int valid;
+    fec_mode mode;
+    uint16_t base;
+    uint64_t mask; //XOR, bit 47 - i protects base + i
+    int k; //RS
+    int index; //RS, row of the code
+    uint32_t ssrc;
+    uint16_t protected_len;
+    uint8_t bitstring[FEC_BITSTRING_SIZE];
+} fec_repair_slot_t;
+
+typedef struct {
+    fec_media_slot_t media[FEC_DECODER_WINDOW];
+    fec_repair_slot_t repairs[FEC_DECODER_REPAIRS];
+    int next_repair;
+    //Of the media stream, valid with have_ssrc
+    uint32_t ssrc;
+    int have_ssrc;
+    //Newest media sequence number seen, blocks too far behind it are dropped
+    uint16_t highest;
+    int started;
+    //Repair data less the received packets while solving a block
+    uint8_t work[FEC_RS_MAX_REPAIR][FEC_BITSTRING_SIZE];
+    //A recovered bit string, placed so its payload is already where the
+    //payload of the rebuilt packet goes
+    uint8_t recovered[FEC_RTP_HEADER_SIZE - FEC_BITSTRING_HEADER
+                      + FEC_BITSTRING_SIZE];
+    fec_decoder_stats_t stats;
+    fec_deliver deliver;
+    void* arg;
+} fec_decoder_t;
+
+//The decoder is big (about 1.7 MB), allocate it rather than putting it on
+//the stack
+void fec_decoder_init(fec_decoder_t* decoder, fec_deliver deliver, void* arg);
+void fec_decoder_push(fec_decoder_t* decoder, const uint8_t* packet, int len);
+
+#endif
@@ -0,0 +1,276 @@
+#include "gf256.h"
+
+#include <string.h>
+#include <pthread.h>
+
+//NEON is looked for first, so tests/ can build the NEON kernels on x86
+//against a plain C arm_neon.h
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GF256_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF256_X86 1
+#endif
+
+static uint8_t exp_table[512];
+static uint8_t log_table[256];
+//Products of c with the low and the high nibble of a byte, the split tables
+//the SIMD kernels look up 16 bytes at a time
+static uint8_t mul_lo[256][16] __attribute__((aligned(16)));
+static uint8_t mul_hi[256][16] __attribute__((aligned(16)));
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+//add is 0 for dst = c*src, 1 for dst ^= c*src
+typedef void (*mul_kernel)(uint8_t* dst, const uint8_t* src, uint8_t c,
+        int len, int add);
+typedef void (*add_kernel)(uint8_t* dst, const uint8_t* src, int len);
+
+static void mul_scalar(uint8_t* dst, const uint8_t* src, uint8_t c,
+        int len, int add)
+{
+    const uint8_t* lo = mul_lo[c];
+    const uint8_t* hi = mul_hi[c];
+    int i;
+
+    for(i = 0; i < len; i++)
+    {
+        uint8_t p = lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+        dst[i] = add ? dst[i] ^ p : p;
+    }
+}
+
+static void add_scalar(uint8_t* dst, const uint8_t* src, int len)
+{
+    int i = 0;
+
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t a, b;
+
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for(; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+#ifdef GF256_X86
+__attribute__((target("ssse3")))
+static void mul_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c,
+        int len, int add)
+{
+    __m128i lo = _mm_load_si128((const __m128i*)mul_lo[c]);
+    __m128i hi = _mm_load_si128((const __m128i*)mul_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i p = _mm_xor_si128(
+                _mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        if(add)
+            p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i*)(dst + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), p);
+    }
+    mul_scalar(dst + i, src + i, c, len - i, add);
+}
+
+__attribute__((target("sse2")))
+static void add_sse2(uint8_t* dst, const uint8_t* src, int len)
+{
+    int i = 0;
+
+    for(; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(
+                    _mm_loadu_si128((const __m128i*)(dst + i)),
+                    _mm_loadu_si128((const __m128i*)(src + i))));
+    add_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(uint8_t* dst, const uint8_t* src, uint8_t c,
+        int len, int add)
+{
+    __m256i lo = _mm256_broadcastsi128_si256(
+            _mm_load_si128((const __m128i*)mul_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(
+            _mm_load_si128((const __m128i*)mul_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i p = _mm256_xor_si256(
+                _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+                _mm256_shuffle_epi8(hi,
+                    _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        if(add)
+            p = _mm256_xor_si256(p,
+                    _mm256_loadu_si256((const __m256i*)(dst + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), p);
+    }
+    mul_scalar(dst + i, src + i, c, len - i, add);
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(uint8_t* dst, const uint8_t* src, int len)
+{
+    int i = 0;
+
+    for(; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(
+                    _mm256_loadu_si256((const __m256i*)(dst + i)),
+                    _mm256_loadu_si256((const __m256i*)(src + i))));
+    add_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef GF256_NEON
+static void mul_neon(uint8_t* dst, const uint8_t* src, uint8_t c,
+        int len, int add)
+{
+    int i = 0;
+#ifdef __aarch64__
+    uint8x16_t lo = vld1q_u8(mul_lo[c]);
+    uint8x16_t hi = vld1q_u8(mul_hi[c]);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+
+    for(; i + 16 <= len; i += 16)
+    {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(lo, vandq_u8(s, mask)),
+                vqtbl1q_u8(hi, vshrq_n_u8(s, 4)));
+        if(add)
+            p = veorq_u8(p, vld1q_u8(dst + i));
+        vst1q_u8(dst + i, p);
+    }
+#else
+    uint8x8x2_t lo;
+    uint8x8x2_t hi;
+    uint8x8_t mask = vdup_n_u8(0x0f);
+
+    lo.val[0] = vld1_u8(mul_lo[c]);
+    lo.val[1] = vld1_u8(mul_lo[c] + 8);
+    hi.val[0] = vld1_u8(mul_hi[c]);
+    hi.val[1] = vld1_u8(mul_hi[c] + 8);
+    for(; i + 8 <= len; i += 8)
+    {
+        uint8x8_t s = vld1_u8(src + i);
+        uint8x8_t p = veor_u8(vtbl2_u8(lo, vand_u8(s, mask)),
+                vtbl2_u8(hi, vshr_n_u8(s, 4)));
+        if(add)
+            p = veor_u8(p, vld1_u8(dst + i));
+        vst1_u8(dst + i, p);
+    }
+#endif
+    mul_scalar(dst + i, src + i, c, len - i, add);
+}
+
+static void add_neon(uint8_t* dst, const uint8_t* src, int len)
+{
+    int i = 0;
+
+    for(; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    add_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+static mul_kernel mul_region_kernel = mul_scalar;
+static add_kernel add_region_kernel = add_scalar;
+static const char* kernel_name = "scalar";
+
+static void build_tables()
+{
+    int i, c, x = 1;
+
+    for(i = 0; i < 255; i++)
+    {
+        exp_table[i] = exp_table[i + 255] = x;
+        log_table[x] = i;
+        x <<= 1;
+        if(x & 0x100)
+            x ^= GF256_POLYNOMIAL;
+    }
+    exp_table[510] = exp_table[511] = exp_table[0];
+
+    for(c = 0; c < 256; c++)
+        for(i = 0; i < 16; i++)
+        {
+            mul_lo[c][i] = gf256_mul(c, i);
+            mul_hi[c][i] = gf256_mul(c, i << 4);
+        }
+
+#ifdef GF256_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        mul_region_kernel = mul_avx2;
+        add_region_kernel = add_avx2;
+        kernel_name = "avx2";
+    }
+    else if(__builtin_cpu_supports("ssse3"))
+    {
+        mul_region_kernel = mul_ssse3;
+        add_region_kernel = add_sse2;
+        kernel_name = "ssse3";
+    }
+#endif
+#ifdef GF256_NEON
+    mul_region_kernel = mul_neon;
+    add_region_kernel = add_neon;
+    kernel_name = "neon";
+#endif
+}
+
+void gf256_init()
+{
+    pthread_once(&init_once, build_tables);
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+    if(!a || !b)
+        return 0;
+
+    return exp_table[log_table[a] + log_table[b]];
+}
+
+uint8_t gf256_inv(uint8_t a)
+{
+    return exp_table[255 - log_table[a]];
+}
+
+void gf256_add_region(uint8_t* dst, const uint8_t* src, int len)
+{
+    add_region_kernel(dst, src, len);
+}
+
+void gf256_mul_add_region(uint8_t* dst, const uint8_t* src, uint8_t c, int len)
+{
+    if(c == 0)
+        return;
+    if(c == 1)
+        add_region_kernel(dst, src, len);
+    else
+        mul_region_kernel(dst, src, c, len, 1);
+}
+
+void gf256_mul_region(uint8_t* dst, uint8_t c, int len)
+{
+    if(c == 0)
+        memset(dst, 0, len);
+    else if(c != 1)
+        mul_region_kernel(dst, dst, c, len, 0);
+}
+
+const char* gf256_kernel_name()
+{
+    return kernel_name;
+}
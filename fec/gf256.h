@@ -0,0 +1,26 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <stdint.h>
+
+//Arithmetic in GF(2^8) for the Reed-Solomon repair packets. The region
+//functions use AVX2 or SSSE3 on x86, whichever the CPU has, and NEON when
+//the compiler targets it (-mfpu=neon on a 32 bit Pi 2 or later, always on
+//64 bit ARM). Plain C otherwise
+#define GF256_POLYNOMIAL 0x11d //x^8 + x^4 + x^3 + x^2 + 1
+
+//Builds the tables, any thread may call it any number of times
+void gf256_init();
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+//a must not be 0
+uint8_t gf256_inv(uint8_t a);
+//dst ^= src
+void gf256_add_region(uint8_t* dst, const uint8_t* src, int len);
+//dst ^= c*src
+void gf256_mul_add_region(uint8_t* dst, const uint8_t* src, uint8_t c, int len);
+//dst = c*dst
+void gf256_mul_region(uint8_t* dst, uint8_t c, int len);
+//Kernel picked by gf256_init()
+const char* gf256_kernel_name();
+
+#endif
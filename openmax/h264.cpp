@@ -1,17 +1,86 @@
 #include "h264.h"
+#include "../common_util/stats.h"
+
+#include <semaphore.h>
 
 static OMX_ERRORTYPE error;
-static OMX_BUFFERHEADERTYPE* encoder_output_buffer;
+static OMX_BUFFERHEADERTYPE* encoder_output_buffers[ENCODER_MAX_OUTPUT_BUFFERS];
+static int encoder_output_buffer_count;
+//Output buffers of the low layer encoder, their pAppPrivate counts on from
+//ENCODER_MAX_OUTPUT_BUFFERS
+static OMX_BUFFERHEADERTYPE* low_output_buffers[ENCODER_MAX_OUTPUT_BUFFERS];
+static int low_output_buffer_count;
+//Buffers filled by the encoders, pushed from fill_buffer_done() and popped
+//by fill_frame_buffer(). One ring per layer
+static spsc_ring_t filled_buffers[STREAM_LAYERS];
+static void* filled_buffer_slots[STREAM_LAYERS][ENCODER_MAX_OUTPUT_BUFFERS];
+//When fill_buffer_done() got each buffer, indexed like pAppPrivate
+static uint64_t buffer_ready_us[STREAM_LAYERS*ENCODER_MAX_OUTPUT_BUFFERS];
+static int frame_notify_fd = -1;
+//Signaled for every filled buffer instead of the encoder event flags, the
+//stream thread waits on it with its commands
+static int buffer_ready_fd = -1;
 static component_t camera;
 static component_t encoder;
 static component_t null_sink;
+static component_t resizer;
+static component_t low_encoder;
+static component_t splitter;
+static component_t motion_resizer;
 static char camera_name[30];
 static char encoder_name[30];
 static char null_sink_name[30];
+static char resizer_name[30];
+static char low_encoder_name[30];
+static char splitter_name[30];
+static char motion_resizer_name[30];
+//Every component in use, in the order they change state
+static component_t* pipeline[6];
+static int pipeline_size;
+//Non zero while the low layer runs: CAMERA_SIMULCAST unless setting it up
+//failed, the main layer then streams alone
+static int simulcast;
+//How many of pipeline[] have a handle and both ends of every tunnel set up,
+//what unload_pipeline() undoes
+static int components_loaded;
+static component_t* tunnel_components[10];
+static OMX_U32 tunnel_ports[10];
+static int tunnel_end_count;
+//Motion gating. The resizer output buffers go from fill_buffer_done() to the
+//motion thread through motion_buffers_filled, motion_sem counts them
+static OMX_BUFFERHEADERTYPE* motion_buffers[MOTION_BUFFERS];
+static int motion_buffer_count;
+static int motion_stride;
+static spsc_ring_t motion_buffers_filled;
+static void* motion_buffer_slots[MOTION_BUFFERS];
+static sem_t motion_sem;
+static pthread_t motion_thread;
+static int motion_running;
+static motion_detector_t motion;
+//Held by the motion thread and by whatever changes the encoder settings, it
+//guards video_config, the bitrates and motion
+static pthread_mutex_t encoder_lock = PTHREAD_MUTEX_INITIALIZER;
+//Last omx_h264_set_bitrate(), 0 for the configured bitrate
+static int requested_bitrate;
 
 static OMX_PARAM_PORTDEFINITIONTYPE port_st;
 static OMX_CONFIG_FRAMERATETYPE framerate_st;
 static OMX_CONFIG_PORTBOOLEANTYPE capture_st;
+static int pipeline_loaded;
+//Target the encoder runs with, below video_config.bitrate when lowered by
+//omx_h264_set_bitrate()
+static int encoder_bitrate;
+static video_config_t video_config = {
+    VIDEO_WIDTH,
+    VIDEO_HEIGHT,
+    VIDEO_FRAMERATE,
+    VIDEO_BITRATE,
+    VIDEO_IDR_PERIOD,
+    VIDEO_QP ? VIDEO_QP_I : 0,
+    VIDEO_QP ? VIDEO_QP_P : 0,
+    VIDEO_PROFILE,
+    VIDEO_REFRESH_PERIOD
+};
 
 //Function that is called when a component receives an event from a secondary
 //thread
@@ -102,8 +171,30 @@ OMX_ERRORTYPE fill_buffer_done (
         OMX_IN OMX_BUFFERHEADERTYPE* buffer){
     component_t* component = (component_t*)app_data;
 
-    DEBUG_MSG("event: %s, fill_buffer_done\n", component->name);
-    wake (component, EVENT_FILL_BUFFER_DONE);
+    DEBUG_TRACE("event: %s, fill_buffer_done\n", component->name);
+    //The ILCS thread can't wait for OMX_SetConfig(), so the motion thread
+    //looks at the frame
+    if (component == &motion_resizer){
+        spsc_ring_push (&motion_buffers_filled, buffer);
+        sem_post (&motion_sem);
+        return OMX_ErrorNone;
+    }
+
+    //Published to the stream thread by the ring push
+    buffer_ready_us[(intptr_t)buffer->pAppPrivate] = get_time_us();
+
+    //Pulled by fill_frame_buffer() or take_frame_buffer(), or given back
+    //with the port flushes while the capture is stopped. The ring holds every
+    //output buffer, so it can't overflow. Nothing else runs on the ILCS
+    //thread, which calls back the other components too
+    spsc_ring_push (&filled_buffers[frame_buffer_layer (buffer)], buffer);
+    //fill_frame_buffer() waits on the main encoder for both, the stream
+    //thread taking them with take_frame_buffer() on the eventfd
+    if (buffer_ready_fd >= 0)
+        event_fd_signal (buffer_ready_fd);
+    else
+        wake (&encoder, EVENT_FILL_BUFFER_DONE);
+    event_fd_signal (frame_notify_fd);
 
     return OMX_ErrorNone;
 }
@@ -130,7 +221,7 @@ void wait (
     }
 }
 
-void init_component (component_t* component){
+int init_component (component_t* component){
     DEBUG_MSG("initializing component %s\n", component->name);
 
     OMX_ERRORTYPE error;
@@ -150,8 +241,10 @@ void init_component (component_t* component){
     if ((error = OMX_GetHandle (&component->handle, component->name, component,
                     &callbacks_st))){
         DEBUG_ERR("error: OMX_GetHandle: %s\n", dump_OMX_ERRORTYPE (error));
-        exit (1);
+        vcos_event_flags_delete (&component->flags);
+        return 0;
     }
+    component->intra_refresh = 0;
 
     //Disable all the ports
     OMX_INDEXTYPE types[] = {
@@ -180,6 +273,8 @@ void init_component (component_t* component){
             wait (component, EVENT_PORT_DISABLE, 0);
         }
     }
+
+    return 1;
 }
 
 void deinit_component (component_t* component){
@@ -280,12 +375,12 @@ void disable_port (component_t* component, OMX_U32 port){
 
 void enable_encoder_output_port (
         component_t* encoder,
-        OMX_BUFFERHEADERTYPE** encoder_output_buffer){
-    //The port is not enabled until the buffer is allocated
+        OMX_BUFFERHEADERTYPE** encoder_output_buffers,
+        int* encoder_output_buffer_count,
+        int first_index){
+    //The port is not enabled until all the buffers are allocated
     OMX_ERRORTYPE error;
 
-    enable_port (encoder, 201);
-
     OMX_PARAM_PORTDEFINITIONTYPE port_st;
     OMX_INIT_STRUCTURE (port_st);
     port_st.nPortIndex = 201;
@@ -295,30 +390,61 @@ void enable_encoder_output_port (
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
-    DEBUG_MSG("allocating %s output buffer\n", encoder->name);
-    if ((error = OMX_AllocateBuffer (encoder->handle, encoder_output_buffer, 201,
-                    0, port_st.nBufferSize))){
-        DEBUG_ERR("error: OMX_AllocateBuffer: %s\n",
+
+    //Ask for a pool of buffers so the encoder can keep filling while the
+    //previous frames are still being sent
+    port_st.nBufferCountActual = ENCODER_OUTPUT_BUFFERS;
+    if (port_st.nBufferCountActual < port_st.nBufferCountMin)
+        port_st.nBufferCountActual = port_st.nBufferCountMin;
+    if (port_st.nBufferCountActual > ENCODER_MAX_OUTPUT_BUFFERS)
+        port_st.nBufferCountActual = ENCODER_MAX_OUTPUT_BUFFERS;
+    if ((error = OMX_SetParameter (encoder->handle, OMX_IndexParamPortDefinition,
+                    &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
 
+    enable_port (encoder, 201);
+
+    DEBUG_MSG("allocating %d %s output buffers\n", port_st.nBufferCountActual,
+            encoder->name);
+    //pAppPrivate holds the index of the buffer, see omx_source.cpp
+    OMX_U32 i;
+    for (i=0; i<port_st.nBufferCountActual; i++){
+        if ((error = OMX_AllocateBuffer (encoder->handle,
+                        &encoder_output_buffers[i], 201,
+                        (OMX_PTR)(intptr_t)(first_index + i),
+                        port_st.nBufferSize))){
+            DEBUG_ERR("error: OMX_AllocateBuffer: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            exit (1);
+        }
+    }
+    *encoder_output_buffer_count = port_st.nBufferCountActual;
+
     wait (encoder, EVENT_PORT_ENABLE, 0);
 }
 
 void disable_encoder_output_port (
         component_t* encoder,
-        OMX_BUFFERHEADERTYPE* encoder_output_buffer){
-    //The port is not disabled until the buffer is released
+        OMX_BUFFERHEADERTYPE** encoder_output_buffers,
+        int encoder_output_buffer_count){
+    //The port is not disabled until all the buffers are released
     OMX_ERRORTYPE error;
 
     disable_port (encoder, 201);
 
-    //Free encoder output buffer
-    DEBUG_MSG("releasing %s output buffer\n", encoder->name);
-    if ((error = OMX_FreeBuffer (encoder->handle, 201, encoder_output_buffer))){
-        DEBUG_ERR("error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
-        exit (1);
+    //Free encoder output buffers
+    DEBUG_MSG("releasing %s output buffers\n", encoder->name);
+    int i;
+    for (i=0; i<encoder_output_buffer_count; i++){
+        if ((error = OMX_FreeBuffer (encoder->handle, 201,
+                        encoder_output_buffers[i]))){
+            DEBUG_ERR("error: OMX_FreeBuffer: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            exit (1);
+        }
     }
 
     wait (encoder, EVENT_PORT_DISABLE, 0);
@@ -518,23 +644,34 @@ void set_camera_settings (component_t* camera){
     }
 }
 
-void set_h264_settings (component_t* encoder){
+static OMX_VIDEO_AVCPROFILETYPE avc_profile (video_profile profile){
+    switch (profile){
+        case VIDEO_PROFILE_MAIN:
+            return OMX_VIDEO_AVCProfileMain;
+        case VIDEO_PROFILE_HIGH:
+            return OMX_VIDEO_AVCProfileHigh;
+        default:
+            return OMX_VIDEO_AVCProfileBaseline;
+    }
+}
+
+int set_h264_settings (component_t* encoder, video_config_t* config){
     DEBUG_MSG("configuring '%s' settings\n", encoder->name);
 
     OMX_ERRORTYPE error;
 
-    if (!VIDEO_QP){
+    if (!config->qp_i && !config->qp_p){
         //Bitrate
         OMX_VIDEO_PARAM_BITRATETYPE bitrate_st;
         OMX_INIT_STRUCTURE (bitrate_st);
         bitrate_st.eControlRate = OMX_Video_ControlRateVariable;
-        bitrate_st.nTargetBitrate = VIDEO_BITRATE;
+        bitrate_st.nTargetBitrate = config->bitrate;
         bitrate_st.nPortIndex = 201;
         if ((error = OMX_SetParameter (encoder->handle, OMX_IndexParamVideoBitrate,
                         &bitrate_st))){
             DEBUG_ERR("error: OMX_SetParameter: %s\n",
                     dump_OMX_ERRORTYPE (error));
-            exit (1);
+            return 0;
         }
     }else{
         //Quantization parameters
@@ -542,13 +679,13 @@ void set_h264_settings (component_t* encoder){
         OMX_INIT_STRUCTURE (quantization_st);
         quantization_st.nPortIndex = 201;
         //nQpB returns an error, it cannot be modified
-        quantization_st.nQpI = VIDEO_QP_I;
-        quantization_st.nQpP = VIDEO_QP_P;
+        quantization_st.nQpI = config->qp_i;
+        quantization_st.nQpP = config->qp_p;
         if ((error = OMX_SetParameter (encoder->handle,
                         OMX_IndexParamVideoQuantization, &quantization_st))){
             DEBUG_ERR("error: OMX_SetParameter: %s\n",
                     dump_OMX_ERRORTYPE (error));
-            exit (1);
+            return 0;
         }
     }
 
@@ -562,7 +699,7 @@ void set_h264_settings (component_t* encoder){
                     &format_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     //IDR period
@@ -572,13 +709,40 @@ void set_h264_settings (component_t* encoder){
     if ((error = OMX_GetConfig (encoder->handle,
                     OMX_IndexConfigVideoAVCIntraPeriod, &idr_st))){
         DEBUG_ERR("error: OMX_GetConfig: %s\n", dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
-    idr_st.nIDRPeriod = VIDEO_IDR_PERIOD;
+    idr_st.nIDRPeriod = config->idr_period;
     if ((error = OMX_SetConfig (encoder->handle,
                     OMX_IndexConfigVideoAVCIntraPeriod, &idr_st))){
         DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
+    }
+
+    //Cyclic intra refresh, nCirMBs macroblocks per frame. The port keeps it
+    //across restarts, so off is set too, but only once it was on: firmware
+    //without the parameter still streams with it off
+    if (config->refresh_period || encoder->intra_refresh){
+        OMX_VIDEO_PARAM_INTRAREFRESHTYPE refresh_st;
+        OMX_INIT_STRUCTURE (refresh_st);
+        refresh_st.nPortIndex = 201;
+        if ((error = OMX_GetParameter (encoder->handle,
+                        OMX_IndexParamVideoIntraRefresh, &refresh_st))){
+            DEBUG_MSG("intra refresh not supported: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            encoder->intra_refresh = 0;
+        }else{
+            int macroblocks = ((config->width + 15)/16)*((config->height + 15)/16);
+            refresh_st.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+            refresh_st.nCirMBs = config->refresh_period
+                ? (macroblocks + config->refresh_period - 1)/config->refresh_period
+                : 0;
+            if ((error = OMX_SetParameter (encoder->handle,
+                            OMX_IndexParamVideoIntraRefresh, &refresh_st))){
+                DEBUG_MSG("intra refresh not set: %s\n",
+                        dump_OMX_ERRORTYPE (error));
+            }
+            encoder->intra_refresh = config->refresh_period != 0;
+        }
     }
 
     //SEI
@@ -590,7 +754,7 @@ void set_h264_settings (component_t* encoder){
                     OMX_IndexParamBrcmVideoAVCSEIEnable, &sei_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     //EEDE
@@ -602,7 +766,7 @@ void set_h264_settings (component_t* encoder){
                     &eede_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     OMX_VIDEO_EEDE_LOSSRATE eede_loss_rate_st;
@@ -613,7 +777,7 @@ void set_h264_settings (component_t* encoder){
                     OMX_IndexParamBrcmEEDELossRate, &eede_loss_rate_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     //AVC Profile
@@ -624,14 +788,14 @@ void set_h264_settings (component_t* encoder){
                     OMX_IndexParamVideoAvc, &avc_st))){
         DEBUG_ERR("error: OMX_GetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
-    avc_st.eProfile = VIDEO_PROFILE;
+    avc_st.eProfile = avc_profile (config->profile);
     if ((error = OMX_SetParameter (encoder->handle,
                     OMX_IndexParamVideoAvc, &avc_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     //Inline SPS/PPS
@@ -643,42 +807,188 @@ void set_h264_settings (component_t* encoder){
                     OMX_IndexParamBrcmVideoAVCInlineHeaderEnable, &headers_st))){
         DEBUG_ERR("error: OMX_SetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
-        exit (1);
+        return 0;
     }
 
     //Note: Motion vectors are not implemented in this program.
     //See for further details
     //https://github.com/gagle/raspberrypi-omxcam/blob/master/src/h264.c
     //https://github.com/gagle/raspberrypi-omxcam/blob/master/src/video.c
+
+    return 1;
 }
 
-void omx_h264_init()
-{
-    strncpy(camera_name, "OMX.broadcom.camera", strlen("OMX.broadcom.camera"));
-    strncpy(encoder_name, "OMX.broadcom.video_encode", strlen("OMX.broadcom.video_encode"));
-    strncpy(null_sink_name, "OMX.broadcom.null_sink", strlen("OMX.broadcom.null_sink"));
+//Gets the port definition of the camera preview port, which the splitter and
+//the resizers take as it is
+static void get_preview_port (OMX_PARAM_PORTDEFINITIONTYPE* preview_st){
+    OMX_INIT_STRUCTURE (*preview_st);
+    preview_st->nPortIndex = 70;
+    if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamPortDefinition,
+                    preview_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+}
 
-    camera.name = &camera_name[0];
-    encoder.name = &encoder_name[0];
-    null_sink.name = &null_sink_name[0];
-    
-    //Initialize Broadcom's VideoCore APIs
-    bcm_host_init ();
+//Sets the input port of a resizer to the preview frames. Returns 0 on
+//failure
+static int configure_resize_input (component_t* resize){
+    OMX_PARAM_PORTDEFINITIONTYPE preview_st;
 
-    //Initialize OpenMAX IL
-    if ((error = OMX_Init ())){
-        DEBUG_ERR("error: OMX_Init: %s\n", dump_OMX_ERRORTYPE (error));
+    get_preview_port (&preview_st);
+
+    OMX_INIT_STRUCTURE (port_st);
+    port_st.nPortIndex = 60;
+    if ((error = OMX_GetParameter (resize->handle, OMX_IndexParamPortDefinition,
+                    &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+    port_st.format.image.nFrameWidth = preview_st.format.video.nFrameWidth;
+    port_st.format.image.nFrameHeight = preview_st.format.video.nFrameHeight;
+    port_st.format.image.nStride = preview_st.format.video.nStride;
+    port_st.format.image.nSliceHeight = preview_st.format.video.nSliceHeight;
+    port_st.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+    port_st.format.image.eColorFormat = preview_st.format.video.eColorFormat;
+    if ((error = OMX_SetParameter (resize->handle, OMX_IndexParamPortDefinition,
+                    &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+
+    return 1;
+}
+
+//Sets the splitter input and the two outputs in use to the preview frames.
+//Returns 0 on failure
+static int configure_splitter (){
+    OMX_PARAM_PORTDEFINITIONTYPE preview_st;
+
+    DEBUG_MSG("configuring %s port definitions\n", splitter.name);
+    get_preview_port (&preview_st);
+
+    OMX_U32 ports[] = {250, 251, 252};
+    int i;
+    for (i=0; i<3; i++){
+        OMX_INIT_STRUCTURE (port_st);
+        port_st.nPortIndex = ports[i];
+        if ((error = OMX_GetParameter (splitter.handle,
+                        OMX_IndexParamPortDefinition, &port_st))){
+            DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            return 0;
+        }
+        port_st.format.video = preview_st.format.video;
+        if ((error = OMX_SetParameter (splitter.handle,
+                        OMX_IndexParamPortDefinition, &port_st))){
+            DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//Sets the motion resizer to scale the preview frames to MOTION_WIDTH x
+//MOTION_HEIGHT planar YUV, the luma plane first
+static void configure_motion (){
+    DEBUG_MSG("configuring %s port definition, %dx%d\n", motion_resizer.name,
+            MOTION_WIDTH, MOTION_HEIGHT);
+    if (!configure_resize_input (&motion_resizer))
+        exit (1);
+
+    OMX_INIT_STRUCTURE (port_st);
+    port_st.nPortIndex = 61;
+    if ((error = OMX_GetParameter (motion_resizer.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+    port_st.format.image.nFrameWidth = MOTION_WIDTH;
+    port_st.format.image.nFrameHeight = MOTION_HEIGHT;
+    port_st.format.image.nStride = MOTION_WIDTH;
+    port_st.format.image.nSliceHeight = MOTION_HEIGHT;
+    port_st.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+    port_st.format.image.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+    if ((error = OMX_SetParameter (motion_resizer.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
         exit (1);
     }
+}
 
-    //Initialize components
-    init_component (&camera);
-    init_component (&encoder);
-    init_component (&null_sink);
+//Sets the resizer and the low layer encoder from video_config. The resizer
+//takes the preview port as it is and scales it to video_low_size(). Returns 0
+//on failure
+static int configure_low_layer (){
+    video_config_t low_config = video_config;
 
-    //Initialize camera drivers
-    load_camera_drivers (&camera);
+    video_low_size (&video_config, &low_config.width, &low_config.height);
+    low_config.bitrate = VIDEO_LOW_BITRATE;
+    low_config.qp_i = 0;
+    low_config.qp_p = 0;
+
+    DEBUG_MSG("configuring %s port definition, %dx%d\n", resizer.name,
+            low_config.width, low_config.height);
+    if (!configure_resize_input (&resizer))
+        return 0;
 
+    OMX_INIT_STRUCTURE (port_st);
+    port_st.nPortIndex = 61;
+    if ((error = OMX_GetParameter (resizer.handle, OMX_IndexParamPortDefinition,
+                    &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+    port_st.format.image.nFrameWidth = low_config.width;
+    port_st.format.image.nFrameHeight = low_config.height;
+    port_st.format.image.nStride = low_config.width;
+    port_st.format.image.nSliceHeight = low_config.height;
+    port_st.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+    port_st.format.image.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+    if ((error = OMX_SetParameter (resizer.handle, OMX_IndexParamPortDefinition,
+                    &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+
+    DEBUG_MSG("configuring low layer %s port definition\n", low_encoder.name);
+    OMX_INIT_STRUCTURE (port_st);
+    port_st.nPortIndex = 201;
+    if ((error = OMX_GetParameter (low_encoder.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+    port_st.format.video.nFrameWidth = low_config.width;
+    port_st.format.video.nFrameHeight = low_config.height;
+    port_st.format.video.nStride = low_config.width;
+    port_st.format.video.xFramerate = low_config.framerate << 16;
+    port_st.format.video.nBitrate = low_config.bitrate;
+    port_st.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
+    if ((error = OMX_SetParameter (low_encoder.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+
+    return set_h264_settings (&low_encoder, &low_config);
+}
+
+//Sets the port definitions of the camera and the encoders from
+//video_config. The ports have to be disabled. Returns 0 if the low layer
+//cannot be set up
+static int configure_ports (){
     //Configure camera port definition
     DEBUG_MSG("configuring %s port definition\n", camera.name);
     OMX_INIT_STRUCTURE (port_st);
@@ -690,10 +1000,10 @@ void omx_h264_init()
         exit (1);
     }
 
-    port_st.format.video.nFrameWidth = CAM_WIDTH;
-    port_st.format.video.nFrameHeight = CAM_HEIGHT;
-    port_st.format.video.nStride = CAM_WIDTH;
-    port_st.format.video.xFramerate = VIDEO_FRAMERATE << 16;
+    port_st.format.video.nFrameWidth = video_config.width;
+    port_st.format.video.nFrameHeight = video_config.height;
+    port_st.format.video.nStride = video_config.width;
+    port_st.format.video.xFramerate = video_config.framerate << 16;
     port_st.format.video.eCompressionFormat = OMX_VIDEO_CodingUnused;
     port_st.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
     if ((error = OMX_SetParameter (camera.handle, OMX_IndexParamPortDefinition,
@@ -730,9 +1040,6 @@ void omx_h264_init()
         exit (1);
     }
 
-    //Configure camera settings
-    set_camera_settings (&camera);
-
     //Configure encoder port definition
     DEBUG_MSG("configuring %s port definition\n", encoder.name);
     OMX_INIT_STRUCTURE (port_st);
@@ -743,12 +1050,13 @@ void omx_h264_init()
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
-    port_st.format.video.nFrameWidth = CAM_WIDTH;
-    port_st.format.video.nFrameHeight = CAM_HEIGHT;
-    port_st.format.video.nStride = CAM_WIDTH;
-    port_st.format.video.xFramerate = VIDEO_FRAMERATE << 16;
+    port_st.format.video.nFrameWidth = video_config.width;
+    port_st.format.video.nFrameHeight = video_config.height;
+    port_st.format.video.nStride = video_config.width;
+    port_st.format.video.xFramerate = video_config.framerate << 16;
     //Despite being configured later, these two fields need to be set
-    port_st.format.video.nBitrate = VIDEO_QP ? 0 : VIDEO_BITRATE;
+    port_st.format.video.nBitrate =
+        (video_config.qp_i || video_config.qp_p) ? 0 : video_config.bitrate;
     port_st.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
     if ((error = OMX_SetParameter (encoder.handle, OMX_IndexParamPortDefinition,
                     &port_st))){
@@ -758,55 +1066,408 @@ void omx_h264_init()
     }
 
     //Configure H264
-    set_h264_settings (&encoder);
+    if (!set_h264_settings (&encoder, &video_config))
+        exit (1);
+    encoder_bitrate = video_config.bitrate;
 
-    //Setup tunnels: camera (video) -> video_encode, camera (preview) -> null_sink
-    DEBUG_MSG("configuring tunnels\n");
-    if ((error = OMX_SetupTunnel (camera.handle, 71, encoder.handle, 200))){
-        DEBUG_ERR("error: OMX_SetupTunnel: %s\n",
+    if (simulcast && CAMERA_MOTION_GATING && !configure_splitter ())
+        return 0;
+    if (simulcast && !configure_low_layer ())
+        return 0;
+    if (CAMERA_MOTION_GATING)
+        configure_motion ();
+
+    return 1;
+}
+
+static void init_filled_buffers (){
+    int i;
+    for (i=0; i<STREAM_LAYERS; i++)
+        spsc_ring_init (&filled_buffers[i], filled_buffer_slots[i],
+                ENCODER_MAX_OUTPUT_BUFFERS);
+    spsc_ring_init (&motion_buffers_filled, motion_buffer_slots,
+            MOTION_BUFFERS);
+}
+
+//The port is not enabled until all the buffers are allocated
+static void enable_motion_port (){
+    OMX_INIT_STRUCTURE (port_st);
+    port_st.nPortIndex = 61;
+    if ((error = OMX_GetParameter (motion_resizer.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
-    if ((error = OMX_SetupTunnel (camera.handle, 70, null_sink.handle, 240))){
-        DEBUG_ERR("error: OMX_SetupTunnel: %s\n",
+    port_st.nBufferCountActual = MOTION_BUFFERS;
+    if ((error = OMX_SetParameter (motion_resizer.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_SetParameter: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+    //The resizer may have padded the stride and the buffer size
+    if ((error = OMX_GetParameter (motion_resizer.handle,
+                    OMX_IndexParamPortDefinition, &port_st))){
+        DEBUG_ERR("error: OMX_GetParameter: %s\n",
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
+    motion_stride = port_st.format.image.nStride;
 
-    //Change state to IDLE
-    change_state (&camera, OMX_StateIdle);
-    wait (&camera, EVENT_STATE_SET, 0);
-    change_state (&encoder, OMX_StateIdle);
-    wait (&encoder, EVENT_STATE_SET, 0);
-    change_state (&null_sink, OMX_StateIdle);
-    wait (&null_sink, EVENT_STATE_SET, 0);
+    enable_port (&motion_resizer, 61);
 
-    //Enable the ports
+    DEBUG_MSG("allocating %d %s output buffers\n", MOTION_BUFFERS,
+            motion_resizer.name);
+    int i;
+    for (i=0; i<MOTION_BUFFERS; i++){
+        if ((error = OMX_AllocateBuffer (motion_resizer.handle,
+                        &motion_buffers[i], 61, 0, port_st.nBufferSize))){
+            DEBUG_ERR("error: OMX_AllocateBuffer: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            exit (1);
+        }
+    }
+    motion_buffer_count = MOTION_BUFFERS;
+
+    wait (&motion_resizer, EVENT_PORT_ENABLE, 0);
+}
+
+//The port is not disabled until all the buffers are released
+static void disable_motion_port (){
+    disable_port (&motion_resizer, 61);
+
+    DEBUG_MSG("releasing %s output buffers\n", motion_resizer.name);
+    int i;
+    for (i=0; i<motion_buffer_count; i++){
+        if ((error = OMX_FreeBuffer (motion_resizer.handle, 61,
+                        motion_buffers[i]))){
+            DEBUG_ERR("error: OMX_FreeBuffer: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+            exit (1);
+        }
+    }
+    motion_buffer_count = 0;
+
+    wait (&motion_resizer, EVENT_PORT_DISABLE, 0);
+}
+
+static void fill_motion_buffer (OMX_BUFFERHEADERTYPE* buffer){
+    OMX_ERRORTYPE error;
+
+    if ((error = OMX_FillThisBuffer (motion_resizer.handle, buffer))){
+        DEBUG_ERR("error: OMX_FillThisBuffer: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+}
+
+//Enables the tunnels and the encoder output ports, in the order they have
+//to come up
+static void enable_ports (){
     enable_port (&camera, 71);
     wait (&camera, EVENT_PORT_ENABLE, 0);
     enable_port (&camera, 70);
     wait (&camera, EVENT_PORT_ENABLE, 0);
-    enable_port (&null_sink, 240);
-    wait (&null_sink, EVENT_PORT_ENABLE, 0);
+    if (simulcast && CAMERA_MOTION_GATING){
+        enable_port (&splitter, 250);
+        wait (&splitter, EVENT_PORT_ENABLE, 0);
+        enable_port (&splitter, 251);
+        wait (&splitter, EVENT_PORT_ENABLE, 0);
+        enable_port (&splitter, 252);
+        wait (&splitter, EVENT_PORT_ENABLE, 0);
+    }
+    if (simulcast){
+        enable_port (&resizer, 60);
+        wait (&resizer, EVENT_PORT_ENABLE, 0);
+        enable_port (&resizer, 61);
+        wait (&resizer, EVENT_PORT_ENABLE, 0);
+        enable_port (&low_encoder, 200);
+        wait (&low_encoder, EVENT_PORT_ENABLE, 0);
+        enable_encoder_output_port (&low_encoder, low_output_buffers,
+                &low_output_buffer_count, ENCODER_MAX_OUTPUT_BUFFERS);
+    }
+    if (CAMERA_MOTION_GATING){
+        enable_port (&motion_resizer, 60);
+        wait (&motion_resizer, EVENT_PORT_ENABLE, 0);
+        enable_motion_port ();
+    }
+    if (!simulcast && !CAMERA_MOTION_GATING){
+        enable_port (&null_sink, 240);
+        wait (&null_sink, EVENT_PORT_ENABLE, 0);
+    }
     enable_port (&encoder, 200);
     wait (&encoder, EVENT_PORT_ENABLE, 0);
-    enable_encoder_output_port (&encoder, &encoder_output_buffer);
+    enable_encoder_output_port (&encoder, encoder_output_buffers,
+            &encoder_output_buffer_count, 0);
+}
+
+//Disables what enable_ports() enabled and frees the encoder output buffers
+static void disable_ports (){
+    disable_port (&camera, 71);
+    wait (&camera, EVENT_PORT_DISABLE, 0);
+    disable_port (&camera, 70);
+    wait (&camera, EVENT_PORT_DISABLE, 0);
+    if (simulcast && CAMERA_MOTION_GATING){
+        disable_port (&splitter, 250);
+        wait (&splitter, EVENT_PORT_DISABLE, 0);
+        disable_port (&splitter, 251);
+        wait (&splitter, EVENT_PORT_DISABLE, 0);
+        disable_port (&splitter, 252);
+        wait (&splitter, EVENT_PORT_DISABLE, 0);
+    }
+    if (simulcast){
+        disable_port (&resizer, 60);
+        wait (&resizer, EVENT_PORT_DISABLE, 0);
+        disable_port (&resizer, 61);
+        wait (&resizer, EVENT_PORT_DISABLE, 0);
+        disable_port (&low_encoder, 200);
+        wait (&low_encoder, EVENT_PORT_DISABLE, 0);
+        disable_encoder_output_port (&low_encoder, low_output_buffers,
+                low_output_buffer_count);
+        low_output_buffer_count = 0;
+    }
+    if (CAMERA_MOTION_GATING){
+        disable_port (&motion_resizer, 60);
+        wait (&motion_resizer, EVENT_PORT_DISABLE, 0);
+        disable_motion_port ();
+    }
+    if (!simulcast && !CAMERA_MOTION_GATING){
+        disable_port (&null_sink, 240);
+        wait (&null_sink, EVENT_PORT_DISABLE, 0);
+    }
+    disable_port (&encoder, 200);
+    wait (&encoder, EVENT_PORT_DISABLE, 0);
+    disable_encoder_output_port (&encoder, encoder_output_buffers,
+            encoder_output_buffer_count);
+    init_filled_buffers ();
+}
+
+//Hands every output buffer to the encoders, they are given back one by one
+//with release_frame_buffer() once sent. The motion thread gives back the
+//motion resizer buffers
+static void queue_output_buffers (){
+    int i;
+    for (i=0; i<encoder_output_buffer_count; i++)
+        release_frame_buffer (encoder_output_buffers[i]);
+    for (i=0; i<low_output_buffer_count; i++)
+        release_frame_buffer (low_output_buffers[i]);
+    for (i=0; i<motion_buffer_count; i++)
+        fill_motion_buffer (motion_buffers[i]);
+}
+
+static void change_pipeline_state (OMX_STATETYPE state){
+    int i;
+    for (i=0; i<pipeline_size; i++){
+        change_state (pipeline[i], state);
+        wait (pipeline[i], EVENT_STATE_SET, 0);
+    }
+}
+
+//Returns 0 on failure
+static int setup_tunnel (
+        component_t* output,
+        OMX_U32 output_port,
+        component_t* input,
+        OMX_U32 input_port){
+    if ((error = OMX_SetupTunnel (output->handle, output_port, input->handle,
+                    input_port))){
+        DEBUG_ERR("error: OMX_SetupTunnel: %s\n",
+                dump_OMX_ERRORTYPE (error));
+        return 0;
+    }
+    tunnel_components[tunnel_end_count] = output;
+    tunnel_ports[tunnel_end_count++] = output_port;
+    tunnel_components[tunnel_end_count] = input;
+    tunnel_ports[tunnel_end_count++] = input_port;
+
+    return 1;
+}
+
+//Creates the components of the pipeline, configures them and sets up the
+//tunnels, all in LOADED. Returns 0 if the low layer cannot be set up, the
+//rest exits on failure
+static int load_pipeline (){
+    pipeline_size = 0;
+    pipeline[pipeline_size++] = &camera;
+    pipeline[pipeline_size++] = &encoder;
+    if (simulcast && CAMERA_MOTION_GATING)
+        pipeline[pipeline_size++] = &splitter;
+    if (simulcast){
+        pipeline[pipeline_size++] = &resizer;
+        pipeline[pipeline_size++] = &low_encoder;
+    }
+    if (CAMERA_MOTION_GATING)
+        pipeline[pipeline_size++] = &motion_resizer;
+    if (!simulcast && !CAMERA_MOTION_GATING)
+        pipeline[pipeline_size++] = &null_sink;
+    components_loaded = 0;
+    tunnel_end_count = 0;
+
+    //Initialize components
+    int i;
+    for (i=0; i<pipeline_size; i++){
+        if (!init_component (pipeline[i]))
+            return 0;
+        components_loaded++;
+    }
+
+    //Initialize camera drivers
+    load_camera_drivers (&camera);
+
+    //Configure camera settings
+    set_camera_settings (&camera);
+
+    if (!configure_ports ())
+        return 0;
+
+    //Setup tunnels: camera (video) -> video_encode. camera (preview) ->
+    //resize -> video_encode for the low layer and -> resize for the motion
+    //thread, through video_splitter with both, or -> null_sink with neither
+    DEBUG_MSG("configuring tunnels\n");
+    if (!setup_tunnel (&camera, 71, &encoder, 200))
+        return 0;
+    if (simulcast && CAMERA_MOTION_GATING){
+        if (!setup_tunnel (&camera, 70, &splitter, 250)
+                || !setup_tunnel (&splitter, 251, &resizer, 60)
+                || !setup_tunnel (&splitter, 252, &motion_resizer, 60))
+            return 0;
+    }else if (simulcast){
+        if (!setup_tunnel (&camera, 70, &resizer, 60))
+            return 0;
+    }else if (CAMERA_MOTION_GATING){
+        if (!setup_tunnel (&camera, 70, &motion_resizer, 60))
+            return 0;
+    }else{
+        if (!setup_tunnel (&camera, 70, &null_sink, 240))
+            return 0;
+    }
+    if (simulcast && !setup_tunnel (&resizer, 61, &low_encoder, 200))
+        return 0;
+
+    return 1;
+}
+
+//Undoes a load_pipeline() that failed, the components are still in LOADED
+static void unload_pipeline (){
+    int i;
+    for (i=0; i<tunnel_end_count; i++){
+        if ((error = OMX_SetupTunnel (tunnel_components[i]->handle,
+                        tunnel_ports[i], 0, 0))){
+            DEBUG_ERR("error: OMX_SetupTunnel: %s\n",
+                    dump_OMX_ERRORTYPE (error));
+        }
+    }
+    tunnel_end_count = 0;
+    for (i=0; i<components_loaded; i++)
+        deinit_component (pipeline[i]);
+    components_loaded = 0;
+}
+
+//Loads the pipeline again without the low layer, which failed to set up.
+//The components have to be in LOADED
+static void reload_without_low_layer (){
+    DEBUG_ERR("the low layer cannot be set up, streaming the main layer "
+            "alone\n");
+    unload_pipeline ();
+    simulcast = 0;
+    if (!load_pipeline ())
+        exit (1);
+}
+
+static void* motion_main (void* arg);
+
+void omx_h264_init()
+{
+    strncpy(camera_name, "OMX.broadcom.camera", strlen("OMX.broadcom.camera"));
+    strncpy(encoder_name, "OMX.broadcom.video_encode", strlen("OMX.broadcom.video_encode"));
+    strncpy(null_sink_name, "OMX.broadcom.null_sink", strlen("OMX.broadcom.null_sink"));
+    strncpy(resizer_name, "OMX.broadcom.resize", strlen("OMX.broadcom.resize"));
+    strncpy(low_encoder_name, "OMX.broadcom.video_encode", strlen("OMX.broadcom.video_encode"));
+    strncpy(splitter_name, "OMX.broadcom.video_splitter", strlen("OMX.broadcom.video_splitter"));
+    strncpy(motion_resizer_name, "OMX.broadcom.resize", strlen("OMX.broadcom.resize"));
+
+    camera.name = &camera_name[0];
+    encoder.name = &encoder_name[0];
+    null_sink.name = &null_sink_name[0];
+    resizer.name = &resizer_name[0];
+    low_encoder.name = &low_encoder_name[0];
+    splitter.name = &splitter_name[0];
+    motion_resizer.name = &motion_resizer_name[0];
+
+    simulcast = CAMERA_SIMULCAST;
+
+    init_filled_buffers ();
+    sem_init (&motion_sem, 0, 0);
+    motion_init (&motion);
+    requested_bitrate = 0;
+    stats_set (STAT_MOTION_SCORE, 0);
+    stats_set (STAT_MOTION_IDLE, 0);
+    
+    //Initialize Broadcom's VideoCore APIs
+    bcm_host_init ();
+
+    //Initialize OpenMAX IL
+    if ((error = OMX_Init ())){
+        DEBUG_ERR("error: OMX_Init: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+
+    //Without the low layer the main one still streams, the clients are told
+    //through omx_h264_layer_count()
+    if (!load_pipeline ()){
+        if (!simulcast)
+            exit (1);
+        reload_without_low_layer ();
+    }
+
+    //Change state to IDLE
+    change_pipeline_state (OMX_StateIdle);
+
+    //Enable the ports
+    enable_ports ();
 
     //Change state to EXECUTING
-    change_state (&camera, OMX_StateExecuting);
-    wait (&camera, EVENT_STATE_SET, 0);
-    change_state (&encoder, OMX_StateExecuting);
-    wait (&encoder, EVENT_STATE_SET, 0);
+    change_pipeline_state (OMX_StateExecuting);
     wait (&encoder, EVENT_PORT_SETTINGS_CHANGED, 0);
-    change_state (&null_sink, OMX_StateExecuting);
-    wait (&null_sink, EVENT_STATE_SET, 0);
+    if (simulcast)
+        wait (&low_encoder, EVENT_PORT_SETTINGS_CHANGED, 0);
+
+    queue_output_buffers ();
+
+    //The components stay in EXECUTING from now on. Frames only flow while the
+    //capture port is enabled, see omx_h264_start_capture()
+    OMX_INIT_STRUCTURE (capture_st);
+    capture_st.nPortIndex = 71;
+    capture_st.bEnabled = OMX_FALSE;
+    pipeline_loaded = 1;
+
+    if (CAMERA_MOTION_GATING){
+        motion_running = 1;
+        if (pthread_create (&motion_thread, 0, motion_main, 0)){
+            DEBUG_ERR("error: pthread_create\n");
+            exit (1);
+        }
+    }
+}
+
+void omx_h264_start_capture()
+{
+    if (capture_st.bEnabled)
+        return;
+
+    //Frames encoded before the last stop are stale, give them back
+    OMX_BUFFERHEADERTYPE* stale;
+    int i;
+    for (i=0; i<STREAM_LAYERS; i++)
+        while ((stale = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                        &filled_buffers[i])))
+            release_frame_buffer (stale);
 
     //Enable camera capture port. This basically says that the port 71 will be
     //used to get data from the camera. If you're capturing a still, the port 72
     //must be used
     DEBUG_MSG("enabling %s capture port\n", camera.name);
-    OMX_INIT_STRUCTURE (capture_st);
-    capture_st.nPortIndex = 71;
     capture_st.bEnabled = OMX_TRUE;
     if ((error = OMX_SetConfig (camera.handle, OMX_IndexConfigPortCapturing,
                     &capture_st))){
@@ -815,9 +1476,13 @@ void omx_h264_init()
     }
 }
 
-void omx_h264_deinit()
+void omx_h264_stop_capture()
 {
-    //Disable camera capture port
+    if (!capture_st.bEnabled)
+        return;
+
+    //Pause the camera, the rest of the pipeline stays in EXECUTING so the next
+    //session only has to wait for one frame interval
     DEBUG_MSG("disabling %s capture port\n", camera.name);
     capture_st.bEnabled = OMX_FALSE;
     if ((error = OMX_SetConfig (camera.handle, OMX_IndexConfigPortCapturing,
@@ -825,38 +1490,32 @@ void omx_h264_deinit()
         DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
         exit (1);
     }
+}
+
+void omx_h264_deinit()
+{
+    //Disable camera capture port
+    omx_h264_stop_capture();
+
+    if (CAMERA_MOTION_GATING){
+        __atomic_store_n (&motion_running, 0, __ATOMIC_RELEASE);
+        sem_post (&motion_sem);
+        pthread_join (motion_thread, 0);
+    }
 
     //Change state to IDLE
-    change_state (&camera, OMX_StateIdle);
-    wait (&camera, EVENT_STATE_SET, 0);
-    change_state (&encoder, OMX_StateIdle);
-    wait (&encoder, EVENT_STATE_SET, 0);
-    change_state (&null_sink, OMX_StateIdle);
-    wait (&null_sink, EVENT_STATE_SET, 0);
+    change_pipeline_state (OMX_StateIdle);
 
     //Disable the tunnel ports
-    disable_port (&camera, 71);
-    wait (&camera, EVENT_PORT_DISABLE, 0);
-    disable_port (&camera, 70);
-    wait (&camera, EVENT_PORT_DISABLE, 0);
-    disable_port (&null_sink, 240);
-    wait (&null_sink, EVENT_PORT_DISABLE, 0);
-    disable_port (&encoder, 200);
-    wait (&encoder, EVENT_PORT_DISABLE, 0);
-    disable_encoder_output_port (&encoder, encoder_output_buffer);
+    disable_ports ();
 
     //Change state to LOADED
-    change_state (&camera, OMX_StateLoaded);
-    wait (&camera, EVENT_STATE_SET, 0);
-    change_state (&encoder, OMX_StateLoaded);
-    wait (&encoder, EVENT_STATE_SET, 0);
-    change_state (&null_sink, OMX_StateLoaded);
-    wait (&null_sink, EVENT_STATE_SET, 0);
+    change_pipeline_state (OMX_StateLoaded);
 
     //Deinitialize components
-    deinit_component (&camera);
-    deinit_component (&encoder);
-    deinit_component (&null_sink);
+    int i;
+    for (i=0; i<pipeline_size; i++)
+        deinit_component (pipeline[i]);
 
     //Deinitialize OpenMAX IL
     if ((error = OMX_Deinit ())){
@@ -866,19 +1525,352 @@ void omx_h264_deinit()
 
     //Deinitialize Broadcom's VideoCore APIs
     bcm_host_deinit ();
+    sem_destroy (&motion_sem);
+    pipeline_loaded = 0;
 }
 
 OMX_BUFFERHEADERTYPE* fill_frame_buffer()
 {
-    //Get the buffer data
-    if ((error = OMX_FillThisBuffer (encoder.handle, encoder_output_buffer))){
+    OMX_BUFFERHEADERTYPE* buffer;
+
+    //Wait until an encoder has filled one of the queued buffers
+    while (!(buffer = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                    &filled_buffers[LAYER_MAIN]))
+            && !(buffer = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                    &filled_buffers[LAYER_LOW])))
+        wait (&encoder, EVENT_FILL_BUFFER_DONE, 0);
+
+    return buffer;
+}
+
+OMX_BUFFERHEADERTYPE* take_frame_buffer()
+{
+    OMX_BUFFERHEADERTYPE* buffer;
+
+    if (!(buffer = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                    &filled_buffers[LAYER_MAIN])))
+        buffer = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                &filled_buffers[LAYER_LOW]);
+
+    return buffer;
+}
+
+void release_frame_buffer(OMX_BUFFERHEADERTYPE* buffer)
+{
+    //Called from the sender thread too, so don't use the shared error
+    OMX_ERRORTYPE error;
+
+    //Queue the buffer to its encoder again
+    component_t* owner =
+        frame_buffer_layer (buffer) == LAYER_LOW ? &low_encoder : &encoder;
+    if ((error = OMX_FillThisBuffer (owner->handle, buffer))){
         DEBUG_ERR("error: OMX_FillThisBuffer: %s\n",
                 dump_OMX_ERRORTYPE (error));
         exit (1);
     }
+}
+
+int64_t frame_buffer_timestamp_us(OMX_BUFFERHEADERTYPE* buffer)
+{
+    //nTimeStamp is in microseconds, split in two halves with OMX_SKIP64BIT
+#ifdef OMX_SKIP64BIT
+    return ((int64_t)buffer->nTimeStamp.nHighPart << 32)
+        | buffer->nTimeStamp.nLowPart;
+#else
+    return buffer->nTimeStamp;
+#endif
+}
+
+uint64_t frame_buffer_ready_us(OMX_BUFFERHEADERTYPE* buffer)
+{
+    return buffer_ready_us[(intptr_t)buffer->pAppPrivate];
+}
+
+int frame_buffer_layer(OMX_BUFFERHEADERTYPE* buffer)
+{
+    return (intptr_t)buffer->pAppPrivate < ENCODER_MAX_OUTPUT_BUFFERS
+        ? LAYER_MAIN : LAYER_LOW;
+}
+
+void omx_h264_get_config(video_config_t* config)
+{
+    *config = video_config;
+}
+
+int omx_h264_config_needs_restart(video_config_t* config)
+{
+    //Only the bitrate, the framerate and the IDR period are live settings
+    return (pipeline_loaded
+            && (config->width != video_config.width
+                || config->height != video_config.height
+                || config->qp_i != video_config.qp_i
+                || config->qp_p != video_config.qp_p
+                || config->profile != video_config.profile
+                || config->refresh_period != video_config.refresh_period));
+}
+
+static void set_encoder_bitrate(int bitrate)
+{
+    OMX_ERRORTYPE error;
+
+    OMX_VIDEO_CONFIG_BITRATETYPE bitrate_st;
+    OMX_INIT_STRUCTURE (bitrate_st);
+    bitrate_st.nPortIndex = 201;
+    bitrate_st.nEncodeBitrate = bitrate;
+    if ((error = OMX_SetConfig (encoder.handle, OMX_IndexConfigVideoBitrate,
+                    &bitrate_st))){
+        DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+    encoder_bitrate = bitrate;
+}
+
+static void set_idr_period(component_t* component, int idr_period)
+{
+    OMX_ERRORTYPE error;
+
+    OMX_VIDEO_CONFIG_AVCINTRAPERIOD idr_st;
+    OMX_INIT_STRUCTURE (idr_st);
+    idr_st.nPortIndex = 201;
+    if ((error = OMX_GetConfig (component->handle,
+                    OMX_IndexConfigVideoAVCIntraPeriod, &idr_st))){
+        DEBUG_ERR("error: OMX_GetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+    idr_st.nIDRPeriod = idr_period;
+    if ((error = OMX_SetConfig (component->handle,
+                    OMX_IndexConfigVideoAVCIntraPeriod, &idr_st))){
+        DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+}
+
+static void set_framerate(component_t* component, OMX_U32 port, int framerate)
+{
+    OMX_ERRORTYPE error;
+
+    OMX_CONFIG_FRAMERATETYPE rate_st;
+    OMX_INIT_STRUCTURE (rate_st);
+    rate_st.nPortIndex = port;
+    rate_st.xEncodeFramerate = framerate << 16;
+    if ((error = OMX_SetConfig (component->handle,
+                    OMX_IndexConfigVideoFramerate, &rate_st))){
+        DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+}
+
+//Framerate of the capture port and the main encoder, the idle one while the
+//scene is still. Needs encoder_lock
+static int gated_framerate()
+{
+    if (motion.idle && MOTION_IDLE_FRAMERATE < video_config.framerate)
+        return MOTION_IDLE_FRAMERATE;
 
-    //Wait until it's filled
-    wait (&encoder, EVENT_FILL_BUFFER_DONE, 0);
+    return video_config.framerate;
+}
+
+//Runs the encoder at the last omx_h264_set_bitrate() under the configured
+//bitrate, and under MOTION_IDLE_BITRATE while the scene is still. Needs
+//encoder_lock
+static void update_encoder_bitrate()
+{
+    int bitrate = requested_bitrate;
+
+    if (!bitrate || bitrate > video_config.bitrate)
+        bitrate = video_config.bitrate;
+    if (motion.idle && bitrate > MOTION_IDLE_BITRATE)
+        bitrate = MOTION_IDLE_BITRATE;
+    if (bitrate == encoder_bitrate)
+        return;
+
+    DEBUG_MSG("encoder bitrate %d -> %d\n", encoder_bitrate, bitrate);
+    set_encoder_bitrate (bitrate);
+}
+
+//Needs encoder_lock
+static void set_live_config(video_config_t* config)
+{
+    video_config_t previous = video_config;
+
+    video_config = *config;
+
+    if (config->bitrate != previous.bitrate
+            && !config->qp_i && !config->qp_p)
+        update_encoder_bitrate ();
+
+    if (config->framerate != previous.framerate){
+        //The camera sets the pace, the encoder rate control follows it. The
+        //preview port and the low layer keep the configured rate while the
+        //motion gate holds the rest back
+        set_framerate (&camera, 71, gated_framerate ());
+        set_framerate (&camera, 70, config->framerate);
+        set_framerate (&encoder, 201, gated_framerate ());
+        if (simulcast)
+            set_framerate (&low_encoder, 201, config->framerate);
+    }
 
-    return encoder_output_buffer;
+    if (config->idr_period != previous.idr_period){
+        set_idr_period (&encoder, config->idr_period);
+        if (simulcast)
+            set_idr_period (&low_encoder, config->idr_period);
+    }
+}
+
+int omx_h264_set_config(video_config_t* config)
+{
+    if (!pipeline_loaded){
+        video_config = *config;
+        return VIDEO_CONFIG_STORED;
+    }
+
+    pthread_mutex_lock (&encoder_lock);
+    if (!omx_h264_config_needs_restart (config)){
+        set_live_config (config);
+        pthread_mutex_unlock (&encoder_lock);
+        return VIDEO_CONFIG_LIVE;
+    }
+
+    //Partial restart: the components stay in EXECUTING and the camera drivers
+    //loaded, only the ports are cycled
+    DEBUG_MSG("reconfiguring %s and %s ports\n", camera.name, encoder.name);
+    OMX_BOOL capturing = capture_st.bEnabled;
+    omx_h264_stop_capture ();
+
+    video_config_t previous = video_config;
+    int result = VIDEO_CONFIG_RESTART;
+    disable_ports ();
+    video_config = *config;
+    //The ports come back at the configured rates
+    motion_init (&motion);
+    stats_set (STAT_MOTION_IDLE, 0);
+    if (!configure_ports ()){
+        //The low layer refused the config, the ports go back to the old one
+        DEBUG_ERR("the low layer cannot take the config, keeping the old "
+                "one\n");
+        video_config = previous;
+        result = VIDEO_CONFIG_FAILED;
+        if (!configure_ports ()){
+            //Not even that, the main layer goes on alone like after a
+            //failed omx_h264_init()
+            change_pipeline_state (OMX_StateIdle);
+            change_pipeline_state (OMX_StateLoaded);
+            reload_without_low_layer ();
+            change_pipeline_state (OMX_StateIdle);
+            enable_ports ();
+            change_pipeline_state (OMX_StateExecuting);
+            wait (&encoder, EVENT_PORT_SETTINGS_CHANGED, 0);
+        }else
+            enable_ports ();
+    }else
+        enable_ports ();
+
+    queue_output_buffers ();
+    pthread_mutex_unlock (&encoder_lock);
+
+    if (capturing)
+        omx_h264_start_capture ();
+
+    return result;
+}
+
+void omx_h264_set_bitrate(int bitrate)
+{
+    if (!pipeline_loaded || video_config.qp_i || video_config.qp_p)
+        return;
+
+    pthread_mutex_lock (&encoder_lock);
+    requested_bitrate = bitrate;
+    update_encoder_bitrate ();
+    pthread_mutex_unlock (&encoder_lock);
+}
+
+//Moves the capture port and the main encoder to the rates gated_framerate()
+//and update_encoder_bitrate() want. Needs encoder_lock
+static void apply_motion_gate()
+{
+    DEBUG_MSG("scene %s, capturing at %d fps\n",
+            motion.idle ? "still" : "moves again", gated_framerate ());
+    set_framerate (&camera, 71, gated_framerate ());
+    set_framerate (&encoder, 201, gated_framerate ());
+    if (!video_config.qp_i && !video_config.qp_p)
+        update_encoder_bitrate ();
+}
+
+//Scores the frames of the motion resizer and gives them back. The gate
+//waits on the VideoCore, which the ILCS thread of fill_buffer_done() must
+//not
+static void* motion_main(void* arg)
+{
+    OMX_BUFFERHEADERTYPE* buffer;
+
+    for (;;){
+        while (sem_wait (&motion_sem) < 0 && errno == EINTR);
+        if (!__atomic_load_n (&motion_running, __ATOMIC_ACQUIRE))
+            break;
+
+        //The ports only cycle under the lock, and that empties the ring
+        pthread_mutex_lock (&encoder_lock);
+        while ((buffer = (OMX_BUFFERHEADERTYPE*)spsc_ring_pop (
+                        &motion_buffers_filled))){
+            if (buffer->nFilledLen >= (OMX_U32)(motion_stride*MOTION_HEIGHT)){
+                if (motion_update (&motion, buffer->pBuffer + buffer->nOffset,
+                            motion_stride, get_time_us ())){
+                    apply_motion_gate ();
+                    stats_set (STAT_MOTION_IDLE, motion.idle);
+                }
+                stats_set (STAT_MOTION_SCORE, motion.score);
+            }
+            fill_motion_buffer (buffer);
+        }
+        pthread_mutex_unlock (&encoder_lock);
+    }
+
+    return 0;
+}
+
+static void request_idr(component_t* component)
+{
+    OMX_ERRORTYPE error;
+
+    OMX_CONFIG_PORTBOOLEANTYPE idr_st;
+    OMX_INIT_STRUCTURE (idr_st);
+    idr_st.nPortIndex = 201;
+    idr_st.bEnabled = OMX_TRUE;
+    if ((error = OMX_SetConfig (component->handle,
+                    OMX_IndexConfigBrcmVideoRequestIFrame, &idr_st))){
+        DEBUG_ERR("error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+        exit (1);
+    }
+}
+
+void omx_h264_request_idr()
+{
+    if (!pipeline_loaded)
+        return;
+
+    request_idr (&encoder);
+    if (simulcast)
+        request_idr (&low_encoder);
+}
+
+int omx_h264_layer_count()
+{
+    return simulcast ? STREAM_LAYERS : 1;
+}
+
+int omx_h264_pending_buffers()
+{
+    return spsc_ring_count (&filled_buffers[LAYER_MAIN])
+        + spsc_ring_count (&filled_buffers[LAYER_LOW]);
+}
+
+void omx_h264_set_frame_notify(int fd)
+{
+    frame_notify_fd = fd;
+}
+
+void omx_h264_set_buffer_ready(int fd)
+{
+    buffer_ready_fd = fd;
 }
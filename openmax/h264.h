@@ -13,6 +13,9 @@
 
 #include "dump.h"
 #include "../common_util/common_util.h"
+#include "../common_util/spsc_ring.h"
+#include "../source/frame_source.h"
+#include "../source/motion.h"
 
 #define OMX_INIT_STRUCTURE(x) \
   memset (&(x), 0, sizeof (x)); \
@@ -23,21 +26,38 @@
   (x).nVersion.s.nRevision = OMX_VERSION_REVISION; \
   (x).nVersion.s.nStep = OMX_VERSION_STEP
 
-#define VIDEO_FRAMERATE 10
-#define VIDEO_BITRATE 140000
-#define VIDEO_IDR_PERIOD 1
+//Number of encoder output buffers kept queued to the encoder. More buffers
+//let encoding overlap with sending, the encoder may raise it to its minimum.
+//A frame bigger than nBufferSize comes in several of them, up to
+//FRAME_MAX_BUFFERS are held by the frame being assembled
+#define ENCODER_OUTPUT_BUFFERS 8
+#define ENCODER_MAX_OUTPUT_BUFFERS 16 //power of two
+
+//Simulcast: the camera preview port goes through OMX.broadcom.resize into a
+//second encoder, which makes the low layer (see VIDEO_LOW_SCALE). 0 leaves
+//the preview port on a null_sink. Off until the graph has run on a Pi
+#define CAMERA_SIMULCAST 0
+//Motion gating (see source/motion.h): the preview port also goes through an
+//OMX.broadcom.resize down to MOTION_WIDTH x MOTION_HEIGHT, whose output
+//buffers a thread of its own scores and gives back. While the scene is
+//still the capture port and the encoder run at the idle rate, the preview
+//port keeps the configured one. With simulcast an OMX.broadcom.video_splitter
+//feeds both resizers. 0 leaves it out. Off until it has run on a Pi
+#define CAMERA_MOTION_GATING 0
+#define MOTION_BUFFERS 4 //power of two
+
+//Framerate, bitrate, IDR period and size default to the VIDEO_ defines of
+//frame_source.h
 #define VIDEO_SEI OMX_FALSE
 #define VIDEO_EEDE OMX_FALSE
 #define VIDEO_EEDE_LOSS_RATE 0
 #define VIDEO_QP OMX_FALSE
 #define VIDEO_QP_I 0 //1 .. 51, 0 means off
 #define VIDEO_QP_P 0 //1 .. 51, 0 means off
-#define VIDEO_PROFILE OMX_VIDEO_AVCProfileBaseline
+#define VIDEO_PROFILE VIDEO_PROFILE_BASELINE
 #define VIDEO_INLINE_HEADERS OMX_FALSE
 
 //Some settings doesn't work well
-#define CAM_WIDTH 320
-#define CAM_HEIGHT 240
 #define CAM_SHARPNESS 0 //-100 .. 100
 #define CAM_CONTRAST 0 //-100 .. 100
 #define CAM_BRIGHTNESS 50 //0 .. 100
@@ -138,9 +158,9 @@ CAM_DRC
   OMX_DynRangeExpHigh
 
 VIDEO_PROFILE
-  OMX_VIDEO_AVCProfileHigh
-  OMX_VIDEO_AVCProfileBaseline
-  OMX_VIDEO_AVCProfileMain
+  VIDEO_PROFILE_HIGH
+  VIDEO_PROFILE_BASELINE
+  VIDEO_PROFILE_MAIN
 */
 
 //Data of each component
@@ -153,6 +173,8 @@ typedef struct {
   VCOS_EVENT_FLAGS_T flags;
   //The fullname of the component
   OMX_STRING name;
+  //Cyclic intra refresh was set on the output port of this encoder handle
+  int intra_refresh;
 } component_t;
 
 //Events used with vcos_event_flags_get() and vcos_event_flags_set()
@@ -190,23 +212,65 @@ void wait (
     component_t* component,
     VCOS_UNSIGNED events,
     VCOS_UNSIGNED* retrieved_events);
-void init_component (component_t* component);
+//0 if the component cannot be created
+int init_component (component_t* component);
 void deinit_component (component_t* component);
 void load_camera_drivers (component_t* component);
 void change_state (component_t* component, OMX_STATETYPE state);
 void enable_port (component_t* component, OMX_U32 port);
 void disable_port (component_t* component, OMX_U32 port);
+//pAppPrivate of each buffer is first_index plus its index
 void enable_encoder_output_port (
     component_t* encoder,
-    OMX_BUFFERHEADERTYPE** encoder_output_buffer);
+    OMX_BUFFERHEADERTYPE** encoder_output_buffers,
+    int* encoder_output_buffer_count,
+    int first_index);
 void disable_encoder_output_port (
     component_t* encoder,
-    OMX_BUFFERHEADERTYPE* encoder_output_buffer);
+    OMX_BUFFERHEADERTYPE** encoder_output_buffers,
+    int encoder_output_buffer_count);
 void set_camera_settings (component_t* camera);
-void set_h264_settings (component_t* encoder);
+//0 on failure
+int set_h264_settings (component_t* encoder, video_config_t* config);
 
 void omx_h264_init();
+void omx_h264_start_capture();
+void omx_h264_stop_capture();
 void omx_h264_deinit();
 OMX_BUFFERHEADERTYPE* fill_frame_buffer();
+//A filled buffer without waiting, 0 if there is none
+OMX_BUFFERHEADERTYPE* take_frame_buffer();
+void release_frame_buffer(OMX_BUFFERHEADERTYPE* buffer);
+int64_t frame_buffer_timestamp_us(OMX_BUFFERHEADERTYPE* buffer);
+//Monotonic time fill_buffer_done() got the buffer
+uint64_t frame_buffer_ready_us(OMX_BUFFERHEADERTYPE* buffer);
+//LAYER_MAIN or LAYER_LOW, by the encoder the buffer belongs to
+int frame_buffer_layer(OMX_BUFFERHEADERTYPE* buffer);
+void omx_h264_get_config(video_config_t* config);
+//Non zero if the config can only be applied by reconfiguring the ports. The
+//encoder output buffers are freed then, so every frame has to be given back
+//with release_frame_buffer() before omx_h264_set_config()
+int omx_h264_config_needs_restart(video_config_t* config);
+//VIDEO_CONFIG_FAILED if the low layer refuses the config, the old one is
+//kept. If the low layer can't take that one either it is dropped, see
+//omx_h264_layer_count()
+int omx_h264_set_config(video_config_t* config);
+//Changes the encoder target without touching the configured bitrate, which
+//stays the ceiling, 0 goes back to it. Ignored while the pipeline isn't loaded or with fixed QPs
+void omx_h264_set_bitrate(int bitrate);
+//Makes the next frame of both encoders an IDR
+void omx_h264_request_idr();
+//1 if CAMERA_SIMULCAST is off or the last omx_h264_init() or
+//omx_h264_set_config() could not set up the low layer
+int omx_h264_layer_count();
+//Encoder output buffers filled and not yet taken by fill_frame_buffer(), of
+//both encoders
+int omx_h264_pending_buffers();
+//eventfd fill_buffer_done() signals, -1 for none
+void omx_h264_set_frame_notify(int fd);
+//eventfd fill_buffer_done() signals instead of the encoder event flags,
+//the buffers are then taken with take_frame_buffer(). -1 for none. Set
+//before omx_h264_init()
+void omx_h264_set_buffer_ready(int fd);
 
 #endif
@@ -0,0 +1,155 @@
+#include "h264.h"
+
+#include <limits.h>
+
+//The camera and the hardware encoder behind the frame_source_t interface.
+//With record=<path> the main layer is written to path as it leaves the
+//encoder, and a line per buffer to path.trace with its nFilledLen and
+//nFlags, for the trace= option of the file source
+
+//Indexed like pAppPrivate, the low layer encoder after the main one
+static source_buffer_t buffers[STREAM_LAYERS*ENCODER_MAX_OUTPUT_BUFFERS];
+//nTimeStamp runs on the VideoCore clock. It is moved onto the monotonic
+//clock with the smallest ready - capture difference seen since the capture
+//started, of both layers as they share the camera clock. So the encode stage
+//of the latency trace is the delay above the fastest frame rather than the
+//absolute one
+static int64_t capture_offset_us;
+static int capture_offset_valid;
+static const char* record_path;
+static FILE* record_file;
+static FILE* record_trace;
+
+static int omx_open(int argc, char** argv)
+{
+    int i;
+
+    for(i = 0; i < argc; i++)
+    {
+        if(!strncmp(argv[i], "record=", 7))
+            record_path = argv[i] + 7;
+        else
+            return 0;
+    }
+
+    return 1;
+}
+
+static void record_buffer(OMX_BUFFERHEADERTYPE* frame_buffer)
+{
+    fwrite(frame_buffer->pBuffer + frame_buffer->nOffset, 1,
+           frame_buffer->nFilledLen, record_file);
+    fprintf(record_trace, "%u %x\n", (unsigned)frame_buffer->nFilledLen
+            , (unsigned)frame_buffer->nFlags);
+}
+
+//Only the stream thread gets here
+static source_buffer_t* to_source_buffer(OMX_BUFFERHEADERTYPE* frame_buffer)
+{
+    source_buffer_t* buffer = &buffers[(intptr_t)frame_buffer->pAppPrivate];
+
+    buffer->data = frame_buffer->pBuffer + frame_buffer->nOffset;
+    buffer->len = frame_buffer->nFilledLen;
+    buffer->timestamp_us = frame_buffer_timestamp_us(frame_buffer);
+    buffer->ready_us = frame_buffer_ready_us(frame_buffer);
+
+    int64_t offset_us = (int64_t)buffer->ready_us - buffer->timestamp_us;
+    if(!capture_offset_valid || offset_us < capture_offset_us)
+    {
+        capture_offset_us = offset_us;
+        capture_offset_valid = 1;
+    }
+    buffer->capture_us = buffer->timestamp_us + capture_offset_us;
+    buffer->end_of_frame = !!(frame_buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME);
+    buffer->keyframe = !!(frame_buffer->nFlags & OMX_BUFFERFLAG_SYNCFRAME);
+    buffer->codec_config =
+        !!(frame_buffer->nFlags & OMX_BUFFERFLAG_CODECCONFIG);
+    buffer->layer = frame_buffer_layer(frame_buffer);
+    buffer->opaque = frame_buffer;
+
+    if(record_file && buffer->layer == LAYER_MAIN)
+        record_buffer(frame_buffer);
+
+    return buffer;
+}
+
+static source_buffer_t* omx_fill_buffer()
+{
+    return to_source_buffer(fill_frame_buffer());
+}
+
+static source_buffer_t* omx_take_buffer()
+{
+    OMX_BUFFERHEADERTYPE* frame_buffer = take_frame_buffer();
+
+    return frame_buffer ? to_source_buffer(frame_buffer) : 0;
+}
+
+static int omx_set_buffer_ready(int fd)
+{
+    omx_h264_set_buffer_ready(fd);
+    return 1;
+}
+
+static void omx_init()
+{
+    char trace_path[PATH_MAX];
+
+    if(record_path)
+    {
+        snprintf(trace_path, sizeof(trace_path), "%s.trace", record_path);
+        if(!(record_file = fopen(record_path, "wb"))
+           || !(record_trace = fopen(trace_path, "w")))
+        {
+            DEBUG_ERR("can't create %s\n", record_file ? trace_path
+                      : record_path);
+            exit(1);
+        }
+    }
+    omx_h264_init();
+}
+
+static void omx_deinit()
+{
+    omx_h264_deinit();
+    if(record_file)
+    {
+        fclose(record_file);
+        fclose(record_trace);
+        record_file = 0;
+        record_trace = 0;
+    }
+}
+
+static void omx_start_capture()
+{
+    //The camera may start its timestamps over
+    capture_offset_valid = 0;
+    omx_h264_start_capture();
+}
+
+static void omx_release_buffer(source_buffer_t* buffer)
+{
+    release_frame_buffer((OMX_BUFFERHEADERTYPE*)buffer->opaque);
+}
+
+frame_source_t omx_source = {
+    "camera",
+    omx_open,
+    omx_init,
+    omx_deinit,
+    omx_start_capture,
+    omx_h264_stop_capture,
+    omx_fill_buffer,
+    omx_release_buffer,
+    omx_h264_get_config,
+    omx_h264_config_needs_restart,
+    omx_h264_set_config,
+    omx_h264_set_bitrate,
+    omx_h264_request_idr,
+    omx_h264_layer_count,
+    omx_h264_pending_buffers,
+    omx_h264_set_frame_notify,
+    omx_set_buffer_ready,
+    omx_take_buffer,
+};
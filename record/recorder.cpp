@@ -0,0 +1,520 @@
+#include "recorder.h"
+#include "ts_mux.h"
+#include "../common_util/stats.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+typedef struct {
+    uint64_t offset; //in the byte stream of the ring
+    uint32_t len;
+    uint64_t capture_us;
+    int keyframe;
+} record_frame_t;
+
+//The ring, the recording asked for and the config are shared by the thread
+//delivering the frames, the command thread and the writer. ring_lock is
+//held for memcpy at most, never across a disk access
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t ring[RECORD_RING_BYTES];
+static uint64_t ring_bytes; //written since the start, the next offset
+static record_frame_t ring_frames[RECORD_RING_FRAMES];
+static uint64_t ring_frame_count;
+static uint64_t ring_oldest; //index of the oldest frame still held
+static record_config_t record_config;
+//Frames captured up to here are recorded, UINT64_MAX until RECORD_STOP
+static uint64_t record_until_us;
+//Set for the writer to begin a file from the frames of the pre window
+static int record_starting;
+static uint64_t record_event_us;
+//The writer has a recording going, it may still catch up past until
+static int record_writing;
+
+//Only used by the thread delivering the frames
+static uint8_t codec_config[RECORD_CONFIG_BYTES];
+static uint32_t codec_config_len;
+
+//Only used by the writer thread
+static pthread_t writer_tid;
+static int writer_running;
+static int wake_fd = -1;
+static uint8_t* frame_copy;
+static uint8_t* write_buf;
+static uint32_t write_used;
+static uint64_t write_base; //file offset of write_buf
+static uint64_t written_end; //bytes handed to the kernel
+static uint64_t allocated; //preallocated with fallocate()
+static int prealloc_ok;
+static int write_failed;
+static int file_fd = -1;
+static char file_path[256];
+static ts_mux_t mux;
+static uint64_t next_frame; //ring index of the next frame to write
+static int need_keyframe;
+static uint64_t window_us; //frames captured before aren't recorded
+static uint64_t first_capture_us; //of the file, PTS 0
+static uint64_t last_sync_us;
+
+static void ring_write(uint64_t offset, const uint8_t* data, uint32_t len)
+{
+    uint32_t at = offset % RECORD_RING_BYTES;
+    uint32_t first = RECORD_RING_BYTES - at < len ? RECORD_RING_BYTES - at : len;
+
+    memcpy(&ring[at], data, first);
+    memcpy(ring, data + first, len - first);
+}
+
+static void ring_read(uint64_t offset, uint8_t* data, uint32_t len)
+{
+    uint32_t at = offset % RECORD_RING_BYTES;
+    uint32_t first = RECORD_RING_BYTES - at < len ? RECORD_RING_BYTES - at : len;
+
+    memcpy(data, &ring[at], first);
+    memcpy(data + first, ring, len - first);
+}
+
+//With ring_lock held
+static int is_active(uint64_t now_us)
+{
+    return record_until_us > now_us || record_writing || record_starting;
+}
+
+static int write_at(const uint8_t* data, uint32_t len, uint64_t offset)
+{
+    while(len)
+    {
+        ssize_t written = pwrite(file_fd, data, len, offset);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return 0;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+
+    return 1;
+}
+
+//Reserves the next RECORD_PREALLOC_BYTES once the writes get near the end
+//of what is reserved. Filesystems without it (vfat) just go without
+static void preallocate(uint64_t end)
+{
+    if(!prealloc_ok || end <= allocated)
+        return;
+
+    if(fallocate(file_fd, FALLOC_FL_KEEP_SIZE, allocated
+                 , RECORD_PREALLOC_BYTES) < 0)
+    {
+        DEBUG_MSG("recording %s without preallocation: %s\n", file_path
+                  , strerror(errno));
+        prealloc_ok = 0;
+        return;
+    }
+    allocated += RECORD_PREALLOC_BYTES;
+}
+
+//Writes write_buf at write_base. A partial buffer is written again once
+//full, so every write starts at a multiple of RECORD_WRITE_BYTES
+static void flush_buffer()
+{
+    if(write_failed || !write_used)
+        return;
+
+    preallocate(write_base + RECORD_WRITE_BYTES);
+    if(!write_at(write_buf, write_used, write_base))
+    {
+        DEBUG_ERR("recording %s: write error %s\n", file_path, strerror(errno));
+        stats_add(STAT_RECORD_ERRORS, 1);
+        write_failed = 1;
+        return;
+    }
+    if(write_base + write_used > written_end)
+    {
+        stats_add(STAT_RECORD_BYTES, write_base + write_used - written_end);
+        written_end = write_base + write_used;
+    }
+}
+
+static void write_packet(const uint8_t* packet, void* arg)
+{
+    memcpy(&write_buf[write_used], packet, TS_PACKET_SIZE);
+    write_used += TS_PACKET_SIZE;
+
+    if(write_used == RECORD_WRITE_BYTES)
+    {
+        flush_buffer();
+        write_base += RECORD_WRITE_BYTES;
+        write_used = 0;
+    }
+}
+
+static int open_file(uint64_t capture_us)
+{
+    uint64_t unix_us = get_unix_time_us();
+    time_t seconds = unix_us/1000000;
+    struct tm local;
+    char name[32];
+
+    if(mkdir(RECORD_DIR, 0755) < 0 && errno != EEXIST)
+    {
+        DEBUG_ERR("can't create %s: %s\n", RECORD_DIR, strerror(errno));
+        return 0;
+    }
+
+    localtime_r(&seconds, &local);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &local);
+    snprintf(file_path, sizeof(file_path), "%s/%s.%03d.ts", RECORD_DIR, name
+             , (int)(unix_us/1000%1000));
+    if((file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+                       , 0644)) < 0)
+    {
+        DEBUG_ERR("can't create %s: %s\n", file_path, strerror(errno));
+        return 0;
+    }
+
+    write_used = 0;
+    write_base = 0;
+    written_end = 0;
+    allocated = 0;
+    prealloc_ok = 1;
+    write_failed = 0;
+    first_capture_us = capture_us;
+    last_sync_us = get_time_us();
+    ts_mux_init(&mux, write_packet, 0);
+    DEBUG_MSG("recording to %s\n", file_path);
+
+    return 1;
+}
+
+static void sync_file(uint64_t now_us)
+{
+    flush_buffer();
+    if(!write_failed && fdatasync(file_fd) < 0)
+    {
+        DEBUG_ERR("recording %s: sync error %s\n", file_path, strerror(errno));
+        stats_add(STAT_RECORD_ERRORS, 1);
+        write_failed = 1;
+    }
+    last_sync_us = get_time_us();
+    stats_set(STAT_RECORD_SYNC_US, last_sync_us - now_us);
+}
+
+static void close_file()
+{
+    uint64_t size;
+
+    sync_file(get_time_us());
+    //Gives back what was reserved past the end
+    size = write_base + write_used;
+    if(allocated > size && ftruncate(file_fd, size) < 0)
+        DEBUG_ERR("recording %s: truncate error %s\n", file_path
+                  , strerror(errno));
+    close(file_fd);
+    file_fd = -1;
+    DEBUG_MSG("recording %s closed, %llu bytes\n", file_path
+              , (unsigned long long)written_end);
+}
+
+//Ends the recording if until passed, unless a trigger moved it meanwhile,
+//or if the file failed
+static int finish_recording(uint64_t capture_us, int failed)
+{
+    pthread_mutex_lock(&ring_lock);
+    int finished = record_until_us < capture_us || failed;
+    if(finished)
+    {
+        if(failed)
+            record_until_us = 0;
+        record_writing = 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if(finished && file_fd >= 0)
+        close_file();
+
+    return finished;
+}
+
+//Writes the frames of the recording the ring got since the last call
+static void write_pending()
+{
+    uint64_t now_us = get_time_us();
+    int caught_up = 0;
+
+    pthread_mutex_lock(&ring_lock);
+    if(record_starting)
+    {
+        record_starting = 0;
+        record_writing = 1;
+        next_frame = ring_oldest;
+        need_keyframe = 1;
+        uint64_t pre_us = (uint64_t)record_config.pre_seconds*1000000;
+        window_us = record_event_us > pre_us ? record_event_us - pre_us : 0;
+    }
+    int writing = record_writing;
+    pthread_mutex_unlock(&ring_lock);
+
+    while(writing && !caught_up)
+    {
+        record_frame_t frame;
+        uint64_t lost = 0;
+
+        pthread_mutex_lock(&ring_lock);
+        if(next_frame < ring_oldest)
+        {
+            //The writer fell behind the ring
+            lost = ring_oldest - next_frame;
+            next_frame = ring_oldest;
+            need_keyframe = 1;
+        }
+        if((caught_up = (next_frame == ring_frame_count)))
+        {
+            pthread_mutex_unlock(&ring_lock);
+            break;
+        }
+        frame = ring_frames[next_frame & (RECORD_RING_FRAMES - 1)];
+        int skip = need_keyframe && (!frame.keyframe
+                                     || frame.capture_us < window_us);
+        if(!skip)
+            ring_read(frame.offset, frame_copy, frame.len);
+        next_frame++;
+        pthread_mutex_unlock(&ring_lock);
+
+        //Only frames missing from the file count, not the ones ahead of
+        //its first keyframe
+        if(file_fd >= 0 && (lost || skip))
+        {
+            if(lost)
+                DEBUG_ERR("recording %s fell %llu frames behind\n", file_path
+                          , (unsigned long long)lost);
+            stats_add(STAT_RECORD_DROPPED, lost + skip);
+        }
+
+        if(finish_recording(frame.capture_us, write_failed))
+            return;
+        if(skip)
+            continue;
+
+        need_keyframe = 0;
+        if(file_fd < 0 && !open_file(frame.capture_us))
+        {
+            finish_recording(frame.capture_us, 1);
+            return;
+        }
+        ts_mux_frame(&mux, frame_copy, frame.len
+                     , (frame.capture_us - first_capture_us)*TS_CLOCK_RATE/1000000
+                     , frame.keyframe);
+        stats_add(STAT_RECORD_FRAMES, 1);
+    }
+
+    //Caught up with the ring: done once until passed, otherwise the file is
+    //synced now and then
+    if(writing && !finish_recording(now_us, write_failed) && file_fd >= 0
+       && now_us - last_sync_us >= RECORD_SYNC_US)
+        sync_file(now_us);
+}
+
+static void* writer_thread(void* arg)
+{
+    struct pollfd pfd;
+
+    pfd.fd = wake_fd;
+    pfd.events = POLLIN;
+
+    while(__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+    {
+        if(poll(&pfd, 1, RECORD_WAIT_MS) > 0)
+            event_fd_drain(wake_fd);
+        write_pending();
+    }
+
+    write_pending();
+    if(file_fd >= 0)
+        close_file();
+
+    return 0;
+}
+
+void record_config_default(record_config_t* config)
+{
+    config->pre_seconds = RECORD_PRE_SECONDS;
+    config->post_seconds = RECORD_POST_SECONDS;
+}
+
+void recorder_init()
+{
+    record_config_default(&record_config);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    frame_copy = (uint8_t*)malloc(RECORD_MAX_FRAME_BYTES);
+    //Page aligned like the writes
+    if(wake_fd < 0 || !frame_copy
+       || posix_memalign((void**)&write_buf, 4096, RECORD_WRITE_BYTES))
+    {
+        DEBUG_ERR("Error while creating the recorder buffers\n");
+        exit(1);
+    }
+
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&writer_tid, 0, writer_thread, 0) != 0)
+    {
+        DEBUG_ERR("Error while creating the recorder thread\n");
+        exit(1);
+    }
+}
+
+void recorder_shutdown()
+{
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    event_fd_signal(wake_fd);
+    pthread_join(writer_tid, 0);
+    close(wake_fd);
+    free(frame_copy);
+    free(write_buf);
+}
+
+void recorder_set_config(record_config_t* config)
+{
+    pthread_mutex_lock(&ring_lock);
+    record_config = *config;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+int recorder_wants_frames(uint64_t now_us)
+{
+    pthread_mutex_lock(&ring_lock);
+    int wants = record_config.pre_seconds || is_active(now_us);
+    pthread_mutex_unlock(&ring_lock);
+
+    return wants;
+}
+
+void recorder_add(source_frame_t* frame)
+{
+    uint32_t prefix = 0;
+    int has_config = 0;
+    int i;
+
+    if(frame->layer != LAYER_MAIN)
+        return;
+
+    //The SPS/PPS buffers of the camera come once per encoder start
+    for(i = 0; i < frame->buffer_count; i++)
+    {
+        source_buffer_t* buffer = frame->buffers[i];
+
+        if(!buffer->codec_config)
+            continue;
+        if(!has_config)
+            codec_config_len = 0;
+        has_config = 1;
+        if(codec_config_len + buffer->len > RECORD_CONFIG_BYTES)
+        {
+            DEBUG_ERR("recorder: SPS/PPS too big\n");
+            continue;
+        }
+        memcpy(&codec_config[codec_config_len], buffer->data, buffer->len);
+        codec_config_len += buffer->len;
+    }
+    if(frame->keyframe && !has_config)
+        prefix = codec_config_len;
+
+    uint32_t len = prefix + frame->len;
+    if(len > RECORD_MAX_FRAME_BYTES)
+    {
+        DEBUG_ERR("recorder: frame of %u bytes too big\n", len);
+        return;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    int active = is_active(get_time_us());
+    if(active || record_config.pre_seconds)
+    {
+        record_frame_t* record =
+            &ring_frames[ring_frame_count & (RECORD_RING_FRAMES - 1)];
+
+        record->offset = ring_bytes;
+        record->len = len;
+        record->capture_us = frame->capture_us;
+        record->keyframe = frame->keyframe;
+        ring_write(ring_bytes, codec_config, prefix);
+        ring_bytes += prefix;
+        for(i = 0; i < frame->buffer_count; i++)
+        {
+            ring_write(ring_bytes, (uint8_t*)frame->segments[i].iov_base
+                       , frame->segments[i].iov_len);
+            ring_bytes += frame->segments[i].iov_len;
+        }
+        ring_frame_count++;
+
+        //Overwritten frames, by count or by bytes
+        while(ring_frame_count - ring_oldest > RECORD_RING_FRAMES
+              || ring_bytes
+              - ring_frames[ring_oldest & (RECORD_RING_FRAMES - 1)].offset
+              > RECORD_RING_BYTES)
+            ring_oldest++;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if(active)
+        event_fd_signal(wake_fd);
+}
+
+//Begins a new recording unless one is going on. With ring_lock held
+static int begin(uint64_t now_us)
+{
+    if(is_active(now_us))
+        return 0;
+
+    record_starting = 1;
+    record_event_us = now_us;
+    return 1;
+}
+
+int recorder_start(uint64_t now_us)
+{
+    pthread_mutex_lock(&ring_lock);
+    int started = begin(now_us);
+    record_until_us = UINT64_MAX;
+    pthread_mutex_unlock(&ring_lock);
+    event_fd_signal(wake_fd);
+
+    return started;
+}
+
+int recorder_trigger(uint64_t now_us)
+{
+    pthread_mutex_lock(&ring_lock);
+    int started = begin(now_us);
+    uint64_t until_us = now_us + (uint64_t)record_config.post_seconds*1000000;
+    if(started || (record_until_us != UINT64_MAX && until_us > record_until_us))
+        record_until_us = until_us;
+    pthread_mutex_unlock(&ring_lock);
+    event_fd_signal(wake_fd);
+
+    return started;
+}
+
+void recorder_stop(uint64_t now_us)
+{
+    pthread_mutex_lock(&ring_lock);
+    if(is_active(now_us))
+        record_until_us = now_us;
+    pthread_mutex_unlock(&ring_lock);
+    event_fd_signal(wake_fd);
+}
+
+int recorder_active(uint64_t now_us)
+{
+    pthread_mutex_lock(&ring_lock);
+    int active = is_active(now_us);
+    pthread_mutex_unlock(&ring_lock);
+
+    return active;
+}
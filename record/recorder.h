@@ -0,0 +1,69 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+#include "../source/frame_assembler.h"
+
+//Records the main layer to MPEG-TS files in RECORD_DIR. The stream thread
+//copies every frame into a RAM ring holding the last seconds of the stream,
+//a thread of the recorder muxes and writes them. The stream thread never
+//waits on the disk: a stalled SD card only makes the writer fall behind,
+//and once the ring overtakes it the frames it missed are lost up to the
+//next keyframe.
+//
+//A recording starts at the first keyframe in the pre seconds before it was
+//asked for. RECORD_START records until RECORD_STOP, RECORD_TRIGGER for post
+//seconds more (a trigger during a clip extends it). With pre set the source
+//keeps capturing without clients, so the ring always holds the pre-event
+//footage
+#define RECORD_DIR "recordings"
+//Ring for the pre-event footage. At high bitrates it holds less than pre
+//seconds
+#define RECORD_RING_BYTES (8*1024*1024)
+#define RECORD_RING_FRAMES 2048 //power of two
+#define RECORD_MAX_FRAME_BYTES (1024*1024)
+//Room for the SPS/PPS the encoder only sends once, put back in front of
+//every keyframe in the ring
+#define RECORD_CONFIG_BYTES 256
+//Size of every write, whole TS packets and 4 KB pages. Each write starts at
+//a multiple of it in the file
+#define RECORD_WRITE_BYTES (188*4096)
+//Reserved ahead of the writes with fallocate(), so a file stays in few
+//extents and a full card fails early
+#define RECORD_PREALLOC_BYTES (16*1024*1024)
+//What is written gets to the card at least this often
+#define RECORD_SYNC_US 2000000
+#define RECORD_WAIT_MS 100
+
+//Defaults of record_config_t, changed at runtime with SET_RECORD
+#define RECORD_PRE_SECONDS 0
+#define RECORD_POST_SECONDS 10
+
+typedef struct {
+    int pre_seconds; //kept in the ring and recorded ahead of a start
+    int post_seconds; //recorded after a trigger
+} record_config_t;
+
+void record_config_default(record_config_t* config);
+//Starts the writer thread
+void recorder_init();
+//Writes what the ring still holds of the recording, closes the file and
+//stops the writer thread
+void recorder_shutdown();
+void recorder_set_config(record_config_t* config);
+//Non zero while the source should capture for the recorder, even without
+//clients
+int recorder_wants_frames(uint64_t now_us);
+//Copies a frame of the main layer into the ring. Called by whichever thread
+//delivers the frames, never blocks on the writer
+void recorder_add(source_frame_t* frame);
+//Return non zero if a new recording begins. Without a keyframe in the pre
+//window it waits for the next one, the caller may ask the source for it
+int recorder_start(uint64_t now_us);
+int recorder_trigger(uint64_t now_us);
+void recorder_stop(uint64_t now_us);
+//Non zero while recording or about to
+int recorder_active(uint64_t now_us);
+
+#endif
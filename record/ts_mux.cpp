@@ -0,0 +1,183 @@
+#include "ts_mux.h"
+
+#include <string.h>
+
+#define TS_SYNC_BYTE 0x47
+#define TS_HEADER_SIZE 4
+#define TS_PAYLOAD_SIZE (TS_PACKET_SIZE - TS_HEADER_SIZE)
+//Adaptation field length and flags, then the PCR
+#define TS_PCR_FIELD_SIZE 8
+#define TS_STREAM_TYPE_H264 0x1b
+#define PES_STREAM_ID_VIDEO 0xe0
+//Start code, stream id, length, flags, header length, PTS
+#define PES_HEADER_SIZE 14
+//H.264 in MPEG-TS wants every access unit to start with a delimiter
+static const uint8_t access_unit_delimiter[] = {0, 0, 0, 1, 9, 0xf0};
+
+//CRC-32/MPEG-2 of the PSI sections. They are only written with keyframes,
+//no table needed
+static uint32_t psi_crc32(const uint8_t* data, int len)
+{
+    uint32_t crc = 0xffffffff;
+    int i, bit;
+
+    for(i = 0; i < len; i++)
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for(bit = 0; bit < 8; bit++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+    return crc;
+}
+
+static void put_header(uint8_t* packet, int pid, int unit_start
+                       , int adaptation, uint8_t* continuity)
+{
+    packet[0] = TS_SYNC_BYTE;
+    packet[1] = (unit_start ? 0x40 : 0) | (pid >> 8);
+    packet[2] = pid & 0xff;
+    packet[3] = (adaptation ? 0x30 : 0x10) | (*continuity & 0x0f);
+    (*continuity)++;
+}
+
+//Writes a PSI section (table id through the last byte before the CRC) in
+//one packet, padded with 0xff
+static void write_section(ts_mux_t* mux, int pid, uint8_t* continuity
+                          , uint8_t* section, int len)
+{
+    uint8_t packet[TS_PACKET_SIZE];
+    uint32_t crc = psi_crc32(section, len);
+
+    memset(packet, 0xff, sizeof(packet));
+    put_header(packet, pid, 1, 0, continuity);
+    packet[4] = 0; //pointer field
+    memcpy(&packet[5], section, len);
+    packet[5 + len] = crc >> 24;
+    packet[6 + len] = crc >> 16;
+    packet[7 + len] = crc >> 8;
+    packet[8 + len] = crc;
+    mux->write(packet, mux->arg);
+}
+
+static void write_tables(ts_mux_t* mux)
+{
+    //Program 1 on the PMT PID
+    uint8_t pat[] = {
+        0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xff,
+    };
+    //One H.264 stream, which carries the PCR too
+    uint8_t pmt[] = {
+        0x02, 0xb0, 18, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, 0xf0, 0x00,
+        TS_STREAM_TYPE_H264, 0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff,
+        0xf0, 0x00,
+    };
+
+    write_section(mux, TS_PID_PAT, &mux->continuity_pat, pat, sizeof(pat));
+    write_section(mux, TS_PID_PMT, &mux->continuity_pmt, pmt, sizeof(pmt));
+}
+
+static void put_pts(uint8_t* buf, uint64_t pts)
+{
+    buf[0] = 0x21 | ((pts >> 29) & 0x0e);
+    buf[1] = pts >> 22;
+    buf[2] = ((pts >> 14) & 0xfe) | 1;
+    buf[3] = pts >> 7;
+    buf[4] = ((pts << 1) & 0xfe) | 1;
+}
+
+static void put_pcr(uint8_t* buf, uint64_t pcr)
+{
+    buf[0] = pcr >> 25;
+    buf[1] = pcr >> 17;
+    buf[2] = pcr >> 9;
+    buf[3] = pcr >> 1;
+    buf[4] = ((pcr & 1) << 7) | 0x7e; //reserved bits, extension 0
+    buf[5] = 0;
+}
+
+void ts_mux_init(
+        ts_mux_t* mux,
+        void (*write)(const uint8_t* packet, void* arg),
+        void* arg)
+{
+    mux->write = write;
+    mux->arg = arg;
+    mux->continuity_pat = 0;
+    mux->continuity_pmt = 0;
+    mux->continuity_video = 0;
+}
+
+void ts_mux_frame(
+        ts_mux_t* mux,
+        const uint8_t* data,
+        uint32_t len,
+        uint64_t pts,
+        int keyframe)
+{
+    uint8_t header[PES_HEADER_SIZE + sizeof(access_unit_delimiter)];
+    uint8_t packet[TS_PACKET_SIZE];
+    uint32_t total = sizeof(header) + len;
+    uint32_t pos = 0;
+
+    if(keyframe)
+        write_tables(mux);
+
+    //Unbounded length, allowed for video
+    header[0] = 0;
+    header[1] = 0;
+    header[2] = 1;
+    header[3] = PES_STREAM_ID_VIDEO;
+    header[4] = 0;
+    header[5] = 0;
+    header[6] = 0x80;
+    header[7] = 0x80; //PTS only, no B frames
+    header[8] = 5;
+    put_pts(&header[9], pts + TS_PTS_DELAY);
+    memcpy(&header[PES_HEADER_SIZE], access_unit_delimiter
+           , sizeof(access_unit_delimiter));
+
+    while(pos < total)
+    {
+        int first = (pos == 0);
+        //The first packet carries the PCR, the last one is stuffed through
+        //the adaptation field
+        int adaptation = first ? TS_PCR_FIELD_SIZE : 0;
+        uint32_t room = TS_PAYLOAD_SIZE - adaptation;
+        uint32_t take = total - pos < room ? total - pos : room;
+        int stuffing = room - take;
+        uint8_t* out = &packet[TS_HEADER_SIZE];
+
+        adaptation += stuffing;
+        put_header(packet, TS_PID_VIDEO, first, adaptation
+                   , &mux->continuity_video);
+        if(adaptation)
+        {
+            out[0] = adaptation - 1;
+            if(adaptation > 1)
+            {
+                out[1] = first ? 0x10 | (keyframe ? 0x40 : 0) : 0;
+                memset(&out[2], 0xff, adaptation - 2);
+                if(first)
+                    put_pcr(&out[2], pts);
+            }
+            out += adaptation;
+        }
+
+        //The payload is the PES header then the frame
+        uint32_t copied = 0;
+        if(pos < sizeof(header))
+        {
+            copied = sizeof(header) - pos < take ? sizeof(header) - pos : take;
+            memcpy(out, &header[pos], copied);
+        }
+        if(take > copied)
+            memcpy(out + copied, data + pos + copied - sizeof(header)
+                   , take - copied);
+
+        pos += take;
+        mux->write(packet, mux->arg);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef TS_MUX_H
+#define TS_MUX_H
+
+#include <stdint.h>
+
+//MPEG-TS (ISO 13818-1) with one H.264 program, as played by ffmpeg, VLC and
+//most NVRs. Needs no index, so a file cut short by a power loss plays up to
+//its last packet
+#define TS_PACKET_SIZE 188
+#define TS_PID_PAT 0x0000
+#define TS_PID_PMT 0x1000
+#define TS_PID_VIDEO 0x0100
+#define TS_CLOCK_RATE 90000
+//PTS ahead of the PCR, room for the decoder buffer
+#define TS_PTS_DELAY (TS_CLOCK_RATE/2)
+
+typedef struct {
+    //Takes every packet as it is made
+    void (*write)(const uint8_t* packet, void* arg);
+    void* arg;
+    uint8_t continuity_pat;
+    uint8_t continuity_pmt;
+    uint8_t continuity_video;
+} ts_mux_t;
+
+void ts_mux_init(
+    ts_mux_t* mux,
+    void (*write)(const uint8_t* packet, void* arg),
+    void* arg);
+//Writes one access unit, Annex-B with start codes, as a PES packet.
+//pts is on the 90 kHz clock. A keyframe is preceded by the PAT and PMT so
+//playback can start there
+void ts_mux_frame(
+    ts_mux_t* mux,
+    const uint8_t* data,
+    uint32_t len,
+    uint64_t pts,
+    int keyframe);
+
+#endif
@@ -0,0 +1,222 @@
+#include "rtp_fec.h"
+#include "../fec/gf256.h"
+
+#if FEC_RTP_HEADER_SIZE + FEC_HEADER_SIZE + FEC_XOR_LEVEL_LONG_SIZE \
+    > RTP_HEADER_SIZE + RTP_CAPTURE_TIME_EXT_SIZE + 2
+#error "rtp_packet_t header has no room for the FEC header"
+#endif
+#if RTP_FEC_MAX_PROTECTED > FEC_MAX_PROTECTED
+#error "media packets are longer than the FEC code words"
+#endif
+
+static const char* mode_names[] = {"off", "xor", "rs"};
+
+void fec_config_default(fec_config_t* config)
+{
+    config->mode = FEC_MODE;
+    config->block_packets = FEC_BLOCK_PACKETS;
+    config->repair_packets = FEC_REPAIR_PACKETS;
+    config->block_frames = FEC_BLOCK_FRAMES;
+}
+
+void rtp_fec_init(rtp_fec_t* fec, rtp_session_t* session, fec_config_t* config)
+{
+    memset(fec, 0, sizeof(*fec));
+    gf256_init();
+    fec->ssrc = FEC_REPAIR_SSRC(session->ssrc);
+    //Random like the media sequence, but not in step with it
+    fec->sequence = (uint16_t)(session->ssrc >> 11);
+    fec->config = *config;
+    fec->next = *config;
+}
+
+void rtp_fec_set_config(rtp_fec_t* fec, fec_config_t* config)
+{
+    fec->next = *config;
+}
+
+const char* fec_mode_name(fec_mode mode)
+{
+    return mode_names[mode];
+}
+
+static int code_rows(fec_config_t* config)
+{
+    return config->mode == FEC_MODE_XOR ? 1 : config->repair_packets;
+}
+
+static uint16_t packet_sequence(rtp_packet_t* packet)
+{
+    return (packet->header[2] << 8) | packet->header[3];
+}
+
+static uint32_t packet_timestamp(rtp_packet_t* packet)
+{
+    uint8_t* h = packet->header;
+
+    return ((uint32_t)h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+}
+
+//Sums the bit string of packet into every code word of the block
+static void add_packet(rtp_fec_t* fec, rtp_packet_t* packet)
+{
+    uint32_t protected_len = packet->size - RTP_HEADER_SIZE;
+    uint8_t header[FEC_BITSTRING_HEADER];
+    int rows = code_rows(&fec->config);
+    int r, i;
+
+    if(!fec->count)
+    {
+        fec->base = packet_sequence(packet);
+        fec->protected_len = 0;
+        for(r = 0; r < rows; r++)
+            memset(fec->code[r], 0, sizeof(fec->code[r]));
+    }
+
+    fec_bitstring_header(packet->header, protected_len, header);
+    for(r = 0; r < rows; r++)
+    {
+        uint8_t weight = fec->config.mode == FEC_MODE_XOR
+            ? 1 : fec_rs_coefficient(r, fec->count);
+        uint8_t* code = fec->code[r];
+        uint32_t offset = FEC_BITSTRING_HEADER;
+
+        gf256_mul_add_region(code, header, weight, FEC_BITSTRING_HEADER);
+        //The payload header and the extension share the first iovec with
+        //the fixed header
+        gf256_mul_add_region(code + offset, packet->header + RTP_HEADER_SIZE
+                             , weight, packet->iov[0].iov_len - RTP_HEADER_SIZE);
+        offset += packet->iov[0].iov_len - RTP_HEADER_SIZE;
+        for(i = 1; i < packet->iov_count; i++)
+        {
+            gf256_mul_add_region(code + offset
+                                 , (uint8_t*)packet->iov[i].iov_base
+                                 , weight, packet->iov[i].iov_len);
+            offset += packet->iov[i].iov_len;
+        }
+    }
+
+    if((int)protected_len > fec->protected_len)
+        fec->protected_len = protected_len;
+    fec->timestamp = packet_timestamp(packet);
+    fec->count++;
+}
+
+//Writes the FEC header of repair packet row after the RTP header, returns
+//its size
+static int write_fec_header(rtp_fec_t* fec, int row, int rows, uint8_t* f)
+{
+    uint8_t* code = fec->code[row];
+
+    f[2] = fec->base >> 8;
+    f[3] = fec->base & 0xff;
+
+    if(fec->config.mode == FEC_MODE_RS)
+    {
+        f[0] = FEC_FLAG_E;
+        f[1] = 0;
+        f[4] = fec->count;
+        f[5] = rows;
+        f[6] = row;
+        f[7] = 0;
+        f[8] = fec->protected_len >> 8;
+        f[9] = fec->protected_len & 0xff;
+        return FEC_HEADER_SIZE;
+    }
+
+    //RFC 5109, the recovery fields are the XOR of the bit string headers
+    int long_mask = fec->count > 16;
+    uint8_t* level = f + FEC_HEADER_SIZE;
+    int mask_bytes = long_mask ? 6 : 2;
+    int i;
+
+    f[0] = code[0] | (long_mask ? FEC_FLAG_L : 0);
+    f[1] = code[1];
+    memcpy(f + 4, code + 2, 6);
+    level[0] = fec->protected_len >> 8;
+    level[1] = fec->protected_len & 0xff;
+    memset(level + 2, 0, mask_bytes);
+    for(i = 0; i < fec->count; i++)
+        level[2 + i/8] |= 0x80 >> (i%8);
+
+    return FEC_HEADER_SIZE + 2 + mask_bytes;
+}
+
+//Appends the repair packets of the block to frame and starts the next one
+static void end_block(rtp_fec_t* fec, rtp_frame_t* frame,
+        rtp_fec_payloads_t* payloads)
+{
+    fec_config_t* config = &fec->config;
+    int rows = config->mode == FEC_MODE_XOR ? 1
+        : (fec->count*config->repair_packets + config->block_packets - 1)
+          /config->block_packets;
+    int r;
+
+    for(r = 0; r < rows; r++)
+    {
+        if(frame->repair_count == RTP_MAX_REPAIR_PACKETS)
+        {
+            DEBUG_ERR("fec: frame needs more than %d repair packets\n"
+                      , RTP_MAX_REPAIR_PACKETS);
+            break;
+        }
+
+        rtp_packet_t* packet =
+            &frame->packets[frame->packet_count + frame->repair_count];
+        uint8_t* data = payloads->payload[frame->repair_count];
+        uint8_t* h = packet->header;
+        //The RS code word carries the bit string header, XOR moves it into
+        //the FEC header
+        int skip = config->mode == FEC_MODE_XOR ? FEC_BITSTRING_HEADER : 0;
+        uint32_t data_len = FEC_BITSTRING_HEADER - skip + fec->protected_len;
+
+        h[0] = 0x80;
+        h[1] = FEC_PAYLOAD_TYPE;
+        h[2] = fec->sequence >> 8;
+        h[3] = fec->sequence & 0xff;
+        h[4] = fec->timestamp >> 24;
+        h[5] = fec->timestamp >> 16;
+        h[6] = fec->timestamp >> 8;
+        h[7] = fec->timestamp;
+        h[8] = fec->ssrc >> 24;
+        h[9] = fec->ssrc >> 16;
+        h[10] = fec->ssrc >> 8;
+        h[11] = fec->ssrc;
+        fec->sequence++;
+
+        packet->iov[0].iov_base = h;
+        packet->iov[0].iov_len = RTP_HEADER_SIZE
+            + write_fec_header(fec, r, rows, h + RTP_HEADER_SIZE);
+        memcpy(data, fec->code[r] + skip, data_len);
+        packet->iov[1].iov_base = data;
+        packet->iov[1].iov_len = data_len;
+        packet->iov_count = 2;
+        packet->size = packet->iov[0].iov_len + data_len;
+        frame->repair_count++;
+    }
+
+    fec->count = 0;
+    fec->frames = 0;
+}
+
+void rtp_fec_protect(rtp_fec_t* fec, rtp_frame_t* frame,
+        rtp_fec_payloads_t* payloads){
+    int i;
+
+    frame->repair_count = 0;
+
+    for(i = 0; i < frame->packet_count; i++)
+    {
+        if(!fec->count)
+            fec->config = fec->next;
+        if(fec->config.mode == FEC_MODE_OFF)
+            continue;
+
+        add_packet(fec, &frame->packets[i]);
+        if(fec->count == fec->config.block_packets)
+            end_block(fec, frame, payloads);
+    }
+
+    if(fec->count && ++fec->frames >= fec->config.block_frames)
+        end_block(fec, frame, payloads);
+}
@@ -0,0 +1,65 @@
+#ifndef RTP_FEC_H
+#define RTP_FEC_H
+
+#include "rtp_h264.h"
+#include "../fec/fec.h"
+
+//Defaults of fec_config_t, changed at runtime with SET_FEC
+#define FEC_MODE FEC_MODE_OFF
+#define FEC_BLOCK_PACKETS 8
+#define FEC_REPAIR_PACKETS 2 //RS only, XOR always sends one
+#define FEC_BLOCK_FRAMES 1
+
+//Longest media packet after the fixed RTP header
+#define RTP_FEC_MAX_PROTECTED (RTP_MAX_PAYLOAD + RTP_CAPTURE_TIME_EXT_SIZE)
+
+typedef struct {
+    fec_mode mode;
+    //k, media packets per block, at most FEC_XOR_MAX_BLOCK or
+    //FEC_RS_MAX_BLOCK
+    int block_packets;
+    //m, repair packets of a full RS block, shorter blocks get a share of
+    //them rounded up. The overhead is m/k
+    int repair_packets;
+    //A block also ends with the frame that makes it span this
+    //many. 1 sends the repair packets of a frame with it, more spread the
+    //overhead of small frames over several of them at the cost of waiting
+    //for those frames to recover a loss
+    int block_frames;
+} fec_config_t;
+
+//Data of the repair packets appended to one frame
+typedef struct {
+    uint8_t payload[RTP_MAX_REPAIR_PACKETS][FEC_BITSTRING_HEADER
+                                            + RTP_FEC_MAX_PROTECTED];
+} rtp_fec_payloads_t;
+
+//Encoder state of the stream. The code words are summed up as the media
+//packets go by, so no packet has to be kept until its block ends
+typedef struct {
+    fec_config_t config; //of the current block
+    fec_config_t next; //taken when the next block starts
+    //Of the repair stream
+    uint16_t sequence;
+    uint32_t ssrc;
+    uint16_t base;
+    uint32_t timestamp; //of the newest packet of the block
+    int count;
+    int frames;
+    int protected_len;
+    uint8_t code[FEC_RS_MAX_REPAIR][FEC_BITSTRING_HEADER + RTP_FEC_MAX_PROTECTED];
+} rtp_fec_t;
+
+void fec_config_default(fec_config_t* config);
+void rtp_fec_init(rtp_fec_t* fec, rtp_session_t* session, fec_config_t* config);
+//Used from the next block on
+void rtp_fec_set_config(rtp_fec_t* fec, fec_config_t* config);
+//Adds the media packets of frame to the blocks and appends the repair
+//packets of the blocks that ended (frame->repair_count). Their data is in
+//payloads, which has to live as long as frame. Call after anything that
+//changes the media packets
+void rtp_fec_protect(rtp_fec_t* fec, rtp_frame_t* frame,
+                     rtp_fec_payloads_t* payloads);
+const char* fec_mode_name(fec_mode mode);
+
+#endif
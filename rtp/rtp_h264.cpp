@@ -0,0 +1,439 @@
+#include "rtp_h264.h"
+
+void rtp_session_init(rtp_session_t* session, uint32_t ssrc)
+{
+    session->ssrc = ssrc;
+    //RFC 3550 recommends a random initial sequence number
+    session->sequence = (uint16_t)(ssrc >> 7);
+}
+
+uint32_t rtp_timestamp_from_us(int64_t timestamp_us)
+{
+    //Wraps around as RTP timestamps do
+    return (uint32_t)(timestamp_us*(RTP_CLOCK_RATE/1000)/1000);
+}
+
+//Returns the position of the next 00 00 01 start code, or end if none
+static uint8_t* find_start_code(uint8_t* p, uint8_t* end)
+{
+    while (p + 3 <= end)
+    {
+        if (p[2] > 1)
+            p += 3;
+        else if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+        else
+            p++;
+    }
+
+    return end;
+}
+
+//Annex-B data in one or more segments, addressed by the offset from the
+//start of the first one
+typedef struct {
+    const struct iovec* segments;
+    int count;
+    uint32_t len;
+} annexb_t;
+
+//NAL unit of an annexb_t, it may straddle segments
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} nal_range_t;
+
+//Returns the segment holding pos and its offset in *base
+static int find_segment(annexb_t* b, uint32_t pos, uint32_t* base)
+{
+    int i;
+
+    *base = 0;
+    for (i=0; i<b->count - 1 && pos - *base >= b->segments[i].iov_len; i++)
+        *base += b->segments[i].iov_len;
+
+    return i;
+}
+
+//Byte at pos, 0xff past the end so it matches no start code
+static uint8_t byte_at(annexb_t* b, uint32_t pos)
+{
+    uint32_t base;
+
+    if (pos >= b->len)
+        return 0xff;
+
+    int i = find_segment(b, pos, &base);
+    return ((uint8_t*)b->segments[i].iov_base)[pos - base];
+}
+
+//Like find_start_code() from pos to the end of b, also finding the start
+//codes split between two segments
+static uint32_t find_start_code_from(annexb_t* b, uint32_t pos)
+{
+    uint32_t base;
+    int i;
+
+    for (i = find_segment(b, pos, &base); i < b->count && pos < b->len; i++)
+    {
+        uint8_t* data = (uint8_t*)b->segments[i].iov_base;
+        uint32_t seg_end = base + b->segments[i].iov_len;
+        uint8_t* found = find_start_code(data + (pos - base),
+                data + b->segments[i].iov_len);
+
+        if (found != data + b->segments[i].iov_len)
+            return base + (found - data);
+
+        //The last two bytes of the segment go on in the next one
+        for (pos = seg_end >= pos + 2 ? seg_end - 2 : pos; pos < seg_end; pos++)
+            if (byte_at(b, pos) == 0 && byte_at(b, pos + 1) == 0
+                && byte_at(b, pos + 2) == 1)
+                return pos;
+
+        base = seg_end;
+    }
+
+    return b->len;
+}
+
+//Returns the next NAL unit at pos. Bytes in front of the first start code
+//(the tail of a NAL unit split across frames) are returned as one unit,
+//trailing zero bytes that belong to the following start code are dropped
+static int next_nal_unit(annexb_t* b, uint32_t* pos, nal_range_t* nal)
+{
+    while (*pos < b->len)
+    {
+        uint32_t start = *pos;
+        if (byte_at(b, start) == 0)
+        {
+            start = find_start_code_from(b, start);
+            if (start == b->len)
+                return 0;
+            start += 3;
+        }
+
+        uint32_t next = find_start_code_from(b, start);
+        uint32_t stop = next;
+        *pos = next;
+
+        if (next != b->len)
+            while (stop > start && byte_at(b, stop - 1) == 0)
+                stop--;
+
+        if (stop > start)
+        {
+            nal->start = start;
+            nal->len = stop - start;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//iovecs the len bytes of b at pos take
+static int count_pieces(annexb_t* b, uint32_t pos, uint32_t len)
+{
+    uint32_t base;
+    int i = find_segment(b, pos, &base);
+    int count = 1;
+
+    for (base += b->segments[i].iov_len; pos + len > base; count++)
+        base += b->segments[++i].iov_len;
+
+    return count;
+}
+
+static rtp_packet_t* new_packet(
+        rtp_session_t* session,
+        rtp_frame_t* frame,
+        uint32_t timestamp){
+    if (frame->packet_count == RTP_MAX_PACKETS)
+        return 0;
+
+    rtp_packet_t* packet = &frame->packets[frame->packet_count++];
+    uint8_t* h = packet->header;
+
+    h[0] = 0x80; //version 2, no padding, extension or CSRC
+    h[1] = RTP_PAYLOAD_TYPE;
+    h[2] = session->sequence >> 8;
+    h[3] = session->sequence & 0xff;
+    h[4] = timestamp >> 24;
+    h[5] = timestamp >> 16;
+    h[6] = timestamp >> 8;
+    h[7] = timestamp;
+    h[8] = session->ssrc >> 24;
+    h[9] = session->ssrc >> 16;
+    h[10] = session->ssrc >> 8;
+    h[11] = session->ssrc;
+    session->sequence++;
+
+    packet->iov[0].iov_base = h;
+    packet->iov[0].iov_len = RTP_HEADER_SIZE;
+    packet->iov_count = 1;
+    packet->size = RTP_HEADER_SIZE;
+
+    return packet;
+}
+
+static void add_payload(rtp_packet_t* packet, void* data, uint32_t len)
+{
+    packet->iov[packet->iov_count].iov_base = data;
+    packet->iov[packet->iov_count].iov_len = len;
+    packet->iov_count++;
+    packet->size += len;
+}
+
+//Adds the len bytes of b at pos, an iovec per segment they are in, as long
+//as the packet has iovecs left. Returns how many were added
+static uint32_t add_range(
+        rtp_packet_t* packet,
+        annexb_t* b,
+        uint32_t pos,
+        uint32_t len){
+    uint32_t base;
+    uint32_t added = 0;
+    int i = find_segment(b, pos, &base);
+
+    for (; added < len && packet->iov_count < RTP_MAX_IOV; i++)
+    {
+        uint32_t offset = pos + added - base;
+        uint32_t piece = b->segments[i].iov_len - offset;
+        if (piece > len - added)
+            piece = len - added;
+
+        if (piece)
+            add_payload(packet, (uint8_t*)b->segments[i].iov_base + offset,
+                    piece);
+        added += piece;
+        base += b->segments[i].iov_len;
+    }
+
+    return added;
+}
+
+static void packetize_fu_a(
+        rtp_session_t* session,
+        rtp_frame_t* frame,
+        annexb_t* b,
+        nal_range_t* nal,
+        uint32_t timestamp){
+    uint8_t nal_header = byte_at(b, nal->start);
+    uint32_t payload = nal->start + 1;
+    uint32_t remaining = nal->len - 1;
+    int first = 1;
+
+    while (remaining)
+    {
+        rtp_packet_t* packet = new_packet(session, frame, timestamp);
+        if (!packet)
+        {
+            DEBUG_ERR("rtp: frame needs more than %d packets\n", RTP_MAX_PACKETS);
+            return;
+        }
+
+        uint32_t chunk = remaining;
+        if (chunk > RTP_MAX_PAYLOAD - 2)
+            chunk = RTP_MAX_PAYLOAD - 2;
+        chunk = add_range(packet, b, payload, chunk);
+
+        //FU indicator keeps F and NRI, FU header keeps the NAL type
+        packet->header[RTP_HEADER_SIZE] = (nal_header & 0xe0) | NAL_TYPE_FU_A;
+        packet->header[RTP_HEADER_SIZE + 1] = (nal_header & 0x1f)
+            | (first ? 0x80 : 0)
+            | (chunk == remaining ? 0x40 : 0);
+        packet->iov[0].iov_len += 2;
+        packet->size += 2;
+
+        payload += chunk;
+        remaining -= chunk;
+        first = 0;
+    }
+}
+
+static void packetize_aggregate(
+        rtp_session_t* session,
+        rtp_frame_t* frame,
+        annexb_t* b,
+        nal_range_t* nals,
+        int count,
+        uint32_t timestamp){
+    rtp_packet_t* packet = new_packet(session, frame, timestamp);
+    if (!packet)
+    {
+        DEBUG_ERR("rtp: frame needs more than %d packets\n", RTP_MAX_PACKETS);
+        return;
+    }
+
+    //Single NAL unit packet
+    if (count == 1)
+    {
+        add_range(packet, b, nals[0].start, nals[0].len);
+        return;
+    }
+
+    //STAP-A, F is ORed and NRI is the maximum of the aggregated units
+    uint8_t f = 0;
+    uint8_t nri = 0;
+    int i;
+    for (i=0; i<count; i++)
+    {
+        uint8_t nal_header = byte_at(b, nals[i].start);
+        f |= nal_header & 0x80;
+        if ((nal_header & 0x60) > nri)
+            nri = nal_header & 0x60;
+    }
+    packet->header[RTP_HEADER_SIZE] = f | nri | NAL_TYPE_STAP_A;
+    packet->iov[0].iov_len += 1;
+    packet->size += 1;
+
+    for (i=0; i<count; i++)
+    {
+        packet->stap_sizes[i][0] = nals[i].len >> 8;
+        packet->stap_sizes[i][1] = nals[i].len & 0xff;
+        add_payload(packet, packet->stap_sizes[i], 2);
+        add_range(packet, b, nals[i].start, nals[i].len);
+    }
+}
+
+int rtp_packetize_h264_segments(
+        rtp_session_t* session,
+        rtp_frame_t* frame,
+        const struct iovec* segments,
+        int count,
+        uint32_t timestamp,
+        int end_of_frame){
+    annexb_t b;
+    uint32_t pos = 0;
+    nal_range_t nal;
+    //NAL units waiting to be aggregated
+    nal_range_t pending[RTP_MAX_STAP_NALS];
+    int pending_count = 0;
+    uint32_t pending_size = 1; //STAP-A indicator
+    int pending_iov = 1; //the RTP header
+    int i;
+
+    frame->packet_count = 0;
+    frame->repair_count = 0;
+
+    b.segments = segments;
+    b.count = count;
+    b.len = 0;
+    for (i=0; i<count; i++)
+        b.len += segments[i].iov_len;
+    if (!count)
+        return 0;
+
+    while (next_nal_unit(&b, &pos, &nal))
+    {
+        if (nal.len > RTP_MAX_PAYLOAD)
+        {
+            if (pending_count)
+                packetize_aggregate(session, frame, &b, pending, pending_count,
+                        timestamp);
+            pending_count = 0;
+            pending_size = 1;
+            pending_iov = 1;
+
+            packetize_fu_a(session, frame, &b, &nal, timestamp);
+            continue;
+        }
+
+        //A unit split between two segments takes an iovec for each part
+        int pieces = count_pieces(&b, nal.start, nal.len);
+
+        if (pending_count == RTP_MAX_STAP_NALS
+            || (pending_count && (pending_size + 2 + nal.len > RTP_MAX_PAYLOAD
+                                  || pending_iov + 1 + pieces > RTP_MAX_IOV)))
+        {
+            packetize_aggregate(session, frame, &b, pending, pending_count,
+                    timestamp);
+            pending_count = 0;
+            pending_size = 1;
+            pending_iov = 1;
+        }
+
+        pending[pending_count++] = nal;
+        pending_size += 2 + nal.len;
+        pending_iov += 1 + pieces;
+    }
+
+    if (pending_count)
+        packetize_aggregate(session, frame, &b, pending, pending_count,
+                timestamp);
+
+    if (end_of_frame && frame->packet_count)
+        frame->packets[frame->packet_count - 1].header[1] |= 0x80;
+
+    return frame->packet_count;
+}
+
+int rtp_packetize_h264(
+        rtp_session_t* session,
+        rtp_frame_t* frame,
+        uint8_t* buf,
+        uint32_t len,
+        uint32_t timestamp,
+        int end_of_frame){
+    struct iovec segment;
+
+    segment.iov_base = buf;
+    segment.iov_len = len;
+
+    return rtp_packetize_h264_segments(session, frame, &segment, 1, timestamp,
+            end_of_frame);
+}
+
+void rtp_add_capture_time(rtp_frame_t* frame, uint64_t capture_unix_us)
+{
+    if (!frame->packet_count)
+        return;
+
+    rtp_packet_t* packet = &frame->packets[frame->packet_count - 1];
+    uint8_t* h = packet->header;
+    if (!(h[1] & 0x80) || (h[0] & 0x10))
+        return;
+
+    //The extension goes between the fixed header and the payload header
+    uint8_t* ext = h + RTP_HEADER_SIZE;
+    memmove(ext + RTP_CAPTURE_TIME_EXT_SIZE, ext,
+            packet->iov[0].iov_len - RTP_HEADER_SIZE);
+
+    ext[0] = 0xbe;
+    ext[1] = 0xde;
+    ext[2] = 0;
+    ext[3] = (RTP_CAPTURE_TIME_EXT_SIZE - 4)/4;
+    ext[4] = (RTP_CAPTURE_TIME_EXT_ID << 4) | (8 - 1);
+    int i;
+    for (i=0; i<8; i++)
+        ext[5 + i] = capture_unix_us >> (56 - 8*i);
+    ext[13] = ext[14] = ext[15] = 0;
+
+    h[0] |= 0x10;
+    packet->iov[0].iov_len += RTP_CAPTURE_TIME_EXT_SIZE;
+    packet->size += RTP_CAPTURE_TIME_EXT_SIZE;
+}
+
+int h264_next_nal_unit(uint8_t** pos, uint8_t* end, nal_unit_t* nal)
+{
+    struct iovec segment;
+    annexb_t b;
+    uint32_t offset = 0;
+    nal_range_t range;
+
+    segment.iov_base = *pos;
+    segment.iov_len = end - *pos;
+    b.segments = &segment;
+    b.count = 1;
+    b.len = segment.iov_len;
+
+    int found = next_nal_unit(&b, &offset, &range);
+    if (found)
+    {
+        nal->data = *pos + range.start;
+        nal->len = range.len;
+    }
+    *pos += offset;
+
+    return found;
+}
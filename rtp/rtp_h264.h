@@ -0,0 +1,101 @@
+#ifndef RTP_H264_H
+#define RTP_H264_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "../common_util/common_util.h"
+
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_TYPE 96 //dynamic payload type for H.264
+#define RTP_CLOCK_RATE 90000
+//Biggest RTP payload per datagram. Keeps IP + UDP + RTP under a 1500 byte MTU
+#define RTP_MAX_PAYLOAD 1400
+//Packets produced by one frame. 512 * 1400 bytes covers a 700KB frame
+#define RTP_MAX_PACKETS 512
+//Room after the media packets of a frame for FEC repair packets, see
+//rtp_fec.h
+#define RTP_MAX_REPAIR_PACKETS 64
+//NAL units aggregated into one STAP-A packet
+#define RTP_MAX_STAP_NALS 8
+#define RTP_MAX_IOV (1 + 2*RTP_MAX_STAP_NALS)
+//Set to 1 to send the capture time of every frame in an RFC 8285 one-byte
+//header extension on its last packet, 64 bit microseconds since the Unix
+//epoch, so a client with a synced clock can measure glass-to-glass latency.
+//The last packet is usually the shortest, so UDP GSO batching is unchanged
+#define RTP_CAPTURE_TIME_EXT 0
+#define RTP_CAPTURE_TIME_EXT_ID 1
+//0xBEDE profile, length, ID/len byte, 8 byte time, 3 bytes of padding
+#define RTP_CAPTURE_TIME_EXT_SIZE 16
+
+//NAL unit types of H.264 and RFC 6184
+#define NAL_TYPE_IDR 5
+#define NAL_TYPE_SPS 7
+#define NAL_TYPE_PPS 8
+#define NAL_TYPE_STAP_A 24
+#define NAL_TYPE_FU_A 28
+
+typedef struct {
+    uint8_t* data;
+    uint32_t len;
+} nal_unit_t;
+
+//One datagram. The payload is never copied, the iovecs point into the encoder
+//buffer and only the headers are built here
+typedef struct {
+    //RTP header, the capture time extension if any, then the FU
+    //indicator/header or the STAP-A indicator
+    uint8_t header[RTP_HEADER_SIZE + RTP_CAPTURE_TIME_EXT_SIZE + 2];
+    //Size fields of the aggregated NAL units of a STAP-A packet
+    uint8_t stap_sizes[RTP_MAX_STAP_NALS][2];
+    struct iovec iov[RTP_MAX_IOV];
+    int iov_count;
+    uint32_t size;
+} rtp_packet_t;
+
+//All the packets of one frame, the media packets then the repair
+//packets
+typedef struct {
+    rtp_packet_t packets[RTP_MAX_PACKETS + RTP_MAX_REPAIR_PACKETS];
+    int packet_count;
+    int repair_count;
+} rtp_frame_t;
+
+typedef struct {
+    uint16_t sequence;
+    uint32_t ssrc;
+} rtp_session_t;
+
+void rtp_session_init(rtp_session_t* session, uint32_t ssrc);
+uint32_t rtp_timestamp_from_us(int64_t timestamp_us);
+//Splits an Annex-B buffer into RFC 6184 packets. Small NAL units are sent as
+//single NAL unit or STAP-A packets, big ones are fragmented with FU-A. The
+//marker bit is set on the last packet if end_of_frame is set.
+//Returns the number of packets, the buffer must outlive the packets
+int rtp_packetize_h264(
+    rtp_session_t* session,
+    rtp_frame_t* frame,
+    uint8_t* buf,
+    uint32_t len,
+    uint32_t timestamp,
+    int end_of_frame);
+//Same for a frame in count segments, e.g. the encoder buffers it came in.
+//NAL units and start codes may straddle segments, a packet then points into
+//both
+int rtp_packetize_h264_segments(
+    rtp_session_t* session,
+    rtp_frame_t* frame,
+    const struct iovec* segments,
+    int count,
+    uint32_t timestamp,
+    int end_of_frame);
+//Adds the capture time extension to the last packet if it has the marker
+//bit, see RTP_CAPTURE_TIME_EXT
+void rtp_add_capture_time(rtp_frame_t* frame, uint64_t capture_unix_us);
+//Iterates the NAL units of an Annex-B buffer, pos starts at the buffer.
+//Returns 0 when there are no more
+int h264_next_nal_unit(uint8_t** pos, uint8_t* end, nal_unit_t* nal);
+
+#endif
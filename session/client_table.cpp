@@ -0,0 +1,873 @@
+#include "client_table.h"
+#include "packet_history.h"
+#include "../udp_setup/udp_setup.h"
+
+#include <sys/timerfd.h>
+
+//The last slot is the multicast group, active while a multicast client is
+static client_t clients[MAX_CLIENTS + 1];
+static client_t* group = &clients[MAX_CLIENTS];
+//Serializes state changes against the fan-out of the stream thread. The
+//sender thread pops the queues without it
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t subscriber_cond;
+static sem_t queued_sem;
+//Packets of the burst frame being sent, only used by the sender thread
+static rtp_frame_t burst_rtp;
+//Copy of a packet of the history being retransmitted, under table_lock
+static uint8_t nack_data[PACKET_HISTORY_PACKET_SIZE];
+static rtp_packet_t nack_packet;
+//Set by the command and stream threads, read by the sender thread
+static int pacing_mode_now = PACING_OFF;
+static int pacing_spread_percent = PACING_SPREAD_PERCENT;
+static uint32_t frame_interval_us;
+//Clients the last frame was queued to, they share the SO_MAX_PACING_RATE
+//of the stream socket
+static int fanout_clients;
+static int layer_count = 1;
+
+static int same_addr(struct sockaddr_in* a, struct sockaddr_in* b)
+{
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr
+            && a->sin_port == b->sin_port);
+}
+
+static int get_state(client_t* client)
+{
+    return __atomic_load_n(&client->state, __ATOMIC_ACQUIRE);
+}
+
+static void set_state(client_t* client, int state)
+{
+    __atomic_store_n(&client->state, state, __ATOMIC_RELEASE);
+}
+
+static client_t* find_client(struct sockaddr_in* command_addr)
+{
+    int i;
+
+    for(i = 0; i < MAX_CLIENTS; i++)
+        if(clients[i].state == CLIENT_ACTIVE
+           && same_addr(&clients[i].command_addr, command_addr))
+            return &clients[i];
+
+    return 0;
+}
+
+//Arms the session timer to deadline_us, 0 disarms it
+static void arm_timer(client_t* client, uint64_t deadline_us)
+{
+    struct itimerspec spec;
+
+    if(client->timer_fd < 0)
+        return;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline_us/1000000;
+    spec.it_value.tv_nsec = (deadline_us%1000000)*1000;
+    if(timerfd_settime(client->timer_fd, TFD_TIMER_ABSTIME, &spec, 0) < 0)
+        DEBUG_ERR("session timer error\n");
+}
+
+static void remove_client(client_t* client)
+{
+    DEBUG_MSG("client %s removed, %llu frames sent, %llu dropped\n"
+              , inet_ntoa(client->command_addr.sin_addr)
+              , (unsigned long long)client->sent_frames
+              , (unsigned long long)client->dropped_frames);
+
+    //The sender thread drops what is still queued and frees the slot
+    arm_timer(client, 0);
+    set_state(client, CLIENT_CLOSING);
+    client_wake_sender();
+}
+
+static void init_client(client_t* client, struct sockaddr_in* stream_addr)
+{
+    client->stream_addr = *stream_addr;
+    client->sent_frames = 0;
+    client->dropped_frames = 0;
+    client->layer = LAYER_MAIN;
+    client->auto_layer = 0;
+    client->layer_reports = 0;
+    client->lossy_reports = 0;
+    client->clean_reports = 0;
+    client->up_reports = LAYER_UP_REPORTS;
+    __atomic_store_n(&client->bursting, 0, __ATOMIC_RELEASE);
+    client->nack_tokens = NACK_BURST_BYTES;
+    client->nack_refill_us = 0;
+    client->retransmits = 0;
+    client->pacing_frame = 0;
+    rate_control_init(&client->rate, RATE_START_BITRATE);
+    spsc_ring_init(&client->queue, client->queue_slots, CLIENT_QUEUE_DEPTH);
+    set_state(client, CLIENT_ACTIVE);
+}
+
+//Starts the client over from the cached GOP of its layer
+static void start_burst(client_t* client)
+{
+    __atomic_store_n(&client->bursting, 1, __ATOMIC_RELEASE);
+    client->burst_step = 0;
+    client->burst_generation = gop_cache_generation(client->layer);
+    client->burst_next_us = 0;
+}
+
+//Moves the client to layer. Returns non zero if the layer has no GOP
+//cached, the client then waits for its next IDR
+static int switch_layer(client_t* client, int layer)
+{
+    if(layer == client->layer)
+        return 0;
+
+    DEBUG_MSG("client %s moves to the %s layer\n"
+              , inet_ntoa(client->command_addr.sin_addr)
+              , layer == LAYER_LOW ? "low" : "main");
+    client->layer = layer;
+    client->layer_reports = 0;
+    client->lossy_reports = 0;
+    client->clean_reports = 0;
+    //The estimate was made on the other layer
+    rate_control_init(&client->rate, RATE_START_BITRATE);
+    //Even without a cached GOP, so the sender thread drops the frames of
+    //the old layer
+    start_burst(client);
+
+    return !gop_cache_valid(layer);
+}
+
+//Counts the report toward a layer switch of a client following its loss.
+//Returns switch_layer() of a switch
+static int follow_loss(client_t* client, receiver_report_t* report)
+{
+    uint32_t packets = report->lost + report->received;
+    double loss;
+
+    if(!packets)
+        return 0;
+
+    loss = (double)report->lost/packets;
+    client->layer_reports++;
+    client->lossy_reports = loss > LAYER_DOWN_LOSS ? client->lossy_reports + 1 : 0;
+    client->clean_reports = loss < LAYER_UP_LOSS ? client->clean_reports + 1 : 0;
+
+    if(client->layer == LAYER_MAIN
+       && client->lossy_reports >= LAYER_DOWN_REPORTS)
+    {
+        //Didn't hold the main layer for as long as it waited below
+        if(client->layer_reports < client->up_reports)
+            client->up_reports = client->up_reports*2 < LAYER_UP_MAX_REPORTS
+                ? client->up_reports*2 : LAYER_UP_MAX_REPORTS;
+        else
+            client->up_reports = LAYER_UP_REPORTS;
+        return switch_layer(client, LAYER_LOW);
+    }
+
+    if(client->layer == LAYER_LOW && client->clean_reports >= client->up_reports)
+        return switch_layer(client, LAYER_MAIN);
+
+    return 0;
+}
+
+//Starts or stops sending to the group. A group still closing is started
+//again by a later call, client_fanout() calls this on every frame
+static void update_group()
+{
+    int members = 0;
+    int i;
+
+    for(i = 0; i < MAX_CLIENTS; i++)
+        members += (clients[i].state == CLIENT_ACTIVE && clients[i].multicast);
+
+    if(members && group->state == CLIENT_FREE)
+    {
+        struct sockaddr_in group_addr;
+        udp_multicast_addr(&group_addr);
+        group->command_addr = group_addr;
+        init_client(group, &group_addr);
+        DEBUG_MSG("multicast to %s started\n", MCAST_GROUP);
+    }
+    else if(!members && group->state == CLIENT_ACTIVE)
+        remove_client(group);
+}
+
+//A frame sent zerocopy stays referenced until the kernel is done with it,
+//only then the source gets the buffer back
+static void zerocopy_hold(void* owner)
+{
+    stream_frame_ref((stream_frame_t*)owner);
+}
+
+static void zerocopy_release(void* owner)
+{
+    stream_frame_unref((stream_frame_t*)owner);
+}
+
+void client_table_init()
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&subscriber_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sem_init(&queued_sem, 0, 0);
+    memset(clients, 0, sizeof(clients));
+    udp_set_zerocopy_owner(zerocopy_hold, zerocopy_release);
+    gop_cache_init();
+    layer_count = 1;
+
+    int i;
+    for(i = 0; i < MAX_CLIENTS + 1; i++)
+        clients[i].timer_fd = -1;
+    for(i = 0; i < MAX_CLIENTS; i++)
+        if((clients[i].timer_fd = timerfd_create(CLOCK_MONOTONIC
+                                                 , TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        {
+            DEBUG_ERR("timerfd_create error\n");
+            exit(1);
+        }
+}
+
+void client_set_layer_count(int count)
+{
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+    layer_count = count;
+    //The source fell back to fewer layers, the clients on a layer gone
+    //move to the main one
+    for(i = 0; i < MAX_CLIENTS; i++)
+    {
+        if(clients[i].state == CLIENT_FREE)
+            continue;
+        if(count < 2)
+            clients[i].auto_layer = 0;
+        if(clients[i].layer >= count)
+            switch_layer(&clients[i], LAYER_MAIN);
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+int client_subscribe(
+        struct sockaddr_in* command_addr,
+        uint64_t deadline_us,
+        int multicast)
+{
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    if(!client)
+    {
+        int i;
+        for(i = 0; i < MAX_CLIENTS && clients[i].state != CLIENT_FREE; i++);
+        if(i == MAX_CLIENTS)
+        {
+            pthread_mutex_unlock(&table_lock);
+            DEBUG_ERR("client table full\n");
+            return 0;
+        }
+
+        struct sockaddr_in stream_addr = *command_addr;
+        stream_addr.sin_port = htons(CLIENT_STREAM_PORT);
+
+        client = &clients[i];
+        client->command_addr = *command_addr;
+        init_client(client, &stream_addr);
+
+        client->auto_layer = CLIENT_AUTO_LAYER && layer_count > 1
+            && !multicast;
+
+        //Start with the cached GOP so the client can decode right away
+        start_burst(client);
+        __atomic_store_n(&client->bursting
+                         , !multicast && gop_cache_valid(client->layer)
+                         , __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&subscriber_cond);
+
+        DEBUG_MSG("client %s subscribed\n", inet_ntoa(command_addr->sin_addr));
+    }
+    client->deadline_us = deadline_us;
+    arm_timer(client, deadline_us);
+    client->multicast = multicast;
+    update_group();
+
+    pthread_mutex_unlock(&table_lock);
+
+    return 1;
+}
+
+int client_keepalive(struct sockaddr_in* command_addr, uint64_t deadline_us)
+{
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    if(client)
+    {
+        client->deadline_us = deadline_us;
+        arm_timer(client, deadline_us);
+    }
+
+    pthread_mutex_unlock(&table_lock);
+
+    return (client != 0);
+}
+
+int client_is_subscribed(struct sockaddr_in* command_addr)
+{
+    pthread_mutex_lock(&table_lock);
+    client_t* client = find_client(command_addr);
+    pthread_mutex_unlock(&table_lock);
+
+    return (client != 0);
+}
+
+void client_unsubscribe(struct sockaddr_in* command_addr)
+{
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    if(client)
+        remove_client(client);
+    update_group();
+
+    pthread_mutex_unlock(&table_lock);
+}
+
+int client_timer_fd(int slot)
+{
+    return clients[slot].timer_fd;
+}
+
+void client_session_timer(int slot)
+{
+    client_t* client = &clients[slot];
+    uint64_t expirations;
+
+    if(read(client->timer_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    pthread_mutex_lock(&table_lock);
+
+    //A keepalive may have moved the deadline since the timer fired
+    if(client->state == CLIENT_ACTIVE && get_time_us() >= client->deadline_us)
+    {
+        DEBUG_MSG("client %s timed out\n"
+                  , inet_ntoa(client->command_addr.sin_addr));
+        remove_client(client);
+        update_group();
+    }
+
+    pthread_mutex_unlock(&table_lock);
+}
+
+void client_remove_all()
+{
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+
+    for(i = 0; i < MAX_CLIENTS + 1; i++)
+        if(clients[i].state == CLIENT_ACTIVE)
+            remove_client(&clients[i]);
+
+    pthread_mutex_unlock(&table_lock);
+}
+
+int client_report(
+        struct sockaddr_in* command_addr,
+        receiver_report_t* report,
+        uint64_t now_us)
+{
+    int flags = 0;
+
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    if(client)
+    {
+        flags = rate_control_update(&client->rate, report, now_us);
+        if(client->auto_layer && follow_loss(client, report))
+            flags |= RATE_REQUEST_IDR;
+    }
+
+    pthread_mutex_unlock(&table_lock);
+
+    return flags;
+}
+
+int client_set_layer(
+        struct sockaddr_in* command_addr,
+        int layer,
+        int* request_idr)
+{
+    int result = -1;
+
+    *request_idr = 0;
+    if(layer >= layer_count || (layer == LAYER_AUTO && layer_count < 2))
+        return -1;
+
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    if(client && !client->multicast)
+    {
+        client->auto_layer = (layer == LAYER_AUTO);
+        if(layer != LAYER_AUTO)
+            *request_idr = switch_layer(client, layer);
+        else
+        {
+            client->lossy_reports = 0;
+            client->clean_reports = 0;
+            client->up_reports = LAYER_UP_REPORTS;
+        }
+        result = client->layer;
+    }
+
+    pthread_mutex_unlock(&table_lock);
+
+    return result;
+}
+
+//Refills the retransmit budget of the client for the time since the last
+//NACK
+static void refill_nack_tokens(client_t* client, uint64_t now_us)
+{
+    int64_t rate = stats_gauge(STAT_BITRATE)*NACK_RATE_PERCENT/100;
+
+    if(rate < NACK_MIN_RATE)
+        rate = NACK_MIN_RATE;
+
+    if(client->nack_refill_us)
+        client->nack_tokens += rate*(int64_t)(now_us - client->nack_refill_us)
+            /8000000;
+    if(client->nack_tokens > NACK_BURST_BYTES)
+        client->nack_tokens = NACK_BURST_BYTES;
+    client->nack_refill_us = now_us;
+}
+
+int client_nack(
+        struct sockaddr_in* command_addr,
+        uint16_t* seqs,
+        int count,
+        uint64_t now_us)
+{
+    int sent = 0;
+    int i;
+
+    stats_add(STAT_NACKED_PACKETS, count);
+
+    pthread_mutex_lock(&table_lock);
+
+    client_t* client = find_client(command_addr);
+    //The cached GOP is resent anyway, and a backed up queue only gets
+    //longer
+    if(!client || client->bursting
+       || spsc_ring_count(&client->queue) > NACK_MAX_QUEUE)
+    {
+        pthread_mutex_unlock(&table_lock);
+        stats_add(STAT_RETRANSMIT_LIMITED, count);
+        return 0;
+    }
+
+    refill_nack_tokens(client, now_us);
+
+    for(i = 0; i < count; i++)
+    {
+        nack_packet.size = packet_history_find(client->layer, seqs[i], now_us
+                                               , nack_data);
+        if(!nack_packet.size)
+        {
+            stats_add(STAT_RETRANSMIT_MISSES, 1);
+            continue;
+        }
+
+        //Same packet, same sequence number, the client takes whichever
+        //copy arrives first
+        nack_packet.iov[0].iov_base = nack_data;
+        nack_packet.iov[0].iov_len = nack_packet.size;
+        nack_packet.iov_count = 1;
+        if(client->nack_tokens < (int64_t)nack_packet.size
+           || udp_send_packet(&nack_packet, &client->stream_addr))
+            stats_add(STAT_RETRANSMIT_LIMITED, 1);
+        else
+        {
+            client->nack_tokens -= nack_packet.size;
+            sent++;
+        }
+    }
+
+    __atomic_add_fetch(&client->retransmits, sent, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&table_lock);
+
+    stats_add(STAT_RETRANSMITS, sent);
+
+    return sent;
+}
+
+int client_target_bitrate()
+{
+    int bitrate = 0;
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+
+    for(i = 0; i < MAX_CLIENTS; i++)
+        if(clients[i].state == CLIENT_ACTIVE && clients[i].rate.reports > 1
+           && clients[i].layer == LAYER_MAIN
+           && (!bitrate || clients[i].rate.bitrate < bitrate))
+            bitrate = clients[i].rate.bitrate;
+
+    pthread_mutex_unlock(&table_lock);
+
+    return bitrate;
+}
+
+int client_get_stats(client_stats_t* out, int max)
+{
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+
+    for(i = 0; i < MAX_CLIENTS + 1 && count < max; i++)
+    {
+        client_t* client = &clients[i];
+        if(client->state != CLIENT_ACTIVE)
+            continue;
+
+        client_stats_t* stats = &out[count++];
+        stats->command_addr = client->command_addr;
+        stats->multicast = (client == group);
+        stats->bursting = client->bursting;
+        stats->layer = client->layer;
+        stats->auto_layer = client->auto_layer;
+        stats->queue_depth = spsc_ring_count(&client->queue);
+        stats->sent_frames = __atomic_load_n(&client->sent_frames
+                                             , __ATOMIC_RELAXED);
+        stats->dropped_frames = __atomic_load_n(&client->dropped_frames
+                                                , __ATOMIC_RELAXED);
+        stats->retransmits = __atomic_load_n(&client->retransmits
+                                             , __ATOMIC_RELAXED);
+        stats->bitrate = client->rate.reports > 1 ? client->rate.bitrate : 0;
+    }
+
+    pthread_mutex_unlock(&table_lock);
+
+    return count;
+}
+
+int client_count()
+{
+    int i;
+    int count = 0;
+
+    for(i = 0; i < MAX_CLIENTS; i++)
+        count += (get_state(&clients[i]) == CLIENT_ACTIVE);
+
+    return count;
+}
+
+void client_wait_subscribers(int timeout_ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms/1000;
+    deadline.tv_nsec += (timeout_ms%1000)*1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    if(!client_count() && !is_quit())
+        pthread_cond_timedwait(&subscriber_cond, &table_lock, &deadline);
+    pthread_mutex_unlock(&table_lock);
+}
+
+void client_wake_subscribers()
+{
+    pthread_mutex_lock(&table_lock);
+    pthread_cond_broadcast(&subscriber_cond);
+    pthread_mutex_unlock(&table_lock);
+}
+
+void client_fanout(stream_frame_t* frame)
+{
+    int queued = 0;
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+
+    gop_cache_add(frame);
+    update_group();
+
+    for(i = 0; i < MAX_CLIENTS + 1; i++)
+    {
+        client_t* client = &clients[i];
+        if(client->state != CLIENT_ACTIVE || client->multicast
+           || client->bursting || client->layer != frame->layer)
+            continue;
+
+        //Only a reference is queued, the payload is shared by every client
+        stream_frame_ref(frame);
+        if(!spsc_ring_push(&client->queue, frame))
+        {
+            stream_frame_unref(frame);
+            __atomic_add_fetch(&client->dropped_frames, 1, __ATOMIC_RELAXED);
+            stats_add(STAT_FRAMES_DROPPED, 1);
+        }
+        else
+            queued++;
+    }
+
+    pthread_mutex_unlock(&table_lock);
+
+    __atomic_store_n(&fanout_clients, queued, __ATOMIC_RELAXED);
+    client_wake_sender();
+}
+
+//Sends the next cached frame if it is due, otherwise lowers *next_us to
+//when it is. Returns non zero if a frame was sent
+static int send_burst(client_t* client, uint64_t now_us, uint64_t* next_us)
+{
+    int sent = 0;
+
+    pthread_mutex_lock(&table_lock);
+
+    //A new IDR replaced the cache, start over with it
+    if(client->burst_generation != gop_cache_generation(client->layer))
+    {
+        client->burst_generation = gop_cache_generation(client->layer);
+        client->burst_step = 0;
+    }
+
+    //Caught up, client_fanout() queues the live frames from here on
+    if(!gop_cache_valid(client->layer)
+       || client->burst_step >= gop_cache_steps(client->layer))
+        __atomic_store_n(&client->bursting, 0, __ATOMIC_RELEASE);
+    else if(now_us >= client->burst_next_us)
+    {
+        gop_cache_packetize(client->layer, client->burst_step++, &burst_rtp);
+        if(udp_send_stream(&burst_rtp, &client->stream_addr))
+        {
+            __atomic_add_fetch(&client->dropped_frames, 1, __ATOMIC_RELAXED);
+            stats_add(STAT_FRAMES_DROPPED, 1);
+        }
+        client->burst_next_us = now_us + GOP_BURST_INTERVAL_US;
+        sent = 1;
+    }
+    else if(!*next_us || client->burst_next_us < *next_us)
+        *next_us = client->burst_next_us;
+
+    pthread_mutex_unlock(&table_lock);
+
+    return sent;
+}
+
+pacing_mode client_set_pacing(pacing_config_t* config)
+{
+    pacing_mode mode = config->mode;
+
+    if(mode == PACING_TXTIME && !udp_enable_txtime())
+    {
+        DEBUG_MSG("SO_TXTIME not supported, pacing in user space\n");
+        mode = PACING_USER;
+    }
+    if(mode != PACING_RATE)
+        udp_set_pacing_rate(0);
+
+    __atomic_store_n(&pacing_spread_percent, config->spread_percent
+                     , __ATOMIC_RELAXED);
+    __atomic_store_n(&pacing_mode_now, mode, __ATOMIC_RELEASE);
+    client_wake_sender();
+
+    return mode;
+}
+
+void client_set_frame_interval(uint32_t interval_us)
+{
+    __atomic_store_n(&frame_interval_us, interval_us, __ATOMIC_RELAXED);
+}
+
+//Drops the frames queued to the client and the one being paced out
+static void drop_queued(client_t* client)
+{
+    stream_frame_t* frame;
+
+    if(client->pacing_frame)
+        stream_frame_unref(client->pacing_frame);
+    client->pacing_frame = 0;
+    while((frame = (stream_frame_t*)spsc_ring_pop(&client->queue)))
+        stream_frame_unref(frame);
+}
+
+//Takes frame off the queue to be paced out
+static void start_paced(client_t* client, stream_frame_t* frame, uint64_t now_us)
+{
+    rtp_frame_t* rtp = &frame->rtp;
+    int count = rtp->packet_count + rtp->repair_count;
+    uint64_t spread_us = (uint64_t)__atomic_load_n(&frame_interval_us
+                                                   , __ATOMIC_RELAXED)
+        *__atomic_load_n(&pacing_spread_percent, __ATOMIC_RELAXED)/100;
+    uint32_t bytes = 0;
+    int i;
+
+    for(i = 0; i < count; i++)
+        bytes += rtp->packets[i].size;
+
+    client->pacing_frame = frame;
+    client->pacing_next = 0;
+    pacer_start_frame(&client->pacer, bytes, spread_us, now_us);
+
+    //The socket is shared, its rate has to cover every client of the frame
+    if(__atomic_load_n(&pacing_mode_now, __ATOMIC_ACQUIRE) == PACING_RATE)
+    {
+        int clients = __atomic_load_n(&fanout_clients, __ATOMIC_RELAXED);
+        udp_set_pacing_rate(client->pacer.rate*(clients > 1 ? clients : 1));
+    }
+}
+
+//Sends the packets of the paced frame that are due, otherwise lowers
+//*next_us to when the next one is. Returns non zero if any was sent
+static int send_paced(client_t* client, uint64_t now_us, uint64_t* next_us)
+{
+    stream_frame_t* frame = client->pacing_frame;
+    rtp_frame_t* rtp = &frame->rtp;
+    int count = rtp->packet_count + rtp->repair_count;
+    int first = client->pacing_next;
+    int last = first;
+    int mode = __atomic_load_n(&pacing_mode_now, __ATOMIC_ACQUIRE);
+    //The next frame is waiting already, pacing would only add latency
+    int catch_up = spsc_ring_count(&client->queue) > 0;
+    int ret;
+
+    if(mode != PACING_USER || catch_up)
+        last = count;
+    else
+        while(last < count && pacer_ready(&client->pacer, now_us))
+            pacer_consume(&client->pacer, rtp->packets[last++].size);
+
+    if(last == first)
+    {
+        uint64_t due_us = pacer_due_us(&client->pacer, now_us);
+        if(!*next_us || due_us < *next_us)
+            *next_us = due_us;
+        return 0;
+    }
+
+    if(mode == PACING_TXTIME)
+        ret = udp_send_timed(&rtp->packets[first], last - first
+                             , &client->stream_addr, now_us
+                             , catch_up ? 0 : client->pacer.spread_us);
+    else
+        ret = udp_send_packets(&rtp->packets[first], last - first
+                               , &client->stream_addr, frame);
+    client->pacing_next = last;
+
+    if(ret)
+    {
+        __atomic_add_fetch(&client->dropped_frames, 1, __ATOMIC_RELAXED);
+        stats_add(STAT_FRAMES_DROPPED, 1);
+    }
+    else if(last == count)
+    {
+        __atomic_add_fetch(&client->sent_frames, 1, __ATOMIC_RELAXED);
+        frame_trace_sent(&frame->trace, get_time_us());
+    }
+
+    if(ret || last == count)
+    {
+        stream_frame_unref(frame);
+        client->pacing_frame = 0;
+    }
+
+    return 1;
+}
+
+uint64_t client_send_queued()
+{
+    uint64_t next_us;
+    int progress;
+    int i;
+
+    //One frame per client and pass, so a client with a long queue doesn't
+    //delay the others
+    do
+    {
+        progress = 0;
+        next_us = 0;
+
+        for(i = 0; i < MAX_CLIENTS + 1; i++)
+        {
+            client_t* client = &clients[i];
+            int state = get_state(client);
+            stream_frame_t* frame;
+
+            if(state == CLIENT_FREE)
+                continue;
+
+            if(state == CLIENT_CLOSING)
+            {
+                drop_queued(client);
+
+                pthread_mutex_lock(&table_lock);
+                set_state(client, CLIENT_FREE);
+                pthread_mutex_unlock(&table_lock);
+                continue;
+            }
+
+            //Only a layer switch leaves frames queued to a bursting client,
+            //of the old layer
+            if(__atomic_load_n(&client->bursting, __ATOMIC_ACQUIRE))
+            {
+                drop_queued(client);
+                progress |= send_burst(client, get_time_us(), &next_us);
+                continue;
+            }
+
+            if(!client->pacing_frame)
+            {
+                if(!(frame = (stream_frame_t*)spsc_ring_pop(&client->queue)))
+                    continue;
+                start_paced(client, frame, get_time_us());
+            }
+
+            progress |= send_paced(client, get_time_us(), &next_us);
+        }
+    } while(progress);
+
+    return next_us;
+}
+
+void client_wait_queued(uint64_t deadline_us)
+{
+    if(!deadline_us)
+    {
+        while(sem_wait(&queued_sem) < 0 && errno == EINTR);
+        return;
+    }
+
+    //sem_timedwait() only takes CLOCK_REALTIME
+    uint64_t now_us = get_time_us();
+    uint64_t wait_us = deadline_us > now_us ? deadline_us - now_us : 0;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_us/1000000;
+    deadline.tv_nsec += (wait_us%1000000)*1000;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while(sem_timedwait(&queued_sem, &deadline) < 0 && errno == EINTR);
+}
+
+void client_wake_sender()
+{
+    sem_post(&queued_sem);
+}
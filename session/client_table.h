@@ -0,0 +1,185 @@
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <netinet/in.h>
+
+#include "stream_frame.h"
+#include "gop_cache.h"
+#include "rate_control.h"
+#include "pacer.h"
+#include "../common_util/spsc_ring.h"
+#include "../common_util/stats.h"
+
+#define MAX_CLIENTS 16
+//Frames waiting to be sent to one client. A client that falls further behind
+//drops frames for itself only
+#define CLIENT_QUEUE_DEPTH 4 //power of two
+//A new client first gets the cached GOP, one frame every
+//GOP_BURST_INTERVAL_US, then the live frames
+#define GOP_BURST_INTERVAL_US 10000
+//Retransmits to one client are limited to NACK_RATE_PERCENT of the encoded
+//bitrate (at least NACK_MIN_RATE bits/s), in bursts of up to
+//NACK_BURST_BYTES. A client whose queue is deeper than NACK_MAX_QUEUE gets
+//none, it is short of bandwidth already
+#define NACK_RATE_PERCENT 25
+#define NACK_MIN_RATE 200000
+#define NACK_BURST_BYTES (16*1500)
+#define NACK_MAX_QUEUE 1
+//With a simulcast source a client follows its loss unless it picked a layer
+//with SET_LAYER: down to the low layer after LAYER_DOWN_REPORTS receiver
+//reports in a row over LAYER_DOWN_LOSS, back up after LAYER_UP_REPORTS in a
+//row under LAYER_UP_LOSS. Falling back down sooner than that doubles the
+//wait for the next try, up to LAYER_UP_MAX_REPORTS
+#define CLIENT_AUTO_LAYER 1
+#define LAYER_DOWN_LOSS 0.10
+#define LAYER_DOWN_REPORTS 2
+#define LAYER_UP_LOSS 0.02
+#define LAYER_UP_REPORTS 10
+#define LAYER_UP_MAX_REPORTS 160
+//client_set_layer() mode that follows the loss
+#define LAYER_AUTO -1
+
+typedef enum {
+    CLIENT_FREE = 0,
+    CLIENT_ACTIVE,
+    //Removed, the sender thread still has to drop its queued frames
+    CLIENT_CLOSING,
+} client_state;
+
+typedef struct {
+    int state;
+    //Receives the multicast group stream instead of its own copy
+    int multicast;
+    //Where the commands come from, identifies the client
+    struct sockaddr_in command_addr;
+    //Where the stream is sent to
+    struct sockaddr_in stream_addr;
+    uint64_t deadline_us;
+    //timerfd armed to deadline_us, none for the multicast group
+    int timer_fd;
+    //Pushed by the stream thread, popped by the sender thread
+    spsc_ring_t queue;
+    void* queue_slots[CLIENT_QUEUE_DEPTH];
+    uint64_t sent_frames;
+    uint64_t dropped_frames;
+    //Layer the client gets, the group always gets LAYER_MAIN
+    int layer;
+    //Following the loss, with the reports counted toward a switch
+    int auto_layer;
+    int layer_reports; //since the last switch
+    int lossy_reports; //in a row
+    int clean_reports; //in a row
+    int up_reports; //clean reports needed to go up
+    //Catching up with the cached GOP of its layer. No live frames are
+    //queued meanwhile, the cache holds them too. After a layer switch the
+    //sender thread first drops the frames of the old layer. Written under
+    //table_lock, the sender thread reads it atomically without
+    int bursting;
+    int burst_step;
+    uint32_t burst_generation;
+    uint64_t burst_next_us;
+    //Bandwidth estimate from the receiver reports of the client
+    rate_control_t rate;
+    //Token bucket of the retransmits, in bytes
+    int64_t nack_tokens;
+    uint64_t nack_refill_us;
+    uint64_t retransmits;
+    //Frame being paced out, taken off the queue, and its next packet. Only
+    //used by the sender thread
+    stream_frame_t* pacing_frame;
+    int pacing_next;
+    pacer_t pacer;
+} client_t;
+
+//What STATS reports about one client
+typedef struct {
+    //Identifies the client, the group address for the multicast group
+    struct sockaddr_in command_addr;
+    int multicast; //the multicast group itself
+    int bursting;
+    int layer;
+    int auto_layer;
+    uint32_t queue_depth;
+    uint64_t sent_frames;
+    uint64_t dropped_frames;
+    uint64_t retransmits;
+    int bitrate; //bandwidth estimate, 0 without receiver reports
+} client_stats_t;
+
+void client_table_init();
+//Layers of the source, 1 without simulcast. The clients on a layer above
+//count move to the main one
+void client_set_layer_count(int count);
+//Adds the client or extends its session until deadline_us. A multicast
+//client joins MCAST_GROUP, which is sent once for all of them while any is
+//subscribed. Returns 0 if the table is full
+int client_subscribe(
+    struct sockaddr_in* command_addr,
+    uint64_t deadline_us,
+    int multicast);
+//Extends the session of a known client. Returns 0 if it isn't subscribed
+int client_keepalive(struct sockaddr_in* command_addr, uint64_t deadline_us);
+int client_is_subscribed(struct sockaddr_in* command_addr);
+void client_unsubscribe(struct sockaddr_in* command_addr);
+//timerfd of the table slot, readable once the session may have timed out
+int client_timer_fd(int slot);
+//Removes the client of the slot if its session timed out
+void client_session_timer(int slot);
+void client_remove_all();
+int client_count();
+//Updates the bandwidth estimate of the client and moves it to another layer
+//if it follows the loss. Returns the rate_control_update() flags, with
+//RATE_REQUEST_IDR also if the new layer has no GOP cached, 0 if it isn't
+//subscribed
+int client_report(
+    struct sockaddr_in* command_addr,
+    receiver_report_t* report,
+    uint64_t now_us);
+//Sends the media packets of the sequence numbers in seqs to the client
+//again, as far as they are still in the packet history and the retransmit
+//rate allows. Returns how many were sent
+int client_nack(
+    struct sockaddr_in* command_addr,
+    uint16_t* seqs,
+    int count,
+    uint64_t now_us);
+//Puts the client on layer, or LAYER_AUTO to follow its loss. Returns the
+//layer it gets now, -1 if it isn't subscribed, takes the multicast group
+//or the source has no such layer. Sets *request_idr if a switch found no
+//GOP cached to start the new layer from
+int client_set_layer(
+    struct sockaddr_in* command_addr,
+    int layer,
+    int* request_idr);
+//Lowest estimate of the main layer clients that send reports, 0 if none
+//does. The encoder is shared, so the slowest client sets the pace
+int client_target_bitrate();
+//Fills out with the active clients and the multicast group, at most max.
+//Returns how many
+int client_get_stats(client_stats_t* out, int max);
+//Waits until there is a subscriber, client_wake_subscribers() or timeout_ms
+//elapsed
+void client_wait_subscribers(int timeout_ms);
+void client_wake_subscribers();
+
+//Adds the frame to the GOP cache and queues a reference of it for every
+//active client of its layer
+void client_fanout(stream_frame_t* frame);
+//Pacing of the frames sent from the queues. Returns the mode used, which is
+//PACING_USER if the kernel lacks the option of the one asked for
+pacing_mode client_set_pacing(pacing_config_t* config);
+//Time between two frames of the source, what the pacing spreads over
+void client_set_frame_interval(uint32_t interval_us);
+//Sends the queued frames round robin, paced. Returns once every queue is
+//empty and no burst frame or paced packet is due, with the time the next
+//one is due (0 if none)
+uint64_t client_send_queued();
+//Blocks the sender thread until frames are queued, client_wake_sender() or
+//deadline_us (0 waits without deadline)
+void client_wait_queued(uint64_t deadline_us);
+void client_wake_sender();
+
+#endif
@@ -0,0 +1,97 @@
+#include "frame_trace.h"
+#include "../common_util/common_util.h"
+
+static latency_hist_t stages[TRACE_STAGES];
+static const char* stage_names[TRACE_STAGES] = {
+    "encode",
+    "handoff",
+    "packetize",
+    "first_send",
+    "last_send",
+    "total",
+};
+
+static void record_stage(int stage, uint64_t from_us, uint64_t to_us)
+{
+    //A stage the frame never reached, or a source clock running ahead
+    if(!from_us || !to_us || to_us < from_us)
+        return;
+
+    latency_hist_record(&stages[stage], to_us - from_us);
+}
+
+void frame_trace_reset()
+{
+    int i;
+
+    for(i = 0; i < TRACE_STAGES; i++)
+        latency_hist_reset(&stages[i]);
+}
+
+void frame_trace_record(frame_trace_t* trace)
+{
+    record_stage(TRACE_ENCODE, trace->capture_us, trace->ready_us);
+    record_stage(TRACE_HANDOFF, trace->ready_us, trace->filled_us);
+    record_stage(TRACE_PACKETIZE, trace->filled_us, trace->queued_us);
+    record_stage(TRACE_FIRST_SEND, trace->queued_us, trace->first_sent_us);
+    record_stage(TRACE_LAST_SEND, trace->queued_us, trace->last_sent_us);
+    record_stage(TRACE_TOTAL, trace->capture_us, trace->last_sent_us);
+}
+
+void frame_trace_sent(frame_trace_t* trace, uint64_t now_us)
+{
+    //Only the sender thread sends, the stream thread reads the stamps once
+    //the last reference is dropped
+    if(!trace->first_sent_us)
+        trace->first_sent_us = now_us;
+    trace->last_sent_us = now_us;
+}
+
+int frame_trace_format(char* out, int size)
+{
+    int used = 0;
+    int i;
+
+    for(i = 0; i < TRACE_STAGES && used < size; i++)
+    {
+        int len = snprintf(out + used, size - used, "%s%s=%llu/%llu/%llu"
+                           , i ? " " : "", stage_names[i]
+                           , (unsigned long long)latency_hist_percentile(&stages[i], 50)
+                           , (unsigned long long)latency_hist_percentile(&stages[i], 99)
+                           , (unsigned long long)latency_hist_max(&stages[i]));
+        if(len < 0)
+            break;
+        used += len;
+    }
+
+    return used < size ? used : size - 1;
+}
+
+void frame_trace_log()
+{
+    int i;
+
+    for(i = 0; i < TRACE_STAGES; i++)
+    {
+        if(!latency_hist_count(&stages[i]))
+            continue;
+
+        DEBUG_MSG("latency %s: p50 %llu us, p99 %llu us, max %llu us"
+                  " (%llu frames)\n"
+                  , stage_names[i]
+                  , (unsigned long long)latency_hist_percentile(&stages[i], 50)
+                  , (unsigned long long)latency_hist_percentile(&stages[i], 99)
+                  , (unsigned long long)latency_hist_max(&stages[i])
+                  , (unsigned long long)latency_hist_count(&stages[i]));
+    }
+}
+
+latency_hist_t* frame_trace_stage(trace_stage stage)
+{
+    return &stages[stage];
+}
+
+const char* frame_trace_stage_name(trace_stage stage)
+{
+    return stage_names[stage];
+}
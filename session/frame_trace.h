@@ -0,0 +1,45 @@
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../common_util/latency_hist.h"
+
+//Room for the GET_LATENCY reply
+#define LATENCY_REPLY_SIZE 512
+
+//Monotonic timestamps of one frame on its way from the camera to the
+//network, 0 if the frame never got there
+typedef struct {
+    uint64_t capture_us; //sensor capture, see source_buffer_t
+    uint64_t ready_us; //the source had the encoded frame
+    uint64_t filled_us; //fill_buffer() returned it to the stream thread
+    uint64_t queued_us; //packetized, about to be fanned out
+    uint64_t first_sent_us; //send to the first client done
+    uint64_t last_sent_us; //send to the last client done
+} frame_trace_t;
+
+//Stages recorded by frame_trace_record()
+typedef enum {
+    TRACE_ENCODE = 0, //capture to ready
+    TRACE_HANDOFF, //ready to filled
+    TRACE_PACKETIZE, //filled to queued
+    TRACE_FIRST_SEND, //queued to first sent
+    TRACE_LAST_SEND, //queued to last sent, the slowest client
+    TRACE_TOTAL, //capture to last sent
+    TRACE_STAGES,
+} trace_stage;
+
+void frame_trace_reset();
+//Adds a finished frame to the stage histograms, called once its last
+//reference is gone
+void frame_trace_record(frame_trace_t* trace);
+void frame_trace_sent(frame_trace_t* trace, uint64_t now_us);
+//p50/p99/max of every stage in us, "<stage>=<p50>/<p99>/<max>"
+int frame_trace_format(char* out, int size);
+void frame_trace_log();
+latency_hist_t* frame_trace_stage(trace_stage stage);
+const char* frame_trace_stage_name(trace_stage stage);
+
+#endif
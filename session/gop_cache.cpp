@@ -0,0 +1,195 @@
+#include "gop_cache.h"
+
+typedef struct {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t timestamp;
+    uint16_t sequence;
+    int end_of_frame;
+} cached_frame_t;
+
+typedef struct {
+    uint8_t arena[GOP_CACHE_BYTES];
+    uint32_t arena_used;
+    cached_frame_t frames[GOP_CACHE_MAX_FRAMES];
+    int frame_count;
+    int valid;
+    uint32_t generation;
+    uint32_t ssrc;
+    uint8_t config[GOP_CACHE_CONFIG_BYTES];
+    uint32_t config_len;
+} gop_cache_t;
+
+//Only touched with the client table lock held, see client_fanout()
+static gop_cache_t caches[STREAM_LAYERS];
+
+static uint16_t header_sequence(rtp_packet_t* packet)
+{
+    return (packet->header[2] << 8) | packet->header[3];
+}
+
+static uint32_t header_ssrc(rtp_packet_t* packet)
+{
+    return ((uint32_t)packet->header[8] << 24) | (packet->header[9] << 16)
+        | (packet->header[10] << 8) | packet->header[11];
+}
+
+static uint32_t header_timestamp(rtp_packet_t* packet)
+{
+    return ((uint32_t)packet->header[4] << 24) | (packet->header[5] << 16)
+        | (packet->header[6] << 8) | packet->header[7];
+}
+
+//Keeps the newest SPS/PPS of the frame copied to the arena at offset
+static void scan_config(gop_cache_t* cache, uint32_t offset, uint32_t len)
+{
+    static const uint8_t start_code[4] = {0, 0, 0, 1};
+    uint8_t* buf = &cache->arena[offset];
+    uint8_t* pos = buf;
+    nal_unit_t nal;
+    int new_config = 1;
+
+    while(h264_next_nal_unit(&pos, buf + len, &nal))
+    {
+        int type = nal.data[0] & 0x1f;
+
+        if(type != NAL_TYPE_SPS && type != NAL_TYPE_PPS)
+            continue;
+
+        //A new SPS/PPS set replaces the previous one
+        if(new_config)
+            cache->config_len = 0;
+        new_config = 0;
+
+        if(cache->config_len + sizeof(start_code) + nal.len
+           > GOP_CACHE_CONFIG_BYTES)
+        {
+            DEBUG_ERR("gop cache: SPS/PPS too big\n");
+            continue;
+        }
+        memcpy(&cache->config[cache->config_len], start_code
+               , sizeof(start_code));
+        memcpy(&cache->config[cache->config_len + sizeof(start_code)]
+               , nal.data, nal.len);
+        cache->config_len += sizeof(start_code) + nal.len;
+    }
+}
+
+void gop_cache_init()
+{
+    int i;
+
+    for(i = 0; i < STREAM_LAYERS; i++)
+    {
+        caches[i].arena_used = 0;
+        caches[i].frame_count = 0;
+        caches[i].valid = 0;
+        caches[i].config_len = 0;
+    }
+}
+
+void gop_cache_add(stream_frame_t* frame)
+{
+    gop_cache_t* cache = &caches[frame->layer];
+    source_frame_t* source = &frame->source;
+    int i;
+
+    if(!frame->rtp.packet_count)
+        return;
+
+    if(source->keyframe)
+    {
+        //Replace the previous GOP in place
+        cache->arena_used = 0;
+        cache->frame_count = 0;
+        cache->valid = 1;
+        cache->generation++;
+    }
+
+    if(!cache->valid)
+        return;
+
+    if(cache->frame_count == GOP_CACHE_MAX_FRAMES
+       || cache->arena_used + source->len > GOP_CACHE_BYTES
+       || !source->complete)
+    {
+        //Incomplete GOPs are useless, wait for the next IDR
+        cache->valid = 0;
+        return;
+    }
+
+    rtp_packet_t* first = &frame->rtp.packets[0];
+    rtp_packet_t* last = &frame->rtp.packets[frame->rtp.packet_count - 1];
+    cached_frame_t* cached = &cache->frames[cache->frame_count++];
+
+    //The copy makes the frame contiguous
+    cached->offset = cache->arena_used;
+    for(i = 0; i < source->buffer_count; i++)
+    {
+        memcpy(&cache->arena[cache->arena_used], source->segments[i].iov_base
+               , source->segments[i].iov_len);
+        cache->arena_used += source->segments[i].iov_len;
+    }
+    cached->len = source->len;
+    cached->sequence = header_sequence(first);
+    cached->timestamp = header_timestamp(first);
+    cached->end_of_frame = last->header[1] & 0x80;
+    cache->ssrc = header_ssrc(first);
+
+    if(source->keyframe)
+        scan_config(cache, cached->offset, cached->len);
+}
+
+int gop_cache_valid(int layer)
+{
+    return caches[layer].valid;
+}
+
+uint32_t gop_cache_generation(int layer)
+{
+    return caches[layer].generation;
+}
+
+int gop_cache_steps(int layer)
+{
+    return caches[layer].valid ? caches[layer].frame_count + 1 : 0;
+}
+
+int gop_cache_packetize(int layer, int step, rtp_frame_t* rtp)
+{
+    gop_cache_t* cache = &caches[layer];
+    rtp_session_t session;
+
+    if(!cache->valid || step > cache->frame_count)
+        return 0;
+
+    session.ssrc = cache->ssrc;
+
+    if(step == 0)
+    {
+        if(!cache->config_len)
+        {
+            rtp->packet_count = 0;
+            rtp->repair_count = 0;
+            return 1;
+        }
+
+        //Take the sequence numbers right before the IDR, the client never
+        //saw the live packets that used them
+        session.sequence = 0;
+        int count = rtp_packetize_h264(&session, rtp, cache->config
+                                       , cache->config_len
+                                       , cache->frames[0].timestamp, 0);
+        session.sequence = cache->frames[0].sequence - count;
+        rtp_packetize_h264(&session, rtp, cache->config, cache->config_len
+                           , cache->frames[0].timestamp, 0);
+        return 1;
+    }
+
+    cached_frame_t* cached = &cache->frames[step - 1];
+    session.sequence = cached->sequence;
+    rtp_packetize_h264(&session, rtp, &cache->arena[cached->offset]
+                       , cached->len, cached->timestamp, cached->end_of_frame);
+
+    return 1;
+}
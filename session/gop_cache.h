@@ -0,0 +1,34 @@
+#ifndef GOP_CACHE_H
+#define GOP_CACHE_H
+
+#include <stdint.h>
+
+#include "stream_frame.h"
+#include "../rtp/rtp_h264.h"
+
+//Copy of the current GOP (the last IDR and every frame after it) of each
+//layer, so a new client or one switching layers can decode right away.
+//Capped at GOP_CACHE_BYTES and GOP_CACHE_MAX_FRAMES per layer, a longer GOP
+//isn't cached until the next IDR
+#define GOP_CACHE_BYTES (1024*1024)
+#define GOP_CACHE_MAX_FRAMES 128
+//Last SPS/PPS seen, sent ahead of the GOP
+#define GOP_CACHE_CONFIG_BYTES 256
+
+void gop_cache_init();
+//Copies the frame into the cache of its layer. An IDR replaces the cached
+//GOP in place
+void gop_cache_add(stream_frame_t* frame);
+//Non zero if the cache of layer holds a GOP starting with an IDR
+int gop_cache_valid(int layer);
+//Incremented every time the cached GOP of layer is replaced
+uint32_t gop_cache_generation(int layer);
+//Number of burst steps: the SPS/PPS then every cached frame
+int gop_cache_steps(int layer);
+//Packetizes a burst step with the sequence numbers and timestamps of the
+//live stream, so the live frames that follow continue it seamlessly. The
+//packets point into the cache and are only valid until the next
+//gop_cache_add(). Returns 0 if there is no such step
+int gop_cache_packetize(int layer, int step, rtp_frame_t* rtp);
+
+#endif
@@ -0,0 +1,34 @@
+#include "keyframe_request.h"
+
+void keyframe_request_init(keyframe_request_t* kr)
+{
+    kr->requests = 0;
+    kr->asked = 0;
+    kr->asked_us = 0;
+    kr->keyframe_us = 0;
+}
+
+void keyframe_request_add(keyframe_request_t* kr)
+{
+    kr->requests++;
+}
+
+int keyframe_request_due(keyframe_request_t* kr, uint64_t now_us)
+{
+    if(!kr->requests
+       || (kr->asked && now_us - kr->asked_us < KEYFRAME_RETRY_US)
+       || (kr->keyframe_us
+           && now_us - kr->keyframe_us < KEYFRAME_MIN_INTERVAL_US))
+        return 0;
+
+    kr->asked = 1;
+    kr->asked_us = now_us;
+    return 1;
+}
+
+void keyframe_request_delivered(keyframe_request_t* kr, uint64_t now_us)
+{
+    kr->requests = 0;
+    kr->asked = 0;
+    kr->keyframe_us = now_us;
+}
@@ -0,0 +1,32 @@
+#ifndef KEYFRAME_REQUEST_H
+#define KEYFRAME_REQUEST_H
+
+#include <stdint.h>
+
+//IDRs asked for by the clients (KEYFRAME_REQUEST after a loss they couldn't
+//repair), by loss spikes and by layer switches. Every request until the
+//next keyframe leaves the source is served by that one, so a loss seen by
+//many clients at once makes a single IDR. Asked IDRs are at least
+//KEYFRAME_MIN_INTERVAL_US after the last keyframe, a request within it
+//waits. A source that ignored the ask is asked again after KEYFRAME_RETRY_US
+#define KEYFRAME_MIN_INTERVAL_US 500000
+#define KEYFRAME_RETRY_US 1000000
+
+typedef struct {
+    uint32_t requests; //since the last keyframe
+    int asked; //the source was asked, its keyframe didn't come yet
+    uint64_t asked_us;
+    uint64_t keyframe_us; //last keyframe delivered, 0 for none
+} keyframe_request_t;
+
+//Pure functions of the requests and the time like rate_control.h, the
+//caller does the locking
+void keyframe_request_init(keyframe_request_t* kr);
+void keyframe_request_add(keyframe_request_t* kr);
+//Non zero if the source should be asked for an IDR now, which is then taken
+//as done
+int keyframe_request_due(keyframe_request_t* kr, uint64_t now_us);
+//A keyframe was delivered, asked for or not
+void keyframe_request_delivered(keyframe_request_t* kr, uint64_t now_us);
+
+#endif
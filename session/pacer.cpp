@@ -0,0 +1,62 @@
+#include "pacer.h"
+
+static const char* mode_names[] = {"off", "user", "rate", "txtime"};
+
+void pacing_config_default(pacing_config_t* config)
+{
+    config->mode = PACING_MODE;
+    config->spread_percent = PACING_SPREAD_PERCENT;
+}
+
+const char* pacing_mode_name(pacing_mode mode)
+{
+    return mode_names[mode];
+}
+
+void pacer_start_frame(
+        pacer_t* pacer,
+        uint32_t bytes,
+        uint64_t spread_us,
+        uint64_t now_us)
+{
+    pacer->spread_us = spread_us;
+    pacer->rate = spread_us ? (uint64_t)bytes*1000000/spread_us : 0;
+    pacer->tokens = (int64_t)PACING_BURST_BYTES*1000000;
+    pacer->refill_us = now_us;
+}
+
+static void refill(pacer_t* pacer, uint64_t now_us)
+{
+    int64_t full = (int64_t)PACING_BURST_BYTES*1000000;
+
+    if(now_us <= pacer->refill_us)
+        return;
+
+    pacer->tokens += pacer->rate*(now_us - pacer->refill_us);
+    if(pacer->tokens > full)
+        pacer->tokens = full;
+    pacer->refill_us = now_us;
+}
+
+int pacer_ready(pacer_t* pacer, uint64_t now_us)
+{
+    if(!pacer->rate)
+        return 1;
+
+    refill(pacer, now_us);
+
+    return pacer->tokens > 0;
+}
+
+void pacer_consume(pacer_t* pacer, uint32_t bytes)
+{
+    pacer->tokens -= (int64_t)bytes*1000000;
+}
+
+uint64_t pacer_due_us(pacer_t* pacer, uint64_t now_us)
+{
+    if(!pacer->rate || pacer_ready(pacer, now_us))
+        return now_us;
+
+    return pacer->refill_us + (-pacer->tokens)/pacer->rate + 1;
+}
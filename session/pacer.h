@@ -0,0 +1,56 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+//Spreads the packets of a frame over spread_percent of the frame interval,
+//so an IDR doesn't hit the access point queue in one burst
+typedef enum {
+    PACING_OFF = 0,
+    //Token bucket of the sender thread, works everywhere
+    PACING_USER,
+    //SO_MAX_PACING_RATE set per frame, needs the fq qdisc on the interface
+    PACING_RATE,
+    //SO_TXTIME launch time per packet, needs the fq qdisc on the interface
+    PACING_TXTIME,
+} pacing_mode;
+
+//Defaults of pacing_config_t, changed at runtime with SET_PACING
+#define PACING_MODE PACING_USER
+#define PACING_SPREAD_PERCENT 50
+//Depth of the user token bucket. The first packets of a frame go out at
+//once, and a wakeup sends what is due in one go rather than a packet each
+#define PACING_BURST_BYTES (4*1500)
+//Timer slack of the sender thread, the default 50 us is close to the gaps
+//of a large frame
+#define PACING_TIMER_SLACK_NS 5000
+
+typedef struct {
+    pacing_mode mode;
+    int spread_percent; //1 to 100
+} pacing_config_t;
+
+//Tokens are kept in millionths of a byte, so no fraction is lost on refill
+typedef struct {
+    uint64_t spread_us; //of the current frame
+    uint64_t rate; //bytes/s of the current frame, 0 doesn't pace
+    int64_t tokens;
+    uint64_t refill_us;
+} pacer_t;
+
+void pacing_config_default(pacing_config_t* config);
+const char* pacing_mode_name(pacing_mode mode);
+//Starts a frame of bytes to be sent within spread_us, with a full bucket
+void pacer_start_frame(
+    pacer_t* pacer,
+    uint32_t bytes,
+    uint64_t spread_us,
+    uint64_t now_us);
+//Non zero if a packet may go now. The bucket may go below zero by the last
+//packet sent, so a packet larger than the bucket is no special case
+int pacer_ready(pacer_t* pacer, uint64_t now_us);
+void pacer_consume(pacer_t* pacer, uint32_t bytes);
+//When pacer_ready() turns true
+uint64_t pacer_due_us(pacer_t* pacer, uint64_t now_us);
+
+#endif
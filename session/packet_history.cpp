@@ -0,0 +1,87 @@
+#include "packet_history.h"
+
+#include <pthread.h>
+#include <string.h>
+
+typedef struct {
+    uint64_t added_us;
+    uint32_t size; //0 for an empty slot
+    uint16_t sequence;
+    uint8_t data[PACKET_HISTORY_PACKET_SIZE];
+} history_packet_t;
+
+//Added to by the thread delivering the frames, searched from the command
+//handler. The media packets of a layer have consecutive sequence numbers,
+//each goes to the slot of its sequence number
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static history_packet_t history[STREAM_LAYERS][PACKET_HISTORY_PACKETS];
+
+static uint16_t packet_sequence(rtp_packet_t* packet)
+{
+    return (packet->header[2] << 8) | packet->header[3];
+}
+
+void packet_history_add(stream_frame_t* frame, uint64_t now_us)
+{
+    int i, j;
+
+    pthread_mutex_lock(&history_lock);
+    for(i = 0; i < frame->rtp.packet_count; i++)
+    {
+        rtp_packet_t* packet = &frame->rtp.packets[i];
+        uint16_t sequence = packet_sequence(packet);
+        history_packet_t* slot = &history[frame->layer]
+            [sequence & (PACKET_HISTORY_PACKETS - 1)];
+        uint32_t size = 0;
+
+        slot->size = 0;
+        for(j = 0; j < packet->iov_count; j++)
+        {
+            if(size + packet->iov[j].iov_len > PACKET_HISTORY_PACKET_SIZE)
+                break;
+            memcpy(slot->data + size, packet->iov[j].iov_base
+                   , packet->iov[j].iov_len);
+            size += packet->iov[j].iov_len;
+        }
+        if(j < packet->iov_count)
+            continue;
+
+        slot->added_us = now_us;
+        slot->sequence = sequence;
+        slot->size = size;
+    }
+    pthread_mutex_unlock(&history_lock);
+}
+
+uint32_t packet_history_find(
+        int layer,
+        uint16_t sequence,
+        uint64_t now_us,
+        uint8_t* data)
+{
+    history_packet_t* slot = &history[layer]
+        [sequence & (PACKET_HISTORY_PACKETS - 1)];
+    uint32_t size = 0;
+
+    pthread_mutex_lock(&history_lock);
+    if(slot->size && slot->sequence == sequence
+       && now_us - slot->added_us <= PACKET_HISTORY_MS*1000ull)
+    {
+        size = slot->size;
+        memcpy(data, slot->data, size);
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    return size;
+}
+
+void packet_history_clear()
+{
+    int layer, i;
+
+    pthread_mutex_lock(&history_lock);
+    for(layer = 0; layer < STREAM_LAYERS; layer++)
+        for(i = 0; i < PACKET_HISTORY_PACKETS; i++)
+            history[layer][i].size = 0;
+    pthread_mutex_unlock(&history_lock);
+}
@@ -0,0 +1,35 @@
+#ifndef PACKET_HISTORY_H
+#define PACKET_HISTORY_H
+
+#include <stdint.h>
+
+#include "stream_frame.h"
+
+//The media packets sent of each layer, for retransmission. They are copied,
+//so the history holds no source buffer and its length doesn't take buffers
+//from the encoder. A NACK comes one RTT plus the reorder wait of the client
+//after the send, and the frames are added before pacing sends them: packets
+//are kept PACKET_HISTORY_MS after packet_history_add()
+#define PACKET_HISTORY_MS 500
+//Slots per layer, power of two. 2048 covers PACKET_HISTORY_MS up to
+//CONFIG_MAX_BITRATE
+#define PACKET_HISTORY_PACKETS 2048
+//Biggest datagram packetized, RTP header and extension included
+#define PACKET_HISTORY_PACKET_SIZE (RTP_HEADER_SIZE + RTP_CAPTURE_TIME_EXT_SIZE \
+    + 2 + RTP_MAX_PAYLOAD)
+
+//Copies the media packets of frame, the oldest packets of its layer are
+//overwritten
+void packet_history_add(stream_frame_t* frame, uint64_t now_us);
+//Copies media packet sequence of layer to data, which holds
+//PACKET_HISTORY_PACKET_SIZE bytes. Returns its size, 0 if it left the history
+//or is older than PACKET_HISTORY_MS
+uint32_t packet_history_find(
+    int layer,
+    uint16_t sequence,
+    uint64_t now_us,
+    uint8_t* data);
+//Forgets every packet
+void packet_history_clear();
+
+#endif
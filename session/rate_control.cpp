@@ -0,0 +1,64 @@
+#include "rate_control.h"
+
+void rate_control_init(rate_control_t* rc, int bitrate)
+{
+    rc->bitrate = bitrate;
+    rc->reports = 0;
+    rc->jitter_us = 0;
+    rc->last_report_us = 0;
+    rc->last_idr_us = 0;
+}
+
+int rate_control_update(
+        rate_control_t* rc,
+        receiver_report_t* report,
+        uint64_t now_us)
+{
+    int flags = 0;
+    uint32_t packets = report->lost + report->received;
+    double loss = packets ? (double)report->lost/packets : 0;
+    uint64_t interval_us = now_us - rc->last_report_us;
+
+    //The first report only starts the interval
+    if(!rc->reports++)
+    {
+        rc->last_report_us = now_us;
+        rc->jitter_us = report->jitter_us;
+        return 0;
+    }
+    rc->last_report_us = now_us;
+    if(!interval_us)
+        return 0;
+
+    double receive_rate = report->bytes*8.0*1000000/interval_us;
+    double estimate = rc->bitrate;
+
+    if(loss > RATE_LOSS_HIGH)
+        estimate *= 1 - loss/2;
+    else if(loss < RATE_LOSS_LOW)
+        estimate *= RATE_INCREASE;
+
+    if(report->jitter_us > rc->jitter_us + RATE_JITTER_RISE_US
+       && estimate > receive_rate*RATE_BACKOFF)
+        estimate = receive_rate*RATE_BACKOFF;
+    rc->jitter_us = report->jitter_us;
+
+    //Don't run far ahead of what actually gets through
+    if(estimate > receive_rate*RATE_RECEIVE_HEADROOM + RATE_MIN_BITRATE)
+        estimate = receive_rate*RATE_RECEIVE_HEADROOM + RATE_MIN_BITRATE;
+
+    if(estimate < RATE_MIN_BITRATE)
+        estimate = RATE_MIN_BITRATE;
+    if(estimate > RATE_MAX_BITRATE)
+        estimate = RATE_MAX_BITRATE;
+    rc->bitrate = (int)estimate;
+
+    if(loss >= RATE_IDR_LOSS
+       && now_us - rc->last_idr_us >= RATE_IDR_MIN_INTERVAL_US)
+    {
+        rc->last_idr_us = now_us;
+        flags |= RATE_REQUEST_IDR;
+    }
+
+    return flags;
+}
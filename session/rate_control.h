@@ -0,0 +1,49 @@
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+#include <stdint.h>
+
+//Bandwidth estimate of one client, updated from its receiver reports. Loss
+//based like GCC: back off on heavy loss, probe upwards while the link is
+//clean, and cut down to the measured receive rate when the jitter grows,
+//which shows queues building up before packets get lost
+#define RATE_START_BITRATE 140000
+#define RATE_MIN_BITRATE 50000
+#define RATE_MAX_BITRATE 25000000
+#define RATE_LOSS_LOW 0.02 //below, probe upwards
+#define RATE_LOSS_HIGH 0.10 //above, back off by half the loss
+#define RATE_INCREASE 1.08 //per report while probing
+#define RATE_JITTER_RISE_US 10000 //jitter growth seen as congestion
+#define RATE_BACKOFF 0.85 //of the receive rate on congestion
+#define RATE_RECEIVE_HEADROOM 1.5 //estimate cap over the receive rate
+#define RATE_IDR_LOSS 0.20 //loss that breaks the picture, ask for an IDR
+#define RATE_IDR_MIN_INTERVAL_US 1000000
+
+//Flags returned by rate_control_update()
+#define RATE_REQUEST_IDR 0x1
+
+//Counters of a client since its previous report
+typedef struct {
+    uint32_t lost; //packets
+    uint32_t received; //packets
+    uint32_t jitter_us; //RFC 3550 interarrival jitter
+    uint64_t bytes;
+} receiver_report_t;
+
+typedef struct {
+    int bitrate; //current estimate
+    int reports;
+    uint32_t jitter_us;
+    uint64_t last_report_us;
+    uint64_t last_idr_us;
+} rate_control_t;
+
+//Pure functions of the reports and the time, they don't touch the encoder
+//so they can be driven from a recorded trace as well
+void rate_control_init(rate_control_t* rc, int bitrate);
+int rate_control_update(
+    rate_control_t* rc,
+    receiver_report_t* report,
+    uint64_t now_us);
+
+#endif
@@ -0,0 +1,54 @@
+#include "stream_frame.h"
+
+#include <string.h>
+
+static stream_frame_t frame_pool[STREAM_FRAME_POOL];
+
+stream_frame_t* stream_frame_get(void (*release)(source_frame_t* source))
+{
+    int i;
+
+    //Only the stream thread takes frames, the sender threads give them back
+    for(i = 0; i < STREAM_FRAME_POOL; i++)
+    {
+        stream_frame_t* frame = &frame_pool[i];
+        if(__atomic_load_n(&frame->in_use, __ATOMIC_ACQUIRE))
+            continue;
+
+        memset(&frame->trace, 0, sizeof(frame->trace));
+        frame->refs = 1;
+        frame->release = release;
+        frame->in_use = 1;
+
+        return frame;
+    }
+
+    return 0;
+}
+
+void stream_frame_ref(stream_frame_t* frame)
+{
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+void stream_frame_unref(stream_frame_t* frame)
+{
+    if(__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    frame_trace_record(&frame->trace);
+    if(frame->release)
+        frame->release(&frame->source);
+    __atomic_store_n(&frame->in_use, 0, __ATOMIC_RELEASE);
+}
+
+int stream_frames_in_use()
+{
+    int i;
+    int count = 0;
+
+    for(i = 0; i < STREAM_FRAME_POOL; i++)
+        count += __atomic_load_n(&frame_pool[i].in_use, __ATOMIC_ACQUIRE);
+
+    return count;
+}
@@ -0,0 +1,38 @@
+#ifndef STREAM_FRAME_H
+#define STREAM_FRAME_H
+
+#include <stdint.h>
+
+#include "../rtp/rtp_h264.h"
+#include "../rtp/rtp_fec.h"
+#include "frame_trace.h"
+#include "../source/frame_assembler.h"
+
+//At least one per encoder output buffer of both layers, see
+//ENCODER_MAX_OUTPUT_BUFFERS
+#define STREAM_FRAME_POOL 32
+
+//A packetized frame shared by every client. The packets point into the
+//source buffers of the frame, which are handed back through release() once
+//the last reference is dropped
+typedef struct {
+    rtp_frame_t rtp;
+    //Data of the repair packets in rtp
+    rtp_fec_payloads_t fec;
+    //Buffers the packets point into
+    source_frame_t source;
+    int layer; //of the source buffers, each has its own RTP session
+    frame_trace_t trace;
+    int refs;
+    int in_use;
+    void (*release)(source_frame_t* source);
+} stream_frame_t;
+
+//Returns NULL if every frame is still referenced. The caller fills in
+//source
+stream_frame_t* stream_frame_get(void (*release)(source_frame_t* source));
+void stream_frame_ref(stream_frame_t* frame);
+void stream_frame_unref(stream_frame_t* frame);
+int stream_frames_in_use();
+
+#endif
@@ -0,0 +1,335 @@
+#include "frame_source.h"
+#include "../rtp/rtp_h264.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Replays a recorded Annex-B stream in a loop. The frames are sent straight
+//from the mapped file, paced at the configured framerate unless "fast".
+//With trace=<path> the file is handed out in the buffers an encoder made of
+//it instead of a buffer per frame: a line per buffer, its nFilledLen and its
+//nFlags in hex, like the camera source records them with record=<path>
+
+//OMX_BUFFERFLAG_ values of the trace
+#define TRACE_END_OF_FRAME 0x10
+#define TRACE_SYNC_FRAME 0x20
+#define TRACE_CODEC_CONFIG 0x80
+
+typedef struct {
+    uint32_t len;
+    uint32_t flags;
+} trace_entry_t;
+
+static const char* file_path;
+static const char* trace_path;
+static int fast;
+static uint8_t* file_data;
+static size_t file_len;
+static uint8_t* file_pos;
+static int loaded;
+static video_config_t config;
+static source_pool_t pool;
+//Pacing restarts from schedule_start_us at schedule_index on every capture
+//start and framerate change
+static uint64_t frame_index;
+static uint64_t schedule_index;
+static uint64_t schedule_start_us;
+static int64_t media_us;
+static trace_entry_t* trace;
+static int trace_count;
+static int trace_pos;
+//A buffer of the trace ended something else than a frame, the next one
+//continues it
+static int in_frame;
+static uint64_t frame_due_us;
+
+static int is_slice(nal_unit_t* nal)
+{
+    int type = nal->data[0] & 0x1f;
+
+    return (type >= 1 && type <= NAL_TYPE_IDR);
+}
+
+//Finds the next access unit: the non VCL units in front of it and every
+//slice of the picture. A slice starting at macroblock 0 (first_mb_in_slice
+//is ue(v), so 0 is a single 1 bit) begins a new picture
+static int next_frame(uint8_t** start, uint32_t* len, int* keyframe)
+{
+    uint8_t* end = file_data + file_len;
+    uint8_t* begin = file_pos;
+    nal_unit_t nal;
+
+    while(h264_next_nal_unit(&file_pos, end, &nal))
+    {
+        if(!is_slice(&nal))
+            continue;
+
+        *keyframe = (nal.data[0] & 0x1f) == NAL_TYPE_IDR;
+        uint8_t* frame_end = nal.data + nal.len;
+        uint8_t* next_pos = file_pos;
+        nal_unit_t next;
+
+        while(h264_next_nal_unit(&next_pos, end, &next)
+              && is_slice(&next) && next.len > 1 && !(next.data[1] & 0x80))
+        {
+            frame_end = next.data + next.len;
+            file_pos = next_pos;
+        }
+
+        *start = begin;
+        *len = frame_end - begin;
+        return 1;
+    }
+
+    return 0;
+}
+
+//Reads the trace into trace, which has to fit in the file
+static void load_trace()
+{
+    FILE* f = fopen(trace_path, "r");
+    uint64_t total = 0;
+    int size = 0;
+    unsigned long len, flags;
+
+    if(!f)
+    {
+        DEBUG_ERR("can't open %s\n", trace_path);
+        exit(1);
+    }
+
+    trace_count = 0;
+    while(fscanf(f, "%lu %lx", &len, &flags) == 2)
+    {
+        if(trace_count == size)
+        {
+            size = size ? size*2 : 1024;
+            if(!(trace = (trace_entry_t*)realloc(trace, size*sizeof(*trace))))
+            {
+                DEBUG_ERR("file source: out of memory\n");
+                exit(1);
+            }
+        }
+        trace[trace_count].len = len;
+        trace[trace_count].flags = flags;
+        trace_count++;
+        total += len;
+    }
+    fclose(f);
+
+    if(!trace_count || total > file_len)
+    {
+        DEBUG_ERR("%s doesn't describe %s\n", trace_path, file_path);
+        exit(1);
+    }
+    trace_pos = 0;
+    in_frame = 0;
+}
+
+//Hands out the next bytes of the file as the next buffer of the trace, both
+//start over together
+static void next_trace_buffer(source_buffer_t* buffer)
+{
+    if(trace_pos == trace_count)
+    {
+        trace_pos = 0;
+        file_pos = file_data;
+    }
+
+    trace_entry_t* entry = &trace[trace_pos++];
+    buffer->data = file_pos;
+    buffer->len = entry->len;
+    buffer->end_of_frame = !!(entry->flags & TRACE_END_OF_FRAME);
+    buffer->keyframe = !!(entry->flags & TRACE_SYNC_FRAME);
+    buffer->codec_config = !!(entry->flags & TRACE_CODEC_CONFIG);
+    file_pos += entry->len;
+}
+
+static void restart_schedule()
+{
+    schedule_start_us = get_time_us();
+    schedule_index = frame_index;
+}
+
+static int file_open(int argc, char** argv)
+{
+    int i;
+
+    if(argc < 1)
+        return 0;
+
+    file_path = argv[0];
+    for(i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "fast"))
+            fast = 1;
+        else if(!strncmp(argv[i], "trace=", 6))
+            trace_path = argv[i] + 6;
+        else
+            return 0;
+    }
+
+    video_config_default(&config);
+    return 1;
+}
+
+static void file_init()
+{
+    struct stat st;
+    int fd;
+
+    if((fd = open(file_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        DEBUG_ERR("can't open %s\n", file_path);
+        exit(1);
+    }
+
+    file_len = st.st_size;
+    file_data = (uint8_t*)mmap(0, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file_data == MAP_FAILED)
+    {
+        DEBUG_ERR("can't map %s\n", file_path);
+        exit(1);
+    }
+
+    file_pos = file_data;
+    if(trace_path)
+        load_trace();
+    source_pool_init(&pool);
+    loaded = 1;
+}
+
+static void file_deinit()
+{
+    munmap(file_data, file_len);
+    free(trace);
+    trace = 0;
+    source_pool_destroy(&pool);
+    loaded = 0;
+}
+
+static void file_start_capture()
+{
+    source_buffer_t skipped;
+
+    //The frame the stop cut short was dropped, go on with the next one
+    while(trace && in_frame)
+    {
+        next_trace_buffer(&skipped);
+        in_frame = !skipped.end_of_frame || skipped.codec_config;
+    }
+    restart_schedule();
+}
+
+static void file_stop_capture()
+{
+}
+
+static source_buffer_t* file_fill_buffer()
+{
+    source_buffer_t* buffer = source_pool_get(&pool);
+    uint64_t interval_us = 1000000/config.framerate;
+
+    if(trace)
+        next_trace_buffer(buffer);
+    else if(!next_frame(&buffer->data, &buffer->len, &buffer->keyframe))
+    {
+        //Loop, the timestamps keep going
+        file_pos = file_data;
+        if(!next_frame(&buffer->data, &buffer->len, &buffer->keyframe))
+        {
+            DEBUG_ERR("no H.264 frames in %s\n", file_path);
+            exit(1);
+        }
+    }
+    if(!trace)
+    {
+        buffer->end_of_frame = 1;
+        buffer->codec_config = 0;
+    }
+
+    //The buffers of a frame follow its first one right away
+    if(!in_frame)
+    {
+        frame_due_us = schedule_start_us
+            + (frame_index - schedule_index)*interval_us;
+        if(!fast)
+            source_sleep_until(frame_due_us);
+    }
+    buffer->ready_us = get_time_us();
+    buffer->capture_us = fast ? buffer->ready_us : frame_due_us;
+    source_notify_frame();
+
+    buffer->timestamp_us = media_us;
+    buffer->layer = LAYER_MAIN;
+    in_frame = !buffer->end_of_frame || buffer->codec_config;
+    if(!in_frame)
+    {
+        media_us += interval_us;
+        frame_index++;
+    }
+
+    return buffer;
+}
+
+static void file_release_buffer(source_buffer_t* buffer)
+{
+    source_pool_put(&pool, buffer);
+}
+
+static void file_get_config(video_config_t* out)
+{
+    *out = config;
+}
+
+static int file_config_needs_restart(video_config_t* config)
+{
+    return 0;
+}
+
+//Only the framerate means something to a recording, it sets the pace
+static int file_set_config(video_config_t* new_config)
+{
+    config = *new_config;
+    restart_schedule();
+
+    return loaded ? VIDEO_CONFIG_LIVE : VIDEO_CONFIG_STORED;
+}
+
+static void file_set_bitrate(int bitrate)
+{
+}
+
+static void file_request_idr()
+{
+}
+
+static int file_pending_buffers()
+{
+    //Frames are read when they are asked for
+    return 0;
+}
+
+frame_source_t file_source = {
+    "file",
+    file_open,
+    file_init,
+    file_deinit,
+    file_start_capture,
+    file_stop_capture,
+    file_fill_buffer,
+    file_release_buffer,
+    file_get_config,
+    file_config_needs_restart,
+    file_set_config,
+    file_set_bitrate,
+    file_request_idr,
+    source_single_layer,
+    file_pending_buffers,
+    source_set_frame_notify,
+    source_set_buffer_ready,
+    source_take_buffer,
+};
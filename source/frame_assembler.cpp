@@ -0,0 +1,128 @@
+#include "frame_assembler.h"
+
+static void start_frame(source_frame_t* frame, int layer)
+{
+    frame->buffer_count = 0;
+    frame->len = 0;
+    frame->timestamp_us = 0;
+    frame->capture_us = 0;
+    frame->ready_us = 0;
+    frame->layer = layer;
+    frame->keyframe = 0;
+    frame->complete = 1;
+}
+
+//Non zero once a buffer of the picture itself was added
+static int has_picture(source_frame_t* frame)
+{
+    int i;
+
+    for(i = 0; i < frame->buffer_count; i++)
+        if(!frame->buffers[i]->codec_config)
+            return 1;
+
+    return 0;
+}
+
+static void deliver_pending(frame_assembler_t* assembler, int layer)
+{
+    source_frame_t frame = assembler->pending[layer];
+
+    start_frame(&assembler->pending[layer], layer);
+    assembler->deliver(&frame);
+}
+
+void frame_assembler_init(
+        frame_assembler_t* assembler,
+        void (*deliver)(source_frame_t* frame),
+        void (*release)(source_buffer_t* buffer))
+{
+    int i;
+
+    for(i = 0; i < STREAM_LAYERS; i++)
+    {
+        start_frame(&assembler->pending[i], i);
+        assembler->dropping[i] = 0;
+    }
+    assembler->deliver = deliver;
+    assembler->release = release;
+}
+
+void frame_assembler_add(frame_assembler_t* assembler, source_buffer_t* buffer)
+{
+    int layer = buffer->layer;
+    source_frame_t* frame = &assembler->pending[layer];
+
+    if(assembler->dropping[layer])
+    {
+        //The SPS/PPS or the first piece of another picture end the one cut,
+        //even if its last buffer got lost
+        if(!buffer->codec_config
+           && buffer->timestamp_us == frame->timestamp_us)
+        {
+            if(buffer->end_of_frame)
+                assembler->dropping[layer] = 0;
+            assembler->release(buffer);
+            return;
+        }
+        assembler->dropping[layer] = 0;
+    }
+
+    //A picture whose last buffer never came ends with the next one, or with
+    //the SPS/PPS in front of it, which belong to the next frame
+    if(has_picture(frame) && (buffer->codec_config
+                              || buffer->timestamp_us != frame->timestamp_us))
+    {
+        DEBUG_ERR("layer %d frame at %lld us had no end\n", layer
+                  , (long long)frame->timestamp_us);
+        deliver_pending(assembler, layer);
+    }
+
+    if(!buffer->codec_config && !has_picture(frame))
+    {
+        frame->timestamp_us = buffer->timestamp_us;
+        frame->capture_us = buffer->capture_us;
+    }
+    frame->buffers[frame->buffer_count] = buffer;
+    frame->segments[frame->buffer_count].iov_base = buffer->data;
+    frame->segments[frame->buffer_count].iov_len = buffer->len;
+    frame->buffer_count++;
+    frame->len += buffer->len;
+    frame->ready_us = buffer->ready_us;
+    frame->keyframe |= buffer->keyframe;
+
+    //The SPS/PPS wait for their picture
+    if(buffer->codec_config && frame->buffer_count < FRAME_MAX_BUFFERS)
+        return;
+
+    if(!buffer->end_of_frame && frame->buffer_count == FRAME_MAX_BUFFERS)
+    {
+        DEBUG_ERR("layer %d frame at %lld us needs more than %d buffers, "
+                  "cutting it\n", layer, (long long)frame->timestamp_us
+                  , FRAME_MAX_BUFFERS);
+        frame->complete = 0;
+        assembler->dropping[layer] = !buffer->codec_config;
+        deliver_pending(assembler, layer);
+        //Keeps the timestamp the dropped buffers are matched against
+        frame->timestamp_us = buffer->timestamp_us;
+        return;
+    }
+
+    if(buffer->end_of_frame)
+        deliver_pending(assembler, layer);
+}
+
+void frame_assembler_reset(frame_assembler_t* assembler)
+{
+    int layer, i;
+
+    for(layer = 0; layer < STREAM_LAYERS; layer++)
+    {
+        source_frame_t* frame = &assembler->pending[layer];
+
+        for(i = 0; i < frame->buffer_count; i++)
+            assembler->release(frame->buffers[i]);
+        start_frame(frame, layer);
+        assembler->dropping[layer] = 0;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef FRAME_ASSEMBLER_H
+#define FRAME_ASSEMBLER_H
+
+#include <sys/uio.h>
+
+#include "frame_source.h"
+
+//Source buffers making up one frame at most. A longer frame is cut there,
+//see source_frame_t.complete. The frame being assembled and the ones in the
+//packet history each hold up to this many buffers, ENCODER_OUTPUT_BUFFERS
+//leaves room for both
+#define FRAME_MAX_BUFFERS 4
+
+//An encoded frame, the source buffers it came in chained in order without
+//copying them: SPS/PPS buffers ahead of the picture, then its pieces. A NAL
+//unit, or a start code, may straddle two of them
+typedef struct {
+    source_buffer_t* buffers[FRAME_MAX_BUFFERS];
+    struct iovec segments[FRAME_MAX_BUFFERS]; //data and len of each buffer
+    int buffer_count;
+    uint32_t len; //of all the buffers
+    //Of the first buffer of the picture, the SPS/PPS may carry none
+    int64_t timestamp_us;
+    uint64_t capture_us;
+    uint64_t ready_us; //of the last buffer
+    int layer;
+    int keyframe;
+    //0 if the frame had more than FRAME_MAX_BUFFERS buffers, the rest of it
+    //was dropped
+    int complete;
+} source_frame_t;
+
+//Chains the buffers of each layer until end_of_frame. The source is expected
+//to flag a keyframe on any of its buffers and to mark the SPS/PPS it hands
+//out on their own with codec_config, those go with the next frame
+typedef struct {
+    source_frame_t pending[STREAM_LAYERS];
+    //The pending frame of the layer was cut, its remaining buffers go back
+    //until the end of the frame
+    int dropping[STREAM_LAYERS];
+    void (*deliver)(source_frame_t* frame);
+    void (*release)(source_buffer_t* buffer);
+} frame_assembler_t;
+
+void frame_assembler_init(
+    frame_assembler_t* assembler,
+    void (*deliver)(source_frame_t* frame),
+    void (*release)(source_buffer_t* buffer));
+//Adds the next buffer of its layer. Calls deliver() with every frame it
+//completes, which then owns the buffers. Called by one thread at a time
+void frame_assembler_add(frame_assembler_t* assembler, source_buffer_t* buffer);
+//Releases the buffers of the frames not completed, once the source stopped
+//handing out buffers
+void frame_assembler_reset(frame_assembler_t* assembler);
+
+#endif
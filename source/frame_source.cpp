@@ -0,0 +1,144 @@
+#include "frame_source.h"
+
+static int frame_notify_fd = -1;
+
+static frame_source_t* sources[] = {
+#ifdef HAVE_LIBOPENMAX
+    &omx_source,
+#endif
+    &synthetic_source,
+    &file_source,
+};
+
+frame_source_t* frame_source_select(int argc, char** argv)
+{
+    frame_source_t* source = sources[0];
+    unsigned int i;
+
+    if(argc > 0)
+    {
+        for(source = 0, i = 0; i < sizeof(sources)/sizeof(sources[0]); i++)
+            if(!strcmp(argv[0], sources[i]->name))
+                source = sources[i];
+
+        if(!source)
+        {
+            DEBUG_ERR("unknown frame source %s\n", argv[0]);
+            return 0;
+        }
+        argc--;
+        argv++;
+    }
+
+    if(!source->open(argc, argv))
+    {
+        DEBUG_ERR("bad arguments for frame source %s\n", source->name);
+        return 0;
+    }
+
+    DEBUG_MSG("frame source: %s\n", source->name);
+    return source;
+}
+
+void video_config_default(video_config_t* config)
+{
+    config->width = VIDEO_WIDTH;
+    config->height = VIDEO_HEIGHT;
+    config->framerate = VIDEO_FRAMERATE;
+    config->bitrate = VIDEO_BITRATE;
+    config->idr_period = VIDEO_IDR_PERIOD;
+    config->qp_i = 0;
+    config->qp_p = 0;
+    config->profile = VIDEO_PROFILE_BASELINE;
+    config->refresh_period = VIDEO_REFRESH_PERIOD;
+}
+
+//Rounded to the nearest multiple of align, at least align
+static int align_size(int size, int align)
+{
+    size = (size + align/2)/align*align;
+
+    return size < align ? align : size;
+}
+
+void video_low_size(video_config_t* config, int* width, int* height)
+{
+    *width = align_size(config->width/VIDEO_LOW_SCALE, 32);
+    *height = align_size(config->height/VIDEO_LOW_SCALE, 16);
+}
+
+void source_pool_init(source_pool_t* pool)
+{
+    memset(pool->buffers, 0, sizeof(pool->buffers));
+    memset(pool->in_use, 0, sizeof(pool->in_use));
+    pthread_mutex_init(&pool->lock, 0);
+    sem_init(&pool->free_sem, 0, SOURCE_POOL_SIZE);
+}
+
+void source_pool_destroy(source_pool_t* pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    sem_destroy(&pool->free_sem);
+}
+
+source_buffer_t* source_pool_get(source_pool_t* pool)
+{
+    source_buffer_t* buffer = 0;
+    int i;
+
+    while(sem_wait(&pool->free_sem) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&pool->lock);
+    for(i = 0; i < SOURCE_POOL_SIZE && !buffer; i++)
+        if(!pool->in_use[i])
+        {
+            pool->in_use[i] = 1;
+            buffer = &pool->buffers[i];
+        }
+    pthread_mutex_unlock(&pool->lock);
+
+    return buffer;
+}
+
+void source_pool_put(source_pool_t* pool, source_buffer_t* buffer)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use[buffer - pool->buffers] = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    sem_post(&pool->free_sem);
+}
+
+void source_sleep_until(uint64_t due_us)
+{
+    struct timespec due;
+
+    due.tv_sec = due_us/1000000;
+    due.tv_nsec = (due_us%1000000)*1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0) == EINTR);
+}
+
+void source_set_frame_notify(int fd)
+{
+    frame_notify_fd = fd;
+}
+
+void source_notify_frame()
+{
+    event_fd_signal(frame_notify_fd);
+}
+
+int source_set_buffer_ready(int fd)
+{
+    return 0;
+}
+
+source_buffer_t* source_take_buffer()
+{
+    return 0;
+}
+
+int source_single_layer()
+{
+    return 1;
+}
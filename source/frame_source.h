@@ -0,0 +1,177 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include "../common_util/common_util.h"
+
+//Build the source once at server start and only pause/resume the capture
+//between sessions. Set to 0 to load and unload it on every VIDEO_REQUEST
+#define PERSISTENT_PIPELINE 1
+//Let a source with a thread of its own (the encoder callback of the camera)
+//queue every buffer and signal an eventfd the stream thread waits on, along
+//with its commands, instead of waking it in fill_buffer(). The callback
+//never runs the packetizer or takes a lock of the stream. 0 always pulls
+#define SOURCE_READY_FD 1
+
+//Defaults of video_config_t
+#define VIDEO_WIDTH 320
+#define VIDEO_HEIGHT 240
+#define VIDEO_FRAMERATE 10
+#define VIDEO_BITRATE 140000
+//Clients that lose a packet ask for an IDR with KEYFRAME_REQUEST, so the
+//GOP doesn't have to be short
+#define VIDEO_IDR_PERIOD 30
+#define VIDEO_REFRESH_PERIOD 0
+
+//Simulcast: a source may encode a second, smaller copy of the stream for
+//clients that can't keep up with the configured one. Its size is the
+//configured one divided by VIDEO_LOW_SCALE, aligned like the camera wants
+//it, its bitrate fixed. It follows the framerate and the IDR period
+#define STREAM_LAYERS 2
+#define LAYER_MAIN 0
+#define LAYER_LOW 1
+#define VIDEO_LOW_SCALE 2
+#define VIDEO_LOW_BITRATE 40000
+
+//Buffers of the file and synthetic sources. Like the encoder output buffers
+//they are only reused once released, which holds the source back. Room for
+//both layers of the synthetic source
+#define SOURCE_POOL_SIZE 12
+
+typedef enum {
+    VIDEO_PROFILE_BASELINE = 0,
+    VIDEO_PROFILE_MAIN,
+    VIDEO_PROFILE_HIGH,
+} video_profile;
+
+//Settings that can be changed at runtime with set_config()
+typedef struct {
+    int width;
+    int height;
+    int framerate;
+    int bitrate;
+    int idr_period;
+    int qp_i; //0 for both QPs uses the bitrate
+    int qp_p;
+    video_profile profile;
+    //Cyclic intra refresh: frames it takes to code every macroblock of the
+    //picture as intra once, a slice of it per frame. Keeps the stream
+    //decodable after a loss without IDR spikes. 0 for off
+    int refresh_period;
+} video_config_t;
+
+//How set_config() applied a config
+#define VIDEO_CONFIG_STORED 0 //source not loaded, used by the next init
+#define VIDEO_CONFIG_LIVE 1 //applied to the running source
+#define VIDEO_CONFIG_RESTART 2 //the source was reconfigured
+#define VIDEO_CONFIG_FAILED 3 //refused, the old config is kept
+
+//Encoded data, Annex-B with start codes
+typedef struct {
+    uint8_t* data;
+    uint32_t len;
+    int64_t timestamp_us;
+    //Monotonic time of the capture and of when the encoded frame was ready,
+    //for the latency trace. A source without a capture clock uses the time
+    //the frame was due
+    uint64_t capture_us;
+    uint64_t ready_us;
+    //A frame may come in several buffers, the last one has end_of_frame.
+    //keyframe is set on at least one buffer of an IDR frame, codec_config on
+    //a buffer with nothing but SPS/PPS, see frame_assembler.h
+    int end_of_frame;
+    int keyframe;
+    int codec_config;
+    int layer; //LAYER_MAIN or LAYER_LOW
+    //Owned by the source
+    void* opaque;
+} source_buffer_t;
+
+//Where the H.264 frames come from. The stream thread calls everything but
+//release_buffer(), which the sender thread calls too
+typedef struct {
+    const char* name;
+    //Takes the arguments following the source name, returns 0 if they are
+    //wrong
+    int (*open)(int argc, char** argv);
+    void (*init)();
+    void (*deinit)();
+    void (*start_capture)();
+    void (*stop_capture)();
+    //Blocks until the next buffer
+    source_buffer_t* (*fill_buffer)();
+    void (*release_buffer)(source_buffer_t* buffer);
+    void (*get_config)(video_config_t* config);
+    //Non zero if the config can only be applied by a restart that needs
+    //every buffer released first
+    int (*config_needs_restart)(video_config_t* config);
+    int (*set_config)(video_config_t* config);
+    //Lowers the bitrate under the configured one, 0 goes back to it
+    void (*set_bitrate)(int bitrate);
+    //Makes the next frame of every layer an IDR
+    void (*request_idr)();
+    //Layers the frames come in, 1 without simulcast. Valid after open(), a
+    //source may drop to fewer in init()
+    int (*layer_count)();
+    //Frames the source holds ready that fill_buffer() hasn't returned yet,
+    //e.g. filled encoder output buffers
+    int (*pending_buffers)();
+    //eventfd signaled as soon as a frame is ready (from the encoder
+    //callback for the camera), -1 for none. Called before init()
+    void (*set_frame_notify)(int fd);
+    //Signals the eventfd fd for every buffer filled on the source's own
+    //thread, take_buffer() then returns them without waiting and
+    //fill_buffer() isn't used. -1 for none. Returns 0 if the source can
+    //only be pulled. Called before init()
+    int (*set_buffer_ready)(int fd);
+    //The next filled buffer, 0 if there is none yet
+    source_buffer_t* (*take_buffer)();
+} frame_source_t;
+
+#ifdef HAVE_LIBOPENMAX
+extern frame_source_t omx_source;
+#endif
+extern frame_source_t file_source;
+extern frame_source_t synthetic_source;
+
+//argv[0] names the source, the camera by default (the synthetic source if
+//built without OMX). Returns 0 on an unknown source or bad arguments
+frame_source_t* frame_source_select(int argc, char** argv);
+void video_config_default(video_config_t* config);
+//Size of the low layer of config
+void video_low_size(video_config_t* config, int* width, int* height);
+
+//Fixed set of buffers handed out by the file and synthetic sources
+typedef struct {
+    source_buffer_t buffers[SOURCE_POOL_SIZE];
+    int in_use[SOURCE_POOL_SIZE];
+    pthread_mutex_t lock;
+    sem_t free_sem;
+} source_pool_t;
+
+void source_pool_init(source_pool_t* pool);
+void source_pool_destroy(source_pool_t* pool);
+//Blocks until a buffer is released
+source_buffer_t* source_pool_get(source_pool_t* pool);
+void source_pool_put(source_pool_t* pool, source_buffer_t* buffer);
+//Sleeps until the monotonic time due_us
+void source_sleep_until(uint64_t due_us);
+//set_frame_notify() of the file and synthetic sources, which signal once a
+//frame is made
+void source_set_frame_notify(int fd);
+void source_notify_frame();
+//set_buffer_ready() and take_buffer() of the file and synthetic sources,
+//which make their frames in fill_buffer()
+int source_set_buffer_ready(int fd);
+source_buffer_t* source_take_buffer();
+//layer_count() of a source without simulcast
+int source_single_layer();
+
+#endif
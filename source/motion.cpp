@@ -0,0 +1,217 @@
+#include "motion.h"
+
+#include <string.h>
+#include <pthread.h>
+
+//NEON is looked for first, like in gf256.cpp, so tests/ can build the NEON
+//kernel on x86
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MOTION_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MOTION_X86 1
+#endif
+
+//Adds the SAD of each of the blocks MOTION_BLOCK byte runs of one row to
+//sums
+typedef void (*sad_kernel)(const uint8_t* a, const uint8_t* b, int blocks,
+        uint32_t* sums);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void sad_scalar(const uint8_t* a, const uint8_t* b, int blocks,
+        uint32_t* sums)
+{
+    int i, j;
+
+    for(i = 0; i < blocks; i++, a += MOTION_BLOCK, b += MOTION_BLOCK)
+        for(j = 0; j < MOTION_BLOCK; j++)
+            sums[i] += a[j] > b[j] ? a[j] - b[j] : b[j] - a[j];
+}
+
+#ifdef MOTION_X86
+__attribute__((target("sse2")))
+static void sad_sse2(const uint8_t* a, const uint8_t* b, int blocks,
+        uint32_t* sums)
+{
+    int i;
+
+    //One sum per 8 bytes
+    for(i = 0; i < blocks; i++, a += 16, b += 16)
+    {
+        __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a),
+                _mm_loadu_si128((const __m128i*)b));
+        sums[i] += _mm_cvtsi128_si32(sad)
+            + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+    }
+}
+
+__attribute__((target("avx2")))
+static void sad_avx2(const uint8_t* a, const uint8_t* b, int blocks,
+        uint32_t* sums)
+{
+    int i = 0;
+
+    //Two blocks at a time, the sums of each in its 128 bit lane
+    for(; i + 2 <= blocks; i += 2, a += 32, b += 32)
+    {
+        __m256i sad = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)a),
+                _mm256_loadu_si256((const __m256i*)b));
+        sad = _mm256_add_epi32(sad, _mm256_srli_si256(sad, 8));
+        sums[i] += _mm256_extract_epi32(sad, 0);
+        sums[i + 1] += _mm256_extract_epi32(sad, 4);
+    }
+    sad_sse2(a, b, blocks - i, sums + i);
+}
+#endif
+
+#ifdef MOTION_NEON
+static void sad_neon(const uint8_t* a, const uint8_t* b, int blocks,
+        uint32_t* sums)
+{
+    int i;
+
+    for(i = 0; i < blocks; i++, a += 16, b += 16)
+    {
+        uint8x16_t diff = vabdq_u8(vld1q_u8(a), vld1q_u8(b));
+        uint64x2_t sad = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(diff)));
+        sums[i] += vgetq_lane_u64(sad, 0) + vgetq_lane_u64(sad, 1);
+    }
+}
+#endif
+
+typedef struct {
+    const char* name;
+    sad_kernel kernel;
+} kernel_entry_t;
+
+//Built in kernels, for motion_use_kernel()
+static const kernel_entry_t kernels[] = {
+    {"scalar", sad_scalar},
+#ifdef MOTION_X86
+    {"sse2", sad_sse2},
+    {"avx2", sad_avx2},
+#endif
+#ifdef MOTION_NEON
+    {"neon", sad_neon},
+#endif
+};
+#define KERNEL_COUNT (int)(sizeof(kernels)/sizeof(kernels[0]))
+
+static sad_kernel sad_row_kernel = sad_scalar;
+static const char* kernel_name = "scalar";
+
+static void pick_kernel()
+{
+#ifdef MOTION_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        sad_row_kernel = sad_avx2;
+        kernel_name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        sad_row_kernel = sad_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+#ifdef MOTION_NEON
+    sad_row_kernel = sad_neon;
+    kernel_name = "neon";
+#endif
+}
+
+void motion_init(motion_detector_t* motion)
+{
+    pthread_once(&init_once, pick_kernel);
+
+    motion->have_previous = 0;
+    motion->score = 0;
+    motion->idle = 0;
+    motion->moved_us = 0;
+}
+
+void motion_block_sad(
+        const uint8_t* a,
+        int a_stride,
+        const uint8_t* b,
+        int b_stride,
+        int width,
+        int height,
+        uint32_t* sums)
+{
+    int blocks = width/MOTION_BLOCK;
+    int y;
+
+    memset(sums, 0, blocks*(height/MOTION_BLOCK)*sizeof(*sums));
+    for(y = 0; y < height; y++)
+        sad_row_kernel(a + y*a_stride, b + y*b_stride, blocks,
+                sums + y/MOTION_BLOCK*blocks);
+}
+
+int motion_update(
+        motion_detector_t* motion,
+        const uint8_t* luma,
+        int stride,
+        uint64_t now_us)
+{
+    uint32_t sums[MOTION_BLOCKS];
+    uint32_t most = 0;
+    int idle = motion->idle;
+    int i, y;
+
+    if(!motion->have_previous)
+    {
+        motion->moved_us = now_us;
+        motion->have_previous = 1;
+    }
+    else
+    {
+        motion_block_sad(luma, stride, motion->previous, MOTION_WIDTH,
+                MOTION_WIDTH, MOTION_HEIGHT, sums);
+        for(i = 0; i < MOTION_BLOCKS; i++)
+            if(sums[i] > most)
+                most = sums[i];
+        motion->score = most*100/(MOTION_BLOCK*MOTION_BLOCK);
+        if(motion->score >= MOTION_THRESHOLD)
+            motion->moved_us = now_us;
+    }
+
+    for(y = 0; y < MOTION_HEIGHT; y++)
+        memcpy(motion->previous + y*MOTION_WIDTH, luma + y*stride,
+                MOTION_WIDTH);
+
+    motion->idle = now_us - motion->moved_us >= (uint64_t)MOTION_IDLE_MS*1000;
+
+    return motion->idle != idle;
+}
+
+const char* motion_kernel_name()
+{
+    return kernel_name;
+}
+
+int motion_use_kernel(const char* name)
+{
+    int i;
+
+    pthread_once(&init_once, pick_kernel);
+    for(i = 0; i < KERNEL_COUNT; i++)
+    {
+        if(strcmp(kernels[i].name, name))
+            continue;
+#ifdef MOTION_X86
+        if((kernels[i].kernel == sad_avx2 && !__builtin_cpu_supports("avx2"))
+           || (kernels[i].kernel == sad_sse2
+               && !__builtin_cpu_supports("sse2")))
+            return 0;
+#endif
+        sad_row_kernel = kernels[i].kernel;
+        kernel_name = kernels[i].name;
+        return 1;
+    }
+
+    return 0;
+}
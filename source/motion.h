@@ -0,0 +1,59 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+
+//Motion gating: a source that sees the raw frames compares the luma of
+//consecutive ones at MOTION_WIDTH x MOTION_HEIGHT, in MOTION_BLOCK squares
+//so a small object moving isn't lost in the noise of the whole picture. Once
+//the scene stayed still for MOTION_IDLE_MS it drops to the idle framerate
+//and bitrate, the first frame that moves brings the configured ones back.
+//The SAD kernel uses AVX2 or SSE2 on x86, whichever the CPU has, and NEON
+//when the compiler targets it. Plain C otherwise
+#define MOTION_WIDTH 128 //multiple of MOTION_BLOCK
+#define MOTION_HEIGHT 96 //multiple of MOTION_BLOCK
+#define MOTION_BLOCK 16
+#define MOTION_BLOCKS ((MOTION_WIDTH/MOTION_BLOCK)*(MOTION_HEIGHT/MOTION_BLOCK))
+//Mean absolute luma difference per pixel of the block that changed most, in
+//hundredths of a level, from which a frame counts as moving. Sensor noise
+//alone stays under 100
+#define MOTION_THRESHOLD 300
+#define MOTION_IDLE_MS 5000
+#define MOTION_IDLE_FRAMERATE 2
+#define MOTION_IDLE_BITRATE 20000
+
+typedef struct {
+    uint8_t previous[MOTION_WIDTH*MOTION_HEIGHT];
+    int have_previous;
+    int score; //of the last frame, 0 until there are two
+    int idle;
+    uint64_t moved_us; //last frame that moved, or the first one
+} motion_detector_t;
+
+//Starts over with a moving scene, any thread may call it
+void motion_init(motion_detector_t* motion);
+//Sums of absolute differences of two width x height planes, one per
+//MOTION_BLOCK square, row after row of squares into sums. width and height
+//are multiples of MOTION_BLOCK
+void motion_block_sad(
+    const uint8_t* a,
+    int a_stride,
+    const uint8_t* b,
+    int b_stride,
+    int width,
+    int height,
+    uint32_t* sums);
+//Scores luma, a MOTION_WIDTH x MOTION_HEIGHT plane stride bytes per row,
+//against the previous frame. Returns 1 if motion->idle changed
+int motion_update(
+    motion_detector_t* motion,
+    const uint8_t* luma,
+    int stride,
+    uint64_t now_us);
+//Kernel picked by motion_init()
+const char* motion_kernel_name();
+//Uses the kernel of that name instead, for the tests and the benchmark.
+//Returns 0 if the build or the CPU doesn't have it
+int motion_use_kernel(const char* name);
+
+#endif
@@ -0,0 +1,384 @@
+#include "frame_source.h"
+#include "motion.h"
+#include "../rtp/rtp_h264.h"
+#include "../common_util/stats.h"
+
+//Generates NAL shaped frames without an encoder: SPS, PPS and an IDR slice
+//every idr_period frames, a P slice otherwise. The sizes follow the bitrate
+//(so the rate control can be exercised) unless fixed with p=/idr=. With
+//simulcast every frame is followed by its low layer copy, VIDEO_LOW_BITRATE
+//sized or a quarter of the fixed sizes. With scene=<seconds> a small picture
+//goes through the motion detector every frame interval, a square moving
+//across it for that long and then an empty picture for as long, and only the
+//frames the gated framerate keeps are made
+
+#define SYNTH_MAX_FRAME_BYTES (256*1024)
+//How much bigger an IDR is than a P frame when the sizes follow the bitrate
+#define SYNTH_IDR_SCALE 8
+//The moving square of scene=
+#define SYNTH_SQUARE_SIZE 24
+#define SYNTH_SQUARE_SPEED 100 //pixels/s
+
+static const uint8_t sps[] = {0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1e, 0xda, 0x05,
+                              0x07, 0xec, 0x04, 0x40};
+static const uint8_t pps[] = {0, 0, 0, 1, 0x68, 0xce, 0x3c, 0x80};
+
+static int fast;
+static int simulcast;
+static uint32_t fixed_p_bytes;
+static uint32_t fixed_idr_bytes;
+static int scene_seconds;
+static motion_detector_t motion;
+static uint8_t scene[MOTION_WIDTH*MOTION_HEIGHT];
+static uint32_t noise_seed;
+static int loaded;
+static video_config_t config;
+static int bitrate;
+static int idr_requested;
+static source_pool_t pool;
+static uint8_t* payloads[SOURCE_POOL_SIZE];
+static uint64_t frame_index;
+static uint64_t frames_since_idr;
+//Low layer copy of the last main frame still to be made
+static int low_pending;
+static int low_idr;
+static uint64_t low_capture_us;
+static uint64_t schedule_index;
+static uint64_t schedule_start_us;
+static int64_t media_us;
+
+static void restart_schedule()
+{
+    schedule_start_us = get_time_us();
+    schedule_index = frame_index;
+}
+
+//P frame size that averages out at layer_bitrate and framerate with one IDR
+//per period
+static uint32_t p_frame_bytes(int layer_bitrate, int framerate)
+{
+    uint64_t frame_bytes = (uint64_t)layer_bitrate/8/framerate;
+    int period = config.idr_period;
+
+    return frame_bytes*period/(period - 1 + SYNTH_IDR_SCALE);
+}
+
+//Writes a slice NAL unit of len bytes after the start code. The body keeps
+//the bytes filled in by synth_init(), which have no zero byte and so never
+//look like a start code
+static uint32_t write_slice(uint8_t* p, int idr, uint32_t len)
+{
+    if(len < 2)
+        len = 2;
+
+    p[0] = 0;
+    p[1] = 0;
+    p[2] = 0;
+    p[3] = 1;
+    p[4] = idr ? 0x65 : 0x41;
+    p[5] = 0x88; //first_mb_in_slice 0
+
+    return 4 + len;
+}
+
+static int synth_open(int argc, char** argv)
+{
+    int i;
+
+    for(i = 0; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "fast"))
+            fast = 1;
+        else if(!strcmp(argv[i], "simulcast"))
+            simulcast = 1;
+        else if(!strncmp(argv[i], "p=", 2))
+            fixed_p_bytes = strtoul(argv[i] + 2, 0, 10);
+        else if(!strncmp(argv[i], "idr=", 4))
+            fixed_idr_bytes = strtoul(argv[i] + 4, 0, 10);
+        else if(!strncmp(argv[i], "scene=", 6))
+        {
+            if((scene_seconds = atoi(argv[i] + 6)) <= 0)
+                return 0;
+        }
+        else
+            return 0;
+    }
+
+    video_config_default(&config);
+    bitrate = config.bitrate;
+    return 1;
+}
+
+static void synth_init()
+{
+    uint32_t seed = 0x12345678;
+    int i;
+    uint32_t j;
+
+    source_pool_init(&pool);
+    for(i = 0; i < SOURCE_POOL_SIZE; i++)
+    {
+        if(!(payloads[i] = (uint8_t*)malloc(SYNTH_MAX_FRAME_BYTES)))
+        {
+            DEBUG_ERR("synthetic source: out of memory\n");
+            exit(1);
+        }
+
+        for(j = 0; j < SYNTH_MAX_FRAME_BYTES; j++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            payloads[i][j] = seed | 0x01;
+        }
+    }
+
+    frames_since_idr = config.idr_period;
+    low_pending = 0;
+    motion_init(&motion);
+    noise_seed = 0x9e3779b9;
+    loaded = 1;
+}
+
+static void synth_deinit()
+{
+    int i;
+
+    for(i = 0; i < SOURCE_POOL_SIZE; i++)
+        free(payloads[i]);
+    source_pool_destroy(&pool);
+    loaded = 0;
+}
+
+static void synth_start_capture()
+{
+    //The low copy of a frame made before the stop is stale
+    low_pending = 0;
+    restart_schedule();
+}
+
+static void synth_stop_capture()
+{
+}
+
+//Writes a frame to p, SPS and PPS ahead of an IDR. Returns its length
+static uint32_t write_frame(uint8_t* p, int idr, int layer)
+{
+    uint32_t max_slice = SYNTH_MAX_FRAME_BYTES - sizeof(sps) - sizeof(pps) - 4;
+    uint32_t fixed_bytes = idr ? fixed_idr_bytes : fixed_p_bytes;
+    uint32_t len = 0;
+    uint32_t slice;
+
+    if(fixed_bytes)
+        slice = layer == LAYER_LOW ? fixed_bytes/4 : fixed_bytes;
+    else if(layer == LAYER_LOW)
+        slice = p_frame_bytes(VIDEO_LOW_BITRATE, config.framerate)
+            *(idr ? SYNTH_IDR_SCALE : 1);
+    else if(motion.idle && MOTION_IDLE_FRAMERATE < config.framerate)
+        slice = p_frame_bytes(bitrate < MOTION_IDLE_BITRATE
+                              ? bitrate : MOTION_IDLE_BITRATE
+                              , MOTION_IDLE_FRAMERATE)
+            *(idr ? SYNTH_IDR_SCALE : 1);
+    else
+        slice = p_frame_bytes(bitrate, config.framerate)
+            *(idr ? SYNTH_IDR_SCALE : 1);
+
+    if(idr)
+    {
+        memcpy(p, sps, sizeof(sps));
+        memcpy(p + sizeof(sps), pps, sizeof(pps));
+        len = sizeof(sps) + sizeof(pps);
+    }
+
+    if(slice > max_slice)
+        slice = max_slice;
+
+    return len + write_slice(p + len, idr, slice);
+}
+
+//Draws the scene at now_us: a gradient with a level of noise, and the square
+//while it moves
+static void draw_scene(uint64_t now_us)
+{
+    uint64_t t_ms = (now_us - schedule_start_us)/1000;
+    int moving = (t_ms/1000/scene_seconds)%2 == 0;
+    int square_x = t_ms*SYNTH_SQUARE_SPEED/1000
+        %(MOTION_WIDTH - SYNTH_SQUARE_SIZE);
+    int square_y = (MOTION_HEIGHT - SYNTH_SQUARE_SIZE)/2;
+    int x, y;
+
+    for(y = 0; y < MOTION_HEIGHT; y++)
+        for(x = 0; x < MOTION_WIDTH; x++)
+        {
+            noise_seed ^= noise_seed << 13;
+            noise_seed ^= noise_seed >> 17;
+            noise_seed ^= noise_seed << 5;
+            scene[y*MOTION_WIDTH + x] = 64 + x/2 + y/2 + noise_seed%3 - 1;
+        }
+
+    if(moving)
+        for(y = square_y; y < square_y + SYNTH_SQUARE_SIZE; y++)
+            memset(scene + y*MOTION_WIDTH + square_x, 235, SYNTH_SQUARE_SIZE);
+}
+
+//Runs the motion detector on the frame due at due_us. Returns 1 if the gated
+//framerate drops the frame
+static int gate_frame(uint64_t due_us)
+{
+    int step = config.framerate/MOTION_IDLE_FRAMERATE;
+
+    draw_scene(due_us);
+    if(motion_update(&motion, scene, MOTION_WIDTH, due_us))
+    {
+        DEBUG_MSG("synthetic source: scene %s\n"
+                  , motion.idle ? "still, encoding at the idle rate"
+                  : "moves again");
+        stats_set(STAT_MOTION_IDLE, motion.idle);
+    }
+    stats_set(STAT_MOTION_SCORE, motion.score);
+
+    return motion.idle && step > 1 && frame_index%step;
+}
+
+static source_buffer_t* synth_fill_buffer()
+{
+    source_buffer_t* buffer = source_pool_get(&pool);
+    uint8_t* p = payloads[buffer - pool.buffers];
+    uint64_t interval_us = 1000000/config.framerate;
+    uint64_t due_us;
+    int idr = 0;
+
+    //Right behind its main frame, with the same times
+    if(low_pending)
+    {
+        low_pending = 0;
+        buffer->data = p;
+        buffer->len = write_frame(p, low_idr, LAYER_LOW);
+        buffer->timestamp_us = media_us - interval_us;
+        buffer->ready_us = get_time_us();
+        buffer->capture_us = low_capture_us;
+        buffer->end_of_frame = 1;
+        buffer->keyframe = low_idr;
+        buffer->codec_config = 0;
+        buffer->layer = LAYER_LOW;
+        source_notify_frame();
+        return buffer;
+    }
+
+    //Every interval is a look at the scene, like the preview port of the
+    //camera, even when the frame is dropped
+    for(;;)
+    {
+        due_us = schedule_start_us + (frame_index - schedule_index)*interval_us;
+        if(!fast)
+            source_sleep_until(due_us);
+        if(!scene_seconds || !gate_frame(due_us))
+            break;
+        media_us += interval_us;
+        frame_index++;
+    }
+
+    if(__atomic_exchange_n(&idr_requested, 0, __ATOMIC_ACQ_REL)
+       || frames_since_idr >= (uint64_t)config.idr_period)
+        idr = 1;
+    if(idr)
+        frames_since_idr = 0;
+    frames_since_idr++;
+
+    uint32_t len = write_frame(p, idr, LAYER_MAIN);
+    buffer->ready_us = get_time_us();
+    buffer->capture_us = fast ? buffer->ready_us : due_us;
+    source_notify_frame();
+
+    buffer->data = p;
+    buffer->len = len;
+    buffer->timestamp_us = media_us;
+    buffer->end_of_frame = 1;
+    buffer->keyframe = idr;
+    buffer->codec_config = 0;
+    buffer->layer = LAYER_MAIN;
+    media_us += interval_us;
+    frame_index++;
+
+    low_pending = simulcast;
+    low_idr = idr;
+    low_capture_us = buffer->capture_us;
+
+    return buffer;
+}
+
+static void synth_release_buffer(source_buffer_t* buffer)
+{
+    //Put back the bytes the headers of this frame overwrote
+    uint8_t* p = payloads[buffer - pool.buffers];
+    uint32_t i;
+
+    for(i = 0; i < sizeof(sps) + sizeof(pps) + 6; i++)
+        p[i] = 0x5b;
+
+    source_pool_put(&pool, buffer);
+}
+
+static void synth_get_config(video_config_t* out)
+{
+    *out = config;
+}
+
+static int synth_config_needs_restart(video_config_t* new_config)
+{
+    return 0;
+}
+
+static int synth_set_config(video_config_t* new_config)
+{
+    if(new_config->bitrate != config.bitrate)
+        bitrate = new_config->bitrate;
+    config = *new_config;
+    restart_schedule();
+
+    return loaded ? VIDEO_CONFIG_LIVE : VIDEO_CONFIG_STORED;
+}
+
+static void synth_set_bitrate(int new_bitrate)
+{
+    if(!new_bitrate || new_bitrate > config.bitrate)
+        new_bitrate = config.bitrate;
+    bitrate = new_bitrate;
+}
+
+static void synth_request_idr()
+{
+    __atomic_store_n(&idr_requested, 1, __ATOMIC_RELEASE);
+}
+
+static int synth_layer_count()
+{
+    return simulcast ? STREAM_LAYERS : 1;
+}
+
+static int synth_pending_buffers()
+{
+    //Frames are made when they are asked for
+    return 0;
+}
+
+frame_source_t synthetic_source = {
+    "synthetic",
+    synth_open,
+    synth_init,
+    synth_deinit,
+    synth_start_capture,
+    synth_stop_capture,
+    synth_fill_buffer,
+    synth_release_buffer,
+    synth_get_config,
+    synth_config_needs_restart,
+    synth_set_config,
+    synth_set_bitrate,
+    synth_request_idr,
+    synth_layer_count,
+    synth_pending_buffers,
+    source_set_frame_notify,
+    source_set_buffer_ready,
+    source_take_buffer,
+};
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../rtp/rtp_fec.h"
+#include "../fec/fec_decoder.h"
+
+//Loss injection through the encoder of rtp_fec.h and the decoder of
+//fec_decoder.h. A stream of frames like the camera's (an IDR of about 12 KB
+//every 30 frames, P frames of one packet) is packetized and protected, its
+//datagrams are dropped at random and the rest go through the decoder.
+//Prints the frames that arrive whole with the overhead each configuration
+//costs, and fails if:
+//  - a recovered packet differs from the one sent
+//  - a media packet isn't on the media SSRC, or a repair packet on its
+//    FEC_REPAIR_SSRC(), or the decoder drops a packet as another stream's
+//  - the decoder mixes up the blocks of a stream with the next one, of
+//    another SSRC, after a switch
+//  - a frame is lost without any loss, or FEC does worse than no FEC
+//  - FEC doesn't recover every frame when each block loses no more than
+//    its repair packets can rebuild: the first m packets of every frame, or
+//    as many as the frame has repair packets, with blocks that end with
+//    their frame
+#define FEC_TEST_FRAMES 3000
+#define FEC_TEST_IDR_PERIOD 30
+#define FEC_TEST_MAX_FRAME 16000
+#define FEC_TEST_SSRC 0x12345678
+#define FEC_TEST_NEXT_SSRC 0x12345679 //of the other layer
+//Every packet sent is kept to compare the recovered ones with
+#define FEC_TEST_MAX_PACKETS 16384
+#define FEC_TEST_DATA_BYTES (FEC_TEST_MAX_PACKETS*FEC_MAX_PACKET)
+
+typedef struct {
+    fec_mode mode;
+    int k;
+    int m;
+    int block_frames;
+} fec_test_config_t;
+
+static const fec_test_config_t configs[] = {
+    {FEC_MODE_OFF, 8, 0, 1},
+    {FEC_MODE_XOR, 4, 1, 1},
+    {FEC_MODE_XOR, 8, 1, 4},
+    {FEC_MODE_RS, 8, 2, 1},
+    {FEC_MODE_RS, 8, 2, 4},
+    {FEC_MODE_RS, 8, 4, 2},
+    {FEC_MODE_RS, 16, 4, 4},
+};
+#define FEC_TEST_CONFIGS (int)(sizeof(configs)/sizeof(configs[0]))
+
+static const double losses[] = {0, 0.01, 0.05, 0.10};
+#define FEC_TEST_LOSSES (int)(sizeof(losses)/sizeof(losses[0]))
+
+//Drop the first drop_first packets of every frame instead of random ones,
+//no more than its repair packets as a short block gets fewer than m
+typedef struct {
+    double loss;
+    int drop_first;
+} loss_model_t;
+
+static rtp_session_t session;
+static rtp_fec_t fec;
+static rtp_frame_t frame;
+static rtp_fec_payloads_t payloads;
+static fec_decoder_t* decoder;
+static uint8_t frame_data[FEC_TEST_MAX_FRAME];
+
+static uint8_t sent_data[FEC_TEST_DATA_BYTES];
+static uint32_t sent_offset[FEC_TEST_MAX_PACKETS];
+static uint16_t sent_len[FEC_TEST_MAX_PACKETS];
+static uint8_t received[FEC_TEST_MAX_PACKETS];
+static uint32_t sent_bytes;
+static uint16_t first_sequence;
+static int frame_first[FEC_TEST_FRAMES];
+static int frame_packets[FEC_TEST_FRAMES];
+
+static int corrupt;
+static int wrong_ssrc;
+static int failures;
+static uint32_t random_state;
+
+//Same sequence on every libc
+static uint32_t next_random()
+{
+    random_state = random_state*1103515245 + 12345;
+    return random_state >> 8;
+}
+
+static double next_uniform()
+{
+    return (next_random() & 0xffffff)/(double)0x1000000;
+}
+
+static void deliver(void* arg, const uint8_t* packet, int len)
+{
+    uint16_t index = (((packet[2] << 8) | packet[3]) - first_sequence) & 0xffff;
+
+    if(index >= FEC_TEST_MAX_PACKETS || len != sent_len[index]
+       || memcmp(packet, sent_data + sent_offset[index], len))
+    {
+        corrupt++;
+        return;
+    }
+    received[index] = 1;
+}
+
+static uint32_t make_frame(int f)
+{
+    uint32_t len = f%FEC_TEST_IDR_PERIOD == 0 ? 12000 + next_random()%2000
+        : 600 + next_random()%800;
+    uint32_t i;
+
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 1;
+    frame_data[3] = f%FEC_TEST_IDR_PERIOD == 0 ? 0x65 : 0x41;
+    //No zero bytes, so no start code inside
+    for(i = 4; i < len; i++)
+        frame_data[i] = next_random() | 1;
+
+    return len;
+}
+
+static uint32_t datagram_ssrc(const uint8_t* datagram)
+{
+    return ((uint32_t)datagram[8] << 24) | (datagram[9] << 16)
+        | (datagram[10] << 8) | datagram[11];
+}
+
+//Streams frames on ssrc through the decoder, which keeps what came before.
+//Returns the share of the frames that arrived whole, in percent
+static double run(const fec_test_config_t* test, loss_model_t* model,
+        uint32_t ssrc, double* overhead)
+{
+    fec_config_t config;
+    uint64_t media_bytes = 0, repair_bytes = 0;
+    int packets = 0;
+    int whole = 0;
+    int drop;
+    int f, i;
+
+    config.mode = test->mode;
+    config.block_packets = test->k;
+    config.repair_packets = test->m;
+    config.block_frames = test->block_frames;
+    random_state = 1234;
+    rtp_session_init(&session, ssrc);
+    rtp_fec_init(&fec, &session, &config);
+    first_sequence = session.sequence;
+    memset(received, 0, sizeof(received));
+    sent_bytes = 0;
+
+    for(f = 0; f < FEC_TEST_FRAMES; f++)
+    {
+        uint32_t len = make_frame(f);
+
+        rtp_packetize_h264(&session, &frame, frame_data, len
+                           , f*(RTP_CLOCK_RATE/30), 1);
+        rtp_fec_protect(&fec, &frame, &payloads);
+        frame_first[f] = packets;
+        frame_packets[f] = frame.packet_count;
+        drop = model->drop_first < frame.repair_count ? model->drop_first
+            : frame.repair_count;
+
+        for(i = 0; i < frame.packet_count + frame.repair_count; i++)
+        {
+            rtp_packet_t* packet = &frame.packets[i];
+            uint8_t datagram[FEC_MAX_PACKET];
+            int size = 0;
+            int v;
+
+            for(v = 0; v < packet->iov_count; v++)
+            {
+                memcpy(datagram + size, packet->iov[v].iov_base
+                       , packet->iov[v].iov_len);
+                size += packet->iov[v].iov_len;
+            }
+
+            //What a receiver demultiplexes on
+            uint32_t packet_ssrc = datagram_ssrc(datagram);
+            if((i < frame.packet_count) != (packet_ssrc == ssrc)
+               || (packet_ssrc != ssrc
+                   && packet_ssrc != FEC_REPAIR_SSRC(ssrc)))
+                wrong_ssrc++;
+
+            if(i < frame.packet_count)
+            {
+                if(packets == FEC_TEST_MAX_PACKETS)
+                {
+                    printf("FAIL more than %d packets\n", FEC_TEST_MAX_PACKETS);
+                    exit(1);
+                }
+                sent_offset[packets] = sent_bytes;
+                sent_len[packets] = size;
+                memcpy(sent_data + sent_bytes, datagram, size);
+                sent_bytes += size;
+                packets++;
+                media_bytes += size;
+            }
+            else
+                repair_bytes += size;
+
+            if(model->drop_first ? i < drop
+               : next_uniform() < model->loss)
+                continue;
+            fec_decoder_push(decoder, datagram, size);
+        }
+    }
+
+    for(f = 0; f < FEC_TEST_FRAMES; f++)
+    {
+        for(i = 0; i < frame_packets[f] && received[frame_first[f] + i]; i++);
+        whole += (i == frame_packets[f]);
+    }
+
+    wrong_ssrc += decoder->stats.bad_packets;
+    *overhead = 100.0*repair_bytes/media_bytes;
+    return 100.0*whole/FEC_TEST_FRAMES;
+}
+
+//A layer switch: the blocks of the first stream are still open when the
+//second one starts, with losses the decoder can only recover from its own
+//blocks
+static void test_stream_switch(loss_model_t* model)
+{
+    const fec_test_config_t* test = &configs[3];
+    double overhead;
+    double first, next;
+
+    corrupt = 0;
+    wrong_ssrc = 0;
+    model->drop_first = test->m;
+    fec_decoder_init(decoder, deliver, 0);
+    first = run(test, model, FEC_TEST_SSRC, &overhead);
+    next = run(test, model, FEC_TEST_NEXT_SSRC, &overhead);
+    printf("stream switch: %.2f%% then %.2f%% whole, %llu streams\n", first
+           , next, (unsigned long long)decoder->stats.streams);
+    if(first != 100 || next != 100 || corrupt || wrong_ssrc
+       || decoder->stats.streams != 2)
+    {
+        printf("FAIL the decoder does not follow a new SSRC\n");
+        failures++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    double off_whole[FEC_TEST_LOSSES] = {0};
+    loss_model_t model;
+    int c, l;
+
+    decoder = (fec_decoder_t*)malloc(sizeof(*decoder));
+
+    printf("frames arriving whole (%%), %d frames, IDR every %d\n"
+           , FEC_TEST_FRAMES, FEC_TEST_IDR_PERIOD);
+    printf("%-4s %3s %3s %6s %9s", "mode", "k", "m", "frames", "overhead");
+    for(l = 0; l < FEC_TEST_LOSSES; l++)
+        printf("  loss %3.0f%%", losses[l]*100);
+    printf("  drop m/frame\n");
+
+    for(c = 0; c < FEC_TEST_CONFIGS; c++)
+    {
+        const fec_test_config_t* test = &configs[c];
+        double overhead = 0;
+        double whole[FEC_TEST_LOSSES];
+        double first_whole = 0;
+        int repair = test->mode == FEC_MODE_XOR ? 1 : test->m;
+
+        corrupt = 0;
+        wrong_ssrc = 0;
+        model.drop_first = 0;
+        for(l = 0; l < FEC_TEST_LOSSES; l++)
+        {
+            model.loss = losses[l];
+            fec_decoder_init(decoder, deliver, 0);
+            whole[l] = run(test, &model, FEC_TEST_SSRC, &overhead);
+        }
+        int drop_test = test->mode != FEC_MODE_OFF && test->block_frames == 1;
+        if(drop_test)
+        {
+            model.drop_first = repair;
+            fec_decoder_init(decoder, deliver, 0);
+            first_whole = run(test, &model, FEC_TEST_SSRC, &overhead);
+        }
+
+        printf("%-4s %3d %3d %6d %8.1f%%", fec_mode_name(test->mode), test->k
+               , repair, test->block_frames, overhead);
+        for(l = 0; l < FEC_TEST_LOSSES; l++)
+            printf("  %9.2f", whole[l]);
+        if(drop_test)
+            printf("  %11.2f", first_whole);
+        printf("\n");
+
+        if(corrupt)
+        {
+            printf("FAIL %d recovered packets differ from the sent ones\n"
+                   , corrupt);
+            failures++;
+        }
+        if(wrong_ssrc)
+        {
+            printf("FAIL %d packets on the wrong SSRC\n", wrong_ssrc);
+            failures++;
+        }
+        if(whole[0] != 100)
+        {
+            printf("FAIL frames lost without loss\n");
+            failures++;
+        }
+        for(l = 0; l < FEC_TEST_LOSSES; l++)
+        {
+            if(test->mode == FEC_MODE_OFF)
+                off_whole[l] = whole[l];
+            else if(whole[l] < off_whole[l])
+            {
+                printf("FAIL worse than no FEC at %.0f%% loss\n"
+                       , losses[l]*100);
+                failures++;
+            }
+        }
+        if(drop_test && first_whole != 100)
+        {
+            printf("FAIL not every block recovered its %d losses\n", repair);
+            failures++;
+        }
+    }
+
+    test_stream_switch(&model);
+
+    free(decoder);
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
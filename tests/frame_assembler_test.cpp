@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../source/frame_assembler.h"
+#include "../rtp/rtp_h264.h"
+
+//Replays partial encoder buffers through frame_assembler_add():
+//  - traces/partial_buffers.h264 cut as in traces/partial_buffers.trace by
+//    the file source: SPS/PPS buffers ahead of an IDR in two pieces, start
+//    codes straddling buffers, a frame in more than FRAME_MAX_BUFFERS
+//    buffers whose last one is dropped, an SEI behind a slice. Every frame is
+//    packetized and depacketized again and its NAL units are compared with
+//    traces/partial_buffers.frames
+//  - buffers with the timestamps the camera gives them, for what the file
+//    source can't make: a lost end of frame, a cut frame whose end is lost,
+//    more SPS/PPS buffers than FRAME_MAX_BUFFERS, both layers interleaved
+//Every buffer has to be released exactly once, by the assembler or by the
+//test once its frame is done.
+//
+//frame_assembler_test <traces dir>
+#define ASSEMBLER_TEST_MAX_NAL 65536
+#define ASSEMBLER_TEST_LINE_SIZE 512
+#define ASSEMBLER_TEST_PATH_SIZE 1024
+//Buffers of one timestamp case
+#define CASE_MAX_BUFFERS 12
+
+//OMX_BUFFERFLAG_ values, as in the traces
+#define FLAG_END_OF_FRAME 0x10
+#define FLAG_SYNC_FRAME 0x20
+#define FLAG_CODEC_CONFIG 0x80
+
+typedef struct {
+    uint32_t flags;
+    int64_t timestamp_us;
+    int layer;
+} case_buffer_t;
+
+typedef struct {
+    const char* name;
+    case_buffer_t buffers[CASE_MAX_BUFFERS];
+    int buffer_count;
+    //Each delivered frame as the mask of the buffers it holds, in order of
+    //delivery, with a * after the mask if it was cut
+    const char* frames;
+    //Buffers the assembler drops itself
+    uint32_t dropped;
+} assembler_case_t;
+
+static const assembler_case_t cases[] = {
+    {"end of frame lost",
+     {{0, 0, 0}, {0, 0, 0}, {FLAG_END_OF_FRAME, 100, 0}}, 3,
+     "3 4", 0},
+    {"end of frame lost before SPS/PPS",
+     {{0, 0, 0}, {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 100, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 100, 0},
+      {FLAG_SYNC_FRAME | FLAG_END_OF_FRAME, 100, 0}}, 4,
+     "1 e", 0},
+    {"SPS/PPS don't end a picture",
+     {{FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_SYNC_FRAME, 0, 0}, {FLAG_END_OF_FRAME, 0, 0}}, 4,
+     "f", 0},
+    {"cut frame",
+     {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0},
+      {FLAG_END_OF_FRAME, 0, 0}, {FLAG_END_OF_FRAME, 100, 0}}, 7,
+     "f* 40", 0x30},
+    {"cut frame, end lost",
+     {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0},
+      {0, 100, 0}, {FLAG_END_OF_FRAME, 100, 0}}, 7,
+     "f* 60", 0x10},
+    {"cut frame, end lost before SPS/PPS",
+     {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 100, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 100, 0},
+      {FLAG_SYNC_FRAME | FLAG_END_OF_FRAME, 100, 0}}, 8,
+     "f* e0", 0x10},
+    {"SPS/PPS reach FRAME_MAX_BUFFERS",
+     {{FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_CODEC_CONFIG | FLAG_END_OF_FRAME, 0, 0},
+      {FLAG_SYNC_FRAME | FLAG_END_OF_FRAME, 0, 0}}, 5,
+     "f 10", 0},
+    {"SPS/PPS without end reach FRAME_MAX_BUFFERS",
+     {{FLAG_CODEC_CONFIG, 0, 0}, {FLAG_CODEC_CONFIG, 0, 0},
+      {FLAG_CODEC_CONFIG, 0, 0}, {FLAG_CODEC_CONFIG, 0, 0},
+      {FLAG_CODEC_CONFIG, 0, 0}, {FLAG_SYNC_FRAME | FLAG_END_OF_FRAME, 0, 0}}, 6,
+     "f* 30", 0},
+    {"layers interleaved",
+     {{0, 0, LAYER_MAIN}, {0, 0, LAYER_LOW}, {FLAG_END_OF_FRAME, 0, LAYER_LOW},
+      {0, 0, LAYER_MAIN}, {FLAG_END_OF_FRAME, 0, LAYER_MAIN}}, 5,
+     "6 19", 0},
+};
+#define CASE_COUNT (int)(sizeof(cases)/sizeof(cases[0]))
+
+static source_buffer_t case_buffers[CASE_MAX_BUFFERS];
+static uint8_t case_data[4] = {0, 0, 1, 0x41};
+static char delivered[ASSEMBLER_TEST_LINE_SIZE];
+static uint32_t dropped;
+static int released[CASE_MAX_BUFFERS];
+
+static frame_assembler_t assembler;
+static int failures;
+
+//The replay
+static FILE* expected;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+static int frame_count;
+static uint8_t nal_data[ASSEMBLER_TEST_MAX_NAL];
+static uint32_t nal_len;
+static char nals[ASSEMBLER_TEST_LINE_SIZE];
+static int buffers_out;
+
+static void fail(const char* where, const char* what)
+{
+    printf("FAIL %s: %s\n", where, what);
+    failures++;
+}
+
+static uint32_t fnv1a(const uint8_t* data, uint32_t len)
+{
+    uint32_t hash = 0x811c9dc5;
+    uint32_t i;
+
+    for(i = 0; i < len; i++)
+        hash = (hash ^ data[i])*0x01000193;
+
+    return hash;
+}
+
+static void end_nal()
+{
+    int pos = strlen(nals);
+
+    if(!nal_len)
+        return;
+    snprintf(nals + pos, sizeof(nals) - pos, " %d:%u:%08x", nal_data[0] & 0x1f
+             , nal_len, fnv1a(nal_data, nal_len));
+    nal_len = 0;
+}
+
+static void add_nal_bytes(const uint8_t* data, uint32_t len)
+{
+    if(nal_len + len > sizeof(nal_data))
+    {
+        fail("replay", "NAL unit too long");
+        return;
+    }
+    memcpy(nal_data + nal_len, data, len);
+    nal_len += len;
+}
+
+//RFC 6184 back into NAL units, appended to nals
+static void depacketize(rtp_packet_t* packet)
+{
+    uint8_t buf[2048];
+    uint32_t len = 0;
+    uint8_t* payload;
+    int v;
+
+    for(v = 0; v < packet->iov_count; v++)
+    {
+        memcpy(buf + len, packet->iov[v].iov_base, packet->iov[v].iov_len);
+        len += packet->iov[v].iov_len;
+    }
+    if(len <= RTP_HEADER_SIZE)
+    {
+        fail("replay", "packet without payload");
+        return;
+    }
+    payload = buf + RTP_HEADER_SIZE;
+    len -= RTP_HEADER_SIZE;
+
+    switch(payload[0] & 0x1f)
+    {
+    case NAL_TYPE_STAP_A:
+        {
+            uint32_t pos = 1;
+
+            while(pos + 2 <= len)
+            {
+                uint32_t size = (payload[pos] << 8) | payload[pos + 1];
+
+                add_nal_bytes(payload + pos + 2, size);
+                end_nal();
+                pos += 2 + size;
+            }
+        }
+        break;
+    case NAL_TYPE_FU_A:
+        if(payload[1] & 0x80)
+        {
+            uint8_t header = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+
+            end_nal();
+            add_nal_bytes(&header, 1);
+        }
+        add_nal_bytes(payload + 2, len - 2);
+        if(payload[1] & 0x40)
+            end_nal();
+        break;
+    default:
+        end_nal();
+        add_nal_bytes(payload, len);
+        end_nal();
+    }
+}
+
+static void release_replayed(source_buffer_t* buffer)
+{
+    buffers_out--;
+    file_source.release_buffer(buffer);
+}
+
+static void deliver_replayed(source_frame_t* frame)
+{
+    char line[ASSEMBLER_TEST_LINE_SIZE];
+    char got[ASSEMBLER_TEST_LINE_SIZE + 32];
+    int count;
+    int i;
+
+    count = rtp_packetize_h264_segments(&session, &rtp_frame, frame->segments
+                                        , frame->buffer_count, 0, 1);
+    nals[0] = '\0';
+    nal_len = 0;
+    for(i = 0; i < count; i++)
+        depacketize(&rtp_frame.packets[i]);
+    end_nal();
+    snprintf(got, sizeof(got), "%d %d%s", frame->complete, frame->keyframe
+             , nals);
+
+    do
+        if(!fgets(line, sizeof(line), expected))
+            strcpy(line, "no more frames");
+    while(line[0] == '#');
+    line[strcspn(line, "\r\n")] = '\0';
+    if(strcmp(line, got))
+    {
+        printf("FAIL frame %d\n  got      %s\n  expected %s\n", frame_count
+               , got, line);
+        failures++;
+    }
+
+    frame_count++;
+    for(i = 0; i < frame->buffer_count; i++)
+        release_replayed(frame->buffers[i]);
+}
+
+static void replay(const char* dir)
+{
+    char h264_path[ASSEMBLER_TEST_PATH_SIZE];
+    char trace_arg[ASSEMBLER_TEST_PATH_SIZE];
+    char frames_path[ASSEMBLER_TEST_PATH_SIZE];
+    char fast[] = "fast";
+    char* argv[3] = {h264_path, fast, trace_arg};
+    char line[ASSEMBLER_TEST_LINE_SIZE];
+    int buffers = 0;
+    FILE* trace;
+
+    snprintf(h264_path, sizeof(h264_path), "%s/partial_buffers.h264", dir);
+    snprintf(trace_arg, sizeof(trace_arg), "trace=%s/partial_buffers.trace"
+             , dir);
+    snprintf(frames_path, sizeof(frames_path), "%s/partial_buffers.frames"
+             , dir);
+    if(!(trace = fopen(trace_arg + 6, "r")) || !(expected = fopen(frames_path, "r")))
+    {
+        printf("FAIL can't open the traces in %s\n", dir);
+        exit(1);
+    }
+    while(fgets(line, sizeof(line), trace))
+        buffers++;
+    fclose(trace);
+
+    if(!file_source.open(3, argv))
+    {
+        printf("FAIL file source arguments\n");
+        exit(1);
+    }
+    file_source.init();
+    file_source.start_capture();
+    rtp_session_init(&session, 0x1234);
+    frame_assembler_init(&assembler, deliver_replayed, release_replayed);
+
+    //The trace once, the file source starts over after it
+    while(buffers--)
+    {
+        buffers_out++;
+        frame_assembler_add(&assembler, file_source.fill_buffer());
+    }
+    frame_assembler_reset(&assembler);
+
+    if(fgets(line, sizeof(line), expected))
+        fail("replay", "fewer frames than expected");
+    if(buffers_out)
+        fail("replay", "buffers not released");
+    printf("replay: %d frames\n", frame_count);
+
+    fclose(expected);
+    file_source.stop_capture();
+    file_source.deinit();
+}
+
+static int buffer_index(source_buffer_t* buffer)
+{
+    return buffer - case_buffers;
+}
+
+//Only the buffers the assembler drops come back here
+static void release_case(source_buffer_t* buffer)
+{
+    released[buffer_index(buffer)]++;
+    dropped |= 1 << buffer_index(buffer);
+}
+
+static void deliver_case(source_frame_t* frame)
+{
+    uint32_t mask = 0;
+    int pos = strlen(delivered);
+    int i;
+
+    if(frame->buffer_count > FRAME_MAX_BUFFERS)
+        fail("case", "frame over FRAME_MAX_BUFFERS");
+    for(i = 0; i < frame->buffer_count; i++)
+    {
+        if(frame->buffers[i]->layer != frame->layer)
+            fail("case", "buffer of another layer");
+        mask |= 1 << buffer_index(frame->buffers[i]);
+        released[buffer_index(frame->buffers[i])]++;
+    }
+    snprintf(delivered + pos, sizeof(delivered) - pos, "%s%x%s", pos ? " " : ""
+             , mask, frame->complete ? "" : "*");
+}
+
+static void run_case(const assembler_case_t* test)
+{
+    int i;
+
+    memset(released, 0, sizeof(released));
+    delivered[0] = '\0';
+    dropped = 0;
+    frame_assembler_init(&assembler, deliver_case, release_case);
+
+    for(i = 0; i < test->buffer_count; i++)
+    {
+        source_buffer_t* buffer = &case_buffers[i];
+        const case_buffer_t* b = &test->buffers[i];
+
+        memset(buffer, 0, sizeof(*buffer));
+        buffer->data = case_data;
+        buffer->len = sizeof(case_data);
+        buffer->timestamp_us = b->timestamp_us;
+        buffer->end_of_frame = !!(b->flags & FLAG_END_OF_FRAME);
+        buffer->keyframe = !!(b->flags & FLAG_SYNC_FRAME);
+        buffer->codec_config = !!(b->flags & FLAG_CODEC_CONFIG);
+        buffer->layer = b->layer;
+        frame_assembler_add(&assembler, buffer);
+    }
+    //Nothing may be left pending, every case ends with an end of frame
+    frame_assembler_reset(&assembler);
+
+    for(i = 0; i < test->buffer_count; i++)
+        if(released[i] != 1)
+            fail(test->name, released[i] ? "a buffer released several times"
+                 : "a buffer never released");
+    if(dropped != test->dropped)
+        fail(test->name, "other buffers dropped");
+
+    if(strcmp(delivered, test->frames))
+    {
+        printf("FAIL %s\n  got      %s\n  expected %s\n", test->name
+               , delivered, test->frames);
+        failures++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int i;
+
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s <traces dir>\n", argv[0]);
+        return 1;
+    }
+
+    replay(argv[1]);
+    for(i = 0; i < CASE_COUNT; i++)
+        run_case(&cases[i]);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
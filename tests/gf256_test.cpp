@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fec/gf256.h"
+
+//Compares the region functions with gf256_mul() a byte at a time, for
+//every length up to two packets and every start offset within a vector, so
+//the SIMD loops and their scalar tails are both covered. Built three times:
+//with the kernels of the build machine, and with the 64 and 32 bit NEON
+//kernels against tests/neon/arm_neon.h. The expected kernel name is the
+//first argument
+#define GF256_TEST_MAX_LEN 3000
+#define GF256_TEST_ROUNDS 4000
+
+static uint8_t src[GF256_TEST_MAX_LEN + 32];
+static uint8_t dst[GF256_TEST_MAX_LEN + 32];
+static uint8_t expected[GF256_TEST_MAX_LEN + 32];
+
+static int failures;
+
+static void check(const char* what, int len, uint8_t c)
+{
+    if(memcmp(dst, expected, sizeof(dst)))
+    {
+        if(failures++ < 10)
+            printf("FAIL %s len=%d c=%d\n", what, len, c);
+    }
+}
+
+static void fill(uint8_t* buf, int len)
+{
+    int i;
+
+    for(i = 0; i < len; i++)
+        buf[i] = rand();
+}
+
+static void check_field()
+{
+    int a, b;
+
+    for(a = 1; a < 256; a++)
+    {
+        if(gf256_mul(a, gf256_inv(a)) != 1)
+            printf("FAIL inverse of %d\n", a), failures++;
+        for(b = 0; b < 256; b++)
+            if(gf256_mul(a, b) != gf256_mul(b, a))
+            {
+                printf("FAIL %d*%d not commutative\n", a, b);
+                failures++;
+            }
+    }
+}
+
+static void check_regions()
+{
+    int round, i;
+
+    for(round = 0; round < GF256_TEST_ROUNDS; round++)
+    {
+        //Short lengths often, they exercise the tails
+        int len = round < 128 ? round : rand()%GF256_TEST_MAX_LEN;
+        int offset = rand()%32;
+        uint8_t c = round%4 == 0 ? round/4%256 : rand();
+        uint8_t* s = src + offset;
+        uint8_t* d = dst + offset;
+        uint8_t* e = expected + offset;
+
+        fill(src, sizeof(src));
+        fill(dst, sizeof(dst));
+
+        memcpy(expected, dst, sizeof(dst));
+        for(i = 0; i < len; i++)
+            e[i] ^= gf256_mul(c, s[i]);
+        gf256_mul_add_region(d, s, c, len);
+        check("mul_add_region", len, c);
+
+        memcpy(expected, dst, sizeof(dst));
+        for(i = 0; i < len; i++)
+            e[i] = gf256_mul(c, e[i]);
+        gf256_mul_region(d, c, len);
+        check("mul_region", len, c);
+
+        memcpy(expected, dst, sizeof(dst));
+        for(i = 0; i < len; i++)
+            e[i] ^= s[i];
+        gf256_add_region(d, s, len);
+        check("add_region", len, 0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    srand(1);
+    gf256_init();
+    printf("kernel %s\n", gf256_kernel_name());
+    if(argc > 1 && strcmp(argv[1], gf256_kernel_name()))
+    {
+        printf("FAIL expected the %s kernel\n", argv[1]);
+        return 1;
+    }
+
+    check_field();
+    check_regions();
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../source/motion.h"
+
+//Compares motion_block_sad() of every kernel the build and the CPU have
+//with a plain sum, on random planes of random strides, then runs
+//motion_update() over a still and a moving scene. Built twice: with the
+//kernels of the build machine, and with the NEON one against
+//tests/neon/arm_neon.h. The kernel motion_init() should pick is the first
+//argument
+#define MOTION_TEST_MAX_WIDTH 320
+#define MOTION_TEST_MAX_HEIGHT 240
+#define MOTION_TEST_MAX_STRIDE (MOTION_TEST_MAX_WIDTH + 64)
+#define MOTION_TEST_ROUNDS 300
+#define MOTION_TEST_MAX_BLOCKS \
+    ((MOTION_TEST_MAX_WIDTH/MOTION_BLOCK)*(MOTION_TEST_MAX_HEIGHT/MOTION_BLOCK))
+#define MOTION_TEST_FRAME_US 100000
+
+static const char* kernel_names[] = {"scalar", "sse2", "avx2", "neon"};
+#define KERNEL_NAMES (int)(sizeof(kernel_names)/sizeof(kernel_names[0]))
+
+static uint8_t a[MOTION_TEST_MAX_STRIDE*MOTION_TEST_MAX_HEIGHT];
+static uint8_t b[MOTION_TEST_MAX_STRIDE*MOTION_TEST_MAX_HEIGHT];
+static uint8_t luma[MOTION_WIDTH*MOTION_HEIGHT];
+static int failures;
+
+static void reference_sad(int a_stride, int b_stride, int width, int height,
+        uint32_t* sums)
+{
+    int blocks = width/MOTION_BLOCK;
+    int x, y;
+
+    memset(sums, 0, blocks*(height/MOTION_BLOCK)*sizeof(*sums));
+    for(y = 0; y < height; y++)
+        for(x = 0; x < width; x++)
+            sums[y/MOTION_BLOCK*blocks + x/MOTION_BLOCK] +=
+                abs(a[y*a_stride + x] - b[y*b_stride + x]);
+}
+
+static void check_kernel(const char* name)
+{
+    uint32_t expected[MOTION_TEST_MAX_BLOCKS];
+    uint32_t sums[MOTION_TEST_MAX_BLOCKS];
+    int round;
+    size_t i;
+
+    srand(1);
+    for(round = 0; round < MOTION_TEST_ROUNDS; round++)
+    {
+        int width = MOTION_BLOCK*(1 + rand()%(MOTION_TEST_MAX_WIDTH/MOTION_BLOCK));
+        int height = MOTION_BLOCK*(1 + rand()%(MOTION_TEST_MAX_HEIGHT/MOTION_BLOCK));
+        int a_stride = width + rand()%(MOTION_TEST_MAX_STRIDE - width + 1);
+        int b_stride = width + rand()%(MOTION_TEST_MAX_STRIDE - width + 1);
+        int blocks = (width/MOTION_BLOCK)*(height/MOTION_BLOCK);
+
+        //Full range differences often, they overflow narrow sums
+        for(i = 0; i < sizeof(a); i++)
+        {
+            a[i] = round%3 ? rand() : 255*(rand()&1);
+            b[i] = round%3 ? rand() : 255 - a[i];
+        }
+
+        reference_sad(a_stride, b_stride, width, height, expected);
+        motion_block_sad(a, a_stride, b, b_stride, width, height, sums);
+        if(memcmp(sums, expected, blocks*sizeof(*sums)))
+        {
+            if(failures++ < 10)
+                printf("FAIL %s %dx%d strides %d %d\n", name, width, height
+                       , a_stride, b_stride);
+        }
+    }
+}
+
+//A textured scene with noise, a bright box moving over it while moving is set
+static void make_scene(int frame, int moving)
+{
+    int x, y;
+
+    for(y = 0; y < MOTION_HEIGHT; y++)
+        for(x = 0; x < MOTION_WIDTH; x++)
+            luma[y*MOTION_WIDTH + x] = 64 + (x/2 + y/3)%128 + rand()%5;
+    if(moving)
+        for(y = 40; y < 56; y++)
+            for(x = frame*4%MOTION_WIDTH; x < frame*4%MOTION_WIDTH + 12
+                && x < MOTION_WIDTH; x++)
+                luma[y*MOTION_WIDTH + x] = 230;
+}
+
+static void check_gating()
+{
+    motion_detector_t motion;
+    uint64_t now_us = 0;
+    int idle_frame = -1, moved_frame = -1;
+    int frame;
+
+    motion_init(&motion);
+    for(frame = 0; frame < 120; frame++, now_us += MOTION_TEST_FRAME_US)
+    {
+        //Still from frame 10 to 89, frame 10 still sees the box go
+        int moving = frame < 10 || frame >= 90;
+
+        make_scene(frame, moving);
+        if(motion_update(&motion, luma, MOTION_WIDTH, now_us))
+        {
+            if(motion.idle && idle_frame < 0)
+                idle_frame = frame;
+            else if(!motion.idle && moved_frame < 0)
+                moved_frame = frame;
+        }
+        if(frame > 0 && frame <= 10 && motion.score < MOTION_THRESHOLD)
+        {
+            printf("FAIL moving frame %d scored %d\n", frame, motion.score);
+            failures++;
+        }
+        if(frame > 10 && frame < 90 && motion.score >= MOTION_THRESHOLD)
+        {
+            printf("FAIL still frame %d scored %d\n", frame, motion.score);
+            failures++;
+        }
+    }
+
+    //Idle MOTION_IDLE_MS after frame 10
+    if(idle_frame != 10 + MOTION_IDLE_MS*1000/MOTION_TEST_FRAME_US
+       || moved_frame != 90)
+    {
+        printf("FAIL idle from frame %d, moving again from frame %d\n"
+               , idle_frame, moved_frame);
+        failures++;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    motion_detector_t motion;
+    int checked = 0;
+    int i;
+
+    motion_init(&motion);
+    printf("kernel %s\n", motion_kernel_name());
+    if(argc > 1 && strcmp(argv[1], motion_kernel_name()))
+    {
+        printf("FAIL expected the %s kernel\n", argv[1]);
+        return 1;
+    }
+    check_gating();
+
+    for(i = 0; i < KERNEL_NAMES; i++)
+        if(motion_use_kernel(kernel_names[i]))
+        {
+            check_kernel(kernel_names[i]);
+            printf("%s checked\n", kernel_names[i]);
+            checked++;
+        }
+    if(checked < 2 && argc > 1 && strcmp(argv[1], "scalar"))
+    {
+        printf("FAIL no SIMD kernel checked\n");
+        failures++;
+    }
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
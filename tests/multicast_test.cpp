@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../common_util/common_util.h"
+#include "../rtp/rtp_h264.h"
+#include "../udp_setup/udp_setup.h"
+
+//Multicast streaming on one host: several receivers join MCAST_GROUP on the
+//loopback device and each has to get every packet of frames sent once with
+//udp_send_stream(), in every send mode. The server stream socket binds
+//MCAST_PORT itself, so the receivers share another port. MCAST_INTERFACE
+//is any, which follows the default route, so the stream socket is pointed
+//at the loopback device here
+#define MCAST_TEST_RECEIVERS 4
+#define MCAST_TEST_FRAMES 200
+#define MCAST_TEST_MAX_FRAME 30000
+
+static const char* mode_names[] = {"sendmsg", "sendmmsg", "gso"};
+
+static int receivers[MCAST_TEST_RECEIVERS];
+static struct sockaddr_in group_addr;
+static rtp_session_t session;
+static rtp_frame_t rtp_frame;
+static uint8_t frame_data[MCAST_TEST_MAX_FRAME];
+//Times each receiver got each sequence number
+static uint8_t seen[MCAST_TEST_RECEIVERS][65536];
+static int failures;
+
+static void expect(int ok, const char* what)
+{
+    if(!ok)
+    {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void setup_receivers()
+{
+    struct ip_mreq mreq;
+    struct in_addr loopback;
+    int one = 1;
+    int size = 4*1024*1024;
+    int i;
+
+    //The group of the server on a port of the first receiver
+    udp_multicast_addr(&group_addr);
+    group_addr.sin_port = 0;
+    mreq.imr_multiaddr = group_addr.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+    for(i = 0; i < MCAST_TEST_RECEIVERS; i++)
+    {
+        struct sockaddr_in addr = group_addr;
+        socklen_t len = sizeof(addr);
+
+        receivers[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(receivers[i], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(receivers[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if(bind(receivers[i], (struct sockaddr*)&addr, sizeof(addr)) < 0
+           || getsockname(receivers[i], (struct sockaddr*)&addr, &len) < 0
+           || setsockopt(receivers[i], IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq
+                         , sizeof(mreq)) < 0)
+        {
+            perror("receiver");
+            exit(1);
+        }
+        group_addr.sin_port = addr.sin_port;
+    }
+
+    loopback.s_addr = htonl(INADDR_LOOPBACK);
+    if(setsockopt(udp_stream_fd(), IPPROTO_IP, IP_MULTICAST_IF, &loopback
+                  , sizeof(loopback)) < 0)
+    {
+        perror("IP_MULTICAST_IF");
+        exit(1);
+    }
+}
+
+//The socket options setup_multicast() sets
+static void test_options()
+{
+    unsigned char ttl = 0, loop = 0;
+    socklen_t len = sizeof(ttl);
+
+    getsockopt(udp_stream_fd(), IPPROTO_IP, IP_MULTICAST_TTL, &ttl, &len);
+    len = sizeof(loop);
+    getsockopt(udp_stream_fd(), IPPROTO_IP, IP_MULTICAST_LOOP, &loop, &len);
+    expect(ttl == MCAST_TTL, "stream socket has MCAST_TTL");
+    expect(loop == MCAST_LOOP, "stream socket has MCAST_LOOP");
+}
+
+static void drain_receivers()
+{
+    uint8_t buf[2048];
+    int i;
+
+    for(i = 0; i < MCAST_TEST_RECEIVERS; i++)
+    {
+        ssize_t len;
+
+        while((len = recv(receivers[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            if(len >= RTP_HEADER_SIZE)
+                seen[i][buf[2] << 8 | buf[3]]++;
+    }
+}
+
+static void test_mode(int mode)
+{
+    uint64_t start_packets, start_syscalls, packets, syscalls;
+    uint16_t first = session.sequence;
+    int total = 0;
+    int frame, i;
+    char what[96];
+
+    if(udp_set_send_mode(mode) != mode)
+    {
+        printf("%s not supported by the kernel\n", mode_names[mode]);
+        return;
+    }
+
+    memset(seen, 0, sizeof(seen));
+    udp_get_send_stats(&start_packets, &start_syscalls);
+    for(frame = 0; frame < MCAST_TEST_FRAMES; frame++)
+    {
+        //Single NAL unit packets to IDRs of a few dozen
+        int len = 16 + rand()%(MCAST_TEST_MAX_FRAME - 16);
+
+        frame_data[4] = frame%30 ? 0x41 : 0x65;
+        total += rtp_packetize_h264(&session, &rtp_frame, frame_data, len
+                                    , frame*9000, 1);
+        expect(!udp_send_stream(&rtp_frame, &group_addr)
+               , "socket buffer never full");
+        drain_receivers();
+    }
+    udp_get_send_stats(&packets, &syscalls);
+
+    snprintf(what, sizeof(what), "%s sends each packet once", mode_names[mode]);
+    expect(packets - start_packets == (uint64_t)total, what);
+    for(i = 0; i < MCAST_TEST_RECEIVERS; i++)
+    {
+        int missing = 0, twice = 0;
+        int n;
+
+        for(n = 0; n < total; n++)
+        {
+            uint16_t sequence = first + n;
+
+            missing += !seen[i][sequence];
+            twice += seen[i][sequence] > 1;
+        }
+        snprintf(what, sizeof(what), "%s receiver %d: %d of %d missing, %d twice"
+                 , mode_names[mode], i, missing, total, twice);
+        expect(!missing && !twice, what);
+    }
+    printf("%s: %d packets in %llu system calls to %d receivers\n"
+           , mode_names[mode], total
+           , (unsigned long long)(syscalls - start_syscalls)
+           , MCAST_TEST_RECEIVERS);
+}
+
+int main(int argc, char** argv)
+{
+    int mode;
+    int i;
+
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+    setup_receivers();
+    rtp_session_init(&session, 0x4d43);
+
+    //No byte pattern that looks like a start code
+    frame_data[0] = 0;
+    frame_data[1] = 0;
+    frame_data[2] = 0;
+    frame_data[3] = 1;
+    for(i = 5; i < MCAST_TEST_MAX_FRAME; i++)
+        frame_data[i] = 1 + rand()%255;
+
+    test_options();
+    for(mode = UDP_SEND_MODE_SENDTO; mode <= UDP_SEND_MODE_GSO; mode++)
+        test_mode(mode);
+
+    for(i = 0; i < MCAST_TEST_RECEIVERS; i++)
+        close(receivers[i]);
+    udp_server_close();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
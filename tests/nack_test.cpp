@@ -0,0 +1,526 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../app/app_config.h"
+#include "../session/client_table.h"
+#include "../session/packet_history.h"
+#include "../udp_setup/udp_setup.h"
+
+//The NACK path of the server without the camera:
+//  - parse_nack() on single numbers, ranges and ranges wrapping past 65535
+//  - packet_history_add() copying the packets, so the source buffers go back
+//    right away, and dropping them by age and by slot count,
+//    packet_history_find() across the wrap and per layer
+//  - the retransmit token bucket of client_nack(), burst, refill and cap
+//  - a NACK of a packet several frames old, sent one Wi-Fi RTT plus the
+//    reorder wait of the client after the frame
+//  - a lossy loopback: frames sent to a client through the stream socket
+//    lose packets, the client NACKs the holes and gets every one back
+//The client stream port is the server stream port, so on loopback the
+//packets come back on udp_stream_fd(). Needs the server ports free
+#define NACK_TEST_FRAME_BYTES 2800
+#define NACK_TEST_BIG_FRAME_BYTES 30000
+#define NACK_TEST_LOSSY_FRAMES 300
+#define NACK_TEST_LOSS 0.10
+#define NACK_TEST_FRAME_US 33333
+//Round trip over a busy Wi-Fi link and how long the client waits for a
+//reordered packet before it NACKs
+#define NACK_TEST_RTT_US 150000
+#define NACK_TEST_REORDER_US 100000
+//Frame data, one buffer per frame held at a time
+#define NACK_TEST_DATA_FRAMES 8
+//Released frames, by the timestamp_us the test gave them
+#define NACK_TEST_MAX_IDS 64
+
+static uint8_t frame_data[NACK_TEST_DATA_FRAMES][NACK_TEST_BIG_FRAME_BYTES];
+static rtp_session_t session;
+static int released[NACK_TEST_MAX_IDS];
+static int failures;
+static uint32_t random_state = 1;
+
+static uint32_t next_random()
+{
+    random_state = random_state*1103515245 + 12345;
+    return random_state >> 8;
+}
+
+static void expect(int ok, const char* what)
+{
+    if(!ok)
+    {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static void release(source_frame_t* source)
+{
+    released[source->timestamp_us%NACK_TEST_MAX_IDS]++;
+}
+
+static void make_data(uint8_t* data, uint32_t len)
+{
+    uint32_t i;
+
+    data[0] = 0;
+    data[1] = 0;
+    data[2] = 1;
+    data[3] = 0x41;
+    for(i = 4; i < len; i++)
+        data[i] = next_random() | 1;
+}
+
+//A packetized frame of id on layer, added to the history at now_us like
+//deliver_frame() does. The caller drops its reference with
+//stream_frame_unref()
+static stream_frame_t* add_frame(int id, uint32_t len, int layer
+        , uint64_t now_us)
+{
+    stream_frame_t* frame = stream_frame_get(release);
+    uint8_t* data = frame_data[id%NACK_TEST_DATA_FRAMES];
+
+    if(!frame)
+    {
+        printf("FAIL no stream frame left\n");
+        exit(1);
+    }
+    make_data(data, len);
+    memset(&frame->source, 0, sizeof(frame->source));
+    frame->source.buffer_count = 1;
+    frame->source.timestamp_us = id;
+    frame->layer = layer;
+    frame->rtp.repair_count = 0;
+    rtp_packetize_h264(&session, &frame->rtp, data, len, id*3000, 1);
+    packet_history_add(frame, now_us);
+
+    return frame;
+}
+
+static uint16_t packet_sequence(const uint8_t* header)
+{
+    return (header[2] << 8) | header[3];
+}
+
+//Whether the history has the datagram of packet on layer at now_us
+static int packet_in_history(rtp_packet_t* packet, int layer
+        , uint64_t now_us)
+{
+    uint8_t data[PACKET_HISTORY_PACKET_SIZE];
+    uint8_t copy[PACKET_HISTORY_PACKET_SIZE];
+    uint32_t size = 0;
+    int i;
+
+    for(i = 0; i < packet->iov_count; i++)
+    {
+        memcpy(data + size, packet->iov[i].iov_base, packet->iov[i].iov_len);
+        size += packet->iov[i].iov_len;
+    }
+
+    return packet_history_find(layer, packet_sequence(packet->header), now_us
+                               , copy) == size && !memcmp(copy, data, size);
+}
+
+//Whether the history has every packet of frame at now_us, 0 if it has
+//none, -1 for some
+static int frame_in_history(stream_frame_t* frame, uint64_t now_us)
+{
+    int found = 0;
+    int i;
+
+    for(i = 0; i < frame->rtp.packet_count; i++)
+        found += packet_in_history(&frame->rtp.packets[i], frame->layer
+                                   , now_us);
+
+    return found == frame->rtp.packet_count ? 1 : found ? -1 : 0;
+}
+
+static void test_parse_nack()
+{
+    uint16_t seqs[16];
+
+    expect(parse_nack("7", seqs, 16) == 1 && seqs[0] == 7, "parse_nack single");
+    expect(parse_nack("3-5 9", seqs, 16) == 4 && seqs[0] == 3 && seqs[2] == 5
+           && seqs[3] == 9, "parse_nack range");
+    expect(parse_nack("65534-1", seqs, 16) == 4 && seqs[0] == 65534
+           && seqs[1] == 65535 && seqs[2] == 0 && seqs[3] == 1
+           , "parse_nack range wrapping around");
+    expect(parse_nack("65535-65535", seqs, 16) == 1 && seqs[0] == 65535
+           , "parse_nack range of one at 65535");
+    expect(parse_nack("65530-10", seqs, 4) == 4 && seqs[3] == 65533
+           , "parse_nack stops at max");
+    expect(parse_nack("1 2 3 4 5", seqs, 3) == 3 && seqs[2] == 3
+           , "parse_nack stops at max numbers");
+    expect(parse_nack("65536", seqs, 16) == 0, "parse_nack out of range");
+    expect(parse_nack("5-x", seqs, 16) == 0, "parse_nack bad range");
+    expect(parse_nack("", seqs, 16) == 0, "parse_nack empty");
+}
+
+static void test_history()
+{
+    uint64_t now_us = 1000000;
+    stream_frame_t* frames[3];
+    int total = 0;
+    int filler;
+
+    memset(released, 0, sizeof(released));
+    //The first frame straddles the wrap of the sequence numbers
+    session.sequence = 65535;
+
+    frames[0] = add_frame(0, NACK_TEST_FRAME_BYTES, LAYER_MAIN, now_us);
+    frames[1] = add_frame(1, NACK_TEST_FRAME_BYTES, LAYER_MAIN, now_us);
+    expect(frame_in_history(frames[0], now_us) == 1
+           && frame_in_history(frames[1], now_us) == 1
+           , "history copies the packets");
+    expect(frames[0]->rtp.packet_count > 1
+           && packet_sequence(frames[0]->rtp.packets[1].header) == 0
+           , "history test wraps the sequence numbers");
+    stream_frame_unref(frames[0]);
+    stream_frame_unref(frames[1]);
+    expect(released[0] == 1 && released[1] == 1 && !stream_frames_in_use()
+           , "history holds no source buffer");
+
+    //The copies outlive the frames, up to PACKET_HISTORY_MS
+    frames[0] = add_frame(2, NACK_TEST_FRAME_BYTES, LAYER_MAIN, now_us);
+    expect(frame_in_history(frames[0], now_us + PACKET_HISTORY_MS*1000ull) == 1
+           , "history keeps packets PACKET_HISTORY_MS");
+    expect(!frame_in_history(frames[0], now_us + PACKET_HISTORY_MS*1000ull + 1)
+           , "history drops older packets");
+    expect(!frame_in_history(frames[0], now_us - 1)
+           , "history has no packet from the future");
+
+    //The same sequence numbers on the other layer are another session
+    expect(!packet_in_history(&frames[0]->rtp.packets[0], LAYER_LOW, now_us)
+           , "history keeps the layers apart");
+    session.sequence = packet_sequence(frames[0]->rtp.packets[0].header);
+    frames[1] = add_frame(3, NACK_TEST_FRAME_BYTES, LAYER_LOW, now_us);
+    expect(frame_in_history(frames[0], now_us) == 1
+           && frame_in_history(frames[1], now_us) == 1
+           , "history has both layers");
+    stream_frame_unref(frames[1]);
+
+    //Later frames take the slots of the oldest packets. Only the last one
+    //of them is compared, they can share a data buffer
+    do
+    {
+        frames[1] = add_frame(7, NACK_TEST_BIG_FRAME_BYTES, LAYER_MAIN, now_us);
+        filler = frames[1]->rtp.packet_count;
+        total += filler;
+        stream_frame_unref(frames[1]);
+    } while(total + filler + frames[0]->rtp.packet_count
+            <= PACKET_HISTORY_PACKETS);
+    expect(frame_in_history(frames[0], now_us) == 1
+           , "history holds PACKET_HISTORY_PACKETS packets");
+    frames[2] = add_frame(6, NACK_TEST_BIG_FRAME_BYTES, LAYER_MAIN, now_us);
+    expect(frame_in_history(frames[0], now_us) != 1
+           && frame_in_history(frames[2], now_us) == 1
+           , "history drops the oldest packets for new ones");
+
+    packet_history_clear();
+    expect(!frame_in_history(frames[2], now_us), "history cleared");
+    stream_frame_unref(frames[0]);
+    stream_frame_unref(frames[2]);
+    expect(stream_frames_in_use() == 0, "history leaks no stream frame");
+}
+
+//Packets that came back on the stream socket, marked in seen by sequence
+//number
+static int receive_packets(uint8_t* seen, int wait_ms)
+{
+    uint8_t buf[2048];
+    struct pollfd pfd;
+    int count = 0;
+    int len;
+
+    pfd.fd = udp_stream_fd();
+    pfd.events = POLLIN;
+    while(poll(&pfd, 1, wait_ms) > 0)
+        while((len = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        {
+            if(len >= RTP_HEADER_SIZE && seen)
+                seen[packet_sequence(buf)] = 1;
+            count++;
+        }
+
+    return count;
+}
+
+static void client_addr(struct sockaddr_in* addr, int port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = htons(port);
+}
+
+//How many of the packets client_nack() sends with tokens bytes in the bucket,
+//it skips the ones that don't fit and goes on. The tokens left in *left
+static int retransmits(stream_frame_t* frame, int first, int64_t tokens
+        , int64_t* left)
+{
+    int sent = 0;
+    int i;
+
+    for(i = first; i < frame->rtp.packet_count; i++)
+        if(tokens >= frame->rtp.packets[i].size)
+        {
+            tokens -= frame->rtp.packets[i].size;
+            sent++;
+        }
+    if(left)
+        *left = tokens;
+
+    return sent;
+}
+
+static void test_token_bucket()
+{
+    struct sockaddr_in addr;
+    uint16_t seqs[RTP_MAX_PACKETS];
+    uint64_t now_us = 1000000;
+    int64_t left;
+    int burst, refill;
+    int count, sent, received;
+    int i;
+
+    client_addr(&addr, 40001);
+    expect(client_subscribe(&addr, ~0ull, 0), "subscribe");
+    memset(released, 0, sizeof(released));
+    stream_frame_t* frame = add_frame(10, NACK_TEST_BIG_FRAME_BYTES
+                                      , LAYER_MAIN, now_us);
+    count = frame->rtp.packet_count;
+    for(i = 0; i < count; i++)
+        seqs[i] = packet_sequence(frame->rtp.packets[i].header);
+    //Without a bitrate gauge the bucket fills at NACK_MIN_RATE, 100 ms of
+    //it on top of what the burst left
+    burst = retransmits(frame, 0, NACK_BURST_BYTES, &left);
+    refill = retransmits(frame, 0, left + NACK_MIN_RATE/80, 0);
+    receive_packets(0, 0);
+
+    sent = client_nack(&addr, seqs, count, now_us);
+    expect(burst < count && sent == burst, "token bucket allows one burst");
+    received = receive_packets(0, 50);
+    expect(received == sent, "retransmits arrive");
+
+    sent = client_nack(&addr, seqs, count, now_us);
+    expect(sent == retransmits(frame, 0, left, 0)
+           , "token bucket empty after the burst");
+
+    sent = client_nack(&addr, seqs, count, now_us + 100000);
+    expect(refill > 0 && sent == refill, "token bucket refills at the rate");
+
+    //Ten seconds refill far more than the burst, the bucket is capped. The
+    //frame goes into the history again, it would be too old
+    packet_history_add(frame, now_us + 10000000);
+    sent = client_nack(&addr, seqs, count, now_us + 10000000);
+    expect(sent == burst, "token bucket capped at NACK_BURST_BYTES");
+    receive_packets(0, 50);
+
+    stream_frame_unref(frame);
+    packet_history_clear();
+    client_unsubscribe(&addr);
+}
+
+//A packet of a 7 Mbit/s stream at 30 fps is lost, the NACK comes
+//NACK_TEST_RTT_US + NACK_TEST_REORDER_US later, after the frames sent
+//meanwhile went into the history. The same datagram comes back
+static void test_older_frame()
+{
+    struct sockaddr_in addr;
+    uint64_t sent_us = 30000000;
+    uint64_t nack_us = sent_us + NACK_TEST_RTT_US + NACK_TEST_REORDER_US;
+    uint8_t data[PACKET_HISTORY_PACKET_SIZE];
+    uint8_t buf[2048];
+    struct pollfd pfd;
+    uint32_t size = 0;
+    int len = 0;
+    int later = 0;
+    int i;
+
+    client_addr(&addr, 40003);
+    expect(client_subscribe(&addr, ~0ull, 0), "subscribe late NACK client");
+    receive_packets(0, 0);
+
+    stream_frame_t* frame = add_frame(0, NACK_TEST_BIG_FRAME_BYTES, LAYER_MAIN
+                                      , sent_us);
+    rtp_packet_t* packet = &frame->rtp.packets[1];
+    uint16_t seq = packet_sequence(packet->header);
+    for(i = 0; i < packet->iov_count; i++)
+    {
+        memcpy(data + size, packet->iov[i].iov_base, packet->iov[i].iov_len);
+        size += packet->iov[i].iov_len;
+    }
+    //The frame goes back to the source, the history has a copy
+    stream_frame_unref(frame);
+
+    while(sent_us + (later + 1)*NACK_TEST_FRAME_US <= nack_us)
+    {
+        later++;
+        stream_frame_unref(add_frame(later, NACK_TEST_BIG_FRAME_BYTES
+                                     , LAYER_MAIN
+                                     , sent_us + later*NACK_TEST_FRAME_US));
+    }
+
+    expect(client_nack(&addr, &seq, 1, nack_us) == 1
+           , "NACK of a packet several frames old is served");
+    pfd.fd = udp_stream_fd();
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 50) > 0)
+        len = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    printf("late NACK: %d frames and %llu ms after the loss\n", later
+           , (unsigned long long)(nack_us - sent_us)/1000);
+    expect(later > 2 && len == (int)size && !memcmp(buf, data, size)
+           , "late NACK gets the lost datagram back");
+
+    expect(client_nack(&addr, &seq, 1, sent_us + PACKET_HISTORY_MS*1000 + 1)
+           == 0, "NACK after PACKET_HISTORY_MS misses");
+
+    packet_history_clear();
+    client_unsubscribe(&addr);
+}
+
+//The frames lose NACK_TEST_LOSS of their packets on the way, the client
+//asks for the holes with ranges like a receiver would and gets them back
+static void test_lossy_loopback()
+{
+    static uint8_t seen[65536];
+    struct sockaddr_in addr, stream_addr;
+    char nack[COMMAND_BUFSIZE];
+    uint16_t seqs[NACK_MAX_PACKETS];
+    int lost = 0, recovered = 0, incomplete = 0;
+    int f, i;
+
+    client_addr(&addr, 40002);
+    expect(client_subscribe(&addr, ~0ull, 0), "subscribe lossy client");
+    stream_addr = addr;
+    stream_addr.sin_port = htons(CLIENT_STREAM_PORT);
+    session.sequence = 65000;
+    receive_packets(0, 0);
+
+    for(f = 0; f < NACK_TEST_LOSSY_FRAMES; f++)
+    {
+        uint64_t now_us = 2000000 + (uint64_t)f*NACK_TEST_FRAME_US;
+        stream_frame_t* frame = add_frame(f, NACK_TEST_FRAME_BYTES, LAYER_MAIN
+                                          , now_us);
+        int pos = 0;
+        int count;
+
+        for(i = 0; i < frame->rtp.packet_count; i++)
+        {
+            rtp_packet_t* packet = &frame->rtp.packets[i];
+            uint16_t seq = packet_sequence(packet->header);
+
+            seen[seq] = 0;
+            if((next_random() & 0xffff) < NACK_TEST_LOSS*0x10000)
+            {
+                lost++;
+                continue;
+            }
+            udp_send_packet(packet, &stream_addr);
+        }
+        receive_packets(seen, 20);
+
+        //Ranges of the holes, as the client sends them
+        nack[0] = '\0';
+        for(i = 0; i < frame->rtp.packet_count; i++)
+        {
+            uint16_t first = packet_sequence(frame->rtp.packets[i].header);
+            uint16_t last = first;
+
+            if(seen[first])
+                continue;
+            while(i + 1 < frame->rtp.packet_count && !seen[(uint16_t)(last + 1)])
+            {
+                last++;
+                i++;
+            }
+            pos += snprintf(nack + pos, sizeof(nack) - pos
+                            , first == last ? "%s%u" : "%s%u-%u"
+                            , pos ? " " : "", first, last);
+        }
+        if(!pos)
+        {
+            stream_frame_unref(frame);
+            continue;
+        }
+
+        count = parse_nack(nack, seqs, NACK_MAX_PACKETS);
+        client_nack(&addr, seqs, count, now_us);
+        receive_packets(seen, 20);
+        for(i = 0; i < count; i++)
+            recovered += seen[seqs[i]];
+        for(i = 0; i < frame->rtp.packet_count; i++)
+            if(!seen[packet_sequence(frame->rtp.packets[i].header)])
+            {
+                incomplete++;
+                break;
+            }
+        stream_frame_unref(frame);
+    }
+
+    printf("lossy loopback: %d frames, %d packets lost, %d recovered, "
+           "%d frames incomplete\n", NACK_TEST_LOSSY_FRAMES, lost, recovered
+           , incomplete);
+    expect(lost > 0 && recovered == lost && !incomplete
+           , "lossy loopback recovers every packet");
+    expect(session.sequence < 65000, "lossy loopback wraps the sequence numbers");
+
+    packet_history_clear();
+    client_unsubscribe(&addr);
+}
+
+//udp_server_setup() exits quietly when it can't bind
+static int ports_free()
+{
+    int ports[2] = {SERVER_COMMAND_PORT, SERVER_STREAM_PORT};
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int ok;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ports[i]);
+        ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(!ok)
+        {
+            printf("FAIL port %d is taken, is a server running?\n", ports[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    rtp_session_init(&session, 0x4e41434b);
+
+    test_parse_nack();
+    test_history();
+
+    if(!ports_free())
+        return 1;
+    udp_server_setup();
+    client_table_init();
+    test_token_bucket();
+    test_older_frame();
+    test_lossy_loopback();
+    client_remove_all();
+    udp_server_close();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+
+    return failures ? 1 : 0;
+}
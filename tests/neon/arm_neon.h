@@ -0,0 +1,156 @@
+#ifndef TESTS_ARM_NEON_H
+#define TESTS_ARM_NEON_H
+
+#include <stdint.h>
+#include <string.h>
+
+//Plain C stand-in for the NEON intrinsics the kernels use, so their NEON
+//branches build and run on an x86 test machine and can be compared with the
+//scalar code. Built with -D__ARM_NEON (and -D__aarch64__ for the 64 bit
+//branch) and this directory ahead of the system headers. Every vector type
+//is a struct of its own, so mixing them up fails to compile as it does with
+//the real header. It says nothing about the speed or the code generation on
+//ARM
+
+typedef struct { uint8_t v[8]; } uint8x8_t;
+typedef struct { uint8_t v[16]; } uint8x16_t;
+typedef struct { uint16_t v[8]; } uint16x8_t;
+typedef struct { uint32_t v[4]; } uint32x4_t;
+typedef struct { uint64_t v[2]; } uint64x2_t;
+typedef struct { uint8x8_t val[2]; } uint8x8x2_t;
+
+static inline uint8x8_t vld1_u8(const uint8_t* p)
+{
+    uint8x8_t r;
+    memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+
+static inline uint8x16_t vld1q_u8(const uint8_t* p)
+{
+    uint8x16_t r;
+    memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+
+static inline void vst1_u8(uint8_t* p, uint8x8_t a)
+{
+    memcpy(p, a.v, sizeof(a.v));
+}
+
+static inline void vst1q_u8(uint8_t* p, uint8x16_t a)
+{
+    memcpy(p, a.v, sizeof(a.v));
+}
+
+static inline uint8x8_t vdup_n_u8(uint8_t x)
+{
+    uint8x8_t r;
+    memset(r.v, x, sizeof(r.v));
+    return r;
+}
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x)
+{
+    uint8x16_t r;
+    memset(r.v, x, sizeof(r.v));
+    return r;
+}
+
+#define NEON_LANEWISE(name, type, lanes, expr) \
+    static inline type name(type a, type b) \
+    { \
+        type r; \
+        int i; \
+        for(i = 0; i < lanes; i++) \
+            r.v[i] = expr; \
+        return r; \
+    }
+
+NEON_LANEWISE(veor_u8, uint8x8_t, 8, a.v[i] ^ b.v[i])
+NEON_LANEWISE(veorq_u8, uint8x16_t, 16, a.v[i] ^ b.v[i])
+NEON_LANEWISE(vand_u8, uint8x8_t, 8, a.v[i] & b.v[i])
+NEON_LANEWISE(vandq_u8, uint8x16_t, 16, a.v[i] & b.v[i])
+NEON_LANEWISE(vabdq_u8, uint8x16_t, 16
+              , a.v[i] > b.v[i] ? a.v[i] - b.v[i] : b.v[i] - a.v[i])
+
+#undef NEON_LANEWISE
+
+//The shift count is an immediate in the real intrinsics
+#define vshr_n_u8(a, n) neon_shr_u8(a, n)
+#define vshrq_n_u8(a, n) neon_shrq_u8(a, n)
+
+static inline uint8x8_t neon_shr_u8(uint8x8_t a, int n)
+{
+    int i;
+    for(i = 0; i < 8; i++)
+        a.v[i] >>= n;
+    return a;
+}
+
+static inline uint8x16_t neon_shrq_u8(uint8x16_t a, int n)
+{
+    int i;
+    for(i = 0; i < 16; i++)
+        a.v[i] >>= n;
+    return a;
+}
+
+//Out of range indexes give 0
+static inline uint8x8_t vtbl2_u8(uint8x8x2_t table, uint8x8_t index)
+{
+    uint8x8_t r;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        r.v[i] = index.v[i] < 16
+            ? table.val[index.v[i]/8].v[index.v[i]%8] : 0;
+    return r;
+}
+
+#ifdef __aarch64__
+static inline uint8x16_t vqtbl1q_u8(uint8x16_t table, uint8x16_t index)
+{
+    uint8x16_t r;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        r.v[i] = index.v[i] < 16 ? table.v[index.v[i]] : 0;
+    return r;
+}
+#endif
+
+//Pairwise add, each lane the sum of two neighbours widened
+static inline uint16x8_t vpaddlq_u8(uint8x16_t a)
+{
+    uint16x8_t r;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        r.v[i] = a.v[2*i] + a.v[2*i + 1];
+    return r;
+}
+
+static inline uint32x4_t vpaddlq_u16(uint16x8_t a)
+{
+    uint32x4_t r;
+    int i;
+
+    for(i = 0; i < 4; i++)
+        r.v[i] = a.v[2*i] + a.v[2*i + 1];
+    return r;
+}
+
+static inline uint64x2_t vpaddlq_u32(uint32x4_t a)
+{
+    uint64x2_t r;
+    int i;
+
+    for(i = 0; i < 2; i++)
+        r.v[i] = (uint64_t)a.v[2*i] + a.v[2*i + 1];
+    return r;
+}
+
+#define vgetq_lane_u64(a, lane) ((a).v[lane])
+
+#endif
@@ -1,13 +1,169 @@
 #include "udp_setup.h"
+#include "udp_uring.h"
+
+#include <sys/eventfd.h>
 
 static int server_command_socket;
 static int server_stream_socket;
 static struct sockaddr_in server_addr;
+//Sender of the last command
 static struct sockaddr_in client_addr;
 static socklen_t client_addr_len;
 static int command_len;
 static char command_buf[COMMAND_BUFSIZE];
 
+static int send_mode;
+//Best mode the kernel has, what udp_set_send_mode() may go back up to
+static int detected_send_mode;
+//Batch handed to sendmmsg(). With GSO one message carries several packets,
+//their iovecs are laid out back to back in batch_iov
+static struct mmsghdr batch_msgs[UDP_BATCH_SIZE];
+static int batch_msg_packets[UDP_BATCH_SIZE];
+static uint32_t batch_msg_bytes[UDP_BATCH_SIZE];
+static struct iovec batch_iov[UDP_GSO_MAX_SEGMENTS*RTP_MAX_IOV*UDP_BATCH_SIZE/8];
+//Room for the GSO segment size or the launch time of SO_TXTIME
+static char batch_cmsg[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(uint64_t))];
+//Owner of the packets being sent, 0 if they may not be sent zerocopy
+static void* batch_owner;
+
+//MSG_ZEROCOPY. The kernel numbers the zerocopy sends of the socket from 0,
+//the owner of send id is held in zerocopy_pending[id % UDP_ZEROCOPY_PENDING]
+//until its completion. Filled by the sender thread, emptied by whoever
+//reads the completions
+static int zerocopy_enabled;
+//SO_ZEROCOPY was taken, what udp_set_zerocopy() may turn back on
+static int zerocopy_supported;
+//The kernel copied the pages after all, zerocopy only costs here
+static int zerocopy_copies;
+static uintptr_t page_size;
+static void* zerocopy_pending[UDP_ZEROCOPY_PENDING];
+static uint32_t zerocopy_next_id;
+static void (*zerocopy_hold)(void* owner);
+static void (*zerocopy_release)(void* owner);
+
+//io_uring, see UDP_IO_URING_COMMANDS. The command ring belongs to the thread reading
+//the commands
+static uring_t command_ring;
+static int command_uring;
+static int command_event_fd = -1;
+//Only tells the multishot recvmsg how much room to keep for the address
+static struct msghdr command_msg;
+
+static void setup_multicast()
+{
+    unsigned char ttl = MCAST_TTL;
+    unsigned char loop = MCAST_LOOP;
+    struct in_addr interface_addr;
+
+    inet_aton(MCAST_INTERFACE, &interface_addr);
+    if(setsockopt(server_stream_socket, IPPROTO_IP, IP_MULTICAST_TTL
+                  , &ttl, sizeof(ttl)) < 0
+       || setsockopt(server_stream_socket, IPPROTO_IP, IP_MULTICAST_LOOP
+                     , &loop, sizeof(loop)) < 0
+       || setsockopt(server_stream_socket, IPPROTO_IP, IP_MULTICAST_IF
+                     , &interface_addr, sizeof(interface_addr)) < 0)
+        DEBUG_ERR("multicast socket options error\n");
+}
+
+static void detect_send_mode()
+{
+    send_mode = UDP_SEND_MODE;
+
+    //Setting a zero segment size is harmless and tells if GSO is known
+    int gso_size = 0;
+    if(send_mode == UDP_SEND_MODE_GSO
+       && setsockopt(server_stream_socket
+                     , SOL_UDP
+                     , UDP_SEGMENT
+                     , &gso_size
+                     , sizeof(gso_size)) < 0)
+    {
+        DEBUG_MSG("UDP GSO not supported, using sendmmsg\n");
+        send_mode = UDP_SEND_MODE_SENDMMSG;
+    }
+    detected_send_mode = send_mode;
+
+    DEBUG_MSG("stream send mode: %s\n", udp_send_mode_name());
+}
+
+static void detect_zerocopy()
+{
+    int one = 1;
+
+    //UDP has it since Linux 5.0
+    page_size = sysconf(_SC_PAGESIZE);
+    zerocopy_supported = UDP_ZEROCOPY
+        && setsockopt(server_stream_socket, SOL_SOCKET, SO_ZEROCOPY
+                      , &one, sizeof(one)) == 0;
+    zerocopy_enabled = zerocopy_supported;
+    if(zerocopy_enabled)
+        DEBUG_MSG("UDP zerocopy from %d bytes\n", UDP_ZEROCOPY_MIN_BYTES);
+    else if(UDP_ZEROCOPY)
+        DEBUG_MSG("UDP zerocopy not supported, copying\n");
+}
+
+//Multishot recvmsg of the commands. Returns 0 if the kernel refused it
+static int arm_command_recv()
+{
+    uring_cqe_t cqe;
+
+    memset(&command_msg, 0, sizeof(command_msg));
+    command_msg.msg_namelen = sizeof(client_addr);
+    stats_add(STAT_COMMAND_SYSCALLS, 1);
+    if(!uring_queue_recvmsg_multishot(&command_ring, server_command_socket
+                                      , &command_msg, 0)
+       || uring_submit(&command_ring, 0) < 0)
+        return 0;
+
+    //An unsupported request fails right away
+    if(uring_peek_cqe(&command_ring, &cqe) && cqe.res < 0
+       && !(cqe.flags & IORING_CQE_F_MORE))
+    {
+        uring_cqe_seen(&command_ring);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void setup_command_uring()
+{
+    //Each buffer takes the recvmsg header and the address ahead of the
+    //command
+    unsigned size = sizeof(struct io_uring_recvmsg_out) + sizeof(client_addr)
+                    + COMMAND_BUFSIZE - 1;
+
+    //The completion ring is twice the size, room for a completion per
+    //buffer and the one ending the multishot request. More would overflow
+    //and only come back through io_uring_enter()
+    if(uring_init(&command_ring, UDP_URING_COMMAND_BUFFERS, 0))
+    {
+        command_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        command_uring = command_event_fd >= 0
+            && uring_setup_buffers(&command_ring, UDP_URING_COMMAND_BUFFERS
+                                   , size)
+            && uring_register_eventfd(&command_ring, command_event_fd)
+            && arm_command_recv();
+        if(!command_uring)
+        {
+            uring_close(&command_ring);
+            if(command_event_fd >= 0)
+                close(command_event_fd);
+            command_event_fd = -1;
+        }
+    }
+}
+
+static void setup_uring()
+{
+    if(UDP_IO_URING_COMMANDS)
+    {
+        setup_command_uring();
+        DEBUG_MSG("io_uring commands %s\n"
+                  , command_uring ? "by multishot recvmsg" : "not supported");
+    }
+}
+
 void udp_server_setup()
 {
     DEBUG_MSG("bind socket for command and stream\n");
@@ -33,20 +189,91 @@ void udp_server_setup()
         DEBUG_ERR(" stream socket bind error\n");
         exit(0);
     }
+
+    setup_multicast();
+    detect_send_mode();
+    detect_zerocopy();
+    setup_uring();
+}
+
+static void close_command_uring()
+{
+    if(command_uring)
+    {
+        uring_close(&command_ring);
+        close(command_event_fd);
+        command_event_fd = -1;
+        command_uring = 0;
+    }
 }
 
 void udp_server_close()
 {
+    close_command_uring();
     close(server_command_socket);
     close(server_stream_socket);
 }
 
+//Takes a command off the command ring
+static int receive_uring_command()
+{
+    uring_cqe_t cqe;
+    unsigned id;
+
+    //Drained before the last look, a completion posted meanwhile signals
+    //the eventfd again
+    if(!uring_next_cqe(&command_ring, &cqe))
+    {
+        stats_add(STAT_COMMAND_SYSCALLS, 1);
+        event_fd_drain(command_event_fd);
+        if(!uring_next_cqe(&command_ring, &cqe))
+            return 0;
+    }
+
+    //The kernel ends the multishot request when it runs out of buffers
+    if(!(cqe.flags & IORING_CQE_F_MORE) && !arm_command_recv())
+        DEBUG_ERR("command receive request error\n");
+
+    id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if(cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+    {
+        if(cqe.flags & IORING_CQE_F_BUFFER)
+            uring_recycle_buffer(&command_ring, id);
+        if(cqe.res != -ENOBUFS)
+            DEBUG_ERR("receive command error\n");
+        return 0;
+    }
+
+    uint8_t* buf = uring_buffer(&command_ring, id);
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buf, sizeof(out));
+
+    //Too long a command is cut like recvfrom() does
+    client_addr_len = out.namelen < sizeof(client_addr)
+        ? out.namelen : sizeof(client_addr);
+    memcpy(&client_addr, buf + sizeof(out), client_addr_len);
+    command_len = out.payloadlen < COMMAND_BUFSIZE - 1
+        ? out.payloadlen : COMMAND_BUFSIZE - 1;
+    memcpy(command_buf, buf + sizeof(out) + command_msg.msg_namelen
+           , command_len);
+    uring_recycle_buffer(&command_ring, id);
+
+    command_buf[command_len] = '\0';
+    DEBUG_TRACE("command received : %d\n", command_len);
+
+    return 1;
+}
+
 int udp_receive_command()
 {
+    if(command_uring)
+        return receive_uring_command();
+
     client_addr_len = sizeof(client_addr);
+    stats_add(STAT_COMMAND_SYSCALLS, 1);
     if((command_len = recvfrom(server_command_socket
                     , command_buf
-                    , COMMAND_BUFSIZE
+                    , COMMAND_BUFSIZE - 1
                     , 0
                     , (struct sockaddr*)&client_addr
                     , &client_addr_len)) < 0)
@@ -55,27 +282,623 @@ int udp_receive_command()
         return 0;
     }
 
-    DEBUG_MSG("command received : %d\n", command_len);
+    command_buf[command_len] = '\0';
+    DEBUG_TRACE("command received : %d\n", command_len);
 
     return 1;
 }
 
+int udp_set_command_uring(int on)
+{
+    if(!on)
+        close_command_uring();
+    else if(!command_uring)
+        setup_command_uring();
+
+    return command_uring;
+}
+
+int udp_command_fd()
+{
+    return command_uring ? command_event_fd : server_command_socket;
+}
+
 int udp_check_command(const char* cmd)
 {
     return (!strncmp(cmd, command_buf, strlen(cmd)));
 }
 
-void udp_send_stream(uint8_t* buf, uint32_t len)
+const char* udp_command_args(const char* cmd)
+{
+    const char* args = command_buf + strlen(cmd);
+
+    while(*args == ' ')
+        args++;
+
+    return args;
+}
+
+int udp_send_packet(rtp_packet_t* packet, struct sockaddr_in* dest)
 {
-    client_addr.sin_port = htons(CLIENT_STREAM_PORT);
-    if(sendto(server_stream_socket
-            , buf
-            , len
-            , 0
-            , (struct sockaddr*)&client_addr
-            , sizeof(client_addr)) < 0)
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = dest;
+    msg.msg_namelen = sizeof(*dest);
+    msg.msg_iov = packet->iov;
+    msg.msg_iovlen = packet->iov_count;
+
+    stats_add(STAT_SEND_SYSCALLS, 1);
+    if(sendmsg(server_stream_socket, &msg, MSG_DONTWAIT) < 0)
     {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            stats_add(STAT_SEND_EAGAIN, 1);
+            return 1;
+        }
+        stats_add(STAT_SEND_ERRORS, 1);
         DEBUG_ERR("stream send error\n");
-        exit(0);
     }
+    else
+    {
+        stats_add(STAT_PACKETS_SENT, 1);
+        stats_add(STAT_BYTES_SENT, packet->size);
+    }
+
+    return 0;
+}
+
+static int send_per_packet(
+        rtp_packet_t* packets,
+        int count,
+        struct sockaddr_in* dest)
+{
+    int i;
+
+    //A lost packet is recovered by the client, keep streaming
+    for(i = 0; i < count; i++)
+        if(udp_send_packet(&packets[i], dest))
+            return 1;
+
+    return 0;
+}
+
+//Holds batch_owner in the pending slots of the next count zerocopy sends.
+//Returns 0 if the slots are still taken, then the messages are copied
+static int hold_zerocopy(int count)
+{
+    int i;
+
+    if(!batch_owner)
+        return 0;
+
+    for(i = 0; i < count; i++)
+        if(__atomic_load_n(&zerocopy_pending[(zerocopy_next_id + i)
+                                             % UDP_ZEROCOPY_PENDING]
+                           , __ATOMIC_ACQUIRE))
+            return 0;
+
+    //Stored before the send, the completion may come before it returns
+    for(i = 0; i < count; i++)
+    {
+        zerocopy_hold(batch_owner);
+        __atomic_store_n(&zerocopy_pending[(zerocopy_next_id + i)
+                                           % UDP_ZEROCOPY_PENDING]
+                         , batch_owner, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+//Takes the ids of the sent messages, gives back the slots of the rest.
+//Keeps errno of the send
+static void sent_zerocopy(int sent, int count)
+{
+    int send_errno = errno;
+    int i;
+
+    for(i = sent; i < count; i++)
+    {
+        void** slot = &zerocopy_pending[(zerocopy_next_id + i)
+                                        % UDP_ZEROCOPY_PENDING];
+        void* owner = __atomic_exchange_n(slot, (void*)0, __ATOMIC_ACQ_REL);
+        zerocopy_release(owner);
+    }
+
+    zerocopy_next_id += sent;
+    stats_add(STAT_ZEROCOPY_SENDS, sent);
+    errno = send_errno;
+}
+
+static int send_socket_batch(struct mmsghdr* msgs, int count, int flags)
+{
+    stats_add(STAT_SEND_SYSCALLS, 1);
+    return sendmmsg(server_stream_socket, msgs, count, flags);
+}
+
+//Sends the prepared batch, returns -1 if the kernel refuses the send mode
+//Returns 1 if the socket buffer is full and the rest must be dropped.
+//packets_done is set to the packets of the messages sent or dropped on an
+//error, those must not be sent again in another mode
+static int flush_batch(int msg_count, int* packets_done)
+{
+    int done = 0;
+    int copy = 0;
+    int i;
+
+    *packets_done = 0;
+
+    while(done < msg_count)
+    {
+        int zerocopy = !copy && hold_zerocopy(msg_count - done);
+
+        int flags = MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0);
+        int ret = send_socket_batch(&batch_msgs[done], msg_count - done, flags);
+        if(zerocopy)
+            sent_zerocopy(ret < 0 ? 0 : ret, msg_count - done);
+        if(ret < 0)
+        {
+            //Out of option memory for the pinned pages or more fragments
+            //than the skb takes, copy this batch
+            if(zerocopy && (errno == ENOBUFS || errno == EMSGSIZE))
+            {
+                copy = 1;
+                continue;
+            }
+
+            if(errno == ENOSYS
+               || (send_mode == UDP_SEND_MODE_GSO
+                   && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)))
+            {
+                for(i = 0; i < done; i++)
+                    *packets_done += batch_msg_packets[i];
+                return -1;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                stats_add(STAT_SEND_EAGAIN, 1);
+                return 1;
+            }
+
+            //Drop the message that failed and go on with the rest
+            stats_add(STAT_SEND_ERRORS, 1);
+            DEBUG_ERR("stream send error\n");
+            done++;
+            continue;
+        }
+
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        for(i = done; i < done + ret; i++)
+        {
+            packets += batch_msg_packets[i];
+            bytes += batch_msg_bytes[i];
+        }
+        stats_add(STAT_PACKETS_SENT, packets);
+        stats_add(STAT_BYTES_SENT, bytes);
+        done += ret;
+    }
+
+    for(i = 0; i < done; i++)
+        *packets_done += batch_msg_packets[i];
+    return 0;
+}
+
+static void init_batch_msg(
+        int m,
+        struct sockaddr_in* dest,
+        struct iovec* iov,
+        int iov_count,
+        int packets,
+        uint32_t bytes)
+{
+    struct msghdr* msg = &batch_msgs[m].msg_hdr;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = dest;
+    msg->msg_namelen = sizeof(*dest);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = iov_count;
+    batch_msg_packets[m] = packets;
+    batch_msg_bytes[m] = bytes;
+}
+
+//One message per packet. sent is set to the packets done with, as by
+//flush_batch()
+static int send_batched(
+        rtp_packet_t* packets,
+        int count,
+        struct sockaddr_in* dest,
+        int* sent)
+{
+    int first = 0;
+    int done;
+
+    *sent = 0;
+
+    while(first < count)
+    {
+        int m;
+        for(m = 0; m < UDP_BATCH_SIZE && first + m < count; m++)
+        {
+            rtp_packet_t* packet = &packets[first + m];
+            init_batch_msg(m, dest, packet->iov, packet->iov_count, 1
+                           , packet->size);
+        }
+
+        int ret = flush_batch(m, &done);
+        *sent += done;
+        if(ret)
+            return ret;
+        first += m;
+    }
+
+    return 0;
+}
+
+//Pages spanned by the iovecs of packet. Sent zerocopy, each is a fragment
+//of the skb
+static int packet_frags(rtp_packet_t* packet)
+{
+    int frags = 0;
+    int i;
+
+    for(i = 0; i < packet->iov_count; i++)
+    {
+        uintptr_t start = (uintptr_t)packet->iov[i].iov_base;
+        uintptr_t end = start + packet->iov[i].iov_len - 1;
+        frags += end/page_size - start/page_size + 1;
+    }
+
+    return frags;
+}
+
+//Runs of equally sized packets (the last one may be shorter) become one GSO
+//message that the kernel splits into datagrams of gso_size bytes. sent is
+//set to the packets done with, as by flush_batch()
+static int send_gso(
+        rtp_packet_t* packets,
+        int count,
+        struct sockaddr_in* dest,
+        int* sent)
+{
+    //The header and payload iovecs of a packet are two fragments at least,
+    //so a zerocopy super packet is cut short at UDP_ZEROCOPY_MAX_FRAGS
+    int max_frags = batch_owner ? UDP_ZEROCOPY_MAX_FRAGS : 0;
+    int p = 0;
+    int done;
+
+    *sent = 0;
+
+    while(p < count)
+    {
+        int m = 0;
+        int iov_used = 0;
+
+        while(m < UDP_BATCH_SIZE && p < count)
+        {
+            uint32_t gso_size = packets[p].size;
+            uint32_t bytes = 0;
+            int segments = 0;
+            int frags = 0;
+            int iov_first = iov_used;
+
+            while(p < count
+                  && segments < UDP_GSO_MAX_SEGMENTS
+                  && bytes + packets[p].size <= UDP_GSO_MAX_BYTES
+                  && packets[p].size <= gso_size
+                  && iov_used + packets[p].iov_count
+                     <= (int)(sizeof(batch_iov)/sizeof(batch_iov[0]))
+                  && (!max_frags || !segments
+                      || frags + packet_frags(&packets[p]) <= max_frags))
+            {
+                rtp_packet_t* packet = &packets[p];
+                if(max_frags)
+                    frags += packet_frags(packet);
+                memcpy(&batch_iov[iov_used]
+                       , packet->iov
+                       , packet->iov_count*sizeof(struct iovec));
+                iov_used += packet->iov_count;
+                bytes += packet->size;
+                segments++;
+                p++;
+
+                //Only the last segment may be shorter than gso_size
+                if(packet->size < gso_size)
+                    break;
+            }
+
+            //Out of iovec space, send what is batched so far
+            if(!segments)
+                break;
+
+            init_batch_msg(m, dest, &batch_iov[iov_first]
+                           , iov_used - iov_first, segments, bytes);
+            if(segments > 1)
+            {
+                struct msghdr* msg = &batch_msgs[m].msg_hdr;
+                msg->msg_control = batch_cmsg[m];
+                msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = gso_size;
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+            m++;
+        }
+
+        int ret = flush_batch(m, &done);
+        *sent += done;
+        if(ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+int udp_send_stream(rtp_frame_t* frame, struct sockaddr_in* dest)
+{
+    return udp_send_packets(frame->packets
+                            , frame->packet_count + frame->repair_count
+                            , dest, 0);
+}
+
+int udp_send_packets(
+        rtp_packet_t* packets,
+        int count,
+        struct sockaddr_in* dest,
+        void* owner)
+{
+    uint32_t bytes = 0;
+    int sent;
+    int ret;
+    int i;
+
+    //Pinning the pages and reading the completion cost more than copying a
+    //small frame
+    for(i = 0; i < count; i++)
+        bytes += packets[i].size;
+    batch_owner = zerocopy_enabled
+        && !__atomic_load_n(&zerocopy_copies, __ATOMIC_RELAXED)
+        && bytes >= UDP_ZEROCOPY_MIN_BYTES ? owner : 0;
+
+    if(send_mode == UDP_SEND_MODE_GSO)
+    {
+        if((ret = send_gso(packets, count, dest, &sent)) >= 0)
+            return ret;
+
+        //Only the kind of errors of a kernel without GSO get here, the
+        //mode is lowered for good and the packets not sent yet go again
+        DEBUG_MSG("UDP GSO send failed, using sendmmsg\n");
+        send_mode = UDP_SEND_MODE_SENDMMSG;
+        packets += sent;
+        count -= sent;
+    }
+
+    if(send_mode == UDP_SEND_MODE_SENDMMSG)
+    {
+        if((ret = send_batched(packets, count, dest, &sent)) >= 0)
+            return ret;
+
+        DEBUG_MSG("sendmmsg not supported, using sendmsg\n");
+        send_mode = UDP_SEND_MODE_SENDTO;
+        packets += sent;
+        count -= sent;
+    }
+
+    return send_per_packet(packets, count, dest);
+}
+
+//One message per packet, each with its launch time. Not with GSO, the
+//qdisc would send the whole super packet at the time of the first one
+int udp_send_timed(
+        rtp_packet_t* packets,
+        int count,
+        struct sockaddr_in* dest,
+        uint64_t start_us,
+        uint64_t spread_us)
+{
+    uint64_t total = 0;
+    uint64_t before = 0;
+    int first = 0;
+    int done;
+    int i;
+
+    //A message per packet, too small for zerocopy
+    batch_owner = 0;
+    for(i = 0; i < count; i++)
+        total += packets[i].size;
+
+    while(first < count)
+    {
+        int m;
+        for(m = 0; m < UDP_BATCH_SIZE && first + m < count; m++)
+        {
+            rtp_packet_t* packet = &packets[first + m];
+            init_batch_msg(m, dest, packet->iov, packet->iov_count, 1
+                           , packet->size);
+
+            //Launch in proportion to the bytes ahead of the packet
+            uint64_t txtime_ns = (start_us + spread_us*before/total)*1000;
+            struct msghdr* msg = &batch_msgs[m].msg_hdr;
+            msg->msg_control = batch_cmsg[m];
+            msg->msg_controllen = CMSG_SPACE(sizeof(txtime_ns));
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(txtime_ns));
+            memcpy(CMSG_DATA(cmsg), &txtime_ns, sizeof(txtime_ns));
+            before += packet->size;
+        }
+
+        //The rest of the frame is lost on an error, the client recovers it
+        int ret = flush_batch(m, &done);
+        if(ret)
+            return ret > 0;
+        first += m;
+    }
+
+    return 0;
+}
+
+void udp_set_zerocopy_owner(
+        void (*hold)(void* owner),
+        void (*release)(void* owner))
+{
+    zerocopy_hold = hold;
+    zerocopy_release = release;
+}
+
+int udp_set_zerocopy(int on)
+{
+    zerocopy_enabled = on && zerocopy_supported;
+    __atomic_store_n(&zerocopy_copies, 0, __ATOMIC_RELAXED);
+
+    return zerocopy_enabled;
+}
+
+int udp_zerocopy_enabled()
+{
+    return zerocopy_enabled;
+}
+
+int udp_stream_fd()
+{
+    return server_stream_socket;
+}
+
+void udp_stream_events()
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)
+                            + sizeof(struct sockaddr_in))];
+    char discard[64];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    //Nothing is meant to arrive here, but it mustn't keep the socket
+    //readable either
+    while(recv(server_stream_socket, discard, sizeof(discard), MSG_DONTWAIT) >= 0);
+
+    for(;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(server_stream_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err err;
+
+            if(cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if(err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            //Sends ee_info to ee_data are done with the pages
+            uint32_t id;
+            for(id = err.ee_info; id != err.ee_data + 1; id++)
+            {
+                void* owner = __atomic_exchange_n(
+                    &zerocopy_pending[id % UDP_ZEROCOPY_PENDING]
+                    , (void*)0, __ATOMIC_ACQ_REL);
+                if(owner)
+                    zerocopy_release(owner);
+            }
+
+            //The device couldn't take the pages (loopback always copies)
+            if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                stats_add(STAT_ZEROCOPY_COPIED, err.ee_data - err.ee_info + 1);
+                if(UDP_ZEROCOPY_STOP_ON_COPY
+                   && !__atomic_exchange_n(&zerocopy_copies, 1
+                                           , __ATOMIC_RELAXED))
+                    DEBUG_MSG("UDP zerocopy sends are copied, copying\n");
+            }
+        }
+    }
+}
+
+int udp_enable_txtime()
+{
+    struct sock_txtime txtime;
+
+    //fq takes CLOCK_MONOTONIC launch times
+    memset(&txtime, 0, sizeof(txtime));
+    txtime.clockid = CLOCK_MONOTONIC;
+    if(setsockopt(server_stream_socket, SOL_SOCKET, SO_TXTIME
+                  , &txtime, sizeof(txtime)) < 0)
+        return 0;
+
+    return 1;
+}
+
+void udp_set_pacing_rate(uint64_t bytes_per_s)
+{
+    //The option is 32 bits before 64 bit support, ~0 lifts the limit
+    uint32_t rate = !bytes_per_s || bytes_per_s > UINT32_MAX - 1
+        ? ~0U : (uint32_t)bytes_per_s;
+
+    if(setsockopt(server_stream_socket, SOL_SOCKET, SO_MAX_PACING_RATE
+                  , &rate, sizeof(rate)) < 0)
+        DEBUG_ERR("pacing rate error\n");
+}
+
+struct sockaddr_in* udp_command_addr()
+{
+    return &client_addr;
+}
+
+void udp_get_send_stats(uint64_t* packets, uint64_t* syscalls)
+{
+    *packets = stats_counter(STAT_PACKETS_SENT);
+    *syscalls = stats_counter(STAT_SEND_SYSCALLS);
+}
+
+int udp_set_send_mode(int mode)
+{
+    send_mode = mode < detected_send_mode ? mode : detected_send_mode;
+
+    return send_mode;
+}
+
+const char* udp_send_mode_name()
+{
+    switch(send_mode)
+    {
+        case UDP_SEND_MODE_GSO: return "gso";
+        case UDP_SEND_MODE_SENDMMSG: return "sendmmsg";
+        default: return "sendmsg";
+    }
+}
+
+void udp_reply_command(const char* reply)
+{
+    udp_reply_to(&client_addr, reply);
+}
+
+void udp_reply_to(struct sockaddr_in* addr, const char* reply)
+{
+    if(sendto(server_command_socket
+              , reply
+              , strlen(reply)
+              , 0
+              , (struct sockaddr*)addr
+              , sizeof(*addr)) < 0)
+        DEBUG_ERR("command reply error\n");
+}
+
+void udp_multicast_addr(struct sockaddr_in* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    inet_aton(MCAST_GROUP, &addr->sin_addr);
+    addr->sin_port = htons(MCAST_PORT);
 }
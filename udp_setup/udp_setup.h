@@ -11,19 +11,141 @@
 #include <unistd.h> /* close() */
 #include <string.h> /* memset() */
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <linux/net_tstamp.h> /* struct sock_txtime */
+#include <linux/errqueue.h> /* struct sock_extended_err */
 
 #include "../common_util/common_util.h"
+#include "../common_util/stats.h"
+#include "../rtp/rtp_h264.h"
 
-#define COMMAND_BUFSIZE 20
+#define COMMAND_BUFSIZE 256 //room for SET_CONFIG arguments
 #define SERVER_COMMAND_PORT 50000
 #define SERVER_STREAM_PORT 50001
 #define CLIENT_COMMAND_PORT 50000
 #define CLIENT_STREAM_PORT 50001
 
+//Multicast mode, clients join with VIDEO_JOIN_MCAST and the stream is sent
+//once to the group
+#define MCAST_GROUP "239.255.0.1"
+#define MCAST_PORT CLIENT_STREAM_PORT
+#define MCAST_TTL 1 //1 keeps the stream on the local segment
+#define MCAST_LOOP 1 //also deliver to receivers on this host
+#define MCAST_INTERFACE "0.0.0.0" //address of the outgoing interface, any
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+//How the packets of a frame are handed to the kernel
+#define UDP_SEND_MODE_SENDTO 0 //one sendmsg() per packet
+#define UDP_SEND_MODE_SENDMMSG 1 //the whole frame with sendmmsg()
+#define UDP_SEND_MODE_GSO 2 //sendmmsg() of UDP_SEGMENT (GSO) super packets
+//Preferred mode, lowered at startup/runtime if the kernel lacks support
+#define UDP_SEND_MODE UDP_SEND_MODE_GSO
+#define UDP_BATCH_SIZE 64 //messages per sendmmsg()
+#define UDP_GSO_MAX_SEGMENTS 64 //UDP_MAX_SEGMENTS of the kernel
+#define UDP_GSO_MAX_BYTES 65000
+
+//MSG_ZEROCOPY for the GSO super packets of sends of at least
+//UDP_ZEROCOPY_MIN_BYTES, whole frames unless user pacing splits them up (see
+//session/pacer.h). The owner of the packets is held until the kernel
+//reports it is done with the pages, see udp_set_zerocopy_owner(). A
+//zerocopy skb takes at most UDP_ZEROCOPY_MAX_FRAGS pages, which cuts the
+//super packets down to a few RTP packets. Once the kernel reports copying
+//the pages anyway (loopback, a device without scatter-gather) zerocopy is
+//dropped with UDP_ZEROCOPY_STOP_ON_COPY
+#define UDP_ZEROCOPY 1
+#define UDP_ZEROCOPY_MIN_BYTES 32768
+#define UDP_ZEROCOPY_MAX_FRAGS 17 //MAX_SKB_FRAGS of the kernel
+#define UDP_ZEROCOPY_STOP_ON_COPY 1
+#define UDP_ZEROCOPY_PENDING 1024 //power of two, sends awaiting completion
+
+//io_uring for the commands where the kernel has it (Linux 6.0), falling
+//back to recvfrom() on its own. A multishot recvmsg takes the commands,
+//udp_command_fd() is then an eventfd. The stream stays on sendmmsg(), which
+//already makes one system call per batch
+#define UDP_IO_URING_COMMANDS 1
+#define UDP_URING_COMMAND_BUFFERS 16 //power of two, commands not read yet
+
 void udp_server_setup();
 void udp_server_close();
+//Reads one command, call when udp_command_fd() is readable
 int udp_receive_command();
+int udp_command_fd();
+//Reads the commands through io_uring or with recvfrom(), udp_command_fd()
+//changes. Returns non zero if they come through io_uring
+int udp_set_command_uring(int on);
 int udp_check_command(const char* cmd);
-void udp_send_stream(uint8_t* buf, uint32_t len);
+//Text following the command name, without leading spaces
+const char* udp_command_args(const char* cmd);
+//Sends the media packets of frame, then its repair packets. Non blocking,
+//returns 1 if the socket buffer was full and the rest of the frame was
+//dropped
+int udp_send_stream(rtp_frame_t* frame, struct sockaddr_in* dest);
+//Same for count packets from packets on. With an owner the packets may be
+//sent zerocopy, the owner is then held until the kernel released them
+int udp_send_packets(
+    rtp_packet_t* packets,
+    int count,
+    struct sockaddr_in* dest,
+    void* owner);
+//Hands every packet to the kernel at once, with SO_TXTIME launch times
+//spread over spread_us from start_us (get_time_us()). Needs
+//udp_enable_txtime() and a qdisc that honours them (fq), without one they
+//go out right away
+int udp_send_timed(
+    rtp_packet_t* packets,
+    int count,
+    struct sockaddr_in* dest,
+    uint64_t start_us,
+    uint64_t spread_us);
+//How an owner passed to udp_send_packets() is held and released, set before
+//the first send
+void udp_set_zerocopy_owner(
+    void (*hold)(void* owner),
+    void (*release)(void* owner));
+//Turns zerocopy on or off, and forgets that the kernel copied the pages
+//before. Returns 0 if the socket can't send zerocopy
+int udp_set_zerocopy(int on);
+int udp_zerocopy_enabled();
+//The stream socket. Zerocopy completions make it report an error
+int udp_stream_fd();
+//Reads the zerocopy completions and releases their owners. Safe to call
+//from any thread
+void udp_stream_events();
+//Returns 0 if the kernel lacks SO_TXTIME
+int udp_enable_txtime();
+//SO_MAX_PACING_RATE of the stream socket, 0 is unlimited. Only the fq qdisc
+//paces UDP by it
+void udp_set_pacing_rate(uint64_t bytes_per_s);
+//Sends a single packet the same way, returns 1 if the socket buffer was full
+int udp_send_packet(rtp_packet_t* packet, struct sockaddr_in* dest);
+//Address the last command came from
+struct sockaddr_in* udp_command_addr();
+//Sends a text reply to the sender of the last command
+void udp_reply_command(const char* reply);
+void udp_reply_to(struct sockaddr_in* addr, const char* reply);
+void udp_multicast_addr(struct sockaddr_in* addr);
+void udp_get_send_stats(uint64_t* packets, uint64_t* syscalls);
+//Sends the stream in mode, or the best mode below it the kernel has. Returns
+//the mode used
+int udp_set_send_mode(int mode);
+const char* udp_send_mode_name();
 
 #endif
@@ -0,0 +1,345 @@
+#include "udp_uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if UDP_URING_AVAILABLE
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//Same numbers on every architecture
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_io_uring_register 427
+#endif
+
+//The one group of buffers the multishot recvmsg picks from
+#define URING_BUFFER_GROUP 0
+
+static int sys_setup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(
+        uring_t* ring,
+        unsigned to_submit,
+        unsigned min_complete,
+        unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int sys_register(uring_t* ring, unsigned opcode, void* arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr);
+}
+
+static void* map_ring(uring_t* ring, size_t len, off_t offset)
+{
+    void* addr = mmap(0, len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+
+    return addr == MAP_FAILED ? 0 : addr;
+}
+
+int uring_init(uring_t* ring, unsigned entries, unsigned flags)
+{
+    struct io_uring_params params;
+    uint8_t* sq;
+    uint8_t* cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+
+    ring->fd = sys_setup(entries, &params);
+    if(ring->fd < 0)
+        return 0;
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_len = params.sq_off.array
+                        + params.sq_entries*sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes
+                        + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+    //Both rings in one mapping since Linux 5.4
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_len > ring->sq_ring_len)
+            ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = 0;
+    }
+
+    ring->sq_ring = map_ring(ring, ring->sq_ring_len, IORING_OFF_SQ_RING);
+    if(ring->sq_ring && ring->cq_ring_len)
+        ring->cq_ring = map_ring(ring, ring->cq_ring_len, IORING_OFF_CQ_RING);
+    else
+        ring->cq_ring = ring->sq_ring;
+    ring->sqes = map_ring(ring, ring->sqes_len, IORING_OFF_SQES);
+    if(!ring->sq_ring || !ring->cq_ring || !ring->sqes)
+    {
+        uring_close(ring);
+        return 0;
+    }
+
+    sq = (uint8_t*)ring->sq_ring;
+    cq = (uint8_t*)ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_queued = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    return 1;
+}
+
+void uring_close(uring_t* ring)
+{
+    if(ring->fd < 0)
+        return;
+
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    if(ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    if(ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    free(ring->bufs);
+    close(ring->fd);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static struct io_uring_sqe* next_sqe(uring_t* ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned index;
+    struct io_uring_sqe* sqe;
+
+    if(ring->sq_queued - head >= ring->entries)
+        return 0;
+
+    index = ring->sq_queued & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_queued++;
+
+    sqe = (struct io_uring_sqe*)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+int uring_queue_recvmsg_multishot(
+        uring_t* ring,
+        int fd,
+        struct msghdr* msg,
+        uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = next_sqe(ring);
+
+    if(!sqe)
+        return 0;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+
+    return 1;
+}
+
+static unsigned cq_ready(uring_t* ring)
+{
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+int uring_submit(uring_t* ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->sq_queued - *ring->sq_tail;
+    int submitted;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+    do
+        submitted = sys_enter(ring, to_submit, wait_nr,
+                              wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    while(submitted < 0 && errno == EINTR);
+    if(submitted < 0)
+        return -errno;
+
+    //A signal may end the wait once the requests are in
+    while(cq_ready(ring) < wait_nr)
+        if(sys_enter(ring, 0, wait_nr, IORING_ENTER_GETEVENTS) < 0
+           && errno != EINTR)
+            return -errno;
+
+    return submitted;
+}
+
+int uring_peek_cqe(uring_t* ring, uring_cqe_t* cqe)
+{
+    struct io_uring_cqe* entry;
+
+    if(!cq_ready(ring))
+        return 0;
+
+    entry = (struct io_uring_cqe*)ring->cqes
+            + (*ring->cq_head & *ring->cq_mask);
+    cqe->user_data = entry->user_data;
+    cqe->res = entry->res;
+    cqe->flags = entry->flags;
+
+    return 1;
+}
+
+void uring_cqe_seen(uring_t* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_next_cqe(uring_t* ring, uring_cqe_t* cqe)
+{
+    if(!uring_peek_cqe(ring, cqe))
+        return 0;
+
+    uring_cqe_seen(ring);
+
+    return 1;
+}
+
+int uring_setup_buffers(uring_t* ring, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+    void* addr;
+    unsigned i;
+
+    //The kernel wants a page aligned ring of a power of two entries
+    ring->buf_ring_len = count*sizeof(struct io_uring_buf);
+    addr = mmap(0, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED)
+        return 0;
+    ring->buf_ring = addr;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)addr;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(sys_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return 0;
+
+    ring->bufs = (uint8_t*)malloc((size_t)count*size);
+    if(!ring->bufs)
+        return 0;
+    ring->buf_count = count;
+    ring->buf_size = size;
+
+    for(i = 0; i < count; i++)
+        uring_recycle_buffer(ring, i);
+
+    return 1;
+}
+
+uint8_t* uring_buffer(uring_t* ring, unsigned id)
+{
+    return ring->bufs + (size_t)id*ring->buf_size;
+}
+
+void uring_recycle_buffer(uring_t* ring, unsigned id)
+{
+    struct io_uring_buf_ring* buf_ring = (struct io_uring_buf_ring*)ring->buf_ring;
+    uint16_t tail = buf_ring->tail;
+    //Not buf_ring->bufs, in C++ the empty struct ahead of it moves it by 8
+    struct io_uring_buf* buf = (struct io_uring_buf*)ring->buf_ring
+                               + (tail & (ring->buf_count - 1));
+
+    //The tail overlaps the first entry, so no whole struct assignment
+    buf->addr = (uintptr_t)uring_buffer(ring, id);
+    buf->len = ring->buf_size;
+    buf->bid = id;
+    __atomic_store_n(&buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+int uring_register_eventfd(uring_t* ring, int fd)
+{
+    return sys_register(ring, IORING_REGISTER_EVENTFD, &fd, 1) == 0;
+}
+
+#else
+
+int uring_init(uring_t* ring, unsigned entries, unsigned flags)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    return 0;
+}
+
+void uring_close(uring_t* ring)
+{
+}
+
+int uring_queue_recvmsg_multishot(
+        uring_t* ring,
+        int fd,
+        struct msghdr* msg,
+        uint64_t user_data)
+{
+    return 0;
+}
+
+int uring_submit(uring_t* ring, unsigned wait_nr)
+{
+    return -ENOSYS;
+}
+
+int uring_peek_cqe(uring_t* ring, uring_cqe_t* cqe)
+{
+    return 0;
+}
+
+void uring_cqe_seen(uring_t* ring)
+{
+}
+
+int uring_next_cqe(uring_t* ring, uring_cqe_t* cqe)
+{
+    return 0;
+}
+
+int uring_setup_buffers(uring_t* ring, unsigned count, unsigned size)
+{
+    return 0;
+}
+
+uint8_t* uring_buffer(uring_t* ring, unsigned id)
+{
+    return 0;
+}
+
+void uring_recycle_buffer(uring_t* ring, unsigned id)
+{
+}
+
+int uring_register_eventfd(uring_t* ring, int fd)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef UDP_URING_H
+#define UDP_URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+//Just enough io_uring for udp_setup, on the raw system calls. Built if the
+//kernel headers know multishot recvmsg (Linux 6.0), otherwise every call
+//fails and udp_setup stays with the socket calls
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#define UDP_URING_AVAILABLE 1
+#else
+#define UDP_URING_AVAILABLE 0
+#endif
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    //Submission ring
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    void* sqes;
+    unsigned sq_queued; //tail including what uring_submit() didn't publish yet
+    //Completion ring
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    //Buffers handed to the multishot recvmsg
+    void* buf_ring;
+    size_t buf_ring_len;
+    uint8_t* bufs;
+    unsigned buf_count;
+    unsigned buf_size;
+} uring_t;
+
+//A completion, copied out of the ring
+typedef struct {
+    uint64_t user_data;
+    int res;
+    unsigned flags;
+} uring_cqe_t;
+
+//Returns 0 if the kernel has no io_uring, refuses it or the setup flags
+int uring_init(uring_t* ring, unsigned entries, unsigned flags);
+void uring_close(uring_t* ring);
+//Queues a multishot recvmsg into the buffers of uring_setup_buffers(). msg
+//only gives the room kept for the address, the message lands in a buffer
+int uring_queue_recvmsg_multishot(
+    uring_t* ring,
+    int fd,
+    struct msghdr* msg,
+    uint64_t user_data);
+//Submits the queued requests and waits for wait_nr completions. Returns
+//the number submitted, -errno on failure
+int uring_submit(uring_t* ring, unsigned wait_nr);
+//Copies the next completion out of the ring without taking it, 0 if there
+//is none
+int uring_peek_cqe(uring_t* ring, uring_cqe_t* cqe);
+void uring_cqe_seen(uring_t* ring);
+//Takes the next completion, 0 if there is none
+int uring_next_cqe(uring_t* ring, uring_cqe_t* cqe);
+//Registers count buffers of size bytes for the multishot recvmsg. Returns
+//0 if the kernel lacks buffer rings (Linux 5.19)
+int uring_setup_buffers(uring_t* ring, unsigned count, unsigned size);
+uint8_t* uring_buffer(uring_t* ring, unsigned id);
+//Hands buffer id back to the kernel
+void uring_recycle_buffer(uring_t* ring, unsigned id);
+//Signals fd for every completion. Returns 0 on failure
+int uring_register_eventfd(uring_t* ring, int fd);
+
+#endif